@@ -94,6 +94,7 @@ static bitdesc_t bits_periph_flags[] = {
     "REMOVABLE", "MEDIA_LOADED", "WAITING", "OPEN",
         "WAITDRAIN", "GROW_OPENINGS", "MODE_VALID", "RECOVERING",
     "RECOVERING_ACTIVE", "KEEP_LABEL", "SENSE", "UNTAG",
+        "NOSORT", "NOMERGE",
 };
 
 static bitdesc_t bits_periph_cap[] = {
@@ -1378,7 +1379,7 @@ print_xs(struct scsipi_xfer *xs, int indent_count)
     if (xs->xs_callout.func == NULL) {
         printf("%sxs_callout  NONE\n", indent);
     } else {
-        printf("%sxs_callout ticks=%d\n", indent, xs->xs_callout.ticks);
+        printf("%sxs_callout expire=%u\n", indent, xs->xs_callout.expire);
         printf("%s           func=%p(%p)\n",
                indent, xs->xs_callout.func, xs->xs_callout.arg);
     }
@@ -1450,7 +1451,7 @@ decode_acb(struct siop_acb *acb)
             printf(" %p %d.%d", xs,
                    xs->xs_periph->periph_target, xs->xs_periph->periph_lun);
             if (xs->xs_callout.func != NULL)
-                printf(" [%d ticks]", xs->xs_callout.ticks);
+                printf(" [expire %u]", xs->xs_callout.expire);
         }
     }
     printf(" flags=%x len=%02d", acb->flags, acb->clen);
@@ -1602,7 +1603,9 @@ show_periph(struct scsipi_periph *periph)
     printf("  periph_changeint=%p\n", periph->periph_changeint);
     if (periph->periph_changeint != NULL)
         show_interrupt(4, periph->periph_changeint);
-    printf("  periph_openings=%d\n", periph->periph_openings);
+    printf("  periph_openings=%d (at most %d, ramp %u)\n",
+           periph->periph_openings, periph->periph_maxopenings,
+           periph->periph_ramp);
     printf("  periph_sent=%d\n", periph->periph_sent);
     printf("  periph_mode=%x\n", periph->periph_mode);
     printf("  periph_period=%d\n", periph->periph_period);
@@ -1627,6 +1630,43 @@ show_periph(struct scsipi_periph *periph)
            1U << periph->periph_blkshift);
     printf("  periph_changenum=%d\n", periph->periph_changenum);
     printf("  periph_tur_active=%d\n", periph->periph_tur_active);
+    printf("  periph_headpos=%u\n", (uint) periph->periph_headpos);
+    printf("  periph_merges=%u\n", periph->periph_merges);
+    printf("  periph_seeks=%u (average %u blocks)\n", periph->periph_seeks,
+           (uint) (periph->periph_seek_blocks /
+                   (periph->periph_seeks ? periph->periph_seeks : 1)));
+    printf("  periph_qfull=%u\n", periph->periph_qfull);
+    printf("  periph_busy=%u\n", periph->periph_busy);
+    printf("  periph_capacity=%u\n", (uint) periph->periph_capacity);
+    printf("  periph_ra=%p\n", periph->periph_ra);
+    if (periph->periph_ra != NULL) {
+        sd_readahead_t *ra = periph->periph_ra;
+        printf("    ra_buf=%p ra_buflen=%u\n", ra->ra_buf, ra->ra_buflen);
+        printf("    ra_blkno=%u ra_nblks=%u ra_state=%u ra_stale=%u\n",
+               (uint) ra->ra_blkno, ra->ra_nblks, ra->ra_state,
+               ra->ra_stale);
+        printf("    ra_next=%u ra_seq=%u ra_nwait=%u ra_writes=%u\n",
+               (uint) ra->ra_next, ra->ra_seq, ra->ra_nwait, ra->ra_writes);
+        printf("    ra_hits=%u ra_misses=%u ra_reads=%u ra_dropped=%u\n",
+               ra->ra_hits, ra->ra_misses, ra->ra_reads, ra->ra_dropped);
+    }
+    printf("  periph_wb=%p\n", periph->periph_wb);
+    if (periph->periph_wb != NULL) {
+        sd_writeback_t *wb = periph->periph_wb;
+        printf("    wb_buf=%p wb_buflen=%u\n", wb->wb_buf, wb->wb_buflen);
+        printf("    wb_blkno=%u wb_nblks=%u wb_flushing=%u wb_error=%d "
+               "wb_nsync=%u\n", (uint) wb->wb_blkno, (uint) wb->wb_nblks,
+               wb->wb_flushing, wb->wb_error, wb->wb_nsync);
+        printf("    wb_writes=%u wb_hits=%u wb_flushes=%u wb_blocks=%u "
+               "wb_syncs=%u\n", wb->wb_writes, wb->wb_hits, wb->wb_flushes,
+               wb->wb_blocks, wb->wb_syncs);
+    }
+    printf("  periph_caching=%02x\n", periph->periph_caching);
+    printf("  periph_unmap=%u max=%u descs=%u gran=%u align=%u\n",
+           periph->periph_unmap, (uint) periph->periph_unmap_max,
+           periph->periph_unmap_descs, (uint) periph->periph_unmap_gran,
+           (uint) periph->periph_unmap_align);
+    printf("  periph_ws_max=%u\n", (uint) periph->periph_ws_max);
     printf("  periph_version=%d\n", periph->periph_version);
 //  printf("  periph_freetags[]=\n", periph->periph_freetags[i]);
 //  printf("  periph_xferq=%p%s\n", xq, (xs == NULL) ? "  EMPTY" : "");
@@ -1662,7 +1702,7 @@ show_periph(struct scsipi_periph *periph)
     if (periph->periph_callout.func == NULL) {
         printf("  periph_callout NONE\n");
     } else {
-        printf("  periph_callout ticks=%d\n", periph->periph_callout.ticks);
+        printf("  periph_callout expire=%u\n", periph->periph_callout.expire);
         printf("                 func=%p(%p)\n",
                periph->periph_callout.func, periph->periph_callout.arg);
     }
@@ -1871,7 +1911,7 @@ main(int argc, char *argv[])
     printf("    adapt_nchannels=%d\n", adapt->adapt_nchannels);
     printf("    adapt_refcnt=%d\n", adapt->adapt_refcnt);
     printf("    adapt_openings=%d\n", adapt->adapt_openings);
-//  printf("    adapt_max_periph=%d\n", adapt->adapt_max_periph);
+    printf("    adapt_max_periph=%d\n", adapt->adapt_max_periph);
     printf("    adapt_flags=%d\n", adapt->adapt_flags);
     printf("    adapt_runnings=%d\n", adapt->adapt_running);
     printf("    adapt_asave=%p\n", adapt->adapt_asave);
@@ -1898,21 +1938,21 @@ main(int argc, char *argv[])
         close_exit();
 
     Forbid();
-    struct scsipi_xfer_queue *xq = &chan->chan_queue;
-    xs = TAILQ_FIRST(xq);
-    printf("  chan_queue=%p%s\n", xq, (xs == NULL) ? "  EMPTY" : "");
-    while (xs != NULL) {
-        printf("    xs=%p", xs);
-        if (xs->xs_periph != NULL) {
-            struct scsipi_periph *tperiph = xs->xs_periph;
-            printf("  periph %d.%d",
-                   tperiph->periph_target, tperiph->periph_lun);
-            if (tperiph == periph)
-                printf(" (THIS)");
+    printf("  chan_queued=%u chan_qready=%08x%08x chan_qnext=%u\n",
+           chan->chan_queued, (uint) (chan->chan_qready >> 32),
+           (uint) chan->chan_qready, chan->chan_qnext);
+    for (uint i = 0; i < ARRAY_SIZE(chan->chan_qperiph); i++) {
+        struct scsipi_periph *tperiph = chan->chan_qperiph[i];
+        if (tperiph == NULL)
+            continue;
+        printf("  periph %d.%d queue%s\n",
+               tperiph->periph_target, tperiph->periph_lun,
+               (tperiph == periph) ? " (THIS)" : "");
+        for (xs = TAILQ_FIRST(&tperiph->periph_queue); xs != NULL;
+             xs = TAILQ_NEXT(xs, channel_q)) {
+            printf("    xs=%p\n", xs);
+            print_xs(xs, 6);
         }
-        printf("\n");
-        print_xs(xs, 6);
-        xs = TAILQ_NEXT(xs, channel_q);
     }
     Permit();
 
@@ -1920,7 +1960,7 @@ main(int argc, char *argv[])
         close_exit();
 
     Forbid();
-    xq = &chan->chan_complete;
+    struct scsipi_xfer_queue *xq = &chan->chan_complete;
     xs = TAILQ_FIRST(xq);
     printf("  chan_complete=%p%s\n", xq, (xs == NULL) ? "  EMPTY" : "");
     while (xs != NULL) {
@@ -1951,6 +1991,8 @@ main(int argc, char *argv[])
         printf("    sc_adapter=%p\n", &sc->sc_adapter);
         printf("    sc_channel=%p\n", &sc->sc_channel);
         printf("    sc_scriptspa=%lx\n", sc->sc_scriptspa);
+        printf("    sc_script=%p sc_reseltab=%p sc_tagtab=%p\n",
+               sc->sc_script, sc->sc_reseltab, sc->sc_tagtab);
         printf("    sc_siopp=%p\n", sc->sc_siopp);
         printf("    sc_active=%lu\n", sc->sc_active);
 
@@ -1975,7 +2017,11 @@ main(int argc, char *argv[])
             print_xs(sc->sc_nexus->xs, 6);
         }
         Permit();
-        printf("    sc_acb[0]=%p\n", sc->sc_acb);
+        printf("    sc_acb[]=");
+        for (pos = 0; pos < sc->sc_nchunks; pos++)
+            printf(" %p", sc->sc_acb[pos]);
+        printf("  (%u chunks of %u, idle %u)\n", sc->sc_nchunks,
+               SIOP_NACB_CHUNK, sc->sc_acb_idle);
         for (pos = 0; pos < ARRAY_SIZE(sc->sc_tinfo); pos++) {
             printf("    sc_tinfo[%d] ", pos);
             show_sc_tinfo(16, &sc->sc_tinfo[pos]);
@@ -1988,12 +2034,59 @@ main(int argc, char *argv[])
         printf("    sc_flags=%02x sc_dien=%02x sc_minsync=%02x "
                "sc_sien=%02x\n",
                sc->sc_flags, sc->sc_dien, sc->sc_minsync, sc->sc_sien);
-        printf("    sc_nosync=%x sc_nodisconnect=%x\n",
-               sc->sc_nosync, sc->sc_nodisconnect);
+        printf("    sc_nosync=%x sc_nofast=%x sc_nodisconnect=%x\n",
+               sc->sc_nosync, sc->sc_nofast, sc->sc_nodisconnect);
+        printf("    sc_stats cmds=%lu ints=%lu resel_host=%lu "
+               "resel_scripts=%lu disc_host=%lu disc_scripts=%lu\n",
+               sc->sc_stats.st_cmds, sc->sc_stats.st_ints,
+               sc->sc_stats.st_resel_host, sc->sc_stats.st_resel_scripts,
+               sc->sc_stats.st_disc_host, sc->sc_stats.st_disc_scripts);
+        if (sc->sc_stats.st_cmds != 0) {
+            printf("      %lu.%02lu ints/cmd, %lu.%02lu ints/cmd saved "
+                   "by SCRIPTS reselection\n",
+                   sc->sc_stats.st_ints / sc->sc_stats.st_cmds,
+                   sc->sc_stats.st_ints * 100 / sc->sc_stats.st_cmds % 100,
+                   sc->sc_stats.st_resel_scripts / sc->sc_stats.st_cmds,
+                   sc->sc_stats.st_resel_scripts * 100 /
+                   sc->sc_stats.st_cmds % 100);
+        }
+        printf("    sc_stats done=%lu done_ints=%lu done_polled=%lu "
+               "done_max=%lu\n",
+               sc->sc_stats.st_done, sc->sc_stats.st_done_ints,
+               sc->sc_stats.st_done_polled, sc->sc_stats.st_done_max);
+        if (sc->sc_stats.st_done_ints != 0) {
+            printf("      %lu.%02lu completions/int\n",
+                   sc->sc_stats.st_done / sc->sc_stats.st_done_ints,
+                   sc->sc_stats.st_done * 100 /
+                   sc->sc_stats.st_done_ints % 100);
+        }
+        printf("    sc_stats sg_segs=%lu sg_parts=%lu sync_slower=%lu\n",
+               sc->sc_stats.st_sg_segs, sc->sc_stats.st_sg_parts,
+               sc->sc_stats.st_sync_slower);
+        printf("    sc_stats polls=%lu poll_starts=%lu poll_ms=%lu "
+               "intr_ms=%lu\n",
+               sc->sc_stats.st_polls, sc->sc_stats.st_poll_starts,
+               sc->sc_stats.st_poll_ms, sc->sc_stats.st_intr_ms);
+        printf("    sc_stats push_bytes=%lu acb_grows=%lu acb_shrinks=%lu\n",
+               sc->sc_stats.st_push_bytes, sc->sc_stats.st_acb_grows,
+               sc->sc_stats.st_acb_shrinks);
+        printf("    sc_stats bounce_cmds=%lu bounce_bytes=%lu "
+               "bounce_free=%02x\n",
+               sc->sc_stats.st_bounce_cmds, sc->sc_stats.st_bounce_bytes,
+               sc->sc_bounce_free);
+        printf("    sc_stats poll_cmds=%lu poll_spun=%lu poll_sleeps=%lu\n",
+               sc->sc_stats.st_poll_cmds, sc->sc_stats.st_poll_spun,
+               sc->sc_stats.st_poll_sleeps);
+        if (sc->sc_stats.st_cmds != 0) {
+            printf("      %lu bytes pushed/cmd\n",
+                   sc->sc_stats.st_push_bytes / sc->sc_stats.st_cmds);
+        }
         for (pos = 0; pos < ARRAY_SIZE(sc->sc_sync); pos++) {
-            printf("    sc_sync[%d] state=%u sxfer=%u sbcl=%u\n",
+            printf("    sc_sync[%d] state=%u sxfer=%u sbcl=%u offer=%u "
+                   "period=%uns\n",
                    pos, sc->sc_sync[pos].state, sc->sc_sync[pos].sxfer,
-                   sc->sc_sync[pos].sbcl);
+                   sc->sc_sync[pos].sbcl, sc->sc_sync[pos].offer * 4,
+                   sc->sc_sync[pos].period);
         }
 
         if (is_user_abort())
@@ -2002,12 +2095,22 @@ main(int argc, char *argv[])
         printf("  as_timerport=%p\n", asave->as_timerport);
         printf("  as_timerio=%p\n",
                asave->as_timerio);
-        callout_t *callout_head = *(asave->as_callout_head);
+        printf("  as_donetimerport=%p as_donetimerio=%p running=%d\n",
+               asave->as_donetimerport, asave->as_donetimerio,
+               asave->as_donetimer_running);
+        printf("  as_polling=%d as_eclock_hz=%u\n",
+               asave->as_polling, asave->as_eclock_hz);
+        callout_t **callout_wheel = asave->as_callout_wheel;
         callout_t *cur;
-        printf("  as_callout_head=%p\n", callout_head);
-        for (cur = callout_head; cur != NULL; cur = cur->co_next) {
-            printf("    %p ticks=%d func=%p(%p)\n",
-                   cur, cur->ticks, cur->func, cur->arg);
+        printf("  as_callout_wheel=%p as_callout_stamp=%llu "
+               "as_walk_ticks=%u\n", callout_wheel,
+               (unsigned long long) asave->as_callout_stamp,
+               asave->as_walk_ticks);
+        for (pos = 0; pos < CALLOUT_WHEEL; pos++) {
+            for (cur = callout_wheel[pos]; cur != NULL; cur = cur->co_next) {
+                printf("    [%d] %p expire=%u func=%p(%p)\n",
+                       pos, cur, cur->expire, cur->func, cur->arg);
+            }
         }
     }
 
@@ -94,7 +94,7 @@ irq_handler_core(a4091_save_t *save)
      * documentation.
      */
     sc->sc_istat |= istat;
-    reg = *ADDR32((uintptr_t) &rp->siop_sstat2);
+    reg = SIOP_READ_SSTAT_DSTAT(rp);
     sc->sc_sstat0 = reg >> 8;
     sc->sc_dstat  = reg;
 
@@ -381,7 +381,8 @@ init_chan(device_t self, UBYTE *boardnum)
     memset(adapt, 0, sizeof (*adapt));
     adapt->adapt_dev = self;
     adapt->adapt_nchannels = 1;
-    adapt->adapt_openings = 7;
+    adapt->adapt_openings = SIOP_NACB_CHUNK;  // More ACBs grow on demand
+    adapt->adapt_max_periph = 7;  // Most openings a periph can ramp up to
     adapt->adapt_request = siop_scsipi_request;
     adapt->adapt_asave = asave;
 
@@ -392,15 +393,19 @@ init_chan(device_t self, UBYTE *boardnum)
     chan->chan_adapter = adapt;
     chan->chan_nluns = (dip_switches & BIT(7)) ? 1 : 8;  // SCSI LUNs enabled?
     chan->chan_id = dip_switches & 7;  // SCSI ID from DIP switches
-    TAILQ_INIT(&chan->chan_queue);
+    chan->chan_flags = SCSIPI_CHAN_CANGROW;
     TAILQ_INIT(&chan->chan_complete);
 
-    asave->as_callout_head = &callout_head;
+    asave->as_callout_wheel = callout_wheel;
 
     if ((dip_switches & BIT(5)) == 0) {
         /* Need to disable synchronous SCSI */
         sc->sc_nosync = ~0;
     }
+    if ((dip_switches & BIT(3)) == 0) {
+        /* Limit synchronous SCSI to 5 MB/s */
+        sc->sc_nofast = ~0;
+    }
     sc->sc_nodisconnect = 0;  /* Mask of targets not allowed to disconnect */
 
     /*
@@ -409,7 +414,7 @@ init_chan(device_t self, UBYTE *boardnum)
      *   SW 7 Off  Internal Termination On          Handled by hardware
      *   SW 6 Off  Synchronous SCSI Mode            sc->sc_nosync
      *   SW 5 Off  Short Spinup                     NOT SUPPORTED YET
-     *   SW 4 Off  SCSI-2 Fast Bus Mode             NOT SUPPORTED YET
+     *   SW 4 Off  SCSI-2 Fast Bus Mode             sc->sc_nofast
      *   SW 3 Off  ADR2=1                           chan->chan_id
      *   SW 2 Off  ADR1=1                           chan->chan_id
      *   SW 1 Off  ADR0=1  Controller Host ID=7     chan->chan_id
@@ -457,6 +462,7 @@ scsipi_alloc_periph(int flags)
 
     for (i = 0; i < PERIPH_NTAGWORDS; i++)
         periph->periph_freetags[i] = 0xffffffff;
+    TAILQ_INIT(&periph->periph_queue);
 
 #if 0
     /* Not tracked for AmigaOS */
@@ -487,6 +493,8 @@ attach(device_t self, uint scsi_target, struct scsipi_periph **periph_p,
 
     if (scsi_target >= 100)
         return (ERROR_OPEN_FAIL);
+    if (lun >= 8)
+        return (ERROR_BAD_UNIT);  // Doesn't fit the IDENTIFY message
 
     if (target == chan->chan_id)
         return (ERROR_SELF_UNIT);
@@ -496,7 +504,8 @@ attach(device_t self, uint scsi_target, struct scsipi_periph **periph_p,
     if (periph == NULL)
         return (ERROR_NO_MEMORY);
     printf("attach(%p, %d)\n", periph, scsi_target);
-    periph->periph_openings  = 4;  // Max # of outstanding commands
+    periph->periph_openings  = 4;  // Outstanding commands to start with
+    periph->periph_maxopenings = chan->chan_adapter->adapt_max_periph;
     periph->periph_target    = target;              // SCSI target ID
     periph->periph_lun       = lun;                 // SCSI LUN
     periph->periph_dbflags   = SCSIPI_DEBUG_FLAGS;  // Full debugging
@@ -505,6 +514,10 @@ attach(device_t self, uint scsi_target, struct scsipi_periph **periph_p,
     periph->periph_channel   = chan;
     periph->periph_changeint = NULL;
     NewMinList(&periph->periph_changeintlist);
+    if (flags & TDF_NO_SORT)
+        periph->periph_flags |= PERIPH_NOSORT;
+    if (flags & TDF_NO_MERGE)
+        periph->periph_flags |= PERIPH_NOMERGE;
 
     rc = scsi_probe_device(chan, target, lun, periph, &failed);
     printf("scsi_probe_device(%d.%d) cont=%d failed=%d\n",
@@ -519,6 +532,7 @@ attach(device_t self, uint scsi_target, struct scsipi_periph **periph_p,
     }
 
     scsipi_insert_periph(chan, periph);
+    scsipi_set_xfer_mode(chan, target, 0);  // Tagged queueing
 #if 0
     /* Might be needed for A3000 / A2091 / A590 */
     scsipi_set_xfer_mode(chan, target, 1);
@@ -536,14 +550,25 @@ detach(struct scsipi_periph *periph)
     if (periph != NULL) {
         int timeout = 6;  // Seconds
         struct scsipi_channel *chan = periph->periph_channel;
-        while (periph->periph_sent > 0) {
-            /* Need to wait for outstanding commands to complete */
+        sd_writeback_flush(periph);
+        while ((periph->periph_sent > 0) ||
+               !TAILQ_EMPTY(&periph->periph_queue) ||
+               sd_readahead_busy(periph) || sd_writeback_dirty(periph)) {
+            /*
+             * Need to wait for outstanding commands to complete, for
+             * those still queued for the adapter to be issued, and
+             * for a write-back flush which could not be issued yet
+             * to be retried by its callout.
+             */
             timeout -= irq_and_timer_handler();
             if (timeout == 0) {
                 printf("Detach timeout waiting for periph to quiesce\n");
                 return;
             }
         }
+        sd_readahead_free(periph);
+        sd_writeback_free(periph);
+        sd_probe_save(periph);
         scsipi_remove_periph(chan, periph);
         scsipi_free_periph(periph);
     }
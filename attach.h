@@ -26,7 +26,19 @@ typedef struct {
     struct siop_softc    *as_device_private;
     struct MsgPort       *as_timerport;
     struct timerequest   *as_timerio;
-    struct callout      **as_callout_head;
+    struct MsgPort       *as_donetimerport;  // Completion poll timer
+    struct timerequest   *as_donetimerio;
+    int8_t                as_donetimer_running;
+    int8_t                as_polling;      // Polling the done ring on a timer
+    uint64_t              as_poll_idle;    // E clock when polls found nothing
+    uint32_t              as_poll_cmds;    // Completions at rate window start
+    uint64_t              as_poll_stamp;   // E clock at rate window start
+    uint64_t              as_mode_stamp;   // E clock at last mode time update
+    uint32_t              as_mode_rem[2];  // Mode E clock ticks not yet in ms
+    uint32_t              as_eclock_hz;    // E clock ticks per second
+    uint64_t              as_callout_stamp; // E clock callouts have run to
+    uint16_t              as_walk_ticks;   // Callout ticks since unit walk
+    struct callout      **as_callout_wheel; // callout_wheel[CALLOUT_WHEEL]
     struct ConfigDev     *as_cd;
     uint32_t             romfile[2];
     /* battmem */
@@ -1,21 +1,26 @@
 #ifndef _CALLOUT_H
 #define _CALLOUT_H
 
+#define CALLOUT_WHEEL 64   /* timing wheel slots, a power of 2 */
+
 typedef struct callout callout_t;
 struct callout {
-    int ticks;             /* ticks remaining */
-    void (*func)(void *);  /* callout function at timeout */
+    u_int expire;          /* callout_ticks at timeout */
+    void (*func)(void *);  /* callout function at timeout, NULL if idle */
     void *arg;             /* callout function argument */
-    callout_t *co_next;    /* next callout in list */
-    callout_t *co_prev;    /* previous callout in list */
+    callout_t *co_next;    /* next callout in wheel slot */
+    callout_t *co_prev;    /* previous callout in wheel slot */
 };
-extern callout_t *callout_head;
+extern callout_t *callout_wheel[CALLOUT_WHEEL];
+extern u_int callout_ticks;
+extern int callout_early;
 void callout_init(callout_t *c, u_int flags);
 int callout_pending(callout_t *c);
 void callout_reset(callout_t *c, int ticks, void (*func)(void *), void *arg);
 int callout_stop(callout_t *c);
 void callout_call(callout_t *c);
 void callout_list(void);
-void callout_run_timeouts(void);
+void callout_run_timeouts(u_int ticks);
+u_int callout_next(void);
 
 #endif /* _CALLOUT_H */
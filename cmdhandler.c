@@ -21,6 +21,7 @@
 #include <exec/lists.h>
 #include <dos/dostags.h>
 #include <devices/scsidisk.h>
+#include <proto/timer.h>
 
 #include "device.h"
 #include "scsi_all.h"
@@ -45,9 +46,24 @@
 #endif
 
 extern struct ExecBase *SysBase;
+struct Device *TimerBase;
 
 a4091_save_t *asave = NULL;
 
+/*
+ * Above irq_poll_rate completions per second, the command handler polls
+ * the done ring every irq_poll_tick_usec for the completions SCRIPTS have
+ * not interrupted for yet. It never polls ISTAT (see irq_poll()), so the
+ * 53C710 interrupts stay on for everything else. Once polling has found
+ * nothing to do for irq_poll_usec, it stops, so a lightly loaded bus
+ * keeps the latency of interrupt mode.
+ */
+int irq_poll_rate = 2000;      // Completions per second, 0 never polls
+int irq_poll_usec = 500;       // Idle polling before it stops
+int irq_poll_tick_usec = 200;  // Time between done ring polls
+
+#define IRQ_POLL_WINDOW 16   // Completions per completion rate sample
+
 /* Command handler startup structure */
 typedef struct {
     struct MsgPort        *msg_port;  // Handler's message port (io_Unit)
@@ -57,11 +73,17 @@ typedef struct {
 } start_msg_t;
 
 
-void
+/*
+ * Service a 53C710 interrupt the interrupt server has captured, or poll
+ * for one while a polled command has interrupts off. Otherwise only the
+ * done ring in memory is polled. Returns non-zero if anything was done.
+ */
+static int
 irq_poll(uint got_int, struct siop_softc *sc)
 {
     if (got_int) {
         siopintr(sc);
+        return (1);
     } else if (sc->sc_flags & SIOP_INTSOFF) {
         /*
          * XXX: According to NCR 53C710-1 errata, polling ISTAT is not safe
@@ -79,34 +101,183 @@ irq_poll(uint got_int, struct siop_softc *sc)
         if (istat & (SIOP_ISTAT_SIP | SIOP_ISTAT_DIP)) {
             uint32_t reg;
             sc->sc_istat |= istat;
-            reg = *ADDR32((uintptr_t) &rp->siop_sstat2);
+            reg = SIOP_READ_SSTAT_DSTAT(rp);
             sc->sc_sstat0 = reg >> 8;
             sc->sc_dstat  = reg;
             siopintr(sc);
+            return (1);
         }
     }
+    /* Pick up completions SCRIPTS have not interrupted for yet */
+    return (siop_done_poll(sc));
+}
+
+/* Add the time since the last update to the current mode's total */
+static void
+irq_mode_account(struct siop_softc *sc, uint64_t now)
+{
+    int      polling = asave->as_polling;
+    uint64_t ticks = asave->as_mode_rem[polling] + now - asave->as_mode_stamp;
+    uint32_t ms = ticks * 1000 / asave->as_eclock_hz;
+
+    asave->as_mode_rem[polling] = ticks - (uint64_t) ms *
+                                          asave->as_eclock_hz / 1000;
+    asave->as_mode_stamp = now;
+    if (polling)
+        sc->sc_stats.st_poll_ms += ms;
+    else
+        sc->sc_stats.st_intr_ms += ms;
+}
+
+static void
+irq_poll_start(struct siop_softc *sc)
+{
+    asave->as_polling = 1;
+    asave->as_poll_idle = 0;
+    sc->sc_stats.st_poll_starts++;
+}
+
+/* Go back to waiting for the interrupt server alone */
+static void
+irq_poll_stop(struct siop_softc *sc)
+{
+    if (asave->as_polling == 0)
+        return;
+    irq_mode_account(sc, eclock_now());
+    asave->as_polling = 0;
 }
 
+/* Polling found nothing to do: stop once that has gone on too long */
+static void
+irq_poll_idle(struct siop_softc *sc)
+{
+    uint64_t now = eclock_now();
+
+    if (asave->as_poll_idle == 0)
+        asave->as_poll_idle = now;
+    else if ((now - asave->as_poll_idle) * 1000000 >=
+             (uint64_t) irq_poll_usec * asave->as_eclock_hz)
+        irq_poll_stop(sc);
+}
+
+/*
+ * Time every IRQ_POLL_WINDOW completions. In interrupt mode, start
+ * polling if they came in faster than irq_poll_rate.
+ */
+static void
+irq_poll_check(struct siop_softc *sc)
+{
+    uint64_t now;
+
+    if ((asave->as_eclock_hz == 0) ||
+        (sc->sc_stats.st_cmds - asave->as_poll_cmds < IRQ_POLL_WINDOW))
+        return;
+    now = eclock_now();
+    irq_mode_account(sc, now);
+    if ((asave->as_polling == 0) && (irq_poll_rate != 0) &&
+        ((now - asave->as_poll_stamp) * irq_poll_rate <=
+         (uint64_t) IRQ_POLL_WINDOW * asave->as_eclock_hz))
+        irq_poll_start(sc);
+    asave->as_poll_stamp = now;
+    asave->as_poll_cmds = sc->sc_stats.st_cmds;
+}
+
+/*
+ * Have the timer fire at the next callout wheel slot with callouts in it,
+ * or after a second.
+ */
 static void
 restart_timer(void)
 {
     if (asave->as_timerio != NULL) {
-        asave->as_timerio->tr_time.tv_secs  = 1;
-        asave->as_timerio->tr_time.tv_micro = 0;
+        u_int ticks = callout_next();
+
+        asave->as_timerio->tr_time.tv_secs  = ticks / TICKS_PER_SECOND;
+        asave->as_timerio->tr_time.tv_micro = ticks % TICKS_PER_SECOND *
+                                              (1000000 / TICKS_PER_SECOND);
         asave->as_timerio->tr_node.io_Command = TR_ADDREQUEST;
         SendIO(&asave->as_timerio->tr_node);
         asave->as_timer_running = 1;
     }
 }
 
+/*
+ * The timer fired: advance the callout wheel by the ticks which have
+ * passed by the E clock, check units for media changes each second, and
+ * set the timer again.
+ */
+static void
+timer_expired(struct scsipi_channel *chan)
+{
+    uint64_t now = eclock_now();
+    u_int    ticks;
+
+    WaitIO(&asave->as_timerio->tr_node);
+    ticks = (now - asave->as_callout_stamp) * TICKS_PER_SECOND /
+            asave->as_eclock_hz;
+    asave->as_callout_stamp += (uint64_t) ticks * asave->as_eclock_hz /
+                               TICKS_PER_SECOND;
+    callout_run_timeouts(ticks);
+    asave->as_walk_ticks += ticks;
+    if (asave->as_walk_ticks >= TICKS_PER_SECOND) {
+        asave->as_walk_ticks = 0;
+        sd_testunitready_walk(chan);
+    }
+    restart_timer();
+}
+
+/*
+ * While polling, poll the done ring every irq_poll_tick_usec. Otherwise,
+ * while commands are active, poll for the completions SCRIPTS hold back
+ * every siop_done_usec.
+ */
+static void
+restart_done_timer(struct siop_softc *sc)
+{
+    int usec;
+
+    if ((asave->as_donetimerio == NULL) || asave->as_donetimer_running)
+        return;
+    if (asave->as_polling)
+        usec = irq_poll_tick_usec;
+    else if (sc->sc_active != 0)
+        usec = siop_done_usec;
+    else
+        return;
+    if (usec == 0)
+        return;
+    asave->as_donetimerio->tr_time.tv_secs  = usec / 1000000;
+    asave->as_donetimerio->tr_time.tv_micro = usec % 1000000;
+    asave->as_donetimerio->tr_node.io_Command = TR_ADDREQUEST;
+    SendIO(&asave->as_donetimerio->tr_node);
+    asave->as_donetimer_running = 1;
+}
+
 static void
 close_timer(void)
 {
     printf("Shutting down timer.\n");
+    delay_close();
     if (asave->as_timer_running) {
         WaitIO(&asave->as_timerio->tr_node);
         asave->as_timer_running = 0;
     }
+    if (asave->as_donetimer_running) {
+        AbortIO(&asave->as_donetimerio->tr_node);
+        WaitIO(&asave->as_donetimerio->tr_node);
+        asave->as_donetimer_running = 0;
+    }
+
+    if (asave->as_donetimerio != NULL) {
+        CloseDevice(&asave->as_donetimerio->tr_node);
+        DeleteExtIO(&asave->as_donetimerio->tr_node);
+        asave->as_donetimerio = NULL;
+    }
+
+    if (asave->as_donetimerport != NULL) {
+        DeletePort(asave->as_donetimerport);
+        asave->as_donetimerport = NULL;
+    }
 
     if (asave->as_timerio != NULL) {
         CloseDevice(&asave->as_timerio->tr_node);
@@ -123,6 +294,7 @@ close_timer(void)
 static int
 open_timer(void)
 {
+    struct EClockVal ev;
     int rc;
 
     printf("Initializing timer.\n");
@@ -153,6 +325,35 @@ open_timer(void)
         close_timer();
         return (rc);
     }
+    TimerBase = asave->as_timerio->tr_node.io_Device;
+    asave->as_eclock_hz  = ReadEClock(&ev);
+    delay_open();
+    asave->as_mode_stamp = eclock_now();
+    asave->as_poll_stamp = asave->as_mode_stamp;
+    asave->as_callout_stamp = asave->as_mode_stamp;
+
+    /* Polling the done ring uses this timer even if siop_done_usec is 0 */
+    asave->as_donetimerport = CreatePort(NULL, 0);
+    if (asave->as_donetimerport == NULL) {
+        close_timer();
+        return (ERROR_NO_MEMORY);
+    }
+    asave->as_donetimerio = (struct timerequest *)
+                                   CreateExtIO(asave->as_donetimerport,
+                                               sizeof (struct timerequest));
+    if (asave->as_donetimerio == NULL) {
+        printf("Fail: CreateExtIO timer\n");
+        close_timer();
+        return (ERROR_NO_MEMORY);
+    }
+
+    rc = OpenDevice(TIMERNAME, UNIT_MICROHZ,
+                    &asave->as_donetimerio->tr_node, 0);
+    if (rc != 0) {
+        printf("Fail: open "TIMERNAME"\n");
+        close_timer();
+        return (rc);
+    }
 
     return (0);
 }
@@ -240,7 +441,7 @@ static const UWORD nsd_supported_cmds[] = {
     CMD_STOP, CMD_START,
     TD_GETGEOMETRY,
     TD_READ64, TD_WRITE64, TD_SEEK64, TD_FORMAT64,
-    HD_SCSICMD,
+    HD_SCSICMD, HD_CACHECTL, HD_UNMAP,
     TD_PROTSTATUS, TD_CHANGENUM, TD_CHANGESTATE,
     NSCMD_DEVICEQUERY,
     NSCMD_TD_READ64, NSCMD_TD_WRITE64, NSCMD_TD_SEEK64, NSCMD_TD_FORMAT64,
@@ -298,13 +499,12 @@ validate_etd:
             blkshift = ((struct scsipi_periph *) ior->io_Unit)->periph_blkshift;
             blkno = iotd->iotd_Req.io_Offset >> blkshift;
 CMD_READ_continue:
+            /* cmd_complete() may ReplyMsg() before sd_readwrite() returns */
+            iotd->iotd_Req.io_Actual = iotd->iotd_Req.io_Length;
             rc = sd_readwrite(iotd->iotd_Req.io_Unit, blkno, B_READ,
                               iotd->iotd_Req.io_Data,
                               iotd->iotd_Req.io_Length, ior);
-            if (rc == 0) {
-                iotd->iotd_Req.io_Actual = iotd->iotd_Req.io_Length;
-                /* cmd_complete() does ReplyMsg() */
-            } else {
+            if (rc != 0) {
                 iotd->iotd_Req.io_Error = rc;
 io_done:
                 iotd->iotd_Req.io_Actual = 0;
@@ -323,13 +523,19 @@ io_done:
             blkshift = ((struct scsipi_periph *) ior->io_Unit)->periph_blkshift;
             blkno = iotd->iotd_Req.io_Offset >> blkshift;
 CMD_WRITE_continue:
-            rc = sd_readwrite(iotd->iotd_Req.io_Unit, blkno, B_WRITE,
-                              iotd->iotd_Req.io_Data,
-                              iotd->iotd_Req.io_Length, ior);
-            if (rc == 0) {
-                iotd->iotd_Req.io_Actual = iotd->iotd_Req.io_Length;
-                /* cmd_complete() does ReplyMsg() */
+            iotd->iotd_Req.io_Actual = iotd->iotd_Req.io_Length;
+            if ((cmd == TD_FORMAT) || (cmd == TD_FORMAT64) ||
+                (cmd == NSCMD_TD_FORMAT64)) {
+                /* A repeated pattern may be written by WRITE SAME */
+                rc = sd_format(iotd->iotd_Req.io_Unit, blkno,
+                               iotd->iotd_Req.io_Data,
+                               iotd->iotd_Req.io_Length, ior);
             } else {
+                rc = sd_readwrite(iotd->iotd_Req.io_Unit, blkno, B_WRITE,
+                                  iotd->iotd_Req.io_Data,
+                                  iotd->iotd_Req.io_Length, ior);
+            }
+            if (rc != 0) {
                 iotd->iotd_Req.io_Error = rc;
                 iotd->iotd_Req.io_Actual = 0;
                 ReplyMsg(&ior->io_Message);
@@ -462,6 +668,42 @@ CMD_SEEK_continue:
             ReplyMsg(&ior->io_Message);
             break;
 
+        case HD_CACHECTL:     // Get or set the drive cache enables
+            PRINTF_CMD("HD_CACHECTL %d %"PRIx32"/%"PRIx32"\n",
+                    ((struct scsipi_periph *) ior->io_Unit)->periph_lun * 10 +
+                    ((struct scsipi_periph *) ior->io_Unit)->periph_target,
+                    iotd->iotd_Req.io_Length, iotd->iotd_Req.io_Offset);
+            rc = 0;
+            if (iotd->iotd_Req.io_Offset != 0)
+                rc = sd_setcache(iotd->iotd_Req.io_Unit,
+                                 iotd->iotd_Req.io_Length,
+                                 iotd->iotd_Req.io_Offset);
+            if (rc == 0)
+                rc = sd_getcache(iotd->iotd_Req.io_Unit,
+                                 &iotd->iotd_Req.io_Actual);
+            ior->io_Error = rc;
+            ReplyMsg(&ior->io_Message);
+            break;
+
+        case HD_UNMAP:        // Discard block ranges
+            PRINTF_CMD("HD_UNMAP %d %"PRIu32" ranges\n",
+                    ((struct scsipi_periph *) ior->io_Unit)->periph_lun * 10 +
+                    ((struct scsipi_periph *) ior->io_Unit)->periph_target,
+                    iotd->iotd_Req.io_Length /
+                    (ULONG) sizeof (struct hd_unmap_range));
+            if (iotd->iotd_Req.io_Length % sizeof (struct hd_unmap_range)) {
+                rc = IOERR_BADLENGTH;
+            } else {
+                rc = sd_unmap(iotd->iotd_Req.io_Unit, iotd->iotd_Req.io_Data,
+                              iotd->iotd_Req.io_Length /
+                              sizeof (struct hd_unmap_range), ior);
+            }
+            if (rc != 0) {
+                iotd->iotd_Req.io_Error = rc;
+                ReplyMsg(&ior->io_Message);
+            }
+            break;
+
         case TD_CHANGENUM:     // Number of disk changes
             PRINTF_CMD("TD_CHANGENUM %d\n",
                     ((struct scsipi_periph *) ior->io_Unit)->periph_lun * 10 +
@@ -533,8 +775,16 @@ CMD_SEEK_continue:
                         iotd->iotd_Req.io_Length);
             if (rc != 0) {
                 ior->io_Error = rc;
+                sd_probe_forget(iotd->iotd_Req.io_Offset % 10,
+                                (iotd->iotd_Req.io_Offset / 10) % 10);
             } else if ((iotd->iotd_Req.io_Length & TDF_DEBUG_OPEN) == 0) {
                 (void) sd_blocksize((struct scsipi_periph *) ior->io_Unit);
+                sd_probe((struct scsipi_periph *) ior->io_Unit,
+                         iotd->iotd_Req.io_Length);
+                if (iotd->iotd_Req.io_Length & TDF_READ_AHEAD)
+                    sd_readahead_init((struct scsipi_periph *) ior->io_Unit);
+                if (iotd->iotd_Req.io_Length & TDF_WRITE_BACK)
+                    sd_writeback_init((struct scsipi_periph *) ior->io_Unit);
             }
 
             ReplyMsg(&ior->io_Message);
@@ -581,8 +831,18 @@ CMD_SEEK_continue:
             ReplyMsg(&ior->io_Message);
             break;
 
-        case TD_MOTOR:         // Turn the drive motor on or off
         case CMD_UPDATE:       // Flush data to disk
+            PRINTF_CMD("CMD_UPDATE %d\n",
+                    ((struct scsipi_periph *) ior->io_Unit)->periph_lun * 10 +
+                    ((struct scsipi_periph *) ior->io_Unit)->periph_target);
+            rc = sd_update(iotd->iotd_Req.io_Unit, ior);
+            if (rc != 0) {
+                iotd->iotd_Req.io_Error = rc;
+                ReplyMsg(&ior->io_Message);
+            }
+            break;
+
+        case TD_MOTOR:         // Turn the drive motor on or off
         case CMD_CLEAR:        // Force re-read of disk data (drop track buffer)
             /* Just reply with success, like the C= scsi.device does */
             ReplyMsg(&ior->io_Message);
@@ -624,17 +884,15 @@ irq_and_timer_handler(void)
     uint32_t timer_mask = asave->as_timer_mask;
     uint32_t mask;
 
+    /* The done ring poll timer is not waited for here */
+    irq_poll_stop(sc);
     mask = Wait(int_mask | timer_mask);
 
     /* Handle incoming interrupts */
     irq_poll(mask & int_mask, sc);
 
-    if (mask & timer_mask) {
-        WaitIO(&asave->as_timerio->tr_node);
-        callout_run_timeouts();
-        sd_testunitready_walk(chan);
-        restart_timer();
-    }
+    if (mask & timer_mask)
+        timer_expired(chan);
 
     /* Process the failure completion queue, if anything is present */
     scsipi_completion_poll(chan);
@@ -655,6 +913,7 @@ cmd_handler(void)
     ULONG                  cmd_mask;
     ULONG                  wait_mask;
     ULONG                  timer_mask;
+    ULONG                  done_mask;
     uint32_t               mask;
 
     task = (struct Task *) FindTask((char *)NULL);
@@ -710,36 +969,52 @@ fail_msgport:
     cmd_mask   = BIT(msgport->mp_SigBit);
     int_mask   = BIT(asave->as_irq_signal);
     timer_mask = BIT(asave->as_timerport->mp_SigBit);
-    wait_mask  = int_mask | timer_mask | cmd_mask;
+    done_mask  = BIT(asave->as_donetimerport->mp_SigBit);
+    wait_mask  = int_mask | timer_mask | cmd_mask | done_mask;
     chan       = &sc->sc_channel;
 
     asave->as_int_mask   = int_mask;
     asave->as_timer_mask = timer_mask;
 
     while (1) {
+        /* While polling, the done timer bounds the wait */
         mask = Wait(wait_mask);
 
         if (asave->as_exiting)
             break;
 
         /* Handle incoming interrupts */
-        do {
-            irq_poll(mask & int_mask, sc);
-        } while ((SetSignal(0, 0) & int_mask) && ((mask |= Wait(wait_mask))));
+        if (asave->as_polling) {
+            sc->sc_stats.st_polls++;
+            if (irq_poll(mask & int_mask, sc) || (mask & cmd_mask))
+                asave->as_poll_idle = 0;
+            else
+                irq_poll_idle(sc);
+        } else {
+            do {
+                irq_poll(mask & int_mask, sc);
+            } while ((SetSignal(0, 0) & int_mask) &&
+                     ((mask |= Wait(wait_mask))));
+        }
+        irq_poll_check(sc);
 
         /* Process timer events */
         if (mask & timer_mask) {
-            WaitIO(&asave->as_timerio->tr_node);
-            callout_run_timeouts();
-            sd_testunitready_walk(chan);
-            restart_timer();
+            timer_expired(chan);
+            irq_mode_account(sc, eclock_now());
+        }
+
+        /* irq_poll() has picked up the completions SCRIPTS held back */
+        if (mask & done_mask) {
+            WaitIO(&asave->as_donetimerio->tr_node);
+            asave->as_donetimer_running = 0;
         }
 
         if (*active > 20) {
-            wait_mask = int_mask | timer_mask;
+            wait_mask = int_mask | timer_mask | done_mask;
             goto run_completion_queue;
         } else {
-            wait_mask = int_mask | timer_mask | cmd_mask;
+            wait_mask = int_mask | timer_mask | cmd_mask | done_mask;
         }
 
         /* Handle new requests */
@@ -747,7 +1022,7 @@ fail_msgport:
             if (cmd_do_iorequest(ior))
                 return;  // Exit handler
             if (*active > 20) {
-                wait_mask = int_mask | timer_mask;
+                wait_mask = int_mask | timer_mask | done_mask;
                 break;
             }
         }
@@ -755,6 +1030,13 @@ fail_msgport:
         /* Process the failure completion queue, if anything is present */
 run_completion_queue:
         scsipi_completion_poll(chan);
+        restart_done_timer(sc);
+
+        /* A callout is due before the timer fires: have it fire now */
+        if (callout_early && asave->as_timer_running) {
+            callout_early = 0;
+            AbortIO(&asave->as_timerio->tr_node);
+        }
     }
 }
 
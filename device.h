@@ -21,6 +21,35 @@
 #define ERROR_NOT_READY       53  // (HFERR_NoBoard + 3)
 
 #define TDF_DEBUG_OPEN    (1<<7)  // Open unit in debug mode (no I/O)
+#define TDF_NO_SORT       (1<<6)  // Issue requests in the order received
+#define TDF_NO_MERGE      (1<<5)  // Don't merge adjacent reads or writes
+#define TDF_READ_AHEAD    (1<<4)  // Read ahead of sequential reads
+#define TDF_WRITE_BACK    (1<<3)  // Hold small writes until CMD_UPDATE
+#define TDF_WRITE_CACHE   (1<<2)  // Turn on the drive's write cache
+
+/*
+ * HD_CACHECTL sets the drive cache bits in io_Offset to those in io_Length
+ * (mode page 8), then returns them all in io_Actual. io_Offset 0 just
+ * reads them.
+ */
+#define HD_CACHECTL       0x2ef8
+#define HDCC_RCD          0x01    // Read cache disabled
+#define HDCC_WCE          0x04    // Write cache enabled
+
+/*
+ * HD_UNMAP discards the block ranges in io_Data, io_Length bytes of
+ * struct hd_unmap_range, so flash targets may erase them. Ranges are
+ * cut to whole units of the target's granularity, and io_Actual returns
+ * the blocks discarded. Targets which can't discard fail it with
+ * IOERR_NOCMD.
+ */
+#define HD_UNMAP          0x2ef9
+
+struct hd_unmap_range {
+    ULONG hur_blkhi;              // First block, upper 32 bits
+    ULONG hur_blklo;              // First block, lower 32 bits
+    ULONG hur_nblks;              // Blocks
+};
 
 /*
  * Unfortunately many of the above overlap with Unix-style error codes
@@ -0,0 +1,2 @@
+/* Host build: AmigaOS <clib/alib_protos.h> is provided by port_host.h */
+#include "port_host.h"
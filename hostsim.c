@@ -0,0 +1,939 @@
+/*
+ * Host simulation of the A4091 driver core.
+ *
+ * This file provides the board layer which attach.c normally provides
+ * (init_chan(), attach(), detach(), ...) and a small benchmark harness
+ * which drives the unmodified command handler through the same
+ * trackdisk-style IORequests that AmigaOS filesystems send. By default,
+ * SCSI commands issued by scsipi go through siop.c to the 53C710 model
+ * in hostsim_siop.c, which runs the driver's SCRIPTS against the
+ * virtual targets in hostsim_target.c. Alternatively, a direct adapter
+ * completes each command synchronously from its adapt_request() entry
+ * point, bypassing siop.c.
+ *
+ * Build with "make hostsim". Run "./hostsim -h" for options.
+ */
+#include "port.h"
+#include "a4091.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <exec/memory.h>
+#include <exec/errors.h>
+#include <devices/trackdisk.h>
+
+#include "device.h"
+#include "scsi_all.h"
+#include "scsipiconf.h"
+#include "scsipi_base.h"
+#include "sd.h"
+#include "siopreg.h"
+#include "siopvar.h"
+#include "attach.h"
+#include "cmdhandler.h"
+#include "hostsim.h"
+
+/* The harness reports to the host console, not the serial port */
+#undef printf
+int printf(const char *fmt, ...);
+
+struct MsgPort *myPort;
+char real_device_name[17] = "a4091.device";
+
+static int hostsim_direct;      /* Bypass siop.c and the 53C710 model */
+static int hostsim_nofast;      /* As with DIP switch 4 On */
+
+extern u_char siop_allow_disc[8];
+extern int siop_done_coalesce;
+extern int siop_no_dma;
+extern int irq_poll_rate;
+
+int scsi_probe_device(struct scsipi_channel *chan, int target, int lun,
+                      struct scsipi_periph *periph, int *failed);
+
+void *
+device_private(device_t dev)
+{
+    return (asave->as_device_private);
+}
+
+/*
+ * NewMinList
+ * ----------
+ * Same as the attach.c version, for Exec versions which lack it.
+ */
+#undef NewMinList
+void
+NewMinList(struct MinList *list)
+{
+    list->mlh_Tail     = NULL;
+    list->mlh_Head     = (struct MinNode *)&list->mlh_Tail;
+    list->mlh_TailPred = (struct MinNode *)list;
+}
+
+/*
+ * hostsim_direct_request
+ * ----------------------
+ * Adapter request function which runs each transfer to completion
+ * against the virtual target, bypassing the 53C710. Completion status
+ * is reported the same way siop_scsidone() reports it.
+ */
+static void
+hostsim_direct_request(struct scsipi_channel *chan, scsipi_adapter_req_t req,
+                       void *arg)
+{
+    struct scsipi_xfer   *xs = arg;
+    struct scsipi_xfer   *mxs;
+    struct scsipi_periph *periph;
+    hostsim_cmd_t         hc;
+    uint32_t              len;
+    uint32_t              pos;
+
+    if (req != ADAPTER_REQ_RUN_XFER)
+        return;
+
+    periph = xs->xs_periph;
+    memset(&hc, 0, sizeof (hc));
+    hc.hc_cdblen = MIN(xs->cmdlen, sizeof (hc.hc_cdb));
+    CopyMem(xs->cmd, hc.hc_cdb, hc.hc_cdblen);
+
+    xs->resid = xs->datalen;
+    if (hostsim_target_start(periph->periph_target, periph->periph_lun,
+                             &hc) != 0) {
+        xs->error = XS_SELTIMEOUT;
+        scsipi_done(xs);
+        return;
+    }
+
+    /* The data of merged xfers follows on in the buffer of each */
+    for (pos = 0, mxs = xs; mxs != NULL; mxs = mxs->amiga_merge) {
+        len = MIN(hc.hc_len - pos, (uint32_t) mxs->datalen);
+        if ((hc.hc_dir == HOSTSIM_DIR_IN) &&
+            (xs->xs_control & XS_CTL_DATA_IN)) {
+            CopyMem(hc.hc_buf + pos, mxs->data, len);
+        } else if ((hc.hc_dir == HOSTSIM_DIR_OUT) &&
+                   (xs->xs_control & XS_CTL_DATA_OUT)) {
+            CopyMem(mxs->data, hc.hc_buf + pos, len);
+        } else if (hc.hc_dir != HOSTSIM_DIR_NONE) {
+            /* Initiator and target disagree on the data phase */
+            hostsim_cmd_free(&hc);
+            xs->error = XS_DRIVER_STUFFUP;
+            scsipi_done(xs);
+            return;
+        } else {
+            len = 0;
+        }
+        mxs->resid = mxs->datalen - len;
+        pos += len;
+    }
+    if ((hc.hc_dir == HOSTSIM_DIR_OUT) && (pos < hc.hc_len))
+        memset(hc.hc_buf + pos, 0, hc.hc_len - pos);
+    hostsim_target_finish(periph->periph_target, periph->periph_lun, &hc);
+    hostsim_cmd_free(&hc);
+
+    xs->status = hc.hc_status;
+    if ((hc.hc_status == SCSI_CHECK) || (hc.hc_status == SCSI_BUSY) ||
+        (hc.hc_status == SCSI_QUEUE_FULL))
+        xs->error = XS_BUSY;
+    scsipi_done(xs);
+}
+
+/*
+ * hostsim_irq_handler
+ * -------------------
+ * Same as irq_handler_core() in attach.c: capture the interrupt status
+ * and wake the service task.
+ */
+static LONG
+hostsim_irq_handler(a4091_save_t *save)
+{
+    struct siop_softc *sc = save->as_device_private;
+    siop_regmap_p      rp;
+    uint8_t            istat;
+    uint32_t           reg;
+
+    if (sc->sc_flags & SIOP_INTSOFF)
+        return (0); /* interrupts are not active */
+
+    rp = sc->sc_siopp;
+    istat = rp->siop_istat;
+    if ((istat & (SIOP_ISTAT_SIP | SIOP_ISTAT_DIP)) == 0)
+        return (0);
+    save->as_irq_count++;
+
+    sc->sc_istat |= istat;
+    reg = SIOP_READ_SSTAT_DSTAT(rp);
+    sc->sc_sstat0 = reg >> 8;
+    sc->sc_dstat  = reg;
+
+    if (save->as_svc_task != NULL)
+        Signal(save->as_svc_task, BIT(save->as_irq_signal));
+
+    return (!!(save->as_irq_count & 0xf));
+}
+
+int
+init_chan(device_t self, UBYTE *boardnum)
+{
+    struct siop_softc     *sc = asave->as_device_private;
+    struct scsipi_adapter *adapt = &sc->sc_adapter;
+    struct scsipi_channel *chan = &sc->sc_channel;
+
+    printf("hostsim: board #%u is the %s\n", *boardnum,
+           hostsim_direct ? "virtual bus" : "53C710 model");
+
+    memset(sc, 0, sizeof (*sc));
+    sc->sc_dev = self;
+    TAILQ_INIT(&sc->ready_list);
+    TAILQ_INIT(&sc->nexus_list);
+    TAILQ_INIT(&sc->free_list);
+
+    memset(adapt, 0, sizeof (*adapt));
+    adapt->adapt_dev = self;
+    adapt->adapt_nchannels = 1;
+    adapt->adapt_openings = hostsim_direct ? 7 : SIOP_NACB_CHUNK;
+    adapt->adapt_max_periph = 7;  // Most openings a periph can ramp up to
+    adapt->adapt_request = hostsim_direct ? hostsim_direct_request :
+                                            siop_scsipi_request;
+    adapt->adapt_asave = asave;
+
+    memset(chan, 0, sizeof (*chan));
+    chan->chan_adapter = adapt;
+    chan->chan_nluns = 8;
+    chan->chan_id = 7;
+    if (!hostsim_direct)
+        chan->chan_flags = SCSIPI_CHAN_CANGROW;
+    TAILQ_INIT(&chan->chan_complete);
+
+    asave->as_callout_wheel = callout_wheel;
+    asave->as_svc_task = FindTask(NULL);
+    asave->as_irq_signal = AllocSignal(-1);
+
+    scsipi_channel_init(chan);
+    if (hostsim_direct)
+        return (0);
+
+    /* As attach.c does for the real board */
+    sc->sc_siopp = hostsim_siop_attach(A4091_IRQ);
+    if (sc->sc_siopp == NULL)
+        return (ERROR_NO_MEMORY);
+    sc->sc_clock_freq = 50;     /* Clock = 50 MHz */
+    sc->sc_ctest7 = SIOP_CTEST7_CDIS;  // Disable burst
+    sc->sc_dcntl = 0;
+    if (hostsim_nofast)
+        sc->sc_nofast = ~0;
+
+    asave->as_irq_count = 0;
+    asave->as_isr = AllocMem(sizeof (*asave->as_isr),
+                             MEMF_CLEAR | MEMF_PUBLIC);
+    if (asave->as_isr == NULL)
+        return (ERROR_NO_MEMORY);
+    asave->as_isr->is_Node.ln_Type = NT_INTERRUPT;
+    asave->as_isr->is_Node.ln_Pri  = A4091_INTPRI;
+    asave->as_isr->is_Node.ln_Name = real_device_name;
+    asave->as_isr->is_Data         = asave;
+    asave->as_isr->is_Code         = (void (*)()) hostsim_irq_handler;
+    AddIntServer(A4091_IRQ, asave->as_isr);
+
+    Signal(asave->as_svc_task, BIT(asave->as_irq_signal));
+    siopinitialize(sc);
+    return (0);
+}
+
+void
+deinit_chan(device_t self)
+{
+    struct siop_softc *sc = asave->as_device_private;
+
+    if (!hostsim_direct) {
+        siopshutdown(&sc->sc_channel);
+        if (asave->as_isr != NULL) {
+            RemIntServer(A4091_IRQ, asave->as_isr);
+            FreeMem(asave->as_isr, sizeof (*asave->as_isr));
+            asave->as_isr = NULL;
+        }
+        hostsim_siop_detach();
+    }
+    FreeSignal(asave->as_irq_signal);
+}
+
+struct scsipi_periph *
+scsipi_alloc_periph(int flags)
+{
+    struct scsipi_periph *periph;
+    uint i;
+
+    periph = AllocMem(sizeof (*periph), MEMF_PUBLIC | MEMF_CLEAR);
+    if (periph == NULL)
+        return (NULL);
+
+    for (i = 0; i < PERIPH_NTAGWORDS; i++)
+        periph->periph_freetags[i] = 0xffffffff;
+    TAILQ_INIT(&periph->periph_queue);
+
+    return (periph);
+}
+
+void
+scsipi_free_periph(struct scsipi_periph *periph)
+{
+    FreeMem(periph, sizeof (*periph));
+}
+
+int
+attach(device_t self, uint scsi_target, struct scsipi_periph **periph_p,
+       uint flags)
+{
+    struct siop_softc     *sc = device_private(self);
+    struct scsipi_channel *chan = &sc->sc_channel;
+    struct scsipi_periph  *periph;
+    int target = scsi_target % 10;
+    int lun    = (scsi_target / 10) % 10;
+    int failed = 0;
+
+    if (scsi_target >= 100)
+        return (ERROR_OPEN_FAIL);
+    if (lun >= 8)
+        return (ERROR_BAD_UNIT);  // Doesn't fit the IDENTIFY message
+
+    if (target == chan->chan_id)
+        return (ERROR_SELF_UNIT);
+
+    periph = scsipi_alloc_periph(0);
+    *periph_p = periph;
+    if (periph == NULL)
+        return (ERROR_NO_MEMORY);
+    periph->periph_openings  = 4;  // Outstanding commands to start with
+    periph->periph_maxopenings = chan->chan_adapter->adapt_max_periph;
+    periph->periph_target    = target;
+    periph->periph_lun       = lun;
+    periph->periph_changenum = 1;
+    periph->periph_channel   = chan;
+    NewMinList(&periph->periph_changeintlist);
+    if (flags & TDF_NO_SORT)
+        periph->periph_flags |= PERIPH_NOSORT;
+    if (flags & TDF_NO_MERGE)
+        periph->periph_flags |= PERIPH_NOMERGE;
+
+    (void) scsi_probe_device(chan, target, lun, periph, &failed);
+    if (failed) {
+        scsipi_free_periph(periph);
+        return (failed);
+    }
+
+    scsipi_insert_periph(chan, periph);
+    scsipi_set_xfer_mode(chan, target, 0);  // Tagged queueing
+    return (0);
+}
+
+void
+detach(struct scsipi_periph *periph)
+{
+    if (periph != NULL) {
+        int timeout = 6;  // Seconds
+        struct scsipi_channel *chan = periph->periph_channel;
+        sd_writeback_flush(periph);
+        while ((periph->periph_sent > 0) ||
+               !TAILQ_EMPTY(&periph->periph_queue) ||
+               sd_readahead_busy(periph) || sd_writeback_dirty(periph)) {
+            /* A read-ahead or write-back may be queued, running or due */
+            timeout -= irq_and_timer_handler();
+            if (timeout == 0) {
+                printf("Detach timeout waiting for periph to quiesce\n");
+                return;
+            }
+        }
+        sd_readahead_free(periph);
+        sd_writeback_free(periph);
+        sd_probe_save(periph);
+        scsipi_remove_periph(chan, periph);
+        scsipi_free_periph(periph);
+    }
+}
+
+int
+periph_still_attached(void)
+{
+    uint                   i;
+    struct siop_softc     *sc = asave->as_device_private;
+    struct scsipi_channel *chan = &sc->sc_channel;
+
+    for (i = 0; i < SCSIPI_CHAN_PERIPH_BUCKETS; i++)
+        if (LIST_FIRST(&chan->chan_periphtab[i]) != NULL)
+            return (1);
+    return (0);
+}
+
+/*
+ * Benchmark harness
+ * -----------------
+ * Keeps a fixed number of CMD_READ / CMD_WRITE requests outstanding to
+ * one unit and reports throughput and completion latency.
+ */
+typedef struct hs_req {
+    struct IOExtTD  iotd;
+    uint8_t        *buf;
+    uint64_t        start;
+    struct hs_req  *next;       /* Next idle request */
+    struct hd_unmap_range range;  /* Blocks an HD_UNMAP discards */
+} hs_req_t;
+
+static uint32_t hs_rand_state = 1;
+
+static uint32_t
+hs_rand(void)
+{
+    /* xorshift32, so runs are repeatable for a given seed */
+    hs_rand_state ^= hs_rand_state << 13;
+    hs_rand_state ^= hs_rand_state >> 17;
+    hs_rand_state ^= hs_rand_state << 5;
+    return (hs_rand_state);
+}
+
+static int
+hs_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a;
+    uint32_t y = *(const uint32_t *) b;
+    return ((x > y) - (x < y));
+}
+
+/* Each sector written in verify mode carries its own block number */
+static void
+hs_stamp(uint8_t *buf, uint32_t len, uint32_t blk)
+{
+    uint32_t pos;
+    for (pos = 0; pos < len; pos += TD_SECTOR, blk++) {
+        uint32_t *ptr = (uint32_t *) (buf + pos);
+        uint i;
+        for (i = 0; i < TD_SECTOR / sizeof (uint32_t); i += 2) {
+            ptr[i] = blk;
+            ptr[i + 1] = ~blk;
+        }
+    }
+}
+
+static int
+hs_check(const uint8_t *buf, uint32_t len, uint32_t blk)
+{
+    uint32_t pos;
+    for (pos = 0; pos < len; pos += TD_SECTOR, blk++) {
+        const uint32_t *ptr = (const uint32_t *) (buf + pos);
+        if ((ptr[0] == 0) && (ptr[1] == 0))
+            continue;  // Never written
+        if ((ptr[0] != blk) || (ptr[1] != ~blk) ||
+            (ptr[TD_SECTOR / sizeof (uint32_t) - 2] != blk)) {
+            printf("Verify error at block %u: got %08x %08x\n",
+                   blk, ptr[0], ptr[1]);
+            return (1);
+        }
+    }
+    return (0);
+}
+
+static void
+usage(void)
+{
+    printf("usage: hostsim [options] [image ...]\n"
+           "    -b <bytes>  transfer size (default 4096)\n"
+           "    -C          turn on the drive write cache\n"
+           "    -c <count>  completions per 53C710 interrupt (default 4)\n"
+           "    -D          direct adapter instead of siop.c and the 53C710 model\n"
+           "    -d <usec>   targets disconnect, reselecting after <usec>\n"
+           "    -E          issue requests in order, without the elevator\n"
+           "    -e <ns>     parity errors at sync periods below <ns>\n"
+           "    -F <pct>    percentage of writes which are TD_FORMAT of zeros\n"
+           "    -f          no fast SCSI, as with DIP switch 4 On\n"
+           "    -G          targets unmap only through WRITE SAME (16)\n"
+           "    -g          targets have no WRITE SAME\n"
+           "    -h          show this help\n"
+           "    -M          don't merge adjacent requests\n"
+           "    -m <MB>     RAM disk / new image size in MB (default 64)\n"
+           "    -n <count>  number of requests (default 10000)\n"
+           "    -N          poll every command in siop_poll() (siop_no_dma)\n"
+           "    -O          odd-aligned request buffers, which siop.c bounces\n"
+           "    -P <rate>   poll the done ring above <rate> completions/s "
+           "(default 2000, 0 never)\n"
+           "    -p          with -d, targets also disconnect in the data phase\n"
+           "    -Q <depth>  targets queue at most <depth> commands per LUN\n"
+           "    -q <depth>  outstanding requests (default 1)\n"
+           "    -R <KB>     read ahead of sequential reads, <KB> for all units\n"
+           "    -S <seed>   random seed\n"
+           "    -s          sequential instead of random offsets\n"
+           "    -T <pct>    percentage of requests which discard (HD_UNMAP)\n"
+           "    -t <usec>   poll for held back completions every <usec>\n"
+           "    -u <unit>   SCSI unit to test (default 0)\n"
+           "    -V          stamp written blocks and verify reads\n"
+           "    -W <ms>     hold small writes for up to <ms> (write-back)\n"
+           "    -w <pct>    percentage of requests which are writes\n"
+           "Each image is attached at the next SCSI target starting at 0.\n"
+           "With no image, a RAM disk is attached at target 0.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    struct MsgPort       *port;
+    struct DriveGeometry *geom;
+    struct IOExtTD        giotd;
+    struct EClockVal      ev;
+    hs_req_t             *reqs;
+    hs_req_t             *idle = NULL;
+    uint32_t             *lat;
+    void                 *unit;
+    struct scsipi_periph *periph;
+    uint    boardnum   = 0;
+    uint    xfer       = 4096;
+    uint    size_mb    = 64;
+    uint    count      = 10000;
+    uint    depth      = 1;
+    uint    scsi_unit  = 0;
+    uint    write_pct  = 0;
+    uint    trim_pct   = 0;
+    uint    format_pct = 0;
+    uint    sequential = 0;
+    uint    verify     = 0;
+    uint    targets    = 0;
+    uint    disc_usec  = 0;
+    uint    disconnect = 0;
+    uint    data_disc  = 0;
+    uint    cable_ns   = 0;
+    uint    task_set   = 0;
+    uint    open_flags = 0;
+    uint    odd        = 0;
+    uint64_t saved;
+    uint    issued     = 0;
+    uint    done       = 0;
+    uint    errors     = 0;
+    uint    nblks;
+    uint32_t seq_blk   = 0;
+    uint64_t bytes     = 0;
+    uint64_t unmapped  = 0;
+    uint64_t start;
+    uint64_t elapsed;
+    uint64_t lat_sum   = 0;
+    hostsim_siop_stats_t stats;
+    struct siop_softc   *sc;
+    uint    i;
+    int     ch;
+    int     rc;
+
+    while ((ch = getopt(argc, argv, "b:Cc:Dd:Ee:F:fGghMm:Nn:OP:pQ:q:R:S:sT:t:u:VW:w:")) != -1) {
+        switch (ch) {
+            case 'b':
+                xfer = strtoul(optarg, NULL, 0);
+                break;
+            case 'C':
+                open_flags |= TDF_WRITE_CACHE;
+                break;
+            case 'c':
+                siop_done_coalesce = strtoul(optarg, NULL, 0);
+                break;
+            case 'D':
+                hostsim_direct = 1;
+                break;
+            case 'd':
+                disc_usec = strtoul(optarg, NULL, 0);
+                disconnect = 1;
+                break;
+            case 'E':
+                open_flags |= TDF_NO_SORT;
+                break;
+            case 'e':
+                cable_ns = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                hostsim_nofast = 1;
+                break;
+            case 'F':
+                format_pct = strtoul(optarg, NULL, 0);
+                break;
+            case 'G':
+                hostsim_target_set_unmap(0);
+                break;
+            case 'g':
+                hostsim_target_set_write_same(0);
+                break;
+            case 'M':
+                open_flags |= TDF_NO_MERGE;
+                break;
+            case 'm':
+                size_mb = strtoul(optarg, NULL, 0);
+                break;
+            case 'N':
+                siop_no_dma = 1;
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            case 'O':
+                odd = 1;
+                break;
+            case 'P':
+                irq_poll_rate = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                data_disc = 1;
+                break;
+            case 'Q':
+                task_set = strtoul(optarg, NULL, 0);
+                break;
+            case 'q':
+                depth = strtoul(optarg, NULL, 0);
+                break;
+            case 'R':
+                sd_ra_budget_kb = strtoul(optarg, NULL, 0);
+                open_flags |= TDF_READ_AHEAD;
+                break;
+            case 'S':
+                hs_rand_state = strtoul(optarg, NULL, 0) | 1;
+                break;
+            case 's':
+                sequential = 1;
+                break;
+            case 'T':
+                trim_pct = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                siop_done_usec = strtoul(optarg, NULL, 0);
+                break;
+            case 'u':
+                scsi_unit = strtoul(optarg, NULL, 0);
+                break;
+            case 'V':
+                verify = 1;
+                break;
+            case 'W':
+                sd_wb_age_ms = strtoul(optarg, NULL, 0);
+                open_flags |= TDF_WRITE_BACK;
+                break;
+            case 'w':
+                write_pct = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                usage();
+                exit(ch == 'h' ? 0 : 1);
+        }
+    }
+    if ((xfer == 0) || (xfer % TD_SECTOR) || (depth == 0) || (count == 0)) {
+        printf("Transfer size must be a non-zero multiple of %u; "
+               "depth and count must be non-zero\n", TD_SECTOR);
+        exit(1);
+    }
+
+    for (; optind < argc; optind++, targets++) {
+        if (hostsim_target_add(targets, 0, argv[optind], size_mb) != 0) {
+            printf("Failed to attach %s\n", argv[optind]);
+            exit(1);
+        }
+    }
+    if ((targets == 0) && (hostsim_target_add(0, 0, NULL, size_mb) != 0)) {
+        printf("Failed to create %u MB RAM disk\n", size_mb);
+        exit(1);
+    }
+
+    if (disconnect) {
+        /* The AmigaOS build doesn't let targets disconnect by default */
+        memset(siop_allow_disc, 3, sizeof (siop_allow_disc));
+    }
+    hostsim_siop_set_disconnect(disconnect ? disconnect + data_disc : 0,
+                                disc_usec);
+    hostsim_siop_set_cable(cable_ns);
+    hostsim_siop_set_task_set(task_set);
+    start = host_usec();
+    rc = start_cmd_handler(&boardnum);
+    if (rc != 0) {
+        printf("Failed to start command handler: %d\n", rc);
+        exit(1);
+    }
+    rc = open_unit(scsi_unit, &unit, open_flags);
+    if (rc != 0) {
+        printf("Failed to open unit %u: %d\n", scsi_unit, rc);
+        stop_cmd_handler();
+        exit(1);
+    }
+    sc = asave->as_device_private;
+    if (!hostsim_direct) {
+        printf("Started and probed in %llu us: %lu polled commands, %lu "
+               "found in the done ring within %dus, %lu 1 ms sleeps\n",
+               (unsigned long long) (host_usec() - start),
+               sc->sc_stats.st_poll_cmds, sc->sc_stats.st_poll_spun,
+               siop_poll_spin_usec, sc->sc_stats.st_poll_sleeps);
+    }
+
+    /*
+     * The 53C710 model DMAs to the geometry buffer directly, so it must
+     * be below 4GB. The stack of the host's main thread isn't.
+     */
+    geom = AllocMem(sizeof (*geom), MEMF_PUBLIC | MEMF_CLEAR);
+    port = CreateMsgPort();
+    if (geom == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    memset(&giotd, 0, sizeof (giotd));
+    giotd.iotd_Req.io_Message.mn_ReplyPort = port;
+    giotd.iotd_Req.io_Unit    = unit;
+    giotd.iotd_Req.io_Command = TD_GETGEOMETRY;
+    giotd.iotd_Req.io_Data    = geom;
+    giotd.iotd_Req.io_Length  = sizeof (*geom);
+    PutMsg(myPort, &giotd.iotd_Req.io_Message);
+    WaitPort(port);
+    GetMsg(port);
+    if ((giotd.iotd_Req.io_Error != 0) || (geom->dg_SectorSize != TD_SECTOR)) {
+        printf("TD_GETGEOMETRY failed: %d (sector size %u)\n",
+               giotd.iotd_Req.io_Error, geom->dg_SectorSize);
+        exit(1);
+    }
+    printf("Unit %u: %u sectors of %u bytes, C=%u H=%u S=%u\n", scsi_unit,
+           geom->dg_TotalSectors, geom->dg_SectorSize, geom->dg_Cylinders,
+           geom->dg_Heads, geom->dg_TrackSectors);
+
+    giotd.iotd_Req.io_Command = HD_CACHECTL;
+    giotd.iotd_Req.io_Offset  = 0;
+    PutMsg(myPort, &giotd.iotd_Req.io_Message);
+    WaitPort(port);
+    GetMsg(port);
+    if (giotd.iotd_Req.io_Error == 0) {
+        printf("Unit %u: write cache %s, read cache %s\n", scsi_unit,
+               (giotd.iotd_Req.io_Actual & HDCC_WCE) ? "on" : "off",
+               (giotd.iotd_Req.io_Actual & HDCC_RCD) ? "off" : "on");
+    }
+    periph = unit;
+    if (periph->periph_unmap != SD_UNMAP_NONE) {
+        printf("Unit %u: discards by %s of up to %u blocks, in units of %u\n",
+               scsi_unit, (periph->periph_unmap == SD_UNMAP_UNMAP) ?
+               "UNMAP" : "WRITE SAME (16)", periph->periph_unmap_max,
+               periph->periph_unmap_gran);
+    }
+
+    nblks = xfer / TD_SECTOR;
+    if (geom->dg_TotalSectors < nblks) {
+        printf("Transfer size exceeds disk capacity\n");
+        exit(1);
+    }
+
+    reqs = AllocMem(sizeof (*reqs) * depth, MEMF_PUBLIC | MEMF_CLEAR);
+    lat = malloc(sizeof (*lat) * count);
+    if ((reqs == NULL) || (lat == NULL)) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < depth; i++) {
+        reqs[i].buf = AllocMem(xfer + odd, MEMF_PUBLIC | MEMF_CLEAR);
+        if (reqs[i].buf == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+        reqs[i].buf += odd;
+        reqs[i].iotd.iotd_Req.io_Message.mn_ReplyPort = port;
+        reqs[i].iotd.iotd_Req.io_Unit = unit;
+        reqs[i].next = idle;
+        idle = &reqs[i];
+    }
+
+    printf("%u %s %s requests of %u bytes, depth %u, %u%% writes\n",
+           count, sequential ? "sequential" : "random",
+           verify ? "verified" : "unverified", xfer, depth, write_pct);
+
+    hostsim_siop_stats(NULL, 1);
+    sc = asave->as_device_private;
+    memset(&sc->sc_stats, 0, sizeof (sc->sc_stats));
+    ReadEClock(&ev);  /* Interrupt / polling times start now, too */
+    asave->as_mode_stamp = ((uint64_t) ev.ev_hi << 32) | ev.ev_lo;
+    start = host_usec();
+    while (done < count) {
+        struct IOExtTD *iotd;
+        hs_req_t       *req;
+
+        /* Keep the queue full; tagged commands may complete in any order */
+        while ((issued < count) && (idle != NULL)) {
+            uint32_t blk;
+            req = idle;
+            idle = req->next;
+            iotd = &req->iotd;
+            if (sequential) {
+                if (seq_blk + nblks > geom->dg_TotalSectors)
+                    seq_blk = 0;
+                blk = seq_blk;
+                seq_blk += nblks;
+            } else {
+                blk = hs_rand() % (geom->dg_TotalSectors - nblks + 1);
+            }
+            iotd->iotd_Req.io_Command = ((hs_rand() % 100) < write_pct) ?
+                                        CMD_WRITE : CMD_READ;
+            iotd->iotd_Req.io_Offset = blk * TD_SECTOR;
+            iotd->iotd_Req.io_Length = xfer;
+            iotd->iotd_Req.io_Data   = req->buf;
+            iotd->iotd_Req.io_Error  = 0;
+            if ((format_pct != 0) &&
+                (iotd->iotd_Req.io_Command == CMD_WRITE) &&
+                ((hs_rand() % 100) < format_pct)) {
+                iotd->iotd_Req.io_Command = TD_FORMAT;
+                memset(req->buf, 0, xfer);
+            }
+            if ((trim_pct != 0) && ((hs_rand() % 100) < trim_pct)) {
+                req->range.hur_blkhi = 0;
+                req->range.hur_blklo = blk;
+                req->range.hur_nblks = nblks;
+                iotd->iotd_Req.io_Command = HD_UNMAP;
+                iotd->iotd_Req.io_Length  = sizeof (req->range);
+                iotd->iotd_Req.io_Data    = &req->range;
+            }
+            if (verify && (iotd->iotd_Req.io_Command == CMD_WRITE))
+                hs_stamp(req->buf, xfer, blk);
+            req->start = host_usec();
+            PutMsg(myPort, &iotd->iotd_Req.io_Message);
+            issued++;
+        }
+
+        WaitPort(port);
+        while ((iotd = (struct IOExtTD *) GetMsg(port)) != NULL) {
+            uint64_t now = host_usec();
+            req = (hs_req_t *) iotd;
+            lat[done] = now - req->start;
+            lat_sum += lat[done];
+            done++;
+            req->next = idle;
+            idle = req;
+            if (iotd->iotd_Req.io_Error != 0) {
+                errors++;
+                continue;
+            }
+            if (iotd->iotd_Req.io_Command == HD_UNMAP) {
+                unmapped += iotd->iotd_Req.io_Actual;
+                continue;
+            }
+            bytes += iotd->iotd_Req.io_Actual;
+            if (verify && (iotd->iotd_Req.io_Command == CMD_READ) &&
+                hs_check(req->buf, xfer,
+                         iotd->iotd_Req.io_Offset / TD_SECTOR)) {
+                errors++;
+            }
+        }
+    }
+    if (open_flags & (TDF_WRITE_BACK | TDF_WRITE_CACHE)) {
+        /* Requests which were held count as done once they are written */
+        giotd.iotd_Req.io_Command = CMD_UPDATE;
+        PutMsg(myPort, &giotd.iotd_Req.io_Message);
+        WaitPort(port);
+        GetMsg(port);
+        if (giotd.iotd_Req.io_Error != 0) {
+            printf("CMD_UPDATE failed: %d\n", giotd.iotd_Req.io_Error);
+            errors++;
+        }
+    }
+    elapsed = host_usec() - start;
+    if (elapsed == 0)
+        elapsed = 1;
+
+    qsort(lat, count, sizeof (*lat), hs_cmp_u32);
+    printf("%u requests in %llu us: %llu IOPS, %llu.%02llu MB/s, %u errors\n",
+           count, (unsigned long long) elapsed,
+           (unsigned long long) count * 1000000 / elapsed,
+           (unsigned long long) (bytes / elapsed),
+           (unsigned long long) (bytes * 100 / elapsed) % 100, errors);
+    printf("latency us: avg %llu min %u p50 %u p99 %u max %u\n",
+           (unsigned long long) (lat_sum / count), lat[0],
+           lat[count / 2], lat[(uint64_t) count * 99 / 100], lat[count - 1]);
+    if (trim_pct != 0)
+        printf("sd: %llu blocks discarded\n", (unsigned long long) unmapped);
+    printf("scsipi: %u requests merged, %u commands issued, average seek "
+           "%llu blocks\n", periph->periph_merges, periph->periph_seeks,
+           (unsigned long long) (periph->periph_seek_blocks /
+                                 MAX(periph->periph_seeks, 1)));
+    printf("scsipi: %d openings (at most %d), %u TASK SET FULL, %u BUSY\n",
+           periph->periph_openings, periph->periph_maxopenings,
+           periph->periph_qfull, periph->periph_busy);
+    if (periph->periph_ra != NULL) {
+        sd_readahead_t *ra = periph->periph_ra;
+        printf("sd: read-ahead of %u KB: %u hits, %u misses (%u%% hit), "
+               "%u reads, %u dropped\n", ra->ra_buflen / 1024,
+               ra->ra_hits, ra->ra_misses,
+               ra->ra_hits * 100 / MAX(ra->ra_hits + ra->ra_misses, 1),
+               ra->ra_reads, ra->ra_dropped);
+    }
+    if (periph->periph_wb != NULL) {
+        sd_writeback_t *wb = periph->periph_wb;
+        printf("sd: write-back of %u KB: %u writes held, written by %u "
+               "WRITEs of %u blocks, %u reads from it, %u SYNCHRONIZE "
+               "CACHE\n", wb->wb_buflen / 1024, wb->wb_writes,
+               wb->wb_flushes, wb->wb_blocks, wb->wb_hits, wb->wb_syncs);
+    }
+    if (!hostsim_direct) {
+        hostsim_siop_stats(&stats, 0);
+        printf("53C710: %llu commands, %llu interrupts (%llu.%02llu/cmd), "
+               "%llu fetches (%llu/cmd)\n",
+               (unsigned long long) stats.hs_commands,
+               (unsigned long long) stats.hs_interrupts,
+               (unsigned long long) (stats.hs_interrupts /
+                                     MAX(stats.hs_commands, 1)),
+               (unsigned long long) (stats.hs_interrupts * 100 /
+                                     MAX(stats.hs_commands, 1)) % 100,
+               (unsigned long long) stats.hs_fetches,
+               (unsigned long long) (stats.hs_fetches /
+                                     MAX(stats.hs_commands, 1)));
+        printf("53C710: %llu bytes moved, %llu disconnects, "
+               "%llu reselects\n",
+               (unsigned long long) stats.hs_dma_bytes,
+               (unsigned long long) stats.hs_disconnects,
+               (unsigned long long) stats.hs_reselects);
+        printf("53C710: %llu tagged commands, at most %llu queued "
+               "at targets, %llu refused\n",
+               (unsigned long long) stats.hs_tagged,
+               (unsigned long long) stats.hs_queue_max,
+               (unsigned long long) stats.hs_queue_full);
+        /* Whatever the host didn't see was handled by SCRIPTS */
+        saved = stats.hs_disconnects - sc->sc_stats.st_disc_host +
+                stats.hs_reselects - sc->sc_stats.st_resel_host;
+        printf("siop: %lu disconnects and %lu reselections handled by "
+               "host (%llu.%02llu host interrupts/cmd saved)\n",
+               sc->sc_stats.st_disc_host, sc->sc_stats.st_resel_host,
+               (unsigned long long) (saved / MAX(sc->sc_stats.st_cmds, 1)),
+               (unsigned long long) (saved * 100 /
+                                     MAX(sc->sc_stats.st_cmds, 1) % 100));
+        printf("siop: %lu completions at %lu interrupts (%lu.%02lu each, "
+               "at most %lu), %lu found without an interrupt\n",
+               sc->sc_stats.st_done, sc->sc_stats.st_done_ints,
+               sc->sc_stats.st_done / MAX(sc->sc_stats.st_done_ints, 1),
+               sc->sc_stats.st_done * 100 /
+               MAX(sc->sc_stats.st_done_ints, 1) % 100,
+               sc->sc_stats.st_done_max, sc->sc_stats.st_done_polled);
+        printf("siop: %lu data segments listed (%lu.%02lu/cmd), %lu lists "
+               "continued with the next part\n",
+               sc->sc_stats.st_sg_segs,
+               sc->sc_stats.st_sg_segs / MAX(sc->sc_stats.st_cmds, 1),
+               sc->sc_stats.st_sg_segs * 100 /
+               MAX(sc->sc_stats.st_cmds, 1) % 100,
+               sc->sc_stats.st_sg_parts);
+        printf("siop: %llu parity errors, %lu sync periods slowed, "
+               "target %u period %uns\n",
+               (unsigned long long) stats.hs_parity,
+               sc->sc_stats.st_sync_slower, scsi_unit % 10,
+               sc->sc_sync[scsi_unit % 10].period);
+        printf("siop: polled the done ring %lu times in %lu ms, interrupts "
+               "alone for %lu ms, polling started %lu times\n",
+               sc->sc_stats.st_polls, sc->sc_stats.st_poll_ms,
+               sc->sc_stats.st_intr_ms, sc->sc_stats.st_poll_starts);
+        printf("siop: %lu bytes of ACB cache lines pushed per command\n",
+               sc->sc_stats.st_push_bytes / MAX(sc->sc_stats.st_cmds, 1));
+        printf("siop: %u ACBs, %lu chunks of %u added and %lu freed\n",
+               sc->sc_nchunks * SIOP_NACB_CHUNK, sc->sc_stats.st_acb_grows,
+               SIOP_NACB_CHUNK, sc->sc_stats.st_acb_shrinks);
+        printf("siop: %lu commands bounced %lu bytes\n",
+               sc->sc_stats.st_bounce_cmds, sc->sc_stats.st_bounce_bytes);
+    }
+
+    for (i = 0; i < depth; i++)
+        FreeMem(reqs[i].buf - odd, xfer + odd);
+    FreeMem(reqs, sizeof (*reqs) * depth);
+    FreeMem(geom, sizeof (*geom));
+    free(lat);
+    DeleteMsgPort(port);
+
+    close_unit(unit);
+    stop_cmd_handler();
+    hostsim_target_remove_all();
+    return (errors ? 1 : 0);
+}
@@ -0,0 +1,72 @@
+#ifndef _HOSTSIM_H
+#define _HOSTSIM_H
+
+/*
+ * Host simulation of the A4091 driver core
+ * ----------------------------------------
+ * The hostsim program runs the unmodified command handler, sd, scsipi
+ * and siop code on a Linux host against virtual SCSI targets which are
+ * backed by image files. See hostsim.c for the board layer and the
+ * benchmark harness, hostsim_siop.c for the 53C710 model, and
+ * hostsim_target.c for the target emulation.
+ */
+
+#define HOSTSIM_MAX_TARGETS     8
+#define HOSTSIM_MAX_LUNS        8
+
+#define HOSTSIM_DIR_NONE        0
+#define HOSTSIM_DIR_IN          1       /* Target to initiator */
+#define HOSTSIM_DIR_OUT         2       /* Initiator to target */
+
+/*
+ * A command in progress on a virtual target. The initiator fills in the
+ * CDB and calls hostsim_target_start(), which decides the data phase
+ * direction and length. For DATA IN the target has already placed the
+ * data in hc_buf; for DATA OUT the initiator places the data there.
+ * hostsim_target_finish() then completes the command and sets hc_status.
+ * The data buffer belongs to the command, and is reused by the next
+ * command started with the same hostsim_cmd_t until hostsim_cmd_free().
+ */
+typedef struct {
+    uint8_t   hc_cdb[16];
+    uint      hc_cdblen;
+    int       hc_dir;           /* HOSTSIM_DIR_* */
+    uint32_t  hc_len;           /* Bytes in the data phase */
+    uint8_t  *hc_buf;           /* Target data buffer */
+    uint8_t   hc_status;        /* SCSI status byte */
+    uint8_t  *hc_mem;           /* Buffer owned by this command */
+    uint32_t  hc_memlen;
+} hostsim_cmd_t;
+
+int  hostsim_target_add(uint target, uint lun, const char *path,
+                        uint64_t size_mb);
+void hostsim_target_remove_all(void);
+int  hostsim_target_present(uint target, uint lun);
+int  hostsim_target_start(uint target, uint lun, hostsim_cmd_t *hc);
+void hostsim_target_finish(uint target, uint lun, hostsim_cmd_t *hc);
+void hostsim_target_set_unmap(int unmap);
+void hostsim_target_set_write_same(int write_same);
+void hostsim_cmd_free(hostsim_cmd_t *hc);
+
+/* 53C710 activity counters, see hostsim_siop_stats() */
+typedef struct {
+    uint64_t  hs_commands;      /* Commands sent to a target */
+    uint64_t  hs_interrupts;    /* Interrupts raised to the host */
+    uint64_t  hs_fetches;       /* SCRIPTS instructions fetched */
+    uint64_t  hs_dma_bytes;     /* Bytes moved by SCRIPTS block moves */
+    uint64_t  hs_disconnects;   /* Target disconnects */
+    uint64_t  hs_reselects;     /* Target reselections */
+    uint64_t  hs_tagged;        /* Commands with a queue tag */
+    uint64_t  hs_queue_max;     /* Most commands queued at targets */
+    uint64_t  hs_parity;        /* Parity errors from a slow cable */
+    uint64_t  hs_queue_full;    /* Commands refused with TASK SET FULL */
+} hostsim_siop_stats_t;
+
+void *hostsim_siop_attach(LONG irq);
+void  hostsim_siop_detach(void);
+void  hostsim_siop_set_disconnect(int enable, uint latency_us);
+void  hostsim_siop_set_cable(uint min_ns);
+void  hostsim_siop_set_task_set(uint depth);
+void  hostsim_siop_stats(hostsim_siop_stats_t *stats, int clear);
+
+#endif /* _HOSTSIM_H */
@@ -0,0 +1,1178 @@
+/*
+ * Behavioral model of the NCR 53C710 for the host simulation.
+ *
+ * The model provides the register file which siop.c accesses through
+ * sc->sc_siopp, and a thread which plays the part of the SCRIPTS
+ * processor. It fetches and executes the scripts[] program assembled
+ * from siop_script.ss, performs the table indirect moves described by
+ * the DSA table (struct siop_ds), and runs the SCSI bus phases against
+ * the virtual targets in hostsim_target.c. SCRIPTS interrupts, phase
+ * mismatch, selection timeout and unexpected disconnect are reported
+ * through ISTAT, DSTAT and SSTAT0 as the chip does, so siop_start(),
+ * siopintr() and siop_checkintr() run unmodified.
+ *
+ * Register writes can't be trapped, so the model samples the registers
+ * which start or steer the SCRIPTS processor (DSP, DCNTL STD, and the
+ * ISTAT ABRT and SIGP bits) whenever a task is about to block in Exec,
+ * and periodically otherwise. The interrupt output behaves as a level
+ * triggered line which stays asserted until SSTAT0 and DSTAT are read
+ * through hostsim_siop_status().
+ *
+ * Only the instructions and registers which siop_script.ss uses are
+ * modeled. Anything else halts the SCRIPTS processor with an Illegal
+ * Instruction Detected interrupt. Memory moves treat the register file
+ * as plain memory, which is what the script needs for the DSA and
+ * SCRATCH registers.
+ */
+#include "port.h"
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
+
+#include "scsi_all.h"
+#include "scsi_message.h"
+#include "scsipiconf.h"
+#include "siopreg.h"
+#include "siopvar.h"
+#include "hostsim.h"
+
+/* SCSI bus phases, as encoded in SCRIPTS instructions and SBCL */
+#define PHASE_DATA_OUT  0
+#define PHASE_DATA_IN   1
+#define PHASE_COMMAND   2
+#define PHASE_STATUS    3
+#define PHASE_MSG_OUT   6
+#define PHASE_MSG_IN    7
+#define PHASE_BUS_FREE  8       /* Target has released the bus */
+#define PHASE_RESUME    9       /* Continue the command after reselection */
+
+/* SCSI control signals, as used by SBCL and SET / CLEAR */
+#define SBCL_ATN        0x08
+#define SBCL_ACK        0x40
+
+#define HM_POLL_USEC    1000    /* Register sampling period when idle */
+#define HM_CTEST8_REV   0x20    /* Chip revision 2 */
+
+/* Result of executing one SCRIPTS instruction */
+#define HM_CONTINUE     0
+#define HM_HALT         1       /* Interrupt raised, SCRIPTS stopped */
+#define HM_BLOCK        2       /* Waiting for reselection */
+
+/* Target side state of an I_T_L or I_T_L_Q nexus */
+#define NX_FREE         0
+#define NX_CONNECTED    1
+#define NX_DISCONNECTED 2
+
+#define HM_MAX_NEXUS    64      /* Commands queued at all targets */
+
+typedef struct {
+    uint8_t       nx_state;     /* NX_* */
+    uint8_t       nx_target;
+    uint8_t       nx_lun;
+    uint8_t       nx_tagged;    /* Command has a queue tag */
+    uint8_t       nx_tag;
+    uint8_t       nx_disc_ok;   /* Initiator allowed disconnect */
+    uint8_t       nx_have_cmd;  /* Command phase is complete */
+    uint32_t      nx_pos;       /* Data phase bytes transferred */
+    uint32_t      nx_split;     /* Disconnect when nx_pos gets here */
+    uint8_t       nx_late;      /* Disconnect again before status */
+    uint64_t      nx_ready;     /* When a disconnected target reselects */
+    hostsim_cmd_t nx_cmd;
+} hm_nexus_t;
+
+/*
+ * The chip sees the DSA table as 32-bit words, and the table offsets in
+ * the script assume that layout. On the host, struct siop_ds is built
+ * from native longs and pointers, so chip offsets are translated to
+ * structure members.
+ */
+typedef struct {
+    long  te_len;
+    char *te_buf;
+} hm_table_entry_t;
+
+static siop_regmap_p     rp;
+static pthread_t         hm_thread;
+static pthread_mutex_t   hm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    hm_cond;
+static int               hm_running;
+static int               hm_kicked;
+static LONG              hm_irq;
+
+/* SCRIPTS processor */
+static int               hm_active;     /* SCRIPTS are running */
+static uint32_t          hm_dsp;        /* Next instruction */
+static uint32_t          hm_dsp_shown;  /* DSP as last published */
+static uint32_t          hm_insn;       /* First word of current insn */
+static uint8_t           hm_istat;      /* DIP, SIP and CON */
+static uint8_t           hm_dstat;      /* Pending DMA interrupts */
+static uint8_t           hm_sstat0;     /* Pending SCSI interrupts */
+
+/* SCSI bus */
+static hm_nexus_t        hm_nexus[HM_MAX_NEXUS];
+static hm_nexus_t        hm_select;     /* Selected, nexus not yet known */
+static uint              hm_queued;     /* Commands in hm_nexus[] */
+static hm_nexus_t       *hm_nx;         /* Connected nexus */
+static int               hm_phase;
+static int               hm_ack_held;   /* Last message byte not acked */
+static int               hm_atn;
+static uint8_t           hm_msgin[8];   /* Target message in queue */
+static uint              hm_msgin_len;
+static uint              hm_msgin_pos;
+static int               hm_msgin_then; /* Phase once the message is acked */
+
+/* Target behavior */
+static int               hm_disconnect;
+static uint              hm_latency;
+static uint              hm_cable_ns;   /* Fastest sync period that works */
+static uint              hm_task_set;   /* Commands a LUN holds, 0 no limit */
+static uint              hm_sync_ns[8]; /* Period agreed, 0 if async */
+
+static hostsim_siop_stats_t hm_stats;
+
+/*
+ * Chip register address (as used by SCRIPTS register instructions) to
+ * byte offset plus one in siop_regmap_t. The register map is laid out
+ * for the big-endian 68030 bus, so byte registers are at the chip
+ * address XOR 3. Longword registers are host native longs, whose least
+ * significant byte is chip byte 0.
+ */
+#define REG8(addr, field) \
+    [addr] = offsetof(siop_regmap_t, field) + 1
+#define REG32(addr, field) \
+    [addr]     = offsetof(siop_regmap_t, field) + 1, \
+    [addr + 1] = offsetof(siop_regmap_t, field) + 2, \
+    [addr + 2] = offsetof(siop_regmap_t, field) + 3, \
+    [addr + 3] = offsetof(siop_regmap_t, field) + 4
+
+static const uint8_t hm_regs[0x40] = {
+    REG8(0x00, siop_scntl0),  REG8(0x01, siop_scntl1),
+    REG8(0x02, siop_sdid),    REG8(0x03, siop_sien),
+    REG8(0x04, siop_scid),    REG8(0x05, siop_sxfer),
+    REG8(0x06, siop_sodl),    REG8(0x07, siop_socl),
+    REG8(0x08, siop_sfbr),    REG8(0x09, siop_sidl),
+    REG8(0x0a, siop_sbdl),    REG8(0x0b, siop_sbcl),
+    REG8(0x0c, siop_dstat),   REG8(0x0d, siop_sstat0),
+    REG8(0x0e, siop_sstat1),  REG8(0x0f, siop_sstat2),
+    REG32(0x10, siop_dsa),
+    REG8(0x14, siop_ctest0),  REG8(0x15, siop_ctest1),
+    REG8(0x16, siop_ctest2),  REG8(0x17, siop_ctest3),
+    REG8(0x18, siop_ctest4),  REG8(0x19, siop_ctest5),
+    REG8(0x1a, siop_ctest6),  REG8(0x1b, siop_ctest7),
+    REG32(0x1c, siop_temp),
+    REG8(0x20, siop_dfifo),   REG8(0x21, siop_istat),
+    REG8(0x22, siop_ctest8),  REG8(0x23, siop_lcrc),
+    REG32(0x28, siop_dnad),
+    REG32(0x2c, siop_dsp),
+    REG32(0x30, siop_dsps),
+    REG32(0x34, siop_scratch),
+    REG8(0x38, siop_dmode),   REG8(0x39, siop_dien),
+    REG8(0x3a, siop_dwt),     REG8(0x3b, siop_dcntl),
+    REG32(0x3c, siop_adder),
+};
+
+static volatile uint8_t *
+hm_reg(uint addr)
+{
+    if ((addr >= ARRAY_SIZE(hm_regs)) || (hm_regs[addr] == 0))
+        return (NULL);
+    return ((volatile uint8_t *) rp + hm_regs[addr] - 1);
+}
+
+static void *
+hm_ptr(uint32_t addr)
+{
+    return ((void *) (uintptr_t) addr);
+}
+
+static uint32_t
+hm_sext24(uint32_t value)
+{
+    return ((value & 0x00800000) ? (value | 0xff000000) : value);
+}
+
+/*
+ * The driver owns the ABRT, RST and SIGP bits of ISTAT and may
+ * store to it at any time, so the model's bits are merged in with a
+ * compare-and-swap rather than a plain store.
+ */
+static void
+hm_put_istat(uint8_t clear)
+{
+    uint8_t old = rp->siop_istat;
+    uint8_t new;
+
+    do {
+        new = (old & ~clear & (SIOP_ISTAT_ABRT | SIOP_ISTAT_RST |
+                               SIOP_ISTAT_SIGP)) | hm_istat;
+    } while (!__atomic_compare_exchange_n(&rp->siop_istat, &old, new, 0,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+static uint8_t
+hm_sbcl(void)
+{
+    if ((hm_nx == NULL) || (hm_phase >= PHASE_BUS_FREE))
+        return (0);
+    return (SIOP_REQ | SIOP_BSY | (hm_atn ? SBCL_ATN : 0) | hm_phase);
+}
+
+static void
+hm_publish_dsp(void)
+{
+    if (rp->siop_dsp != hm_dsp)
+        rp->siop_dsp = hm_dsp;
+    hm_dsp_shown = hm_dsp;
+}
+
+/*
+ * hm_interrupt
+ * ------------
+ * Halt the SCRIPTS processor and post an interrupt. The remaining byte
+ * count of an interrupted block move is left in DBC. The driver reads
+ * DCMD and DBC as one longword, so they are stored together.
+ */
+static int
+hm_interrupt(uint8_t dstat, uint8_t sstat0, uint32_t dbc)
+{
+    hm_dstat  |= dstat;
+    hm_sstat0 |= sstat0;
+    if (dstat != 0)
+        hm_istat |= SIOP_ISTAT_DIP;
+    if (sstat0 != 0)
+        hm_istat |= SIOP_ISTAT_SIP;
+    hm_active = 0;
+    hm_stats.hs_interrupts++;
+
+    rp->siop_sbcl   = hm_sbcl();
+    rp->siop_sstat0 = hm_sstat0;
+    rp->siop_dstat  = SIOP_DSTAT_DFE | hm_dstat;
+    rp->siop_sstat1 = 0;
+    rp->siop_sstat2 = 0;
+    *(volatile uint32_t *) &rp->siop_dcmd = (hm_insn & 0xff000000) |
+                                            (dbc & 0x00ffffff);
+    rp->siop_dfifo = rp->siop_dbc0 & 0x7f;  /* DMA FIFO is empty */
+    hm_publish_dsp();
+    hm_put_istat(0);
+    return (HM_HALT);
+}
+
+static int
+hm_irq_asserted(void)
+{
+    return ((hm_dstat & rp->siop_dien) || (hm_sstat0 & rp->siop_sien));
+}
+
+/* Target side */
+
+static void
+hm_queue_msgin(const uint8_t *msg, uint len, int then)
+{
+    CopyMem(msg, hm_msgin, len);
+    hm_msgin_len  = len;
+    hm_msgin_pos  = 0;
+    hm_msgin_then = then;
+    hm_phase      = PHASE_MSG_IN;
+}
+
+/* Release the bus, with SAVE DATA POINTERS first if sdp is set */
+static void
+hm_tgt_disconnect(hm_nexus_t *nx, int sdp)
+{
+    static const uint8_t disconnect[] = {
+        MSG_SAVEDATAPOINTER, MSG_DISCONNECT
+    };
+
+    nx->nx_ready = host_usec() + hm_latency;
+    hm_queue_msgin(disconnect + !sdp, sizeof (disconnect) - !sdp,
+                   PHASE_BUS_FREE);
+}
+
+/* Move to the data phase of the command, or to status */
+static void
+hm_tgt_dispatch(hm_nexus_t *nx)
+{
+    hostsim_cmd_t *hc = &nx->nx_cmd;
+
+    if ((nx->nx_pos == hc->hc_len) && nx->nx_late) {
+        nx->nx_late = 0;
+        hm_tgt_disconnect(nx, 1);
+        return;
+    }
+    if (nx->nx_pos < hc->hc_len) {
+        if (hc->hc_dir == HOSTSIM_DIR_IN) {
+            hm_phase = PHASE_DATA_IN;
+            return;
+        }
+        if (hc->hc_dir == HOSTSIM_DIR_OUT) {
+            hm_phase = PHASE_DATA_OUT;
+            return;
+        }
+    }
+    hostsim_target_finish(nx->nx_target, nx->nx_lun, hc);
+    hm_phase = PHASE_STATUS;
+}
+
+/* The LUN already holds as many commands as its task set allows */
+static int
+hm_tgt_task_set_full(hm_nexus_t *nx)
+{
+    uint count = 0;
+    uint i;
+
+    if ((hm_task_set == 0) || (nx == &hm_select))
+        return (0);
+    for (i = 0; i < HM_MAX_NEXUS; i++) {
+        if ((hm_nexus[i].nx_state != NX_FREE) && (&hm_nexus[i] != nx) &&
+            (hm_nexus[i].nx_target == nx->nx_target) &&
+            (hm_nexus[i].nx_lun == nx->nx_lun))
+            count++;
+    }
+    return (count >= hm_task_set);
+}
+
+static void
+hm_tgt_command(hm_nexus_t *nx)
+{
+    hostsim_cmd_t *hc = &nx->nx_cmd;
+
+    hm_stats.hs_commands++;
+    nx->nx_pos = 0;
+    nx->nx_split = 0;
+    nx->nx_late = 0;
+    nx->nx_have_cmd = 1;
+    if (hm_tgt_task_set_full(nx)) {
+        /* Refuse the command without disconnecting */
+        hm_stats.hs_queue_full++;
+        hc->hc_dir = HOSTSIM_DIR_NONE;
+        hc->hc_len = 0;
+        hc->hc_status = SCSI_QUEUE_FULL;
+        hm_tgt_dispatch(nx);
+        return;
+    }
+    if (hostsim_target_start(nx->nx_target, nx->nx_lun, hc) != 0) {
+        hc->hc_dir = HOSTSIM_DIR_NONE;
+        hc->hc_status = SCSI_CHECK;
+    }
+    if (hm_disconnect && nx->nx_disc_ok) {
+        if ((hm_disconnect > 1) && (hc->hc_dir != HOSTSIM_DIR_NONE)) {
+            /* Also disconnect halfway through the data, and after it */
+            nx->nx_split = (hc->hc_len / 2) & ~511;
+            nx->nx_late  = 1;
+        }
+        /* Release the bus while the command "executes" */
+        hm_tgt_disconnect(nx, 0);
+        return;
+    }
+    hm_tgt_dispatch(nx);
+}
+
+static void
+hm_tgt_free(hm_nexus_t *nx)
+{
+    if ((nx != &hm_select) && (nx->nx_state != NX_FREE))
+        hm_queued--;
+    nx->nx_state = NX_FREE;
+}
+
+/* The IDENTIFY message selects the LUN which the command is for */
+static void
+hm_tgt_identify(uint8_t code)
+{
+    if (hm_nx != &hm_select)
+        return;
+    hm_select.nx_lun     = code & 0x07;
+    hm_select.nx_disc_ok = (code & MSG_IDENTIFY_DR) == MSG_IDENTIFY_DR;
+}
+
+/*
+ * hm_tgt_nexus
+ * ------------
+ * Once the messages which follow selection have been received, the
+ * target knows the I_T_L or I_T_L_Q nexus of the command, and gives it
+ * an entry of its own. If the table is full, the command runs in the
+ * selection entry without disconnecting.
+ */
+static void
+hm_tgt_nexus(void)
+{
+    hm_nexus_t *nx;
+    uint        i;
+
+    if (hm_nx != &hm_select)
+        return;
+    for (i = 0; i < HM_MAX_NEXUS; i++) {
+        nx = &hm_nexus[i];
+        if (nx->nx_state != NX_FREE)
+            continue;
+        nx->nx_target   = hm_select.nx_target;
+        nx->nx_lun      = hm_select.nx_lun;
+        nx->nx_tagged   = hm_select.nx_tagged;
+        nx->nx_tag      = hm_select.nx_tag;
+        nx->nx_disc_ok  = hm_select.nx_disc_ok;
+        nx->nx_have_cmd = 0;
+        nx->nx_pos      = 0;
+        nx->nx_state    = NX_CONNECTED;
+        hm_nx = nx;
+        if (++hm_queued > hm_stats.hs_queue_max)
+            hm_stats.hs_queue_max = hm_queued;
+        if (nx->nx_tagged)
+            hm_stats.hs_tagged++;
+        return;
+    }
+    hm_select.nx_disc_ok = 0;
+}
+
+/* Message out bytes from the initiator */
+static void
+hm_tgt_msgout(const uint8_t *msg, uint len)
+{
+    static const uint8_t reject[] = { MSG_REJECT };
+    uint8_t sdtr[5];
+    uint    pos = 0;
+
+    hm_atn = 0;
+    while (pos < len) {
+        uint8_t code = msg[pos];
+
+        if (code & MSG_IDENTIFY) {
+            hm_tgt_identify(code);
+            pos++;
+        } else if ((code >= MSG_SIMPLE_Q_TAG) && (code <= MSG_ORDERED_Q_TAG)) {
+            if ((pos + 1 < len) && (hm_nx == &hm_select)) {
+                hm_select.nx_tagged = 1;
+                hm_select.nx_tag    = msg[pos + 1];
+            }
+            pos += 2;
+        } else if (code == MSG_EXT_MESSAGE) {
+            if ((pos + 4 < len) && (msg[pos + 1] == 3) &&
+                (msg[pos + 2] == MSG_SYNC_REQ)) {
+                /* Accept the offer, within what the 53C710 supports */
+                sdtr[0] = MSG_EXT_MESSAGE;
+                sdtr[1] = 3;
+                sdtr[2] = MSG_SYNC_REQ;
+                sdtr[3] = MAX(msg[pos + 3], 25);    /* 100ns */
+                sdtr[4] = MIN(msg[pos + 4], SIOP_MAX_OFFSET);
+                hm_sync_ns[hm_nx->nx_target] = sdtr[4] ? sdtr[3] * 4 : 0;
+                hm_queue_msgin(sdtr, sizeof (sdtr), PHASE_RESUME);
+            } else {
+                hm_queue_msgin(reject, sizeof (reject), PHASE_RESUME);
+            }
+            if (pos + 1 >= len)
+                break;
+            pos += msg[pos + 1] + 2;
+        } else if ((code == MSG_ABORT) || (code == MSG_ABORT_TAG) ||
+                   (code == MSG_BUS_DEVICE_RESET)) {
+            hm_tgt_free(hm_nx);
+            hm_phase = PHASE_BUS_FREE;
+            return;
+        } else {
+            pos++;
+        }
+    }
+    hm_tgt_nexus();
+    if (hm_phase == PHASE_MSG_OUT)
+        hm_phase = PHASE_RESUME;
+    if (hm_phase == PHASE_RESUME) {
+        if (hm_nx->nx_have_cmd)
+            hm_tgt_dispatch(hm_nx);
+        else
+            hm_phase = PHASE_COMMAND;
+    }
+}
+
+/* Data phase bytes the target moves before it changes phase */
+static uint32_t
+hm_data_left(hm_nexus_t *nx)
+{
+    if (nx->nx_split > nx->nx_pos)
+        return (nx->nx_split - nx->nx_pos);
+    return (nx->nx_cmd.hc_len - nx->nx_pos);
+}
+
+static void
+hm_data_moved(hm_nexus_t *nx)
+{
+    if (nx->nx_pos == nx->nx_split) {
+        nx->nx_split = 0;
+        hm_tgt_disconnect(nx, 1);
+    } else if (nx->nx_pos == nx->nx_cmd.hc_len) {
+        hm_tgt_dispatch(nx);
+    }
+}
+
+/*
+ * hm_transfer
+ * -----------
+ * Run the current bus phase for up to len bytes at buf, returning the
+ * number of bytes moved. The target may change phase as a result.
+ */
+static uint32_t
+hm_transfer(uint8_t *buf, uint32_t len)
+{
+    static const uint8_t complete[] = { MSG_CMD_COMPLETE };
+    hm_nexus_t    *nx = hm_nx;
+    hostsim_cmd_t *hc = &nx->nx_cmd;
+    uint32_t       n = 0;
+
+    switch (hm_phase) {
+        case PHASE_DATA_OUT:
+            n = MIN(len, hm_data_left(nx));
+            CopyMem(buf, hc->hc_buf + nx->nx_pos, n);
+            nx->nx_pos += n;
+            hm_data_moved(nx);
+            break;
+        case PHASE_DATA_IN:
+            n = MIN(len, hm_data_left(nx));
+            CopyMem(hc->hc_buf + nx->nx_pos, buf, n);
+            rp->siop_sfbr = buf[0];
+            nx->nx_pos += n;
+            hm_data_moved(nx);
+            break;
+        case PHASE_COMMAND:
+            n = MIN(len, sizeof (hc->hc_cdb));
+            memset(hc->hc_cdb, 0, sizeof (hc->hc_cdb));
+            CopyMem(buf, hc->hc_cdb, n);
+            hc->hc_cdblen = n;
+            hm_tgt_command(nx);
+            break;
+        case PHASE_STATUS:
+            buf[0] = hc->hc_status;
+            rp->siop_sfbr = buf[0];
+            n = 1;
+            hm_tgt_free(nx);
+            hm_queue_msgin(complete, sizeof (complete), PHASE_BUS_FREE);
+            break;
+        case PHASE_MSG_OUT:
+            n = len;
+            hm_tgt_msgout(buf, len);
+            break;
+        case PHASE_MSG_IN:
+            n = MIN(len, hm_msgin_len - hm_msgin_pos);
+            CopyMem(hm_msgin + hm_msgin_pos, buf, n);
+            rp->siop_sfbr = buf[0];
+            hm_msgin_pos += n;
+            /* The target changes phase only once ACK is released */
+            if (hm_msgin_pos == hm_msgin_len)
+                hm_ack_held = 1;
+            break;
+    }
+    hm_stats.hs_dma_bytes += n;
+    return (n);
+}
+
+static void
+hm_disconnected(void)
+{
+    hm_nx = NULL;
+    hm_phase = PHASE_BUS_FREE;
+    hm_atn = 0;
+    hm_ack_held = 0;
+    hm_istat &= ~SIOP_ISTAT_CON;
+    hm_put_istat(0);
+}
+
+static void
+hm_connect(hm_nexus_t *nx)
+{
+    hm_nx = nx;
+    nx->nx_state = NX_CONNECTED;
+    hm_atn = 0;
+    hm_ack_held = 0;
+    hm_istat |= SIOP_ISTAT_CON;
+    hm_put_istat(0);
+}
+
+/* The initiator releases ACK on the last byte of a message in */
+static void
+hm_release_ack(void)
+{
+    if (hm_ack_held == 0)
+        return;
+    hm_ack_held = 0;
+    if (hm_atn && (hm_msgin_then != PHASE_BUS_FREE)) {
+        /* Target responds to ATN by going to message out */
+        hm_phase = PHASE_MSG_OUT;
+        return;
+    }
+    switch (hm_msgin_then) {
+        case PHASE_BUS_FREE:
+            if ((hm_nx->nx_state == NX_CONNECTED) &&
+                (hm_msgin[hm_msgin_len - 1] == MSG_DISCONNECT)) {
+                hm_nx->nx_state = NX_DISCONNECTED;
+                hm_stats.hs_disconnects++;
+            }
+            hm_phase = PHASE_BUS_FREE;
+            break;
+        case PHASE_RESUME:
+            if (hm_nx->nx_have_cmd)
+                hm_tgt_dispatch(hm_nx);
+            else
+                hm_phase = PHASE_COMMAND;
+            break;
+        default:
+            hm_phase = hm_msgin_then;
+            break;
+    }
+}
+
+/*
+ * hm_reselector
+ * -------------
+ * Return the disconnected target which is ready to reselect, if any.
+ * The earliest time another target will be ready is stored at next.
+ */
+static hm_nexus_t *
+hm_reselector(uint64_t *next)
+{
+    uint64_t    now = host_usec();
+    hm_nexus_t *best = NULL;
+    uint        i;
+
+    for (i = 0; i < HM_MAX_NEXUS; i++) {
+        hm_nexus_t *nx = &hm_nexus[i];
+        if (nx->nx_state != NX_DISCONNECTED)
+            continue;
+        if (nx->nx_ready > now) {
+            if (nx->nx_ready < *next)
+                *next = nx->nx_ready;
+        } else if ((best == NULL) || (nx->nx_target > best->nx_target)) {
+            best = nx;  /* Highest SCSI ID wins arbitration */
+        }
+    }
+    return (best);
+}
+
+/* SCRIPTS instructions */
+
+static uint32_t
+hm_table_read(uint32_t offset)
+{
+    struct siop_ds   *ds = hm_ptr(rp->siop_dsa);
+    hm_table_entry_t *te = (hm_table_entry_t *) &ds->idlen;
+
+    /* The saved data pointer at offset 0 is only accessed by memory moves */
+    if (offset == sizeof (uint32_t))
+        return ((uint32_t) ds->scsi_addr);
+    offset -= 2 * sizeof (uint32_t);
+    te += offset / (2 * sizeof (uint32_t));
+    if (offset & sizeof (uint32_t))
+        return ((uint32_t) (uintptr_t) te->te_buf);
+    return ((uint32_t) te->te_len);
+}
+
+static int
+hm_block_move(uint32_t addr)
+{
+    uint     phase = (hm_insn >> 24) & 7;
+    uint32_t count = hm_insn & 0x00ffffff;
+    uint32_t n;
+
+    if (hm_insn & BIT(29))
+        return (hm_interrupt(SIOP_DSTAT_IID, 0, count));  /* Indirect */
+    if (hm_insn & BIT(28)) {
+        /* Table indirect: offset from DSA in the low 24 bits */
+        uint32_t offset = count;
+        count = hm_table_read(offset) & 0x00ffffff;
+        addr  = hm_table_read(offset + sizeof (uint32_t));
+    }
+
+    if (hm_ack_held)
+        hm_release_ack();
+    if ((hm_nx == NULL) || (hm_phase == PHASE_BUS_FREE)) {
+        hm_disconnected();
+        return (hm_interrupt(0, SIOP_SSTAT0_UDC, count));
+    }
+    if (hm_phase != phase) {
+        rp->siop_dnad = addr;
+        return (hm_interrupt(0, SIOP_SSTAT0_M_A, count));
+    }
+    if (count == 0)
+        return (hm_interrupt(SIOP_DSTAT_IID, 0, count));
+    if ((phase == PHASE_DATA_IN) && (hm_sync_ns[hm_nx->nx_target] != 0) &&
+        (hm_sync_ns[hm_nx->nx_target] < hm_cable_ns)) {
+        /* Too fast for the cable: the first byte arrives garbled */
+        hm_stats.hs_parity++;
+        rp->siop_dnad = addr;
+        return (hm_interrupt(0, SIOP_SSTAT0_PAR, count));
+    }
+
+    n = hm_transfer(hm_ptr(addr), count);
+    rp->siop_dnad = addr + n;
+    if (n < count) {
+        /* Target changed phase before the byte count was exhausted */
+        return (hm_interrupt(0, SIOP_SSTAT0_M_A, count - n));
+    }
+    return (HM_CONTINUE);
+}
+
+static int
+hm_select_target(void)
+{
+    uint32_t id;
+    uint     target;
+
+    if (hm_nx != NULL)
+        return (hm_interrupt(SIOP_DSTAT_IID, 0, 0));
+    id = (hm_insn & BIT(25)) ? hm_table_read(hm_insn & 0x00ffffff) : hm_insn;
+    rp->siop_sdid  = (id >> 16) & 0xff;
+    rp->siop_sxfer = (id >> 8) & 0xff;
+    if (rp->siop_sdid == 0)
+        return (hm_interrupt(SIOP_DSTAT_IID, 0, 0));
+
+    target = ffs(rp->siop_sdid) - 1;
+    if (!hostsim_target_present(target, 0))
+        return (hm_interrupt(0, SIOP_SSTAT0_STO, 0));
+
+    hm_select.nx_target   = target;
+    hm_select.nx_lun      = 0;
+    hm_select.nx_tagged   = 0;
+    hm_select.nx_disc_ok  = 0;
+    hm_select.nx_have_cmd = 0;
+    hm_connect(&hm_select);
+    if (hm_insn & BIT(24)) {
+        hm_atn = 1;
+        hm_phase = PHASE_MSG_OUT;
+    } else {
+        /* No IDENTIFY, so the command is for LUN 0 */
+        hm_tgt_identify(MSG_IDENTIFY);
+        hm_tgt_nexus();
+        hm_phase = PHASE_COMMAND;
+    }
+    return (HM_CONTINUE);
+}
+
+static int
+hm_wait_reselect(uint32_t alt)
+{
+    uint64_t    next = UINT64_MAX;
+    hm_nexus_t *nx;
+    uint8_t     msg[3];
+
+    if (hm_nx != NULL)
+        return (hm_interrupt(SIOP_DSTAT_IID, 0, 0));
+    nx = hm_reselector(&next);
+    if (nx != NULL) {
+        hm_stats.hs_reselects++;
+        hm_connect(nx);
+        rp->siop_lcrc = rp->siop_scid | BIT(nx->nx_target);
+        /* Queue tag message follows IDENTIFY for a tagged command */
+        msg[0] = MSG_IDENTIFY | nx->nx_lun;
+        msg[1] = MSG_SIMPLE_Q_TAG;
+        msg[2] = nx->nx_tag;
+        hm_queue_msgin(msg, nx->nx_tagged ? 3 : 1, PHASE_RESUME);
+        return (HM_CONTINUE);
+    }
+    if (rp->siop_istat & SIOP_ISTAT_SIGP) {
+        hm_dsp = alt;
+        return (HM_CONTINUE);
+    }
+    hm_dsp -= 8;  /* Keep waiting */
+    return (HM_BLOCK);
+}
+
+static int
+hm_io(uint32_t addr)
+{
+    uint32_t alt = (hm_insn & BIT(26)) ? hm_dsp + hm_sext24(addr) : addr;
+
+    switch ((hm_insn >> 27) & 7) {
+        case 0:  /* SELECT */
+            if (hm_select_target() != HM_CONTINUE)
+                return (HM_HALT);
+            return (HM_CONTINUE);
+        case 1:  /* WAIT DISCONNECT */
+            if (hm_ack_held)
+                hm_release_ack();
+            if ((hm_nx != NULL) && (hm_phase != PHASE_BUS_FREE))
+                return (hm_interrupt(0, SIOP_SSTAT0_SGE, 0));
+            hm_disconnected();
+            return (HM_CONTINUE);
+        case 2:  /* WAIT RESELECT */
+            return (hm_wait_reselect(alt));
+        case 3:  /* SET */
+            if (hm_insn & SBCL_ATN) {
+                hm_atn = 1;
+                /* Target responds to ATN at the end of a data phase byte */
+                if ((hm_nx != NULL) && ((hm_phase == PHASE_DATA_OUT) ||
+                                        (hm_phase == PHASE_DATA_IN)))
+                    hm_phase = PHASE_MSG_OUT;
+            }
+            return (HM_CONTINUE);
+        case 4:  /* CLEAR */
+            if (hm_insn & SBCL_ATN)
+                hm_atn = 0;
+            if (hm_insn & SBCL_ACK)
+                hm_release_ack();
+            return (HM_CONTINUE);
+    }
+    return (hm_interrupt(SIOP_DSTAT_IID, 0, 0));
+}
+
+static uint8_t
+hm_reg_read(uint addr)
+{
+    uint8_t value = *hm_reg(addr);
+
+    switch (addr) {
+        case 0x01:  /* SCNTL1 */
+            value &= ~SIOP_SCNTL1_CON;
+            if (hm_nx != NULL)
+                value |= SIOP_SCNTL1_CON;
+            break;
+        case 0x16:  /* CTEST2: reading clears SIGP */
+            value &= ~SIOP_CTEST2_SIGP;
+            if (rp->siop_istat & SIOP_ISTAT_SIGP)
+                value |= SIOP_CTEST2_SIGP;
+            hm_put_istat(SIOP_ISTAT_SIGP);
+            break;
+    }
+    return (value);
+}
+
+/* Read/write register instructions: opcode 5, 6 and 7 */
+static int
+hm_register(void)
+{
+    uint    opcode = (hm_insn >> 27) & 7;
+    uint    addr   = (hm_insn >> 16) & 0x7f;
+    uint8_t data   = (hm_insn >> 8) & 0xff;
+    uint8_t src;
+    uint8_t result;
+
+    if (hm_reg(addr) == NULL)
+        return (hm_interrupt(SIOP_DSTAT_IID, 0, 0));
+    src = (opcode == 5) ? rp->siop_sfbr : hm_reg_read(addr);
+
+    switch ((hm_insn >> 24) & 7) {
+        default:
+        case 0: result = data;             break;
+        case 1: result = src << 1;         break;
+        case 2: result = src | data;       break;
+        case 3: result = src ^ data;       break;
+        case 4: result = src & data;       break;
+        case 5: result = src >> 1;         break;
+        case 6: result = src + data;       break;
+        case 7: result = src + data + 1;   break;  /* Carry is not kept */
+    }
+    if (opcode == 6)
+        rp->siop_sfbr = result;
+    else
+        *hm_reg(addr) = result;
+    return (HM_CONTINUE);
+}
+
+static int
+hm_transfer_control(uint32_t addr)
+{
+    uint32_t target = (hm_insn & BIT(23)) ? hm_dsp + hm_sext24(addr) : addr;
+    int      taken = 1;
+
+    if (hm_insn & BIT(16)) {
+        /* Wait for a valid phase */
+        if ((hm_nx == NULL) || (hm_phase == PHASE_BUS_FREE)) {
+            hm_disconnected();
+            return (hm_interrupt(0, SIOP_SSTAT0_UDC, 0));
+        }
+    }
+    if (hm_insn & (BIT(17) | BIT(18))) {
+        int match = 1;
+        if (hm_insn & BIT(17))
+            match = (hm_nx != NULL) && (hm_phase == ((hm_insn >> 24) & 7));
+        if (hm_insn & BIT(18)) {
+            uint8_t mask = (hm_insn >> 8) & 0xff;
+            if ((rp->siop_sfbr & ~mask) != (hm_insn & ~mask & 0xff))
+                match = 0;
+        }
+        taken = (match == !!(hm_insn & BIT(19)));
+    }
+    if (!taken)
+        return (HM_CONTINUE);
+
+    switch ((hm_insn >> 27) & 7) {
+        case 0:  /* JUMP */
+            hm_dsp = target;
+            return (HM_CONTINUE);
+        case 1:  /* CALL */
+            rp->siop_temp = hm_dsp;
+            hm_dsp = target;
+            return (HM_CONTINUE);
+        case 2:  /* RETURN */
+            hm_dsp = rp->siop_temp;
+            return (HM_CONTINUE);
+        case 3:  /* INT */
+            return (hm_interrupt(SIOP_DSTAT_SIR, 0, 0));
+    }
+    return (hm_interrupt(SIOP_DSTAT_IID, 0, 0));
+}
+
+/* MOVE MEMORY: a third instruction word holds the destination */
+static int
+hm_memory_move(uint32_t src, uint32_t dst)
+{
+    uint32_t count = hm_insn & 0x00ffffff;
+
+    hm_dsp += 4;
+    if (hm_insn & 0x3f000000)
+        return (hm_interrupt(SIOP_DSTAT_IID, 0, 0));
+    memmove(hm_ptr(dst), hm_ptr(src), count);
+    hm_stats.hs_dma_bytes += count;
+    return (HM_CONTINUE);
+}
+
+static int
+hm_step(void)
+{
+    const uint32_t *ip = hm_ptr(hm_dsp);
+    uint32_t        addr;
+
+    hm_insn = ip[0];
+    addr    = ip[1];
+    hm_dsp += 8;
+    rp->siop_dsps = addr;
+    hm_stats.hs_fetches++;
+
+    switch (hm_insn >> 30) {
+        case 0:
+            return (hm_block_move(addr));
+        case 1:
+            if (((hm_insn >> 27) & 7) >= 5)
+                return (hm_register());
+            return (hm_io(addr));
+        case 2:
+            return (hm_transfer_control(addr));
+        case 3:
+            return (hm_memory_move(addr, ip[2]));
+    }
+    return (hm_interrupt(SIOP_DSTAT_IID, 0, 0));
+}
+
+/* Software reset (ISTAT ABRT / RST), which also resets the SCSI bus */
+static void
+hm_reset(void)
+{
+    uint i;
+
+    hm_active = 0;
+    hm_dstat  = 0;
+    hm_sstat0 = 0;
+    hm_istat  = 0;
+    for (i = 0; i < HM_MAX_NEXUS; i++)
+        hm_nexus[i].nx_state = NX_FREE;  /* Keep the data buffers */
+    hm_queued = 0;
+    memset(hm_sync_ns, 0, sizeof (hm_sync_ns));
+    hm_disconnected();
+    hm_put_istat(SIOP_ISTAT_ABRT | SIOP_ISTAT_RST);
+    rp->siop_dstat  = SIOP_DSTAT_DFE;
+    rp->siop_sstat0 = 0;
+    rp->siop_ctest1 = SIOP_CTEST1_FMT;
+    rp->siop_ctest8 = (rp->siop_ctest8 & ~SIOP_CTEST8_V) | HM_CTEST8_REV;
+    rp->siop_dsp    = 0;  /* Any DSP the driver stores starts SCRIPTS */
+    hm_dsp_shown = rp->siop_dsp;
+    hm_dsp = hm_dsp_shown;
+}
+
+/* Look for driver register writes which start or steer the chip */
+static void
+hm_sample(void)
+{
+    if (rp->siop_istat & SIOP_ISTAT_ABRT) {
+        hm_reset();
+        return;
+    }
+    hm_put_istat(0);  /* Driver may have stored over CON */
+    if (hm_istat & (SIOP_ISTAT_DIP | SIOP_ISTAT_SIP))
+        return;       /* Halted until the interrupt is serviced */
+
+    if (rp->siop_dsp != hm_dsp_shown) {
+        hm_dsp = rp->siop_dsp;
+        hm_dsp_shown = hm_dsp;
+        hm_active = 1;
+        rp->siop_dcntl &= ~SIOP_DCNTL_STD;
+    } else if (rp->siop_dcntl & SIOP_DCNTL_STD) {
+        rp->siop_dcntl &= ~SIOP_DCNTL_STD;
+        hm_active = 1;
+    }
+}
+
+static void *
+hm_main(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&hm_lock);
+    while (hm_running) {
+        uint64_t next = host_usec() + HM_POLL_USEC;
+        uint64_t now;
+        struct timespec ts;
+
+        hm_sample();
+        while (hm_active) {
+            if (hm_step() == HM_BLOCK) {
+                (void) hm_reselector(&next);
+                hm_publish_dsp();
+                break;
+            }
+        }
+        if (hm_irq_asserted())
+            host_intr_raise(hm_irq);
+
+        if (__atomic_exchange_n(&hm_kicked, 0, __ATOMIC_SEQ_CST))
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = host_usec();
+        next = (next > now) ? next - now : 0;
+        ts.tv_sec  += next / 1000000;
+        ts.tv_nsec += (next % 1000000) * 1000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&hm_cond, &hm_lock, &ts);
+    }
+    pthread_mutex_unlock(&hm_lock);
+    return (NULL);
+}
+
+/*
+ * hm_kick
+ * -------
+ * Exec wait hook: a task is about to block, or is polling its signals,
+ * so the driver may have just written to the chip. This runs with Exec's
+ * lock held, so it must not take hm_lock.
+ */
+static void
+hm_kick(void)
+{
+    __atomic_store_n(&hm_kicked, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&hm_cond);
+}
+
+/*
+ * hostsim_siop_status
+ * -------------------
+ * Combined SSTAT0 / DSTAT read (see SIOP_READ_SSTAT_DSTAT). Reading
+ * clears the pending interrupt status, which releases the interrupt
+ * line.
+ */
+uint32_t
+hostsim_siop_status(volatile void *regs)
+{
+    uint32_t value;
+
+    (void) regs;
+    pthread_mutex_lock(&hm_lock);
+    value = (hm_sstat0 << 8) | SIOP_DSTAT_DFE | hm_dstat;
+    hm_sstat0 = 0;
+    hm_dstat  = 0;
+    hm_istat &= ~(SIOP_ISTAT_DIP | SIOP_ISTAT_SIP);
+    rp->siop_sstat0 = 0;
+    rp->siop_dstat  = SIOP_DSTAT_DFE;
+    hm_put_istat(0);
+    pthread_mutex_unlock(&hm_lock);
+    return (value);
+}
+
+void *
+hostsim_siop_attach(LONG irq)
+{
+    pthread_condattr_t attr;
+
+    rp = AllocMem(sizeof (*rp), MEMF_PUBLIC | MEMF_CLEAR);
+    if (rp == NULL)
+        return (NULL);
+    hm_irq = irq;
+    hm_reset();
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hm_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    hm_running = 1;
+    if (pthread_create(&hm_thread, NULL, hm_main, NULL) != 0) {
+        FreeMem((APTR) rp, sizeof (*rp));
+        rp = NULL;
+        return (NULL);
+    }
+    host_set_wait_hook(hm_kick);
+    return ((void *) rp);
+}
+
+void
+hostsim_siop_detach(void)
+{
+    uint i;
+
+    if (rp == NULL)
+        return;
+    host_set_wait_hook(NULL);
+    pthread_mutex_lock(&hm_lock);
+    hm_running = 0;
+    pthread_cond_signal(&hm_cond);
+    pthread_mutex_unlock(&hm_lock);
+    pthread_join(hm_thread, NULL);
+    pthread_cond_destroy(&hm_cond);
+    for (i = 0; i < HM_MAX_NEXUS; i++)
+        hostsim_cmd_free(&hm_nexus[i].nx_cmd);
+    hostsim_cmd_free(&hm_select.nx_cmd);
+    FreeMem((APTR) rp, sizeof (*rp));
+    rp = NULL;
+}
+
+/*
+ * hostsim_siop_set_disconnect
+ * ---------------------------
+ * When enabled, targets which are allowed to disconnect do so after the
+ * command phase, and reselect latency_us microseconds later. With
+ * enable set to 2, they also save data pointers and disconnect halfway
+ * through the data phase, and again before status.
+ */
+void
+hostsim_siop_set_disconnect(int enable, uint latency_us)
+{
+    pthread_mutex_lock(&hm_lock);
+    hm_disconnect = enable;
+    hm_latency    = latency_us;
+    pthread_mutex_unlock(&hm_lock);
+}
+
+/*
+ * hostsim_siop_set_cable
+ * ----------------------
+ * Model a cable which only carries synchronous transfers with a period
+ * of at least min_ns: faster data in transfers get a parity error.
+ * Zero (the default) lets every period through.
+ */
+void
+hostsim_siop_set_cable(uint min_ns)
+{
+    pthread_mutex_lock(&hm_lock);
+    hm_cable_ns = min_ns;
+    pthread_mutex_unlock(&hm_lock);
+}
+
+/*
+ * hostsim_siop_set_task_set
+ * -------------------------
+ * Model targets which queue at most depth commands per LUN, answering
+ * any more with TASK SET FULL status. Zero (the default) is no limit.
+ */
+void
+hostsim_siop_set_task_set(uint depth)
+{
+    pthread_mutex_lock(&hm_lock);
+    hm_task_set = depth;
+    pthread_mutex_unlock(&hm_lock);
+}
+
+void
+hostsim_siop_stats(hostsim_siop_stats_t *stats, int clear)
+{
+    pthread_mutex_lock(&hm_lock);
+    if (stats != NULL)
+        *stats = hm_stats;
+    if (clear)
+        memset(&hm_stats, 0, sizeof (hm_stats));
+    pthread_mutex_unlock(&hm_lock);
+}
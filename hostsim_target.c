@@ -0,0 +1,746 @@
+/*
+ * Virtual SCSI direct-access targets for the host simulation.
+ *
+ * Each target/LUN is backed either by an image file or, when no file
+ * is given, by a RAM disk. The emulation covers the commands which the
+ * driver itself issues (probe, geometry, read/write and start/stop),
+ * and reports CHECK CONDITION with ILLEGAL REQUEST sense for anything
+ * else so the error paths in scsipi and sd can be exercised as well.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "port.h"
+#include "scsipiconf.h"
+#include "scsi_all.h"
+#include "scsipi_all.h"
+#include "scsi_disk.h"
+#include "scsipi_disk.h"
+#include "hostsim.h"
+
+#define HT_BLKSIZE      512
+#define HT_HEADS        16
+#define HT_SECTORS      63
+#define HT_UNMAP_MAX    4096    /* Most blocks an UNMAP or WRITE SAME takes */
+#define HT_UNMAP_DESCS  8       /* Most UNMAP block descriptors */
+#define HT_UNMAP_GRAN   8       /* Optimal unmap granularity */
+
+typedef struct {
+    int       ht_present;
+    int       ht_fd;            /* Image file, or -1 for RAM disk */
+    uint8_t  *ht_ram;           /* RAM disk contents */
+    uint64_t  ht_blocks;        /* Capacity in HT_BLKSIZE blocks */
+    uint8_t   ht_caching;       /* Mode page 8 flags (WCE, RCD) */
+    uint8_t   ht_sense[18];     /* Pending fixed-format sense data */
+} hostsim_lun_t;
+
+static hostsim_lun_t ht_luns[HOSTSIM_MAX_TARGETS][HOSTSIM_MAX_LUNS];
+
+/* 1 if targets have UNMAP, 0 if they only unmap through WRITE SAME */
+static int ht_unmap = 1;
+static int ht_write_same = 1;  /* 0 if targets don't have WRITE SAME */
+
+void
+hostsim_target_set_unmap(int unmap)
+{
+    ht_unmap = unmap;
+}
+
+void
+hostsim_target_set_write_same(int write_same)
+{
+    ht_write_same = write_same;
+}
+
+static hostsim_lun_t *
+ht_get(uint target, uint lun)
+{
+    if ((target >= HOSTSIM_MAX_TARGETS) || (lun >= HOSTSIM_MAX_LUNS))
+        return (NULL);
+    if (ht_luns[target][lun].ht_present == 0)
+        return (NULL);
+    return (&ht_luns[target][lun]);
+}
+
+/*
+ * hostsim_target_add
+ * ------------------
+ * Attach a virtual disk at the given target and LUN. If path is NULL,
+ * a RAM disk of size_mb megabytes is created. Otherwise the image file
+ * is opened, and if it is new or empty, sized to size_mb megabytes.
+ */
+int
+hostsim_target_add(uint target, uint lun, const char *path, uint64_t size_mb)
+{
+    hostsim_lun_t *ht;
+    uint64_t       size = size_mb << 20;
+    struct stat    st;
+
+    if ((target >= HOSTSIM_MAX_TARGETS) || (lun >= HOSTSIM_MAX_LUNS))
+        return (-1);
+    ht = &ht_luns[target][lun];
+    if (ht->ht_present)
+        return (-1);
+    memset(ht, 0, sizeof (*ht));
+    ht->ht_fd = -1;
+
+    if (path == NULL) {
+        if (size == 0)
+            return (-1);
+        ht->ht_ram = calloc(1, size);
+        if (ht->ht_ram == NULL)
+            return (-1);
+    } else {
+        ht->ht_fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (ht->ht_fd < 0) {
+            perror(path);
+            return (-1);
+        }
+        if (fstat(ht->ht_fd, &st) != 0) {
+            perror(path);
+            close(ht->ht_fd);
+            return (-1);
+        }
+        if (st.st_size == 0) {
+            if (ftruncate(ht->ht_fd, size) != 0) {
+                perror(path);
+                close(ht->ht_fd);
+                return (-1);
+            }
+        } else {
+            size = st.st_size;
+        }
+    }
+    ht->ht_blocks = size / HT_BLKSIZE;
+    if (ht->ht_blocks == 0) {
+        if (ht->ht_fd >= 0)
+            close(ht->ht_fd);
+        free(ht->ht_ram);
+        return (-1);
+    }
+    ht->ht_present = 1;
+    return (0);
+}
+
+void
+hostsim_target_remove_all(void)
+{
+    uint target;
+    uint lun;
+
+    for (target = 0; target < HOSTSIM_MAX_TARGETS; target++) {
+        for (lun = 0; lun < HOSTSIM_MAX_LUNS; lun++) {
+            hostsim_lun_t *ht = &ht_luns[target][lun];
+            if (ht->ht_present == 0)
+                continue;
+            if (ht->ht_fd >= 0)
+                close(ht->ht_fd);
+            free(ht->ht_ram);
+            memset(ht, 0, sizeof (*ht));
+        }
+    }
+}
+
+int
+hostsim_target_present(uint target, uint lun)
+{
+    return (ht_get(target, lun) != NULL);
+}
+
+static void
+ht_set_sense(hostsim_lun_t *ht, uint8_t key, uint8_t asc, uint8_t ascq)
+{
+    memset(ht->ht_sense, 0, sizeof (ht->ht_sense));
+    ht->ht_sense[0]  = SSD_RCODE_CURRENT;
+    ht->ht_sense[2]  = key;
+    ht->ht_sense[7]  = sizeof (ht->ht_sense) - 8;
+    ht->ht_sense[12] = asc;
+    ht->ht_sense[13] = ascq;
+}
+
+/*
+ * Each command has its own data phase buffer, as a target which queues
+ * commands may have several in progress at once.
+ */
+static uint8_t *
+ht_buffer(hostsim_cmd_t *hc, uint32_t len)
+{
+    if (len > hc->hc_memlen) {
+        uint8_t *buf = realloc(hc->hc_mem, len);
+        if (buf == NULL)
+            return (NULL);
+        hc->hc_mem = buf;
+        hc->hc_memlen = len;
+    }
+    return (hc->hc_mem);
+}
+
+static int
+ht_media_io(hostsim_lun_t *ht, hostsim_cmd_t *hc, int write, uint64_t lba)
+{
+    uint64_t offset = lba * HT_BLKSIZE;
+    uint32_t len = hc->hc_len;
+    ssize_t  count;
+
+    if (ht->ht_ram != NULL) {
+        if (write)
+            CopyMem(hc->hc_buf, ht->ht_ram + offset, len);
+        else
+            CopyMem(ht->ht_ram + offset, hc->hc_buf, len);
+        return (0);
+    }
+    if (write)
+        count = pwrite(ht->ht_fd, hc->hc_buf, len, offset);
+    else
+        count = pread(ht->ht_fd, hc->hc_buf, len, offset);
+    return (count == (ssize_t) len ? 0 : -1);
+}
+
+/* Write blk to each of nblks blocks, or zeros if blk is NULL (unmapped) */
+static int
+ht_media_fill(hostsim_lun_t *ht, uint64_t lba, uint32_t nblks,
+              const uint8_t *blk)
+{
+    static const uint8_t zero[HT_BLKSIZE];
+    uint64_t offset = lba * HT_BLKSIZE;
+
+    if (blk == NULL)
+        blk = zero;
+    for (; nblks > 0; nblks--, offset += HT_BLKSIZE) {
+        if (ht->ht_ram != NULL)
+            CopyMem((void *) blk, ht->ht_ram + offset, HT_BLKSIZE);
+        else if (pwrite(ht->ht_fd, blk, HT_BLKSIZE, offset) != HT_BLKSIZE)
+            return (-1);
+    }
+    return (0);
+}
+
+/*
+ * ht_mode_page
+ * ------------
+ * Append the requested mode page at ptr, returning its length. The
+ * geometry is synthesized from the capacity with fixed heads and
+ * sectors per track.
+ */
+static uint
+ht_mode_page(hostsim_lun_t *ht, uint page, uint8_t *ptr)
+{
+    uint32_t ncyl = ht->ht_blocks / (HT_HEADS * HT_SECTORS);
+
+    switch (page) {
+        case 3:  /* Format Device */
+            memset(ptr, 0, 24);
+            ptr[0] = 3;
+            ptr[1] = 0x16;
+            _lto2b(HT_SECTORS, ptr + 10);
+            _lto2b(HT_BLKSIZE, ptr + 12);
+            _lto2b(1, ptr + 14);
+            return (24);
+        case 4:  /* Rigid Disk Geometry */
+            memset(ptr, 0, 24);
+            ptr[0] = 4;
+            ptr[1] = 0x16;
+            _lto3b(ncyl, ptr + 2);
+            ptr[5] = HT_HEADS;
+            _lto2b(7200, ptr + 20);
+            return (24);
+        case 8:  /* Caching */
+            memset(ptr, 0, 20);
+            ptr[0] = 8;
+            ptr[1] = 0x12;
+            ptr[2] = ht->ht_caching;
+            return (20);
+        default:
+            return (0);
+    }
+}
+
+static int
+ht_mode_sense(hostsim_lun_t *ht, hostsim_cmd_t *hc, int ten)
+{
+    static const uint8_t all_pages[] = { 3, 4, 8 };
+    uint8_t  *cdb = hc->hc_cdb;
+    uint      page = cdb[2] & 0x3f;
+    uint      hdrlen = ten ? 8 : 4;
+    uint      alloc = ten ? _2btol(cdb + 7) : cdb[4];
+    uint      len;
+    uint      i;
+    uint8_t  *buf;
+
+    if ((cdb[2] & 0xc0) == 0x40) {
+        /* Changeable values: only the cache enable bits */
+        if (page != 8)
+            return (-1);
+    }
+    buf = ht_buffer(hc, 256);
+    if (buf == NULL)
+        return (-1);
+    memset(buf, 0, 256);
+
+    len = hdrlen;
+    if ((cdb[1] & SMS_DBD) == 0) {
+        uint8_t *bd = buf + len;
+        _lto3b(ht->ht_blocks > 0xffffff ? 0xffffff : ht->ht_blocks, bd + 1);
+        _lto3b(HT_BLKSIZE, bd + 5);
+        if (ten)
+            buf[7] = 8;
+        else
+            buf[3] = 8;
+        len += 8;
+    }
+    if (page == 0x3f) {
+        for (i = 0; i < sizeof (all_pages); i++)
+            len += ht_mode_page(ht, all_pages[i], buf + len);
+    } else {
+        uint plen = ht_mode_page(ht, page, buf + len);
+        if (plen == 0)
+            return (-1);
+        if ((cdb[2] & 0xc0) == 0x40) {
+            memset(buf + len + 2, 0, plen - 2);
+            buf[len + 2] = CACHING_WCE | CACHING_RCD;
+        }
+        len += plen;
+    }
+    if (ten)
+        _lto2b(len - 2, buf);
+    else
+        buf[0] = len - 1;
+
+    hc->hc_buf = buf;
+    hc->hc_dir = HOSTSIM_DIR_IN;
+    hc->hc_len = MIN(len, alloc);
+    return (0);
+}
+
+/*
+ * ht_vpd
+ * ------
+ * INQUIRY vital product data: the Block Limits and Logical Block
+ * Provisioning pages, which say how the target unmaps blocks.
+ */
+static int
+ht_vpd(hostsim_lun_t *ht, hostsim_cmd_t *hc)
+{
+    uint8_t  *cdb = hc->hc_cdb;
+    uint      len;
+    uint8_t  *buf;
+
+    buf = ht_buffer(hc, 64);
+    if (buf == NULL)
+        return (-1);
+    memset(buf, 0, 64);
+    buf[0] = T_DIRECT;
+    buf[1] = cdb[2];
+    switch (cdb[2]) {
+        case SINQ_VPD_SUPPORTED:
+            buf[4] = SINQ_VPD_SUPPORTED;
+            buf[5] = SINQ_VPD_BLOCK_LIMITS;
+            buf[6] = SINQ_VPD_PROVISIONING;
+            len = 7;
+            break;
+        case SINQ_VPD_BLOCK_LIMITS: {
+            struct scsi_vpd_block_limits *bl = (void *) buf;
+            bl->wsnz = 1;  /* WRITE SAME of 0 blocks isn't to the end */
+            if (ht_unmap) {
+                _lto4b(HT_UNMAP_MAX, bl->max_unmap_lba_cnt);
+                _lto4b(HT_UNMAP_DESCS, bl->max_unmap_desc_cnt);
+            }
+            _lto4b(HT_UNMAP_GRAN, bl->opt_unmap_gran);
+            _lto4b(VPD_UGAVALID, bl->unmap_gran_align);
+            if (ht_write_same)
+                _lto8b(HT_UNMAP_MAX, bl->max_write_same_len);
+            len = sizeof (*bl);
+            break;
+        }
+        case SINQ_VPD_PROVISIONING: {
+            struct scsi_vpd_provisioning *lbp = (void *) buf;
+            lbp->flags = (ht_write_same ? VPD_LBPWS : 0) |
+                         (ht_unmap ? VPD_LBPU : 0);
+            lbp->prov_type = 2;  /* Thin provisioned */
+            len = sizeof (*lbp);
+            break;
+        }
+        default:
+            return (-1);
+    }
+    _lto2b(len - 4, buf + 2);
+    hc->hc_buf = buf;
+    hc->hc_dir = HOSTSIM_DIR_IN;
+    hc->hc_len = MIN(len, _2btol(cdb + 3));
+    return (0);
+}
+
+/* Unmap (zero) the blocks of each UNMAP block descriptor */
+static void
+ht_unmap_blocks(hostsim_lun_t *ht, hostsim_cmd_t *hc)
+{
+    uint8_t  *buf = hc->hc_buf;
+    uint      len = hc->hc_len;
+    uint      pos;
+    uint64_t  lba;
+    uint32_t  nblks;
+    uint32_t  total = 0;
+
+    if ((len < 8) || (_2btol(buf + 2) > len - 8)) {
+        /* Invalid field in parameter list */
+        ht_set_sense(ht, SKEY_ILLEGAL_REQUEST, 0x26, 0x00);
+        hc->hc_status = SCSI_CHECK;
+        return;
+    }
+    len = 8 + _2btol(buf + 2);
+    for (pos = 8; pos + 16 <= len; pos += 16) {
+        lba = _8btol(buf + pos);
+        nblks = _4btol(buf + pos + 8);
+        total += nblks;
+        if ((pos >= 8 + 16 * HT_UNMAP_DESCS) || (total > HT_UNMAP_MAX)) {
+            ht_set_sense(ht, SKEY_ILLEGAL_REQUEST, 0x26, 0x00);
+            hc->hc_status = SCSI_CHECK;
+            return;
+        }
+        if ((lba + nblks > ht->ht_blocks) || (lba + nblks < lba)) {
+            ht_set_sense(ht, SKEY_ILLEGAL_REQUEST, 0x21, 0x00);
+            hc->hc_status = SCSI_CHECK;
+            return;
+        }
+        if (ht_media_fill(ht, lba, nblks, NULL) != 0) {
+            ht_set_sense(ht, SKEY_MEDIUM_ERROR, 0x0c, 0x00);
+            hc->hc_status = SCSI_CHECK;
+            return;
+        }
+    }
+}
+
+/* Take the caching page of MODE SELECT data; no other page is changeable */
+static void
+ht_mode_select(hostsim_lun_t *ht, hostsim_cmd_t *hc)
+{
+    uint8_t *buf = hc->hc_buf;
+    uint     len = hc->hc_len;
+    uint     pos;
+
+    if (len < 4)
+        goto bad;
+    for (pos = 4 + buf[3]; pos + 2 <= len; pos += 2 + buf[pos + 1]) {
+        if (((buf[pos] & 0x3f) != 8) || (buf[pos + 1] == 0) ||
+            (pos + 3 > len))
+            goto bad;
+        ht->ht_caching = buf[pos + 2] & (CACHING_WCE | CACHING_RCD);
+    }
+    return;
+bad:
+    /* Invalid field in parameter list */
+    ht_set_sense(ht, SKEY_ILLEGAL_REQUEST, 0x26, 0x00);
+    hc->hc_status = SCSI_CHECK;
+}
+
+/*
+ * hostsim_target_start
+ * --------------------
+ * Decode the command in hc and set up its data phase. Returns -1 if no
+ * target responds at this address (selection timeout). Commands which
+ * fail before the data phase complete with no data and CHECK CONDITION
+ * status from hostsim_target_finish().
+ */
+int
+hostsim_target_start(uint target, uint lun, hostsim_cmd_t *hc)
+{
+    hostsim_lun_t *ht = ht_get(target, 0);
+    uint8_t       *cdb = hc->hc_cdb;
+    uint64_t       lba = 0;
+    uint32_t       nblks = 0;
+    uint8_t       *buf;
+
+    if (ht == NULL)
+        return (-1);
+
+    hc->hc_dir = HOSTSIM_DIR_NONE;
+    hc->hc_len = 0;
+    hc->hc_buf = NULL;
+    hc->hc_status = SCSI_OK;
+
+    ht = ht_get(target, lun);
+    if (ht == NULL) {
+        /* Target exists, but not this LUN */
+        if (cdb[0] == INQUIRY) {
+            ht = ht_get(target, 0);
+            buf = ht_buffer(hc, SCSIPI_INQUIRY_LENGTH_SCSI2);
+            if (buf == NULL)
+                goto check_hw;
+            memset(buf, 0, SCSIPI_INQUIRY_LENGTH_SCSI2);
+            buf[0] = SID_QUAL_LU_NOTPRESENT | T_NODEVICE;
+            hc->hc_buf = buf;
+            hc->hc_dir = HOSTSIM_DIR_IN;
+            hc->hc_len = MIN(cdb[4], SCSIPI_INQUIRY_LENGTH_SCSI2);
+            return (0);
+        }
+        ht = ht_get(target, 0);
+        ht_set_sense(ht, SKEY_ILLEGAL_REQUEST, 0x25, 0x00);
+        hc->hc_status = SCSI_CHECK;
+        return (0);
+    }
+
+    switch (cdb[0]) {
+        case SCSI_TEST_UNIT_READY:
+        case START_STOP:
+        case SCSI_PREVENT_ALLOW_MEDIUM_REMOVAL:
+        case SCSI_SYNCHRONIZE_CACHE_10:
+            return (0);
+
+        case SCSI_REQUEST_SENSE:
+            buf = ht_buffer(hc, sizeof (ht->ht_sense));
+            if (buf == NULL)
+                goto check_hw;
+            CopyMem(ht->ht_sense, buf, sizeof (ht->ht_sense));
+            if (buf[0] == 0)
+                buf[0] = SSD_RCODE_CURRENT;
+            buf[7] = sizeof (ht->ht_sense) - 8;
+            memset(ht->ht_sense, 0, sizeof (ht->ht_sense));
+            hc->hc_buf = buf;
+            hc->hc_dir = HOSTSIM_DIR_IN;
+            hc->hc_len = MIN(cdb[4], sizeof (ht->ht_sense));
+            return (0);
+
+        case INQUIRY:
+            if (cdb[1] & SINQ_EVPD) {
+                if (ht_vpd(ht, hc) != 0)
+                    goto check_cdb;
+                return (0);
+            }
+            buf = ht_buffer(hc, SCSIPI_INQUIRY_LENGTH_SCSI2);
+            if (buf == NULL)
+                goto check_hw;
+            memset(buf, 0, SCSIPI_INQUIRY_LENGTH_SCSI2);
+            buf[0] = T_DIRECT;
+            buf[2] = 2;                 /* SCSI-2 */
+            buf[3] = 2;                 /* Response data format */
+            buf[4] = SCSIPI_INQUIRY_LENGTH_SCSI2 - 5;
+            buf[7] = SID_CmdQue | SID_Sync;
+            CopyMem("HOSTSIM ", buf + 8, 8);
+            CopyMem("VIRTUAL DISK    ", buf + 16, 16);
+            CopyMem("1.0 ", buf + 32, 4);
+            hc->hc_buf = buf;
+            hc->hc_dir = HOSTSIM_DIR_IN;
+            hc->hc_len = MIN(cdb[4], SCSIPI_INQUIRY_LENGTH_SCSI2);
+            return (0);
+
+        case READ_CAPACITY_10:
+            buf = ht_buffer(hc, 8);
+            if (buf == NULL)
+                goto check_hw;
+            _lto4b(ht->ht_blocks > 0xffffffff ? 0xffffffff :
+                   ht->ht_blocks - 1, buf);
+            _lto4b(HT_BLKSIZE, buf + 4);
+            hc->hc_buf = buf;
+            hc->hc_dir = HOSTSIM_DIR_IN;
+            hc->hc_len = 8;
+            return (0);
+
+        case SERVICE_ACTION_IN:
+            if ((cdb[1] & 0x1f) != SRC16_READ_CAPACITY)
+                goto check_opcode;
+            buf = ht_buffer(hc, 32);
+            if (buf == NULL)
+                goto check_hw;
+            memset(buf, 0, 32);
+            _lto8b(ht->ht_blocks - 1, buf);
+            _lto4b(HT_BLKSIZE, buf + 8);
+            hc->hc_buf = buf;
+            hc->hc_dir = HOSTSIM_DIR_IN;
+            hc->hc_len = MIN(_4btol(cdb + 10), 32);
+            return (0);
+
+        case SCSI_MODE_SENSE_6:
+            if (ht_mode_sense(ht, hc, 0) != 0)
+                goto check_cdb;
+            return (0);
+
+        case SCSI_MODE_SENSE_10:
+            if (ht_mode_sense(ht, hc, 1) != 0)
+                goto check_cdb;
+            return (0);
+
+        case SCSI_UNMAP:
+            if (!ht_unmap)
+                goto check_opcode;
+            if (_2btol(cdb + 7) == 0)
+                return (0);
+            buf = ht_buffer(hc, _2btol(cdb + 7));
+            if (buf == NULL)
+                goto check_hw;
+            hc->hc_buf = buf;
+            hc->hc_dir = HOSTSIM_DIR_OUT;
+            hc->hc_len = _2btol(cdb + 7);
+            return (0);
+
+        case SCSI_WRITE_SAME_10:
+        case SCSI_WRITE_SAME_16:
+            /* One block of data, written to (or unmapping) them all */
+            if (!ht_write_same)
+                goto check_opcode;
+            if (cdb[0] == SCSI_WRITE_SAME_10) {
+                lba = _4btol(cdb + 2);
+                nblks = _2btol(cdb + 7);
+            } else {
+                lba = _8btol(cdb + 2);
+                nblks = _4btol(cdb + 10);
+            }
+            if ((cdb[1] & SWS_NDOB) || (nblks == 0) ||
+                (nblks > HT_UNMAP_MAX))
+                goto check_cdb;
+            if ((lba + nblks > ht->ht_blocks) || (lba + nblks < lba)) {
+                ht_set_sense(ht, SKEY_ILLEGAL_REQUEST, 0x21, 0x00);
+                hc->hc_status = SCSI_CHECK;
+                return (0);
+            }
+            buf = ht_buffer(hc, HT_BLKSIZE);
+            if (buf == NULL)
+                goto check_hw;
+            hc->hc_buf = buf;
+            hc->hc_dir = HOSTSIM_DIR_OUT;
+            hc->hc_len = HT_BLKSIZE;
+            return (0);
+
+        case SCSI_MODE_SELECT_6:
+            if (cdb[4] == 0)
+                return (0);
+            buf = ht_buffer(hc, cdb[4]);
+            if (buf == NULL)
+                goto check_hw;
+            hc->hc_buf = buf;
+            hc->hc_dir = HOSTSIM_DIR_OUT;
+            hc->hc_len = cdb[4];
+            return (0);
+
+        case SCSI_READ_6_COMMAND:
+        case SCSI_WRITE_6_COMMAND:
+            lba = _3btol(cdb + 1) & 0x1fffff;
+            nblks = cdb[4] ? cdb[4] : 256;
+            break;
+        case READ_10:
+        case WRITE_10:
+            lba = _4btol(cdb + 2);
+            nblks = _2btol(cdb + 7);
+            break;
+        case READ_12:
+        case WRITE_12:
+            lba = _4btol(cdb + 2);
+            nblks = _4btol(cdb + 6);
+            break;
+        case READ_16:
+        case WRITE_16:
+            lba = _8btol(cdb + 2);
+            nblks = _4btol(cdb + 10);
+            break;
+
+        default:
+            goto check_opcode;
+    }
+
+    /* Media access commands */
+    if ((lba + nblks > ht->ht_blocks) || (lba + nblks < lba)) {
+        ht_set_sense(ht, SKEY_ILLEGAL_REQUEST, 0x21, 0x00);
+        hc->hc_status = SCSI_CHECK;
+        return (0);
+    }
+    hc->hc_len = nblks * HT_BLKSIZE;
+    buf = ht_buffer(hc, hc->hc_len);
+    if (buf == NULL)
+        goto check_hw;
+    hc->hc_buf = buf;
+    if ((cdb[0] == SCSI_READ_6_COMMAND) || (cdb[0] == READ_10) ||
+        (cdb[0] == READ_12) || (cdb[0] == READ_16)) {
+        hc->hc_dir = HOSTSIM_DIR_IN;
+        if (ht_media_io(ht, hc, 0, lba) != 0) {
+            ht_set_sense(ht, SKEY_MEDIUM_ERROR, 0x11, 0x00);
+            hc->hc_dir = HOSTSIM_DIR_NONE;
+            hc->hc_len = 0;
+            hc->hc_status = SCSI_CHECK;
+        }
+    } else {
+        hc->hc_dir = HOSTSIM_DIR_OUT;
+    }
+    return (0);
+
+check_opcode:
+    ht_set_sense(ht, SKEY_ILLEGAL_REQUEST, 0x20, 0x00);
+    hc->hc_status = SCSI_CHECK;
+    return (0);
+check_cdb:
+    ht_set_sense(ht, SKEY_ILLEGAL_REQUEST, 0x24, 0x00);
+    hc->hc_status = SCSI_CHECK;
+    return (0);
+check_hw:
+    ht_set_sense(ht, SKEY_HARDWARE_ERROR, 0x44, 0x00);
+    hc->hc_status = SCSI_CHECK;
+    return (0);
+}
+
+/*
+ * hostsim_target_finish
+ * ---------------------
+ * Complete the command after its data phase. For writes, the data the
+ * initiator placed in hc_buf is committed to the media.
+ */
+void
+hostsim_target_finish(uint target, uint lun, hostsim_cmd_t *hc)
+{
+    hostsim_lun_t *ht = ht_get(target, lun);
+    uint8_t       *cdb = hc->hc_cdb;
+    uint64_t       lba;
+
+    if ((ht == NULL) || (hc->hc_dir != HOSTSIM_DIR_OUT))
+        return;
+
+    switch (cdb[0]) {
+        case SCSI_WRITE_6_COMMAND:
+            lba = _3btol(cdb + 1) & 0x1fffff;
+            break;
+        case WRITE_10:
+        case WRITE_12:
+            lba = _4btol(cdb + 2);
+            break;
+        case WRITE_16:
+            lba = _8btol(cdb + 2);
+            break;
+        case SCSI_MODE_SELECT_6:
+            ht_mode_select(ht, hc);
+            return;
+        case SCSI_UNMAP:
+            ht_unmap_blocks(ht, hc);
+            return;
+        case SCSI_WRITE_SAME_10:
+            if (ht_media_fill(ht, _4btol(cdb + 2), _2btol(cdb + 7),
+                              hc->hc_buf) != 0) {
+                ht_set_sense(ht, SKEY_MEDIUM_ERROR, 0x0c, 0x00);
+                hc->hc_status = SCSI_CHECK;
+            }
+            return;
+        case SCSI_WRITE_SAME_16:
+            if (ht_media_fill(ht, _8btol(cdb + 2), _4btol(cdb + 10),
+                              hc->hc_buf) != 0) {
+                ht_set_sense(ht, SKEY_MEDIUM_ERROR, 0x0c, 0x00);
+                hc->hc_status = SCSI_CHECK;
+            }
+            return;
+        default:
+            return;
+    }
+    if (ht_media_io(ht, hc, 1, lba) != 0) {
+        ht_set_sense(ht, SKEY_MEDIUM_ERROR, 0x0c, 0x00);
+        hc->hc_status = SCSI_CHECK;
+    }
+}
+
+/* Release the data phase buffer of a command */
+void
+hostsim_cmd_free(hostsim_cmd_t *hc)
+{
+    free(hc->hc_mem);
+    hc->hc_mem = NULL;
+    hc->hc_memlen = 0;
+    hc->hc_buf = NULL;
+}
@@ -13,6 +13,7 @@
 #include <clib/exec_protos.h>
 #include <clib/intuition_protos.h>
 #include <devices/timer.h>
+#include <proto/timer.h>
 #include <intuition/intuition.h>
 #include <inline/intuition.h>
 #include <exec/io.h>
@@ -113,12 +114,61 @@ static struct timerequest *create_timer(ULONG unit)
     return tr;
 }
 
+/*
+ * The E clock gives a cheap monotonic timestamp once the command handler
+ * has opened timer.device, and times waits too short to sleep for. It
+ * also keeps a timer request open for its own longer waits; other tasks
+ * open one for each wait.
+ */
+#define DELAY_SPIN_USEC 1000  // Shorter waits spin on the E clock
+
+uint32_t eclock_hz = 0;                  // E clock ticks per second
+static struct timerequest *delay_tr;     // Kept open for delay_task
+static struct Task        *delay_task;
+
+void
+delay_open(void)
+{
+    struct EClockVal ev;
+
+    eclock_hz = ReadEClock(&ev);
+    delay_tr = create_timer(UNIT_MICROHZ);
+    if (delay_tr != NULL)
+        delay_task = FindTask(NULL);
+}
+
+void
+delay_close(void)
+{
+    delete_timer(delay_tr);
+    delay_tr = NULL;
+    delay_task = NULL;
+    eclock_hz = 0;
+}
+
+uint64_t
+eclock_now(void)
+{
+    struct EClockVal ev;
+
+    ReadEClock(&ev);
+    return (((uint64_t) ev.ev_hi << 32) | ev.ev_lo);
+}
+
 void
 delay(int usecs)
 {
     struct timerequest *tr;
     struct timeval tv;
 
+    if ((eclock_hz != 0) && ((usecs < DELAY_SPIN_USEC) || (bsd_ilevel > 0))) {
+        uint64_t end = eclock_now() +
+                       ((uint64_t) usecs * eclock_hz + 999999) / 1000000;
+        while (eclock_now() < end)
+            ;
+        return;
+    }
+
     if(bsd_ilevel > 0) {
         printf("delay(%d): Interrupts disabled, using delay loop.\n", usecs);
         for (unsigned long i = 0; i < ((unsigned long)usecs << 3); i++)
@@ -126,7 +176,9 @@ delay(int usecs)
 	return;
     }
 
-    if (usecs < 20000)
+    if (FindTask(NULL) == delay_task)
+        tr = delay_tr;
+    else if (usecs < 20000)
         tr = create_timer(UNIT_MICROHZ);
     else
         tr = create_timer(UNIT_VBLANK);
@@ -139,7 +191,8 @@ delay(int usecs)
     tv.tv_secs  = usecs / 1000000;
     tv.tv_micro = usecs % 1000000;
     wait_for_timer(tr, &tv);
-    delete_timer(tr);
+    if (tr != delay_tr)
+        delete_timer(tr);
 }
 
 /* Block (nesting) interrupts */
@@ -202,39 +255,54 @@ char *itoa(int value, char *string, int radix)
     return string;
 }
 
-/* callout */
-
-callout_t *callout_head = NULL;
+/*
+ * callout
+ *
+ * Callouts hang off a hashed timing wheel of CALLOUT_WHEEL slots, by the
+ * tick they expire at, so arming, stopping and expiring take constant
+ * time. The command handler advances the wheel by the ticks which have
+ * passed each time its timer fires, and has the timer fire at the next
+ * slot with callouts, or after a second.
+ */
+
+callout_t *callout_wheel[CALLOUT_WHEEL];
+u_int callout_ticks = 0;
+u_int callout_wake = 0;   /* callout_ticks the timer is set to fire at */
+int   callout_early = 0;  /* a callout was armed before callout_wake */
 
 static void
 callout_add(callout_t *c)
 {
+    callout_t **slot = &callout_wheel[c->expire & (CALLOUT_WHEEL - 1)];
+
     c->co_prev = NULL;
-    c->co_next = callout_head;
-    if (callout_head != NULL)
-        callout_head->co_prev = c;
-    callout_head = c;
+    c->co_next = *slot;
+    if (*slot != NULL)
+        (*slot)->co_prev = c;
+    *slot = c;
 }
 
 static void
 callout_remove(callout_t *c)
 {
-    if (c == callout_head) {
-        callout_head = c->co_next;
-        if (callout_head != NULL)
-            callout_head->co_prev = NULL;
-        return;
-    }
-    if (c->co_prev != NULL)
+    callout_t **slot = &callout_wheel[c->expire & (CALLOUT_WHEEL - 1)];
+
+    if (c == *slot)
+        *slot = c->co_next;
+    else if (c->co_prev != NULL)
         c->co_prev->co_next = c->co_next;
     if (c->co_next != NULL)
         c->co_next->co_prev = c->co_prev;
+    c->co_next = NULL;
+    c->co_prev = NULL;
 }
 
 void
 callout_init(callout_t *c, u_int flags)
 {
     c->func = NULL;
+    c->co_next = NULL;
+    c->co_prev = NULL;
 }
 
 #ifdef DEBUG
@@ -242,10 +310,13 @@ void
 callout_list(void)
 {
     callout_t *cur;
+    int slot;
 
-    for (cur = callout_head; cur != NULL; cur = cur->co_next) {
-        printf("%c %d %p(%p)\n", (cur == callout_head) ? '>' : ' ',
-               cur->ticks, cur->func, cur->arg);
+    for (slot = 0; slot < CALLOUT_WHEEL; slot++) {
+        for (cur = callout_wheel[slot]; cur != NULL; cur = cur->co_next) {
+            printf("%2d %d %p(%p)\n", slot,
+                   (int) (cur->expire - callout_ticks), cur->func, cur->arg);
+        }
     }
 }
 #endif
@@ -262,20 +333,25 @@ callout_stop(callout_t *c)
 {
     int pending = (c->func != NULL);
     PRINTF_CALLOUT("callout stop %p\n", c->func);
+    if (pending)
+        callout_remove(c);
     c->func = NULL;
-    callout_remove(c);
     return (pending);
 }
 
 void
 callout_reset(callout_t *c, int ticks, void (*func)(void *), void *arg)
 {
-    c->ticks = ticks;
+    if (c->func != NULL)
+        callout_remove(c);
+    if (ticks < 1)
+        ticks = 1;
+    c->expire = callout_ticks + ticks;
     c->func = func;
     c->arg = arg;
-
-    callout_remove(c);
     callout_add(c);
+    if ((int) (c->expire - callout_wake) < 0)
+        callout_early = 1;
     PRINTF_CALLOUT("callout_reset %p(%x) at %d\n",
                    c->func, (uint32_t) c->arg, ticks);
 }
@@ -292,19 +368,56 @@ callout_call(callout_t *c)
     c->func(c->arg);
 }
 
+/*
+ * Advance the wheel by the ticks which have passed, calling the callouts
+ * which expire. A callout is no longer pending when it is called, and may
+ * be reset by its function. Each slot is scanned again after a call, as
+ * the function may stop or reset other callouts in it.
+ */
 void
-callout_run_timeouts(void)
+callout_run_timeouts(u_int ticks)
 {
     callout_t *cur;
+    void (*func)(void *);
 
-    for (cur = callout_head; cur != NULL; cur = cur->co_next) {
-        if (cur->ticks == 1) {
-            cur->ticks = 0;
-            callout_call(cur);
-        } else if (cur->ticks != 0) {
-            cur->ticks -= TICKS_PER_SECOND;
-            if (cur->ticks < 1)
-                cur->ticks = 1;
+    if (ticks > CALLOUT_WHEEL) {
+        /* Slots skipped over would be scanned again below anyway */
+        callout_ticks += ticks - CALLOUT_WHEEL;
+        ticks = CALLOUT_WHEEL;
+    }
+    while (ticks-- > 0) {
+        callout_ticks++;
+        cur = callout_wheel[callout_ticks & (CALLOUT_WHEEL - 1)];
+        while (cur != NULL) {
+            if ((int) (cur->expire - callout_ticks) > 0) {
+                cur = cur->co_next;
+                continue;
+            }
+            callout_remove(cur);
+            func = cur->func;
+            cur->func = NULL;
+            PRINTF_CALLOUT("callout_call %p(%x)\n", func, (uint32_t) cur->arg);
+            func(cur->arg);
+            cur = callout_wheel[callout_ticks & (CALLOUT_WHEEL - 1)];
         }
     }
 }
+
+/*
+ * Ticks until the next wheel slot with a callout in it, at most a second.
+ * The callouts there may be due on a later turn of the wheel. The timer
+ * is taken to be set for then; callout_early flags any callout armed
+ * sooner afterwards.
+ */
+u_int
+callout_next(void)
+{
+    u_int ticks;
+
+    for (ticks = 1; ticks < TICKS_PER_SECOND; ticks++)
+        if (callout_wheel[(callout_ticks + ticks) & (CALLOUT_WHEEL - 1)])
+            break;
+    callout_wake = callout_ticks + ticks;
+    callout_early = 0;
+    return (ticks);
+}
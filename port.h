@@ -40,6 +40,10 @@ void bsd_splx();
 #define kvtop(x) ((uint32_t)(x))
 
 void delay(int usecs);
+void delay_open(void);
+void delay_close(void);
+uint64_t eclock_now(void);
+extern uint32_t eclock_hz;
 
 #define __UNVOLATILE(x) ((void *)(unsigned long)(volatile void *)(x))
 #define __UNCONST(a) ((void *)(intptr_t)(a))
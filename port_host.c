@@ -0,0 +1,996 @@
+/*
+ * Host (Linux) port layer
+ * -----------------------
+ * Emulation of the AmigaOS Exec services used by the driver core, so
+ * that cmdhandler.c, sd.c, scsipi_base.c and siop.c can be run on a
+ * development host (see hostsim.c).
+ *
+ * Each Exec task is a pthread. All Exec state (signals, message port
+ * lists, semaphores and pending timer requests) is protected by a single
+ * lock, exec_lock. A task blocked in Wait() sleeps on its own condition
+ * variable. As with Exec, a newly created task does not run until its
+ * creator blocks, which the command handler startup handshake relies on.
+ *
+ * Disable()/Enable() take a recursive lock which is also held while an
+ * emulated interrupt is delivered, so driver code protected by
+ * bsd_splbio() is not re-entered by an interrupt. Wait() drops that lock
+ * while sleeping, just as Exec re-enables interrupts in a Disable()d
+ * task which calls Wait(). Interrupt servers added with AddIntServer()
+ * are run by an interrupt thread when emulated hardware calls
+ * host_intr_raise().
+ *
+ * Emulated hardware can't see register writes as they happen. It may
+ * install a wait hook, which is called whenever a task is about to
+ * block, to look for new work at the point the driver goes idle.
+ *
+ * AllocMem() uses malloc(). The 53C710 is handed 32-bit buffer
+ * addresses, so malloc() is restricted to the main (brk) arena which,
+ * in a -no-pie executable, sits below 4GB.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+
+#include "port_host.h"
+
+#define HOST_MIN_STACK  (256 << 10)
+
+typedef struct host_task host_task_t;
+struct host_task {
+    struct Task     task;
+    pthread_t       thread;
+    pthread_cond_t  cond;
+    void          (*func)(void);
+    void           *stack;
+    size_t          stacksize;
+    int             started;
+    host_task_t    *next_pending;
+};
+
+static pthread_mutex_t exec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  sem_cond  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  timer_cond;
+static pthread_t       timer_thread;
+static int             timer_thread_running;
+static struct List     timer_list;
+static host_task_t    *pending_tasks;
+
+/* Disable() / Enable() */
+static pthread_mutex_t intr_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  intr_cond  = PTHREAD_COND_INITIALIZER;
+static struct Task    *intr_owner;
+static int             intr_nest;
+
+static __thread struct Task *cur_task;
+
+/* Interrupt servers */
+#define HOST_NUM_INTS   16
+static struct List     int_servers[HOST_NUM_INTS];
+static pthread_mutex_t int_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  int_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       int_thread;
+static int             int_thread_running;
+static ULONG           int_pending;
+
+static void          (*wait_hook)(void);
+
+static struct ExecBase host_execbase;
+struct ExecBase *SysBase = &host_execbase;
+
+static struct Device host_timer_device;
+
+uint64_t
+host_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void
+host_fatal(const char *what)
+{
+    fprintf(stderr, "port_host: %s\n", what);
+    abort();
+}
+
+/*
+ * host_exec_init
+ * --------------
+ * Keeps malloc() in the main arena and off mmap(), so that every
+ * AllocMem() address is representable as a 32-bit DMA address.
+ * This runs as a constructor, before anything can allocate memory.
+ */
+__attribute__((constructor)) void
+host_exec_init(void)
+{
+    static int initialized;
+    pthread_condattr_t attr;
+    int i;
+
+    if (initialized++)
+        return;
+    mallopt(M_MMAP_MAX, 0);
+    mallopt(M_ARENA_MAX, 1);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    NewList(&timer_list);
+    for (i = 0; i < HOST_NUM_INTS; i++)
+        NewList(&int_servers[i]);
+    host_execbase.LibNode.lib_Node.ln_Name = "exec.library";
+}
+
+/* Memory */
+
+APTR
+AllocMem(ULONG size, ULONG flags)
+{
+    void *ptr;
+
+    if (size == 0)
+        return (NULL);
+    if (flags & MEMF_CLEAR)
+        ptr = calloc(1, size);
+    else
+        ptr = malloc(size);
+    if ((ptr != NULL) && ((uintptr_t) ptr + size > 0xffffffffUL))
+        host_fatal("AllocMem() returned memory above 4GB (link -no-pie)");
+    return (ptr);
+}
+
+void
+FreeMem(APTR ptr, ULONG size)
+{
+    (void) size;
+    free(ptr);
+}
+
+void
+CopyMem(const void *src, void *dst, ULONG size)
+{
+    memmove(dst, src, size);
+}
+
+/*
+ * On the host, the chip model (or virtual target) shares the CPU's view
+ * of memory; a full barrier is all that is needed for DMA coherency.
+ */
+void
+CacheClearE(APTR addr, ULONG length, ULONG caches)
+{
+    (void) addr;
+    (void) length;
+    (void) caches;
+    __sync_synchronize();
+}
+
+APTR
+CachePreDMA(APTR addr, LONG *length, ULONG flags)
+{
+    (void) length;
+    (void) flags;
+    __sync_synchronize();
+    return (addr);
+}
+
+void
+CachePostDMA(APTR addr, LONG *length, ULONG flags)
+{
+    (void) addr;
+    (void) length;
+    (void) flags;
+    __sync_synchronize();
+}
+
+/* Lists */
+
+void
+NewList(struct List *list)
+{
+    list->lh_Head     = (struct Node *) &list->lh_Tail;
+    list->lh_Tail     = NULL;
+    list->lh_TailPred = (struct Node *) list;
+}
+
+void
+AddTail(struct List *list, struct Node *node)
+{
+    struct Node *tail = list->lh_TailPred;
+
+    node->ln_Succ     = (struct Node *) &list->lh_Tail;
+    node->ln_Pred     = tail;
+    tail->ln_Succ     = node;
+    list->lh_TailPred = node;
+}
+
+static void
+Insert(struct Node *pred, struct Node *node)
+{
+    node->ln_Succ          = pred->ln_Succ;
+    node->ln_Pred          = pred;
+    pred->ln_Succ->ln_Pred = node;
+    pred->ln_Succ          = node;
+}
+
+void
+Remove(struct Node *node)
+{
+    node->ln_Pred->ln_Succ = node->ln_Succ;
+    node->ln_Succ->ln_Pred = node->ln_Pred;
+}
+
+struct Node *
+RemHead(struct List *list)
+{
+    struct Node *node = list->lh_Head;
+
+    if (node->ln_Succ == NULL)
+        return (NULL);
+    Remove(node);
+    return (node);
+}
+
+/* Tasks and signals */
+
+static host_task_t *
+task_host(struct Task *task)
+{
+    return ((host_task_t *) task->tc_Host);
+}
+
+static host_task_t *
+alloc_host_task(CONST_STRPTR name)
+{
+    host_task_t *ht = AllocMem(sizeof (*ht), MEMF_CLEAR);
+
+    if (ht == NULL)
+        host_fatal("out of memory for task");
+    ht->task.tc_Node.ln_Type = NT_TASK;
+    ht->task.tc_Node.ln_Name = (char *) name;
+    ht->task.tc_SigAlloc     = 0x0000ffff;  /* System signals reserved */
+    ht->task.tc_Host         = ht;
+    pthread_cond_init(&ht->cond, NULL);
+    return (ht);
+}
+
+struct Task *
+FindTask(CONST_STRPTR name)
+{
+    if (name != NULL)
+        return (NULL);
+    if (cur_task == NULL) {
+        /* First Exec call from a thread not created by CreateTask() */
+        host_task_t *ht = alloc_host_task("host");
+        ht->thread  = pthread_self();
+        ht->started = 1;
+        cur_task    = &ht->task;
+    }
+    return (cur_task);
+}
+
+/*
+ * The calling task is about to block, so let any task it created
+ * begin running. Called with exec_lock held.
+ */
+static void
+start_pending_tasks(void)
+{
+    host_task_t *ht;
+
+    while ((ht = pending_tasks) != NULL) {
+        pending_tasks = ht->next_pending;
+        ht->started = 1;
+        pthread_cond_signal(&ht->cond);
+    }
+}
+
+static void *
+task_entry(void *arg)
+{
+    host_task_t *ht = arg;
+
+    pthread_mutex_lock(&exec_lock);
+    while (ht->started == 0)
+        pthread_cond_wait(&ht->cond, &exec_lock);
+    pthread_mutex_unlock(&exec_lock);
+
+    cur_task = &ht->task;
+    ht->func();
+
+    /* Like Exec, a task which returns is removed; its memory is leaked */
+    return (NULL);
+}
+
+struct Task *
+CreateTask(CONST_STRPTR name, LONG pri, void (*func)(void), ULONG stacksize)
+{
+    host_task_t    *ht = alloc_host_task(name);
+    pthread_attr_t  attr;
+
+    (void) pri;
+    (void) FindTask(NULL);  /* Creator needs a task context to block in */
+
+    /* Keep the stack below 4GB too; drivers DMA to stack buffers */
+    ht->stacksize = (stacksize < HOST_MIN_STACK) ? HOST_MIN_STACK : stacksize;
+    ht->stack     = AllocMem(ht->stacksize, MEMF_ANY);
+    ht->func      = func;
+    if (ht->stack == NULL)
+        host_fatal("out of memory for task stack");
+
+    pthread_mutex_lock(&exec_lock);
+    ht->next_pending = pending_tasks;
+    pending_tasks = ht;
+    pthread_mutex_unlock(&exec_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, ht->stack, ht->stacksize);
+    if (pthread_create(&ht->thread, &attr, task_entry, ht) != 0)
+        host_fatal("pthread_create failed");
+    pthread_attr_destroy(&attr);
+    pthread_detach(ht->thread);
+    return (&ht->task);
+}
+
+BYTE
+AllocSignal(LONG signum)
+{
+    struct Task *task = FindTask(NULL);
+    BYTE         sig  = -1;
+
+    pthread_mutex_lock(&exec_lock);
+    if (signum == -1) {
+        for (signum = 31; signum >= 0; signum--)
+            if ((task->tc_SigAlloc & (1U << signum)) == 0)
+                break;
+    }
+    if ((signum >= 0) && (signum < 32) &&
+        ((task->tc_SigAlloc & (1U << signum)) == 0)) {
+        task->tc_SigAlloc |= 1U << signum;
+        task->tc_SigRecvd &= ~(1U << signum);
+        sig = signum;
+    }
+    pthread_mutex_unlock(&exec_lock);
+    return (sig);
+}
+
+void
+FreeSignal(LONG signum)
+{
+    struct Task *task = FindTask(NULL);
+
+    if (signum < 0)
+        return;
+    pthread_mutex_lock(&exec_lock);
+    task->tc_SigAlloc &= ~(1U << signum);
+    pthread_mutex_unlock(&exec_lock);
+}
+
+/* Called with exec_lock held */
+static void
+signal_locked(struct Task *task, ULONG mask)
+{
+    task->tc_SigRecvd |= mask;
+    if (task->tc_SigWait & mask)
+        pthread_cond_signal(&task_host(task)->cond);
+}
+
+void
+Signal(struct Task *task, ULONG mask)
+{
+    pthread_mutex_lock(&exec_lock);
+    signal_locked(task, mask);
+    pthread_mutex_unlock(&exec_lock);
+}
+
+/*
+ * Release Disable() state held by the current task, returning the
+ * nest count so it can be restored with intr_reacquire().
+ */
+static int
+intr_release(struct Task *task)
+{
+    int nest = 0;
+
+    pthread_mutex_lock(&intr_lock);
+    if (intr_owner == task) {
+        nest       = intr_nest;
+        intr_nest  = 0;
+        intr_owner = NULL;
+        pthread_cond_broadcast(&intr_cond);
+    }
+    pthread_mutex_unlock(&intr_lock);
+    return (nest);
+}
+
+static void
+intr_reacquire(struct Task *task, int nest)
+{
+    if (nest == 0)
+        return;
+    pthread_mutex_lock(&intr_lock);
+    while (intr_owner != NULL)
+        pthread_cond_wait(&intr_cond, &intr_lock);
+    intr_owner = task;
+    intr_nest  = nest;
+    pthread_mutex_unlock(&intr_lock);
+}
+
+/* Called with exec_lock held */
+static ULONG
+wait_locked(struct Task *task, ULONG mask)
+{
+    ULONG got;
+
+    start_pending_tasks();
+    while ((task->tc_SigRecvd & mask) == 0) {
+        if (wait_hook != NULL)
+            wait_hook();
+        task->tc_SigWait = mask;
+        pthread_cond_wait(&task_host(task)->cond, &exec_lock);
+    }
+    task->tc_SigWait = 0;
+    got = task->tc_SigRecvd & mask;
+    task->tc_SigRecvd &= ~got;
+    return (got);
+}
+
+ULONG
+Wait(ULONG mask)
+{
+    struct Task *task = FindTask(NULL);
+    ULONG        got;
+    int          nest = intr_release(task);
+
+    pthread_mutex_lock(&exec_lock);
+    got = wait_locked(task, mask);
+    pthread_mutex_unlock(&exec_lock);
+    intr_reacquire(task, nest);
+    return (got);
+}
+
+ULONG
+SetSignal(ULONG newsigs, ULONG mask)
+{
+    struct Task *task = FindTask(NULL);
+    ULONG        old;
+
+    pthread_mutex_lock(&exec_lock);
+    /* A task taking its signals without Wait() may be polling hardware */
+    if ((mask != 0) && (wait_hook != NULL))
+        wait_hook();
+    old = task->tc_SigRecvd;
+    task->tc_SigRecvd = (old & ~mask) | (newsigs & mask);
+    pthread_mutex_unlock(&exec_lock);
+    if ((mask != 0) && (wait_hook != NULL))
+        sched_yield();  /* Let the hardware model run */
+    return (old);
+}
+
+/*
+ * All driver state is owned by the command handler task. Other tasks
+ * only reach it through message ports, which are locked internally, so
+ * Forbid() has nothing to protect on the host.
+ */
+void
+Forbid(void)
+{
+}
+
+void
+Permit(void)
+{
+}
+
+void
+Disable(void)
+{
+    struct Task *task = FindTask(NULL);
+
+    pthread_mutex_lock(&intr_lock);
+    while ((intr_owner != NULL) && (intr_owner != task))
+        pthread_cond_wait(&intr_cond, &intr_lock);
+    intr_owner = task;
+    intr_nest++;
+    pthread_mutex_unlock(&intr_lock);
+}
+
+void
+Enable(void)
+{
+    pthread_mutex_lock(&intr_lock);
+    if (--intr_nest == 0) {
+        intr_owner = NULL;
+        pthread_cond_broadcast(&intr_cond);
+    }
+    pthread_mutex_unlock(&intr_lock);
+}
+
+void
+Cause(struct Interrupt *intr)
+{
+    if ((intr != NULL) && (intr->is_Code != NULL))
+        ((void (*)(APTR)) intr->is_Code)(intr->is_Data);
+}
+
+static void *
+int_thread_main(void *arg)
+{
+    struct Node *node;
+    ULONG        pending;
+    int          num;
+
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&int_lock);
+        while (int_pending == 0)
+            pthread_cond_wait(&int_cond, &int_lock);
+        pending = int_pending;
+        int_pending = 0;
+        pthread_mutex_unlock(&int_lock);
+
+        /* As on the Amiga, a server returning non-zero ends the chain */
+        Disable();
+        for (num = 0; num < HOST_NUM_INTS; num++) {
+            if ((pending & (1U << num)) == 0)
+                continue;
+            for (node = int_servers[num].lh_Head; node->ln_Succ != NULL;
+                 node = node->ln_Succ) {
+                struct Interrupt *intr = (struct Interrupt *) node;
+                if (((LONG (*)(APTR)) intr->is_Code)(intr->is_Data) != 0)
+                    break;
+            }
+        }
+        Enable();
+    }
+    return (NULL);
+}
+
+void
+AddIntServer(LONG intNumber, struct Interrupt *intr)
+{
+    struct Node *node;
+
+    if ((intNumber < 0) || (intNumber >= HOST_NUM_INTS))
+        return;
+
+    pthread_mutex_lock(&int_lock);
+    if (int_thread_running == 0) {
+        if (pthread_create(&int_thread, NULL, int_thread_main, NULL) != 0)
+            host_fatal("could not start interrupt thread");
+        pthread_detach(int_thread);
+        int_thread_running = 1;
+    }
+    pthread_mutex_unlock(&int_lock);
+
+    /* Servers run in priority order */
+    Disable();
+    for (node = int_servers[intNumber].lh_Head; node->ln_Succ != NULL;
+         node = node->ln_Succ) {
+        if (node->ln_Pri < intr->is_Node.ln_Pri)
+            break;
+    }
+    Insert(node->ln_Pred, &intr->is_Node);
+    Enable();
+}
+
+void
+RemIntServer(LONG intNumber, struct Interrupt *intr)
+{
+    (void) intNumber;
+    Disable();
+    Remove(&intr->is_Node);
+    Enable();
+}
+
+/*
+ * host_intr_raise
+ * ---------------
+ * Called by emulated hardware to run the servers for an interrupt.
+ * Like a level-triggered interrupt line, hardware whose interrupt was
+ * not claimed should raise it again while the condition persists.
+ */
+void
+host_intr_raise(LONG intNumber)
+{
+    pthread_mutex_lock(&int_lock);
+    int_pending |= 1U << intNumber;
+    pthread_cond_signal(&int_cond);
+    pthread_mutex_unlock(&int_lock);
+}
+
+/*
+ * host_set_wait_hook
+ * ------------------
+ * The hook is called when a task blocks in Wait() or polls its signals
+ * with SetSignal(). It runs with Exec's internal lock held, so it must
+ * not call Exec functions.
+ */
+void
+host_set_wait_hook(void (*hook)(void))
+{
+    pthread_mutex_lock(&exec_lock);
+    wait_hook = hook;
+    pthread_mutex_unlock(&exec_lock);
+}
+
+void
+Debugger(void)
+{
+    fprintf(stderr, "port_host: Debugger() called\n");
+}
+
+/* Semaphores */
+
+void
+InitSemaphore(struct SignalSemaphore *ss)
+{
+    memset(ss, 0, sizeof (*ss));
+}
+
+void
+ObtainSemaphore(struct SignalSemaphore *ss)
+{
+    struct Task *task = FindTask(NULL);
+
+    pthread_mutex_lock(&exec_lock);
+    if ((ss->ss_Owner != NULL) && (ss->ss_Owner != task)) {
+        start_pending_tasks();
+        while (ss->ss_Owner != NULL)
+            pthread_cond_wait(&sem_cond, &exec_lock);
+    }
+    ss->ss_Owner = task;
+    ss->ss_NestCount++;
+    pthread_mutex_unlock(&exec_lock);
+}
+
+void
+ReleaseSemaphore(struct SignalSemaphore *ss)
+{
+    pthread_mutex_lock(&exec_lock);
+    if (--ss->ss_NestCount <= 0) {
+        ss->ss_NestCount = 0;
+        ss->ss_Owner = NULL;
+        pthread_cond_broadcast(&sem_cond);
+    }
+    pthread_mutex_unlock(&exec_lock);
+}
+
+/* Message ports */
+
+struct MsgPort *
+CreateMsgPort(void)
+{
+    struct MsgPort *port = AllocMem(sizeof (*port), MEMF_CLEAR | MEMF_PUBLIC);
+    BYTE            sig;
+
+    if (port == NULL)
+        return (NULL);
+    sig = AllocSignal(-1);
+    if (sig == -1) {
+        FreeMem(port, sizeof (*port));
+        return (NULL);
+    }
+    port->mp_Node.ln_Type = NT_MSGPORT;
+    port->mp_SigBit       = sig;
+    port->mp_SigTask      = FindTask(NULL);
+    NewList(&port->mp_MsgList);
+    return (port);
+}
+
+void
+DeleteMsgPort(struct MsgPort *port)
+{
+    if (port == NULL)
+        return;
+    FreeSignal(port->mp_SigBit);
+    FreeMem(port, sizeof (*port));
+}
+
+struct MsgPort *
+CreatePort(CONST_STRPTR name, LONG pri)
+{
+    struct MsgPort *port = CreateMsgPort();
+
+    if (port != NULL) {
+        port->mp_Node.ln_Name = (char *) name;
+        port->mp_Node.ln_Pri  = pri;
+    }
+    return (port);
+}
+
+void
+DeletePort(struct MsgPort *port)
+{
+    DeleteMsgPort(port);
+}
+
+/* Called with exec_lock held */
+static void
+putmsg_locked(struct MsgPort *port, struct Message *msg, UBYTE type)
+{
+    msg->mn_Node.ln_Type = type;
+    AddTail(&port->mp_MsgList, &msg->mn_Node);
+    if (port->mp_SigTask != NULL)
+        signal_locked(port->mp_SigTask, 1U << port->mp_SigBit);
+}
+
+void
+PutMsg(struct MsgPort *port, struct Message *msg)
+{
+    pthread_mutex_lock(&exec_lock);
+    putmsg_locked(port, msg, NT_MESSAGE);
+    pthread_mutex_unlock(&exec_lock);
+}
+
+struct Message *
+GetMsg(struct MsgPort *port)
+{
+    struct Message *msg;
+
+    pthread_mutex_lock(&exec_lock);
+    msg = (struct Message *) RemHead(&port->mp_MsgList);
+    pthread_mutex_unlock(&exec_lock);
+    return (msg);
+}
+
+/* Called with exec_lock held */
+static void
+replymsg_locked(struct Message *msg)
+{
+    if (msg->mn_ReplyPort == NULL)
+        msg->mn_Node.ln_Type = NT_FREEMSG;
+    else
+        putmsg_locked(msg->mn_ReplyPort, msg, NT_REPLYMSG);
+}
+
+void
+ReplyMsg(struct Message *msg)
+{
+    pthread_mutex_lock(&exec_lock);
+    replymsg_locked(msg);
+    pthread_mutex_unlock(&exec_lock);
+}
+
+struct Message *
+WaitPort(struct MsgPort *port)
+{
+    struct Task *task = FindTask(NULL);
+    int          nest = intr_release(task);
+
+    pthread_mutex_lock(&exec_lock);
+    while (IsListEmpty(&port->mp_MsgList))
+        (void) wait_locked(task, 1U << port->mp_SigBit);
+    pthread_mutex_unlock(&exec_lock);
+    intr_reacquire(task, nest);
+    return ((struct Message *) port->mp_MsgList.lh_Head);
+}
+
+/* Devices: only timer.device is implemented */
+
+struct IORequest *
+CreateExtIO(struct MsgPort *port, LONG size)
+{
+    struct IORequest *ior;
+
+    if (port == NULL)
+        return (NULL);
+    ior = AllocMem(size, MEMF_CLEAR | MEMF_PUBLIC);
+    if (ior == NULL)
+        return (NULL);
+    ior->io_Message.mn_Node.ln_Type = NT_REPLYMSG;
+    ior->io_Message.mn_ReplyPort    = port;
+    ior->io_Message.mn_Length       = size;
+    return (ior);
+}
+
+void
+DeleteExtIO(struct IORequest *ior)
+{
+    if (ior != NULL)
+        FreeMem(ior, ior->io_Message.mn_Length);
+}
+
+static void *
+timer_thread_main(void *arg)
+{
+    struct timespec ts;
+    struct Node    *node;
+
+    (void) arg;
+    pthread_mutex_lock(&exec_lock);
+    for (;;) {
+        node = timer_list.lh_Head;
+        if (node->ln_Succ == NULL) {
+            pthread_cond_wait(&timer_cond, &exec_lock);
+            continue;
+        }
+        /* SendIO() converted tr_time to an absolute CLOCK_MONOTONIC time */
+        struct timerequest *tr = (struct timerequest *) node;
+        uint64_t due = (uint64_t) tr->tr_time.tv_secs * 1000000 +
+                       tr->tr_time.tv_micro;
+        if (due <= host_usec()) {
+            Remove(node);
+            tr->tr_node.io_Error = 0;
+            replymsg_locked(&tr->tr_node.io_Message);
+            continue;
+        }
+        ts.tv_sec  = due / 1000000;
+        ts.tv_nsec = (due % 1000000) * 1000;
+        pthread_cond_timedwait(&timer_cond, &exec_lock, &ts);
+    }
+    return (NULL);
+}
+
+BYTE
+OpenDevice(CONST_STRPTR name, ULONG unit, struct IORequest *ior, ULONG flags)
+{
+    (void) flags;
+    if (strcmp(name, TIMERNAME) != 0) {
+        ior->io_Error = IOERR_OPENFAIL;
+        return (IOERR_OPENFAIL);
+    }
+
+    pthread_mutex_lock(&exec_lock);
+    if (timer_thread_running == 0) {
+        if (pthread_create(&timer_thread, NULL, timer_thread_main, NULL) != 0)
+            host_fatal("could not start timer thread");
+        pthread_detach(timer_thread);
+        timer_thread_running = 1;
+    }
+    pthread_mutex_unlock(&exec_lock);
+
+    ior->io_Device = &host_timer_device;
+    ior->io_Unit   = (struct Unit *) (uintptr_t) unit;
+    ior->io_Error  = 0;
+    return (0);
+}
+
+void
+CloseDevice(struct IORequest *ior)
+{
+    ior->io_Device = NULL;
+}
+
+void
+SendIO(struct IORequest *ior)
+{
+    struct timerequest *tr = (struct timerequest *) ior;
+    struct Node        *node;
+    uint64_t            due;
+
+    pthread_mutex_lock(&exec_lock);
+    ior->io_Error = 0;
+    ior->io_Message.mn_Node.ln_Type = NT_MESSAGE;
+    if ((ior->io_Device != &host_timer_device) ||
+        (ior->io_Command != TR_ADDREQUEST)) {
+        ior->io_Error = IOERR_NOCMD;
+        replymsg_locked(&ior->io_Message);
+        pthread_mutex_unlock(&exec_lock);
+        return;
+    }
+
+    due = host_usec() + (uint64_t) tr->tr_time.tv_secs * 1000000 +
+          tr->tr_time.tv_micro;
+    tr->tr_time.tv_secs  = due / 1000000;
+    tr->tr_time.tv_micro = due % 1000000;
+
+    /* Keep timer_list sorted by expiration time */
+    for (node = timer_list.lh_TailPred; node->ln_Pred != NULL;
+         node = node->ln_Pred) {
+        struct timerequest *cur = (struct timerequest *) node;
+        uint64_t cdue = (uint64_t) cur->tr_time.tv_secs * 1000000 +
+                        cur->tr_time.tv_micro;
+        if (cdue <= due)
+            break;
+    }
+    Insert(node, &ior->io_Message.mn_Node);
+    pthread_cond_signal(&timer_cond);
+    pthread_mutex_unlock(&exec_lock);
+}
+
+BYTE
+WaitIO(struct IORequest *ior)
+{
+    struct MsgPort *port = ior->io_Message.mn_ReplyPort;
+    struct Task    *task = FindTask(NULL);
+    int             nest = intr_release(task);
+
+    pthread_mutex_lock(&exec_lock);
+    while (ior->io_Message.mn_Node.ln_Type != NT_REPLYMSG)
+        (void) wait_locked(task, 1U << port->mp_SigBit);
+    Remove(&ior->io_Message.mn_Node);
+    pthread_mutex_unlock(&exec_lock);
+    intr_reacquire(task, nest);
+    return (ior->io_Error);
+}
+
+BYTE
+DoIO(struct IORequest *ior)
+{
+    SendIO(ior);
+    return (WaitIO(ior));
+}
+
+struct IORequest *
+CheckIO(struct IORequest *ior)
+{
+    if (ior->io_Message.mn_Node.ln_Type == NT_REPLYMSG)
+        return (ior);
+    return (NULL);
+}
+
+LONG
+AbortIO(struct IORequest *ior)
+{
+    pthread_mutex_lock(&exec_lock);
+    if (ior->io_Message.mn_Node.ln_Type == NT_MESSAGE) {
+        Remove(&ior->io_Message.mn_Node);
+        ior->io_Error = IOERR_ABORTED;
+        replymsg_locked(&ior->io_Message);
+    }
+    pthread_mutex_unlock(&exec_lock);
+    return (0);
+}
+
+/* timer.device E clock, counting at the PAL rate from host time */
+ULONG
+ReadEClock(struct EClockVal *dest)
+{
+    uint64_t usec = host_usec();
+    uint64_t ticks = usec / 1000000 * HOST_ECLOCK_HZ +
+                     usec % 1000000 * HOST_ECLOCK_HZ / 1000000;
+
+    dest->ev_hi = ticks >> 32;
+    dest->ev_lo = ticks;
+    return (HOST_ECLOCK_HZ);
+}
+
+/* Libraries */
+
+struct Library *
+OpenLibrary(CONST_STRPTR name, ULONG version)
+{
+    (void) name;
+    (void) version;
+    return (NULL);
+}
+
+void
+CloseLibrary(struct Library *lib)
+{
+    (void) lib;
+}
+
+LONG
+EasyRequestArgs(struct Window *win, struct EasyStruct *es, ULONG *idcmp,
+                APTR args)
+{
+    (void) win;
+    (void) es;
+    (void) idcmp;
+    (void) args;
+    return (0);
+}
+
+/* debug.lib serial output goes to stderr */
+
+void
+KPutChar(LONG ch)
+{
+    fputc(ch, stderr);
+}
+
+void
+KPutS(CONST_STRPTR str)
+{
+    fputs(str, stderr);
+}
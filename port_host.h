@@ -0,0 +1,456 @@
+#ifndef _PORT_HOST_H
+#define _PORT_HOST_H
+
+/*
+ * Host (Linux) port layer
+ * -----------------------
+ * This header stands in for the AmigaOS NDK when the driver core
+ * (siop.c, scsipi_base.c, sd.c, cmdhandler.c, ...) is built with
+ * "make hostsim". Every NDK include used by those files is redirected
+ * here by the stub headers in host_include/. Only the subset of Exec,
+ * timer.device, trackdisk.device and debug.lib which the driver actually
+ * uses is provided. The implementation in port_host.c maps Exec tasks,
+ * signals and message ports onto pthreads, and AllocMem() onto malloc().
+ *
+ * The driver passes buffer addresses to the 53C710 as 32-bit values
+ * (see kvtop()), so all memory handed out by AllocMem() and all task
+ * stacks are kept below 4GB. The host build must be linked -no-pie.
+ */
+
+/*
+ * Pull in the host headers which define struct timeval before the
+ * Amiga timer.device version is declared below.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/param.h>
+#include <errno.h>
+#undef ERESTART            /* scsipi_base.c supplies its own */
+
+/* NetBSD <sys/cdefs.h> definitions provided by the Amiga libnix headers */
+#define __packed            __attribute__((__packed__))
+#define __aligned(x)        __attribute__((__aligned__(x)))
+#define __unused            __attribute__((__unused__))
+#define __predict_true(x)   __builtin_expect((x) != 0, 1)
+#define __predict_false(x)  __builtin_expect((x) != 0, 0)
+
+#define INCLUDE_VERSION 47      /* ULONG is 32 bits, as with NDK 3.2 */
+#ifndef NBPG
+#define NBPG 4096
+#endif
+#define TICKS_PER_SECOND 50
+
+typedef void           *APTR;
+typedef uint32_t        ULONG;
+typedef int32_t         LONG;
+typedef uint16_t        UWORD;
+typedef int16_t         WORD;
+typedef uint8_t         UBYTE;
+typedef int8_t          BYTE;
+typedef int16_t         BOOL;
+typedef char           *STRPTR;
+typedef const char     *CONST_STRPTR;
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+/* exec/nodes.h */
+struct Node {
+    struct Node *ln_Succ;
+    struct Node *ln_Pred;
+    UBYTE        ln_Type;
+    BYTE         ln_Pri;
+    char        *ln_Name;
+};
+
+struct MinNode {
+    struct MinNode *mln_Succ;
+    struct MinNode *mln_Pred;
+};
+
+#define NT_UNKNOWN      0
+#define NT_TASK         1
+#define NT_INTERRUPT    2
+#define NT_DEVICE       3
+#define NT_MSGPORT      4
+#define NT_MESSAGE      5
+#define NT_FREEMSG      6
+#define NT_REPLYMSG     7
+
+/* exec/lists.h */
+struct List {
+    struct Node *lh_Head;
+    struct Node *lh_Tail;
+    struct Node *lh_TailPred;
+    UBYTE        lh_Type;
+    UBYTE        l_pad;
+};
+
+struct MinList {
+    struct MinNode *mlh_Head;
+    struct MinNode *mlh_Tail;
+    struct MinNode *mlh_TailPred;
+};
+
+#define IsListEmpty(x)    (((x)->lh_TailPred) == (struct Node *)(x))
+
+/* exec/tasks.h */
+struct Task {
+    struct Node  tc_Node;
+    ULONG        tc_SigAlloc;
+    ULONG        tc_SigWait;
+    ULONG        tc_SigRecvd;
+    APTR         tc_UserData;
+    void        *tc_Host;       /* port_host.c private state */
+};
+
+#define SIGF_ABORT   (1 << 0)
+#define SIGF_SINGLE  (1 << 4)
+
+/* exec/ports.h */
+struct MsgPort {
+    struct Node  mp_Node;
+    UBYTE        mp_Flags;
+    UBYTE        mp_SigBit;
+    struct Task *mp_SigTask;
+    struct List  mp_MsgList;
+};
+
+struct Message {
+    struct Node     mn_Node;
+    struct MsgPort *mn_ReplyPort;
+    UWORD           mn_Length;
+};
+
+/* exec/semaphores.h */
+struct SignalSemaphore {
+    struct Node  ss_Link;
+    WORD         ss_NestCount;
+    struct Task *ss_Owner;
+};
+
+/* exec/libraries.h, exec/devices.h */
+struct Library {
+    struct Node lib_Node;
+    UWORD       lib_Version;
+    UWORD       lib_Revision;
+};
+
+struct Device {
+    struct Library dd_Library;
+};
+
+struct Unit {
+    struct MsgPort unit_MsgPort;
+    UBYTE          unit_flags;
+    UBYTE          unit_pad;
+    UWORD          unit_OpenCnt;
+};
+
+struct ExecBase {
+    struct Library LibNode;
+    UWORD          AttnFlags;
+};
+
+/* exec/interrupts.h */
+struct Interrupt {
+    struct Node is_Node;
+    APTR        is_Data;
+    void      (*is_Code)();
+};
+
+/* exec/io.h */
+struct IORequest {
+    struct Message  io_Message;
+    struct Device  *io_Device;
+    struct Unit    *io_Unit;
+    UWORD           io_Command;
+    UBYTE           io_Flags;
+    BYTE            io_Error;
+};
+
+struct IOStdReq {
+    struct Message  io_Message;
+    struct Device  *io_Device;
+    struct Unit    *io_Unit;
+    UWORD           io_Command;
+    UBYTE           io_Flags;
+    BYTE            io_Error;
+    ULONG           io_Actual;
+    ULONG           io_Length;
+    APTR            io_Data;
+    ULONG           io_Offset;
+};
+
+#define IOF_QUICK       (1 << 0)
+
+#define CMD_INVALID     0
+#define CMD_RESET       1
+#define CMD_READ        2
+#define CMD_WRITE       3
+#define CMD_UPDATE      4
+#define CMD_CLEAR       5
+#define CMD_STOP        6
+#define CMD_START       7
+#define CMD_FLUSH       8
+#define CMD_NONSTD      9
+
+/* exec/errors.h */
+#define IOERR_OPENFAIL   (-1)
+#define IOERR_ABORTED    (-2)
+#define IOERR_NOCMD      (-3)
+#define IOERR_BADLENGTH  (-4)
+#define IOERR_BADADDRESS (-5)
+#define IOERR_UNITBUSY   (-6)
+#define IOERR_SELFTEST   (-7)
+
+/* exec/memory.h */
+#define MEMF_ANY        0
+#define MEMF_PUBLIC     (1 << 0)
+#define MEMF_CHIP       (1 << 1)
+#define MEMF_FAST       (1 << 2)
+#define MEMF_24BITDMA   (1 << 9)
+#define MEMF_CLEAR      (1 << 16)
+
+/* exec/execbase.h cache control */
+#define CACRF_EnableI   (1 << 0)
+#define CACRF_ClearI    (1 << 3)
+#define CACRF_EnableD   (1 << 8)
+#define CACRF_ClearD    (1 << 11)
+#define DMA_Continue    (1 << 1)
+#define DMA_NoModify    (1 << 2)
+#define DMA_ReadFromRAM (1 << 3)
+
+/* devices/timer.h */
+#define TIMERNAME       "timer.device"
+#define UNIT_MICROHZ    0
+#define UNIT_VBLANK     1
+#define TR_ADDREQUEST   (CMD_NONSTD)
+
+#define timeval amiga_timeval
+struct timeval {
+    ULONG tv_secs;
+    ULONG tv_micro;
+};
+
+struct timerequest {
+    struct IORequest tr_node;
+    struct timeval   tr_time;
+};
+
+struct EClockVal {
+    ULONG ev_hi;
+    ULONG ev_lo;
+};
+
+#define HOST_ECLOCK_HZ  709379  /* PAL E clock */
+
+/* devices/trackdisk.h */
+#define TD_MOTOR        (CMD_NONSTD + 0)
+#define TD_SEEK         (CMD_NONSTD + 1)
+#define TD_FORMAT       (CMD_NONSTD + 2)
+#define TD_REMOVE       (CMD_NONSTD + 3)
+#define TD_CHANGENUM    (CMD_NONSTD + 4)
+#define TD_CHANGESTATE  (CMD_NONSTD + 5)
+#define TD_PROTSTATUS   (CMD_NONSTD + 6)
+#define TD_RAWREAD      (CMD_NONSTD + 7)
+#define TD_RAWWRITE     (CMD_NONSTD + 8)
+#define TD_GETDRIVETYPE (CMD_NONSTD + 9)
+#define TD_GETNUMTRACKS (CMD_NONSTD + 10)
+#define TD_ADDCHANGEINT (CMD_NONSTD + 11)
+#define TD_REMCHANGEINT (CMD_NONSTD + 12)
+#define TD_GETGEOMETRY  (CMD_NONSTD + 13)
+#define TD_EJECT        (CMD_NONSTD + 14)
+#define TD_LASTCOMM     (CMD_NONSTD + 15)
+
+#define TDF_EXTCOM      (1 << 15)
+#define ETD_WRITE       (CMD_WRITE | TDF_EXTCOM)
+#define ETD_READ        (CMD_READ | TDF_EXTCOM)
+#define ETD_MOTOR       (TD_MOTOR | TDF_EXTCOM)
+#define ETD_SEEK        (TD_SEEK | TDF_EXTCOM)
+#define ETD_FORMAT      (TD_FORMAT | TDF_EXTCOM)
+#define ETD_UPDATE      (CMD_UPDATE | TDF_EXTCOM)
+#define ETD_CLEAR       (CMD_CLEAR | TDF_EXTCOM)
+
+#define TD_SECTOR       512
+#define TD_SECSHIFT     9
+
+struct IOExtTD {
+    struct IOStdReq iotd_Req;
+    ULONG           iotd_Count;
+    ULONG           iotd_SecLabel;
+};
+
+struct DriveGeometry {
+    ULONG dg_SectorSize;
+    ULONG dg_TotalSectors;
+    ULONG dg_Cylinders;
+    ULONG dg_CylSectors;
+    ULONG dg_Heads;
+    ULONG dg_TrackSectors;
+    ULONG dg_BufMemType;
+    UBYTE dg_DeviceType;
+    UBYTE dg_Flags;
+    UWORD dg_Reserved;
+};
+
+#define DG_DIRECT_ACCESS 0
+#define DG_CDROM         5
+#define DGF_REMOVABLE    1
+
+#define TDERR_NotSpecified  20
+#define TDERR_NoSecHdr      21
+#define TDERR_BadSecPreamble 22
+#define TDERR_BadSecID      23
+#define TDERR_BadHdrSum     24
+#define TDERR_BadSecSum     25
+#define TDERR_TooFewSecs    26
+#define TDERR_BadSecHdr     27
+#define TDERR_WriteProt     28
+#define TDERR_DiskChanged   29
+#define TDERR_SeekError     30
+#define TDERR_NoMem         31
+#define TDERR_BadUnitNum    32
+#define TDERR_BadDriveType  33
+#define TDERR_DriveInUse    34
+#define TDERR_PostReset     35
+
+/* devices/scsidisk.h */
+#define HD_SCSICMD      28
+
+struct SCSICmd {
+    UWORD *scsi_Data;
+    ULONG  scsi_Length;
+    ULONG  scsi_Actual;
+    UBYTE *scsi_Command;
+    UWORD  scsi_CmdLength;
+    UWORD  scsi_CmdActual;
+    UBYTE  scsi_Flags;
+    UBYTE  scsi_Status;
+    UBYTE *scsi_SenseData;
+    UWORD  scsi_SenseLength;
+    UWORD  scsi_SenseActual;
+};
+
+#define SCSIF_WRITE         0
+#define SCSIF_READ          1
+#define SCSIF_NOSENSE       0
+#define SCSIF_AUTOSENSE     2
+#define SCSIF_OLDAUTOSENSE  6
+
+#define HFERR_SelfUnit      40
+#define HFERR_DMA           41
+#define HFERR_Phase         42
+#define HFERR_Parity        43
+#define HFERR_SelTimeout    44
+#define HFERR_BadStatus     45
+#define HFERR_NoBoard       50
+
+/* dos/dostags.h, utility/tagitem.h */
+#define TAG_END         0
+
+/* intuition/intuition.h */
+struct Window;
+struct EasyStruct {
+    ULONG  es_StructSize;
+    ULONG  es_Flags;
+    STRPTR es_Title;
+    STRPTR es_TextFormat;
+    STRPTR es_GadgetFormat;
+};
+
+extern struct ExecBase *SysBase;
+
+/* Exec memory */
+APTR AllocMem(ULONG size, ULONG flags);
+void FreeMem(APTR ptr, ULONG size);
+void CopyMem(const void *src, void *dst, ULONG size);
+
+/* Exec tasks and signals */
+struct Task *FindTask(CONST_STRPTR name);
+struct Task *CreateTask(CONST_STRPTR name, LONG pri, void (*func)(void),
+                        ULONG stacksize);
+BYTE AllocSignal(LONG signum);
+void FreeSignal(LONG signum);
+void Signal(struct Task *task, ULONG mask);
+ULONG Wait(ULONG mask);
+ULONG SetSignal(ULONG newsigs, ULONG mask);
+void Forbid(void);
+void Permit(void);
+void Disable(void);
+void Enable(void);
+void Cause(struct Interrupt *intr);
+void AddIntServer(LONG intNumber, struct Interrupt *intr);
+void RemIntServer(LONG intNumber, struct Interrupt *intr);
+void Debugger(void);
+
+/* Exec semaphores */
+void InitSemaphore(struct SignalSemaphore *ss);
+void ObtainSemaphore(struct SignalSemaphore *ss);
+void ReleaseSemaphore(struct SignalSemaphore *ss);
+
+/* Exec lists */
+void NewList(struct List *list);
+void AddTail(struct List *list, struct Node *node);
+void Remove(struct Node *node);
+struct Node *RemHead(struct List *list);
+
+/* Exec message ports (including amiga.lib CreatePort/DeletePort) */
+struct MsgPort *CreateMsgPort(void);
+void DeleteMsgPort(struct MsgPort *port);
+struct MsgPort *CreatePort(CONST_STRPTR name, LONG pri);
+void DeletePort(struct MsgPort *port);
+void PutMsg(struct MsgPort *port, struct Message *msg);
+struct Message *GetMsg(struct MsgPort *port);
+void ReplyMsg(struct Message *msg);
+struct Message *WaitPort(struct MsgPort *port);
+
+/* Exec devices (only timer.device is provided) */
+struct IORequest *CreateExtIO(struct MsgPort *port, LONG size);
+void DeleteExtIO(struct IORequest *ior);
+BYTE OpenDevice(CONST_STRPTR name, ULONG unit, struct IORequest *ior,
+                ULONG flags);
+void CloseDevice(struct IORequest *ior);
+BYTE DoIO(struct IORequest *ior);
+void SendIO(struct IORequest *ior);
+BYTE WaitIO(struct IORequest *ior);
+struct IORequest *CheckIO(struct IORequest *ior);
+LONG AbortIO(struct IORequest *ior);
+ULONG ReadEClock(struct EClockVal *dest);
+
+/* Exec libraries (always fail on the host) */
+struct Library *OpenLibrary(CONST_STRPTR name, ULONG version);
+void CloseLibrary(struct Library *lib);
+LONG EasyRequestArgs(struct Window *win, struct EasyStruct *es,
+                     ULONG *idcmp, APTR args);
+
+/* Exec cache control */
+void CacheClearE(APTR addr, ULONG length, ULONG caches);
+APTR CachePreDMA(APTR addr, LONG *length, ULONG flags);
+void CachePostDMA(APTR addr, LONG *length, ULONG flags);
+
+/* debug.lib */
+void KPutChar(LONG ch);
+void KPutS(CONST_STRPTR str);
+
+/* Host-only services */
+void host_exec_init(void);
+uint64_t host_usec(void);
+void host_intr_raise(LONG intNumber);
+void host_set_wait_hook(void (*hook)(void));
+
+/*
+ * The 53C710 model (hostsim_siop.c) implements the combined SSTAT0/DSTAT
+ * read, as the interrupt status must be cleared when it is read.
+ */
+uint32_t hostsim_siop_status(volatile void *rp);
+#define SIOP_READ_SSTAT_DSTAT(rp) hostsim_siop_status(rp)
+
+#endif /* _PORT_HOST_H */
@@ -213,8 +213,53 @@ struct scsi_synchronize_cache_16 {
 	u_int8_t control;
 };
 
+#define	SCSI_UNMAP			0x42
+struct scsi_unmap {
+	u_int8_t opcode;
+	u_int8_t byte2;
+#define	SU_ANCHOR	0x01
+	u_int8_t reserved[4];
+	u_int8_t byte7;			/* group number */
+	u_int8_t length[2];		/* parameter list length */
+	u_int8_t control;
+};
+
+#define	SCSI_WRITE_SAME_10		0x41
+struct scsi_write_same_10 {
+	u_int8_t opcode;
+	u_int8_t flags;			/* see WRITE SAME (16) */
+	u_int8_t addr[4];
+	u_int8_t byte7;			/* group number */
+	u_int8_t length[2];
+	u_int8_t control;
+};
+
+#define	SCSI_WRITE_SAME_16		0x93
+struct scsi_write_same_16 {
+	u_int8_t opcode;
+	u_int8_t flags;
+#define	SWS_NDOB	0x01		/* no data-out buffer */
+#define	SWS_UNMAP	0x08		/* unmap the blocks if it can */
+#define	SWS_ANCHOR	0x10
+	u_int8_t addr[8];
+	u_int8_t length[4];
+	u_int8_t byte15;		/* group number */
+	u_int8_t control;
+};
+
 /* DATAs definitions for the above commands */
 
+struct scsi_unmap_data {
+	u_int8_t length[2];		/* bytes which follow */
+	u_int8_t desc_length[2];	/* bytes of descriptors */
+	u_int8_t reserved[4];
+	struct scsi_unmap_desc {
+		u_int8_t addr[8];
+		u_int8_t nblks[4];
+		u_int8_t reserved[4];
+	} desc[1];
+};
+
 struct scsi_reassign_blocks_data {
 	u_int8_t reserved[2];
 	u_int8_t length[2];
@@ -404,4 +449,41 @@ union scsi_disk_pages {
 	} control_params;
 };
 
+/* INQUIRY vital product data pages */
+#define	SINQ_VPD_SUPPORTED	0x00	/* supported VPD pages */
+#define	SINQ_VPD_BLOCK_LIMITS	0xb0
+#define	SINQ_VPD_PROVISIONING	0xb2	/* logical block provisioning */
+
+struct scsi_vpd_block_limits {
+	u_int8_t device;
+	u_int8_t page_code;
+	u_int8_t page_length[2];
+	u_int8_t wsnz;
+	u_int8_t max_cmp_write_len;
+	u_int8_t opt_xfer_gran[2];
+	u_int8_t max_xfer_len[4];
+	u_int8_t opt_xfer_len[4];
+	u_int8_t max_prefetch_len[4];
+	u_int8_t max_unmap_lba_cnt[4];
+	u_int8_t max_unmap_desc_cnt[4];
+	u_int8_t opt_unmap_gran[4];
+	u_int8_t unmap_gran_align[4];
+#define	VPD_UGAVALID	0x80000000	/* unmap_gran_align is valid */
+	u_int8_t max_write_same_len[8];
+	u_int8_t reserved[20];
+};
+
+struct scsi_vpd_provisioning {
+	u_int8_t device;
+	u_int8_t page_code;
+	u_int8_t page_length[2];
+	u_int8_t threshold_exp;
+	u_int8_t flags;
+#define	VPD_LBPU	0x80		/* UNMAP unmaps */
+#define	VPD_LBPWS	0x40		/* WRITE SAME (16) with UNMAP does */
+#define	VPD_LBPWS10	0x20		/* WRITE SAME (10) with UNMAP does */
+	u_int8_t prov_type;
+	u_int8_t reserved;
+};
+
 #endif /* _DEV_SCSIPI_SCSI_DISK_H_ */
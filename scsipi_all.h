@@ -59,6 +59,7 @@
 struct scsipi_inquiry {
 	u_int8_t opcode;
 	u_int8_t byte2;
+#define	SINQ_EVPD	0x01		/* vital product data page */
 	u_int8_t unused[2];
 	u_int8_t length;
 	u_int8_t control;
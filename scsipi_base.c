@@ -138,6 +138,12 @@ static void scsipi_adapter_request(struct scsipi_channel *chan,
 	                           scsipi_adapter_req_t req, void *arg);
 static struct scsipi_xfer *scsipi_get_xs(struct scsipi_periph *periph,
                                          int flags);
+static int	scsipi_sort(struct scsipi_xfer *);
+static void	scsipi_periph_ready(struct scsipi_periph *);
+static void	scsipi_periph_ramp(struct scsipi_periph *);
+static void	scsipi_periph_throttle(struct scsipi_periph *, int);
+static void	scsipi_unmerge(struct scsipi_xfer *);
+static void	scsipi_merge_done(struct scsipi_xfer *);
 #else
 static void	scsipi_completion_thread(void *);
 #endif
@@ -208,7 +214,9 @@ scsipi_channel_init(struct scsipi_channel *chan)
 #endif /* !PORT_AMIGA */
 
 	/* Initialize the queues. */
+#ifndef PORT_AMIGA
 	TAILQ_INIT(&chan->chan_queue);
+#endif
 	TAILQ_INIT(&chan->chan_complete);
 
 	for (i = 0; i < SCSIPI_CHAN_PERIPH_BUCKETS; i++)
@@ -1635,6 +1643,7 @@ scsipi_mode_sense_big(struct scsipi_periph *periph, int byte2, int page,
 	return scsipi_command(periph, (void *)&cmd, sizeof(cmd),
 	    (void *)data, len, retries, timeout, NULL, flags | XS_CTL_DATA_IN);
 }
+#endif
 
 int
 scsipi_mode_select(struct scsipi_periph *periph, int byte2,
@@ -1652,6 +1661,7 @@ scsipi_mode_select(struct scsipi_periph *periph, int byte2,
 	    (void *)data, len, retries, timeout, NULL, flags | XS_CTL_DATA_OUT);
 }
 
+#ifndef PORT_AMIGA
 int
 scsipi_mode_select_big(struct scsipi_periph *periph, int byte2,
     struct scsi_mode_parameter_header_10 *data, int len, int flags, int retries,
@@ -1892,6 +1902,10 @@ scsipi_done(struct scsipi_xfer *xs)
 		goto out;
 	}
 	scsipi_put_resource(chan);
+#ifdef PORT_AMIGA
+	if (xs->error == XS_NOERROR)
+		scsipi_periph_ramp(periph);
+#endif
 	xs->xs_periph->periph_sent--;
 
 	/*
@@ -1934,6 +1948,25 @@ scsipi_done(struct scsipi_xfer *xs)
 		periph->periph_flags |= PERIPH_SENSE;
 		periph->periph_xscheck = xs;
 	}
+#ifdef PORT_AMIGA
+	/*
+	 * On TASK SET FULL, the target holds the commands still
+	 * outstanding and no more.  Remember that as its depth before
+	 * another command can take the opening this one had.  With none
+	 * outstanding, the target is busy with other initiators.
+	 */
+	if (xs->error == XS_BUSY && xs->status == SCSI_QUEUE_FULL) {
+		periph->periph_qfull++;
+		if (periph->periph_sent == 0) {
+			xs->status = SCSI_BUSY;
+		} else {
+			scsipi_periph_throttle(periph, periph->periph_sent);
+			periph->periph_maxopenings = periph->periph_openings;
+		}
+	}
+	/* The periph has an opening again, unless it must get sense first */
+	scsipi_periph_ready(periph);
+#endif
 
 	/*
 	 * If this was an xfer that was not to complete asynchronously,
@@ -2149,7 +2182,18 @@ scsipi_complete(struct scsipi_xfer *xs)
 			error = ERESTART;
 		} else if (xs->xs_retries != 0) {
 #else  /* PORT_AMIGA */
-// }
+		if (xs->error == XS_BUSY && xs->status == SCSI_QUEUE_FULL) {
+			/* scsipi_done() has cut the openings already */
+			error = ERESTART;
+			break;
+		}
+		if (xs->error == XS_BUSY && xs->status == SCSI_BUSY) {
+			mutex_enter(chan_mtx(chan));
+			periph->periph_busy++;
+			scsipi_periph_throttle(periph,
+			    periph->periph_openings / 2);
+			mutex_exit(chan_mtx(chan));
+		}
 		if (xs->xs_retries != 0) {
 #endif
 			xs->xs_retries--;
@@ -2233,6 +2277,15 @@ scsipi_complete(struct scsipi_xfer *xs)
 		break;
 	}
 
+#ifdef PORT_AMIGA
+	if (error != 0 && xs->amiga_merge != NULL) {
+		mutex_enter(chan_mtx(chan));
+		scsipi_unmerge(xs);
+		mutex_exit(chan_mtx(chan));
+		return ERESTART;
+	}
+#endif
+
 	mutex_enter(chan_mtx(chan));
 	if (error == ERESTART) {
 #ifdef PORT_AMIGA
@@ -2279,12 +2332,15 @@ scsipi_complete(struct scsipi_xfer *xs)
          * The callback is used by multiple requesters to trigger an
          * asynchronous I/O continuation:
          *
-         * sd_complete() geom_done_inquiry() scsidirect_complete()
-         * geom_done_get_capacity() geom_done_mode_page_3()
-         * geom_done_mode_page_4() geom_done_mode_page_5()
+         * sd_complete() sd_ra_complete() geom_done_inquiry()
+         * scsidirect_complete() geom_done_get_capacity()
+         * geom_done_mode_page_3() geom_done_mode_page_4()
+         * geom_done_mode_page_5()
          */
         if (xs->xs_done_callback != NULL)
             xs->xs_done_callback(xs);
+        if (xs->amiga_merge != NULL)
+            scsipi_merge_done(xs);
 #endif
 
 	mutex_enter(chan_mtx(chan));
@@ -2328,6 +2384,9 @@ scsipi_request_sense(struct scsipi_xfer *xs)
 	    0, 1000, NULL, flags);
 	periph->periph_flags &= ~PERIPH_SENSE;
 	periph->periph_xscheck = NULL;
+#ifdef PORT_AMIGA
+	scsipi_periph_ready(periph);
+#endif
 	switch (error) {
 	case 0:
 		/* we have a valid sense */
@@ -2364,24 +2423,307 @@ scsipi_request_sense(struct scsipi_xfer *xs)
 static void
 print_xs_queue(struct scsipi_channel *chan)
 {
-    struct scsipi_xfer *lxs = NULL;
+    struct scsipi_periph *periph;
     struct scsipi_xfer *xs;
-    int count = 9;
+    int i;
 
     printf("queue:");
-    for (xs = TAILQ_FIRST(&chan->chan_queue); xs != NULL;
-         xs = TAILQ_NEXT(xs, channel_q)) {
-        if (xs == lxs) {
-            break;
-        }
-        printf(" %p", xs);
-        if (count++ > 10)
-            break;
+    for (i = 0; i < 8 * 8; i++) {
+        periph = chan->chan_qperiph[i];
+        if (periph == NULL)
+            continue;
+        printf(" %d.%d%s", periph->periph_target, periph->periph_lun,
+               (chan->chan_qready & ((uint64_t) 1 << i)) ? "*" : "");
+        TAILQ_FOREACH(xs, &periph->periph_queue, channel_q)
+            printf(" %p", xs);
     }
     printf("\n");
 }
 #endif
 
+#ifdef PORT_AMIGA
+/*
+ * A disk read or write is passed over by at most SCSIPI_SORT_PASSES
+ * later ones, and merging builds transfers of up to SCSIPI_MERGE_MAX.
+ */
+#define	SCSIPI_SORT_PASSES	8
+#define	SCSIPI_MERGE_MAX	(128 * 1024)
+
+/*
+ * scsipi_rw_10:
+ *
+ *	Make the command of a read or write xfer a READ(10) or WRITE(10)
+ *	of the given blocks.
+ */
+static void
+scsipi_rw_10(struct scsipi_xfer *xs, uint64_t blkno, uint32_t nblks)
+{
+	struct scsipi_rw_10 *cmd = (struct scsipi_rw_10 *) &xs->cmdstore;
+	struct scsipi_periph *periph = xs->xs_periph;
+
+	memset(cmd, 0, sizeof (*cmd));
+	cmd->opcode = (xs->xs_control & XS_CTL_DATA_IN) ? READ_10 : WRITE_10;
+	_lto4b(blkno, cmd->addr);
+	_lto2b(nblks, cmd->length);
+	if (periph->periph_version <= 2)
+		cmd->byte2 |= ((periph->periph_lun << SCSI_CMD_LUN_SHIFT) &
+		    SCSI_CMD_LUN_MASK);
+	xs->cmd = &xs->cmdstore;
+	xs->cmdlen = sizeof (*cmd);
+}
+
+/*
+ * scsipi_merge_end:
+ *
+ *	Return the block after those of an xfer and the ones merged
+ *	into it.
+ */
+static uint64_t
+scsipi_merge_end(struct scsipi_xfer *xs)
+{
+	while (xs->amiga_merge != NULL)
+		xs = xs->amiga_merge;
+	return (xs->amiga_blkno + xs->amiga_nblks);
+}
+
+/*
+ * scsipi_merge:
+ *
+ *	Merge xs into the queued qxs if it directly follows or precedes
+ *	it. Returns the xfer which is now first, or NULL if they can't
+ *	be merged.
+ */
+static struct scsipi_xfer *
+scsipi_merge(struct scsipi_xfer *qxs, struct scsipi_xfer *xs)
+{
+	struct scsipi_xfer *txs;
+	uint64_t end;
+	int len = xs->datalen;
+
+	if ((qxs->xs_control ^ xs->xs_control) & XS_CTL_DATA_IN)
+		return (NULL);
+	if ((qxs->xs_control | xs->xs_control) & XS_CTL_ORDERED_TAG)
+		return (NULL);	/* must stay after what was issued before */
+	for (txs = qxs; txs->amiga_merge != NULL; txs = txs->amiga_merge)
+		len += txs->datalen;
+	len += txs->datalen;
+	end = txs->amiga_blkno + txs->amiga_nblks;
+	if (len > SCSIPI_MERGE_MAX ||
+	    end - qxs->amiga_blkno + xs->amiga_nblks > 0xffff)
+		return (NULL);
+
+	if (xs->amiga_blkno == end &&
+	    end + xs->amiga_nblks <= 0x100000000ULL) {
+		txs->amiga_merge = xs;
+		scsipi_rw_10(qxs, qxs->amiga_blkno,
+		    end + xs->amiga_nblks - qxs->amiga_blkno);
+		return (qxs);
+	}
+	if (xs->amiga_blkno + xs->amiga_nblks == qxs->amiga_blkno &&
+	    end <= 0x100000000ULL) {
+		xs->amiga_merge = qxs;
+		xs->amiga_passed = qxs->amiga_passed;
+		scsipi_rw_10(xs, xs->amiga_blkno, end - xs->amiga_blkno);
+		return (xs);
+	}
+	return (NULL);
+}
+
+/*
+ * scsipi_sort:
+ *
+ *	Queue a disk read or write in C-SCAN order among those of its
+ *	periph: ascending from the block after the last one issued,
+ *	wrapping around at the end of the disk. An xfer is not queued
+ *	ahead of one it overlaps unless both are reads, nor ahead of one
+ *	already passed over SCSIPI_SORT_PASSES times. Adjacent reads or
+ *	writes are merged into a single command; returns 1 if xs was
+ *	merged into a queued xfer.
+ */
+static int
+scsipi_sort(struct scsipi_xfer *xs)
+{
+	struct scsipi_periph *periph = xs->xs_periph;
+	struct scsipi_xfer_queue *xq = &periph->periph_queue;
+	struct scsipi_xfer *qxs, *mxs, *pos = NULL;
+	uint64_t key = xs->amiga_blkno - periph->periph_headpos;
+	uint64_t end = xs->amiga_blkno + xs->amiga_nblks;
+	int sorting = (periph->periph_flags & PERIPH_NOSORT) == 0;
+	int merged = 0;
+
+	TAILQ_FOREACH_REVERSE(qxs, xq, scsipi_xfer_queue, channel_q) {
+		if (qxs->amiga_nblks == 0 || qxs->xs_requeuecnt != 0 ||
+		    qxs->amiga_passed >= SCSIPI_SORT_PASSES)
+			break;
+		if (qxs->amiga_blkno < end &&
+		    xs->amiga_blkno < scsipi_merge_end(qxs) &&
+		    ((xs->xs_control | qxs->xs_control) & XS_CTL_DATA_OUT))
+			break;
+
+		if ((periph->periph_flags & PERIPH_NOMERGE) == 0 &&
+		    (mxs = scsipi_merge(qxs, xs)) != NULL) {
+			if (mxs == xs) {
+				TAILQ_INSERT_BEFORE(qxs, xs, channel_q);
+				TAILQ_REMOVE(xq, qxs, channel_q);
+			}
+			periph->periph_merges++;
+			pos = TAILQ_NEXT(mxs, channel_q);
+			merged = 1;
+			goto passed;
+		}
+
+		if (sorting && qxs->amiga_blkno - periph->periph_headpos > key)
+			pos = qxs;
+		else
+			sorting = 0;
+	}
+
+	if (pos != NULL)
+		TAILQ_INSERT_BEFORE(pos, xs, channel_q);
+	else
+		TAILQ_INSERT_TAIL(xq, xs, channel_q);
+
+ passed:
+	for (; pos != NULL; pos = TAILQ_NEXT(pos, channel_q))
+		pos->amiga_passed++;
+	return (merged);
+}
+
+/*
+ * scsipi_unmerge:
+ *
+ *	Requeue each of the xfers merged into one which failed, so they
+ *	are retried on their own.
+ */
+static void
+scsipi_unmerge(struct scsipi_xfer *xs)
+{
+	struct scsipi_xfer *next;
+
+	scsipi_rw_10(xs, xs->amiga_blkno, xs->amiga_nblks);
+	for (; xs != NULL; xs = next) {
+		next = xs->amiga_merge;
+		xs->amiga_merge = NULL;
+		xs->error = XS_NOERROR;
+		xs->status = SCSI_OK;
+		xs->xs_status &= ~XS_STS_DONE;
+		xs->resid = xs->datalen;
+		xs->xs_requeuecnt++;
+		(void) scsipi_enqueue(xs);
+	}
+}
+
+/*
+ * scsipi_merge_done:
+ *
+ *	Complete the xfers merged into one which completed.
+ */
+static void
+scsipi_merge_done(struct scsipi_xfer *xs)
+{
+	struct scsipi_xfer *mxs, *next;
+
+	for (mxs = xs->amiga_merge; mxs != NULL; mxs = next) {
+		next = mxs->amiga_merge;
+		mxs->error = xs->error;
+		mxs->status = xs->status;
+		mxs->sense = xs->sense;
+		mxs->xs_status |= XS_STS_DONE;
+		if (mxs->xs_done_callback != NULL)
+			mxs->xs_done_callback(mxs);
+		if (mxs->xs_control & XS_CTL_ASYNC)
+			scsipi_put_xs(mxs);
+	}
+	xs->amiga_merge = NULL;
+}
+#endif
+
+#ifdef PORT_AMIGA
+/*
+ * scsipi_periph_ready:
+ *
+ *	Note in the channel whether a periph can issue the next of its
+ *	queued xfers: it has openings and isn't running an untagged
+ *	command, and only recovery commands go while sense is pending.
+ */
+static void
+scsipi_periph_ready(struct scsipi_periph *periph)
+{
+	struct scsipi_channel *chan = periph->periph_channel;
+	struct scsipi_xfer *xs = TAILQ_FIRST(&periph->periph_queue);
+	uint64_t bit = (uint64_t) 1 << PERIPH_QINDEX(periph);
+
+	if (xs != NULL &&
+	    periph->periph_sent < periph->periph_openings &&
+	    (periph->periph_flags & PERIPH_UNTAG) == 0 &&
+	    ((periph->periph_flags & (PERIPH_RECOVERING | PERIPH_SENSE)) == 0 ||
+	     (xs->xs_control & XS_CTL_URGENT) != 0))
+		chan->chan_qready |= bit;
+	else
+		chan->chan_qready &= ~bit;
+}
+
+/*
+ * A periph gets another opening once SCSIPI_OPENINGS_RAMP commands have
+ * completed while it was using all of the ones it has.
+ */
+#define	SCSIPI_OPENINGS_RAMP	64
+
+/*
+ * scsipi_periph_ramp:
+ *
+ *	Called with the channel lock held for each command which
+ *	completes without error.  Once enough of them have done so while
+ *	the periph was using all of its openings, give it another one,
+ *	up to the most it is known to take.
+ */
+static void
+scsipi_periph_ramp(struct scsipi_periph *periph)
+{
+	if (periph->periph_sent < periph->periph_openings ||
+	    periph->periph_openings >= periph->periph_maxopenings)
+		return;
+	if (++periph->periph_ramp >= SCSIPI_OPENINGS_RAMP) {
+		periph->periph_ramp = 0;
+		periph->periph_openings++;
+	}
+}
+
+/*
+ * scsipi_periph_throttle:
+ *
+ *	Called with the channel lock held when the target is too busy
+ *	for another command.  Cut the periph's openings to at most the
+ *	given number, and start ramping up again from there.
+ */
+static void
+scsipi_periph_throttle(struct scsipi_periph *periph, int openings)
+{
+	if (openings < 1)
+		openings = 1;
+	if (periph->periph_openings > openings)
+		periph->periph_openings = openings;
+	periph->periph_ramp = 0;
+	scsipi_periph_ready(periph);
+}
+
+/*
+ * scsipi_next_ready:
+ *
+ *	Return the first periph which can issue an xfer, starting at
+ *	the one after the periph which issued last.
+ */
+static struct scsipi_periph *
+scsipi_next_ready(struct scsipi_channel *chan)
+{
+	uint64_t later = chan->chan_qready &
+	    ~(((uint64_t) 1 << chan->chan_qnext) - 1);
+
+	return (chan->chan_qperiph[__builtin_ctzll(later != 0 ? later :
+	    chan->chan_qready)]);
+}
+#endif
+
 /*
  * scsipi_enqueue:
  *
@@ -2391,6 +2733,12 @@ static int
 scsipi_enqueue(struct scsipi_xfer *xs)
 {
 	struct scsipi_channel *chan = xs->xs_periph->periph_channel;
+#ifdef PORT_AMIGA
+	/* Each periph has its own queue */
+	struct scsipi_xfer_queue *xq = &xs->xs_periph->periph_queue;
+#else
+	struct scsipi_xfer_queue *xq = &chan->chan_queue;
+#endif
 	struct scsipi_xfer *qxs;
 
 	SDT_PROBE1(scsi, base, xfer, enqueue,  xs);
@@ -2400,8 +2748,12 @@ scsipi_enqueue(struct scsipi_xfer *xs)
 	 * the queue, we can't proceed.
 	 */
 	KASSERT(mutex_owned(chan_mtx(chan)));
+#ifdef PORT_AMIGA
+	if ((xs->xs_control & XS_CTL_POLL) != 0 && chan->chan_queued != 0) {
+#else
 	if ((xs->xs_control & XS_CTL_POLL) != 0 &&
 	    TAILQ_FIRST(&chan->chan_queue) != NULL) {
+#endif
 		xs->error = XS_DRIVER_STUFFUP;
 		return EAGAIN;
 	}
@@ -2415,7 +2767,7 @@ scsipi_enqueue(struct scsipi_xfer *xs)
                 printf("[adding %p head]", xs);
                 print_xs_queue(chan);
 #endif
-		TAILQ_INSERT_HEAD(&chan->chan_queue, xs, channel_q);
+		TAILQ_INSERT_HEAD(xq, xs, channel_q);
 #ifdef QUEUE_DEBUG
                 print_xs_queue(chan);
 #endif
@@ -2433,7 +2785,7 @@ scsipi_enqueue(struct scsipi_xfer *xs)
 	 * there naturally.)
 	 */
 	if (xs->xs_requeuecnt != 0) {
-		for (qxs = TAILQ_FIRST(&chan->chan_queue); qxs != NULL;
+		for (qxs = TAILQ_FIRST(xq); qxs != NULL;
 		     qxs = TAILQ_NEXT(qxs, channel_q)) {
 			if (qxs->xs_periph == xs->xs_periph &&
 			    qxs->xs_requeuecnt < xs->xs_requeuecnt)
@@ -2444,24 +2796,36 @@ scsipi_enqueue(struct scsipi_xfer *xs)
                         printf("[adding %p after %p]", xs, qxs);
                         print_xs_queue(chan);
 #endif
-			TAILQ_INSERT_AFTER(&chan->chan_queue, qxs, xs,
-			    channel_q);
+			TAILQ_INSERT_AFTER(xq, qxs, xs, channel_q);
 #ifdef QUEUE_DEBUG
                         print_xs_queue(chan);
 #endif
 			goto out;
 		}
 	}
+#ifdef PORT_AMIGA
+	if (xs->amiga_nblks != 0 && xs->xs_requeuecnt == 0 &&
+	    (xs->xs_periph->periph_flags & (PERIPH_NOSORT | PERIPH_NOMERGE)) !=
+	    (PERIPH_NOSORT | PERIPH_NOMERGE)) {
+		if (scsipi_sort(xs) != 0)
+			return 0;	/* merged into one already queued */
+		goto out;
+	}
+#endif
 #ifdef QUEUE_DEBUG
         printf("[adding %p tail]", xs);
         print_xs_queue(chan);
 #endif
-	TAILQ_INSERT_TAIL(&chan->chan_queue, xs, channel_q);
+	TAILQ_INSERT_TAIL(xq, xs, channel_q);
 #ifdef QUEUE_DEBUG
         print_xs_queue(chan);
 #endif
  out:
-#ifndef PORT_AMIGA
+#ifdef PORT_AMIGA
+	chan->chan_queued++;
+	chan->chan_qperiph[PERIPH_QINDEX(xs->xs_periph)] = xs->xs_periph;
+	scsipi_periph_ready(xs->xs_periph);
+#else
 	if (xs->xs_control & XS_CTL_THAW_PERIPH)
 		scsipi_periph_thaw_locked(xs->xs_periph, 1);
 #endif
@@ -2499,6 +2863,17 @@ scsipi_run_queue(struct scsipi_channel *chan)
 		}
 #endif
 
+#ifdef PORT_AMIGA
+		/*
+		 * Take the next xfer of the next periph which can issue
+		 * one, round-robin.
+		 */
+		if (chan->chan_qready != 0) {
+			periph = scsipi_next_ready(chan);
+			xs = TAILQ_FIRST(&periph->periph_queue);
+			goto got_one;
+		}
+#else
 		/*
 		 * Look for work to do, and make sure we can do it.
 		 */
@@ -2506,24 +2881,10 @@ scsipi_run_queue(struct scsipi_channel *chan)
 		     xs = TAILQ_NEXT(xs, channel_q)) {
 			periph = xs->xs_periph;
 
-#ifdef PORT_AMIGA
-			if ((periph->periph_sent >= periph->periph_openings) ||
-			    (periph->periph_flags & PERIPH_UNTAG) != 0) {
-                            /*
-                             * PERIPH_UNTAG means the device is running a
-                             * single untagged command. No other commands
-                             * are allowed at this time.
-                             */
-                                if (xs == TAILQ_LAST(&chan->chan_queue, scsipi_xfer_queue))
-                                    break;  // Last entry in queue
-				continue;
-                        }
-#else
 			if ((periph->periph_sent >= periph->periph_openings) ||
 			    periph->periph_qfreeze != 0 ||
 			    (periph->periph_flags & PERIPH_UNTAG) != 0)
 				continue;
-#endif
 
 			if ((periph->periph_flags &
 			    (PERIPH_RECOVERING | PERIPH_SENSE)) != 0 &&
@@ -2535,6 +2896,7 @@ scsipi_run_queue(struct scsipi_channel *chan)
 			 */
 			goto got_one;
 		}
+#endif
 
 		/*
 		 * Can't find any work to do right now.
@@ -2585,10 +2947,29 @@ scsipi_run_queue(struct scsipi_channel *chan)
                 printf("[removing %p]\n", xs);
                 print_xs_queue(chan);
 #endif
+#ifdef PORT_AMIGA
+		TAILQ_REMOVE(&periph->periph_queue, xs, channel_q);
+		chan->chan_queued--;
+		if (TAILQ_EMPTY(&periph->periph_queue))
+			chan->chan_qperiph[PERIPH_QINDEX(periph)] = NULL;
+		chan->chan_qnext = (PERIPH_QINDEX(periph) + 1) & 63;
+#else
 		TAILQ_REMOVE(&chan->chan_queue, xs, channel_q);
+#endif
 #ifdef QUEUE_DEBUG
                 print_xs_queue(chan);
 #endif
+#ifdef PORT_AMIGA
+		if (xs->amiga_nblks != 0) {
+			/* Seek distance from where the last one ended */
+			periph->periph_seek_blocks +=
+			    (xs->amiga_blkno > periph->periph_headpos) ?
+			    xs->amiga_blkno - periph->periph_headpos :
+			    periph->periph_headpos - xs->amiga_blkno;
+			periph->periph_seeks++;
+			periph->periph_headpos = scsipi_merge_end(xs);
+		}
+#endif
 
 		/*
 		 * If the command is to be tagged, allocate a tag ID
@@ -2599,6 +2980,9 @@ scsipi_run_queue(struct scsipi_channel *chan)
 		else
 			periph->periph_flags |= PERIPH_UNTAG;
 		periph->periph_sent++;
+#ifdef PORT_AMIGA
+		scsipi_periph_ready(periph);
+#endif
 		mutex_exit(chan_mtx(chan));
 
 		SDT_PROBE2(scsi, base, queue, run,  chan, xs);
@@ -3090,54 +3474,6 @@ scsipi_async_event_max_openings(struct scsipi_channel *chan,
 	}
 }
 
-/*
- * scsipi_set_xfer_mode:
- *
- *	Set the xfer mode for the specified I_T Nexus.
- */
-void
-scsipi_set_xfer_mode(struct scsipi_channel *chan, int target, int immed)
-{
-	struct scsipi_xfer_mode xm;
-	struct scsipi_periph *itperiph;
-	int lun;
-
-	/*
-	 * Go to the minimal xfer mode.
-	 */
-	xm.xm_target = target;
-	xm.xm_mode = 0;
-	xm.xm_period = 0;			/* ignored */
-	xm.xm_offset = 0;			/* ignored */
-
-	/*
-	 * Find the first LUN we know about on this I_T Nexus.
-	 */
-	for (itperiph = NULL, lun = 0; lun < chan->chan_nluns; lun++) {
-		itperiph = scsipi_lookup_periph(chan, target, lun);
-		if (itperiph != NULL)
-			break;
-	}
-	if (itperiph != NULL) {
-		xm.xm_mode = itperiph->periph_cap;
-		/*
-		 * Now issue the request to the adapter.
-		 */
-		scsipi_adapter_request(chan, ADAPTER_REQ_SET_XFER_MODE, &xm);
-		/*
-		 * If we want this to happen immediately, issue a dummy
-		 * command, since most adapters can't really negotiate unless
-		 * they're executing a job.
-		 */
-		if (immed != 0) {
-			(void) scsipi_test_unit_ready(itperiph,
-			    XS_CTL_DISCOVERY | XS_CTL_IGNORE_ILLEGAL_REQUEST |
-			    XS_CTL_IGNORE_NOT_READY |
-			    XS_CTL_IGNORE_MEDIA_CHANGE);
-		}
-	}
-}
-
 /*
  * scsipi_channel_reset:
  *
@@ -3392,6 +3728,54 @@ scsipi_adapter_request(struct scsipi_channel *chan,
 #endif
 }
 
+/*
+ * scsipi_set_xfer_mode:
+ *
+ *	Set the xfer mode for the specified I_T Nexus.
+ */
+void
+scsipi_set_xfer_mode(struct scsipi_channel *chan, int target, int immed)
+{
+	struct scsipi_xfer_mode xm;
+	struct scsipi_periph *itperiph;
+	int lun;
+
+	/*
+	 * Go to the minimal xfer mode.
+	 */
+	xm.xm_target = target;
+	xm.xm_mode = 0;
+	xm.xm_period = 0;			/* ignored */
+	xm.xm_offset = 0;			/* ignored */
+
+	/*
+	 * Find the first LUN we know about on this I_T Nexus.
+	 */
+	for (itperiph = NULL, lun = 0; lun < chan->chan_nluns; lun++) {
+		itperiph = scsipi_lookup_periph(chan, target, lun);
+		if (itperiph != NULL)
+			break;
+	}
+	if (itperiph != NULL) {
+		xm.xm_mode = itperiph->periph_cap;
+		/*
+		 * Now issue the request to the adapter.
+		 */
+		scsipi_adapter_request(chan, ADAPTER_REQ_SET_XFER_MODE, &xm);
+		/*
+		 * If we want this to happen immediately, issue a dummy
+		 * command, since most adapters can't really negotiate unless
+		 * they're executing a job.
+		 */
+		if (immed != 0) {
+			(void) scsipi_test_unit_ready(itperiph,
+			    XS_CTL_DISCOVERY | XS_CTL_IGNORE_ILLEGAL_REQUEST |
+			    XS_CTL_IGNORE_NOT_READY |
+			    XS_CTL_IGNORE_MEDIA_CHANGE);
+		}
+	}
+}
+
 #ifndef PORT_AMIGA
 int
 scsipi_adapter_ioctl(struct scsipi_channel *chan, u_long cmd,
@@ -199,9 +199,7 @@ struct scsipi_adapter {
 	int	adapt_nchannels;	/* number of adapter channels */
 	volatile int	adapt_refcnt;		/* adapter's reference count */
 	int	adapt_openings;		/* total # of command openings */
-#ifndef PORT_AMIGA
 	int	adapt_max_periph;	/* max openings per periph */
-#endif
 	int	adapt_flags;
 
 	void	(*adapt_request)(struct scsipi_channel *,
@@ -331,8 +329,20 @@ struct scsipi_channel {
 	int	chan_qfreeze;		/* freeze count for queue */
 #endif
 
+#ifdef PORT_AMIGA
+	/*
+	 * Periphs with xfers waiting to be issued, by PERIPH_QINDEX(),
+	 * and a bitmap of those which can issue one now. The bitmap is
+	 * served round-robin starting at chan_qnext.
+	 */
+	struct scsipi_periph *chan_qperiph[8 * 8];
+	uint64_t chan_qready;
+	u_int	chan_qnext;
+	u_int	chan_queued;		/* xfers waiting on all periphs */
+#else
 	/* Job queue for this channel. */
 	struct scsipi_xfer_queue chan_queue;
+#endif
 
 	/* Completed (async) jobs. */
 	struct scsipi_xfer_queue chan_complete;
@@ -474,6 +484,25 @@ struct scsipi_periph {
 	uint	periph_blkshift;	/* Block size of this LUN in bits */
         uint    periph_changenum;       /* Count of removes/inserts */
         uint    periph_tur_active;      /* Test unit ready already active */
+	uint64_t periph_headpos;	/* block after the last one issued */
+	u_int	periph_merges;		/* requests merged into another */
+	u_int	periph_seeks;		/* sorted requests issued */
+	uint64_t periph_seek_blocks;	/* distance of those from headpos */
+	struct scsipi_xfer_queue periph_queue; /* xfers waiting to be issued */
+	int	periph_maxopenings;	/* most openings the target takes */
+	u_int	periph_ramp;		/* completions toward another opening */
+	u_int	periph_qfull;		/* TASK SET FULL statuses returned */
+	u_int	periph_busy;		/* BUSY statuses returned */
+	uint64_t periph_capacity;	/* blocks, 0 if not known */
+	struct sd_readahead *periph_ra;	/* read-ahead, if TDF_READ_AHEAD */
+	struct sd_writeback *periph_wb;	/* write-back, if TDF_WRITE_BACK */
+	uint8_t	periph_caching;		/* mode page 8 WCE and RCD, if read */
+	uint8_t	periph_unmap;		/* SD_UNMAP_* command to discard with */
+	uint16_t periph_unmap_descs;	/* most ranges in an UNMAP */
+	uint32_t periph_unmap_max;	/* most blocks in a command */
+	uint32_t periph_unmap_gran;	/* blocks are discarded in units of */
+	uint32_t periph_unmap_align;	/* first block of the first unit */
+	uint32_t periph_ws_max;		/* most blocks in a WRITE SAME */
 #endif
 
 	int	periph_version;		/* ANSI SCSI version */
@@ -506,6 +535,14 @@ struct scsipi_periph {
 };
 #endif
 
+#ifdef PORT_AMIGA
+/*
+ * Index of a periph in the channel's queue tables.
+ */
+#define	PERIPH_QINDEX(periph)						\
+	((periph)->periph_target * 8 + (periph)->periph_lun)
+#endif
+
 /*
  * Macro to return the current xfer mode of a periph.
  */
@@ -543,6 +580,8 @@ struct scsipi_periph {
 #define PERIPH_KEEP_LABEL	0x0200	/* retain label after 'full' close */
 #define	PERIPH_SENSE		0x0400	/* periph has sense pending */
 #define PERIPH_UNTAG		0x0800	/* untagged command running */
+#define PERIPH_NOSORT		0x1000	/* queue requests in FIFO order */
+#define PERIPH_NOMERGE		0x2000	/* don't merge adjacent requests */
 
 /* periph_quirks */
 #define	PQUIRK_AUTOSAVE		0x00000001	/* do implicit SAVE POINTERS */
@@ -570,6 +609,7 @@ struct scsipi_periph {
 #define PQUIRK_NOREPSUPPOPC     0x01000000      /* does not grok
 						   REPORT SUPPORTED OPCODES
 						   to fetch device timeouts */
+#define	PQUIRK_NOWRITESAME	0x02000000	/* does not grok WRITE SAME */
 /*
  * Error values an adapter driver may return
  */
@@ -619,6 +659,10 @@ struct scsipi_xfer {
 
         void    *xs_callback_arg;       /* AmigaOS callback data */
         void    *amiga_ior;             /* AmigaOS IO request for transfer */
+	struct scsipi_xfer *amiga_merge; /* next xfer merged into this one */
+	uint64_t amiga_blkno;		/* first block of a read or write */
+	uint32_t amiga_nblks;		/* its blocks, 0 if not sortable */
+	u_int	amiga_passed;		/* times passed over in the queue */
 	int	xs_control;		/* control flags */
 	volatile int xs_status;		/* status flags */
 	struct scsipi_periph *xs_periph;/* peripheral doing the xfer */
@@ -8,6 +8,7 @@
 #include <string.h>
 #include <sys/param.h>
 #include <exec/errors.h>
+#include <clib/alib_protos.h>
 #include <devices/scsidisk.h>
 #include <devices/trackdisk.h>
 #include "scsipiconf.h"
@@ -31,6 +32,18 @@
 #define SD_IO_TIMEOUT   (3 * 1000)  // 5 seconds
 #endif
 
+#ifndef SD_SYNC_TIMEOUT
+#define SD_SYNC_TIMEOUT (30 * 1000)  // The whole drive cache may be written
+#endif
+
+#ifndef SD_UNMAP_TIMEOUT
+#define SD_UNMAP_TIMEOUT (30 * 1000)  // Flash may erase as it unmaps
+#endif
+
+#ifndef SD_FORMAT_TIMEOUT
+#define SD_FORMAT_TIMEOUT (30 * 1000)  // A WRITE SAME writes it all
+#endif
+
 typedef struct
 {
     struct scsi_mode_parameter_header_6 hdr;
@@ -227,6 +240,7 @@ uint32_t
 sd_blocksize(void *periph_p)
 {
     struct scsipi_periph *periph = periph_p;
+    uint64_t capacity;
     int      flags;
     int blksize = 0;
     scsi_mode_sense_t modepage;
@@ -239,9 +253,11 @@ sd_blocksize(void *periph_p)
     /*
      * SCSI Read Capacity can provide block size.
      */
-    (void) sd_read_capacity(periph, &blksize, flags);
-    if (is_valid_blksize(blksize))
+    capacity = sd_read_capacity(periph, &blksize, flags);
+    if (is_valid_blksize(blksize)) {
+        periph->periph_capacity = capacity;
         goto got_blocksize;
+    }
 
     /*
      * SCSI Mode page 3 can give bytes per sector and sectors per track
@@ -368,17 +384,15 @@ sd_testunitready_walk(struct scsipi_channel *chan)
 }
 
 /*
- * sd_readwrite
- * ------------
- * Initiate a read or write operation on the specified SCSI device.
- * b_flags includes B_READ when the operation is a read from the SCSI
- * device to computer RAM.
+ * sd_rw_xs
+ * --------
+ * Build the READ or WRITE for a transfer of buflen bytes at blkno,
+ * with a simple or ordered tag.
  */
-int
-sd_readwrite(void *periph_p, uint64_t blkno, uint b_flags, void *buf,
-             uint buflen, void *ior)
+static struct scsipi_xfer *
+sd_rw_xs(struct scsipi_periph *periph, uint64_t blkno, uint b_flags,
+         void *buf, uint buflen, int tag)
 {
-    struct scsipi_periph *periph = periph_p;
     struct scsipi_generic cmdbuf;
     struct scsipi_xfer *xs;
     uint32_t blkshift = periph->periph_blkshift;
@@ -422,7 +436,7 @@ sd_readwrite(void *periph_p, uint64_t blkno, uint b_flags, void *buf,
         _lto8b(blkno, cmd->addr);
         _lto4b(nblks, cmd->length);
     }
-    flags = XS_CTL_ASYNC | XS_CTL_SIMPLE_TAG;
+    flags = XS_CTL_ASYNC | tag;
     if (b_flags & B_READ)
         flags |= XS_CTL_DATA_IN;
     else
@@ -431,19 +445,643 @@ sd_readwrite(void *periph_p, uint64_t blkno, uint b_flags, void *buf,
     xs = scsipi_make_xs_locked(periph, &cmdbuf, cmdlen, buf, buflen,
                                SDRETRIES, SD_IO_TIMEOUT, NULL, flags);
     if (__predict_false(xs == NULL))
-        return (TDERR_NoMem);  // out of memory
+        return (NULL);
 
-    xs->amiga_ior = ior;
-    xs->xs_done_callback = sd_complete;
+    if ((nblks << blkshift) == buflen) {
+        /* Whole blocks, so the queue may sort and merge it */
+        xs->amiga_blkno = blkno;
+        xs->amiga_nblks = nblks;
+    }
 
 #if 0
     printf("sd%d.%d %p issue %c %u %u\n",
            periph->periph_target, periph->periph_lun, xs,
            (flags & XS_CTL_DATA_OUT) ? 'W' : 'R', (uint32_t) blkno, nblks);
 #endif
+    return (xs);
+}
+
+static int
+sd_rw_issue(struct scsipi_periph *periph, uint64_t blkno, uint b_flags,
+            void *buf, uint buflen, void *ior, int tag)
+{
+    struct scsipi_xfer *xs;
+
+    xs = sd_rw_xs(periph, blkno, b_flags, buf, buflen, tag);
+    if (__predict_false(xs == NULL))
+        return (TDERR_NoMem);  // out of memory
+
+    xs->amiga_ior = ior;
+    xs->xs_done_callback = sd_complete;
     return (scsipi_execute_xs(xs));
 }
 
+/*
+ * Sequential read-ahead
+ * ---------------------
+ * A unit opened with TDF_READ_AHEAD gets a buffer of up to SD_RA_KB
+ * from sd_ra_budget_kb. Once SD_RA_TRIGGER reads in a row have each
+ * started where the one before ended, the buffer is filled by a single
+ * READ of the blocks after the last of them. Later reads which fall
+ * entirely within the buffer are copied from it (waiting for it if it
+ * is still being read), and when the stream has read up to its end,
+ * it is filled again. It is dropped by a write to its blocks, by any
+ * SCSI direct command, and by a media change. Nothing is read ahead
+ * while a write is in progress, as the target may reorder the two.
+ */
+uint sd_ra_budget_kb = 256;   // Memory for the read-ahead of all units
+static uint sd_ra_used;       // Bytes of that in use
+
+#define SD_RA_KB      64  // Largest read-ahead buffer of a unit
+#define SD_RA_TRIGGER  2  // Sequential reads before reading ahead
+
+static void sd_ra_complete(struct scsipi_xfer *xs);
+static int sd_wb_overlaps(sd_writeback_t *wb, uint64_t blkno, uint64_t nblks);
+
+static void
+sd_ra_drop(sd_readahead_t *ra)
+{
+    if (ra->ra_state == SD_RA_READING) {
+        ra->ra_stale = 1;  // sd_ra_complete() counts it
+    } else if (ra->ra_state == SD_RA_VALID) {
+        ra->ra_state = SD_RA_EMPTY;
+        ra->ra_dropped++;
+    }
+}
+
+/* Drop the read-ahead if any of its blocks are written */
+static void
+sd_ra_write(sd_readahead_t *ra, uint64_t blkno, uint64_t nblks)
+{
+    if ((ra != NULL) && (ra->ra_state != SD_RA_EMPTY) &&
+        (blkno < ra->ra_blkno + ra->ra_nblks) &&
+        (blkno + nblks > ra->ra_blkno))
+        sd_ra_drop(ra);
+}
+
+/* Read ahead of the stream if it has read everything in the buffer */
+static void
+sd_ra_fill(struct scsipi_periph *periph, sd_readahead_t *ra)
+{
+    struct scsipi_xfer *xs;
+    uint64_t blkno = ra->ra_next;
+    uint64_t nblks = ra->ra_buflen >> periph->periph_blkshift;
+
+    if ((ra->ra_seq < SD_RA_TRIGGER) || (ra->ra_state == SD_RA_READING) ||
+        (ra->ra_writes != 0) || (blkno >= periph->periph_capacity))
+        return;
+    if ((ra->ra_state == SD_RA_VALID) && (blkno >= ra->ra_blkno) &&
+        (blkno < ra->ra_blkno + ra->ra_nblks))
+        return;
+
+    if (nblks > periph->periph_capacity - blkno)
+        nblks = periph->periph_capacity - blkno;
+    if (sd_wb_overlaps(periph->periph_wb, blkno, nblks))
+        return;  // The unit doesn't have those blocks yet
+    xs = sd_rw_xs(periph, blkno, B_READ, ra->ra_buf,
+                  nblks << periph->periph_blkshift, XS_CTL_SIMPLE_TAG);
+    if (xs == NULL)
+        return;
+    xs->xs_done_callback = sd_ra_complete;
+
+    /* The direct adapter completes it before scsipi_execute_xs() returns */
+    ra->ra_state     = SD_RA_READING;
+    ra->ra_stale     = 0;
+    ra->ra_blkno     = blkno;
+    ra->ra_nblks     = nblks;
+    ra->ra_changenum = periph->periph_changenum;
+    ra->ra_reads++;
+    (void) scsipi_execute_xs(xs);
+}
+
+/*
+ * sd_ra_read
+ * ----------
+ * Returns non-zero if the read was completed from the read-ahead
+ * buffer, or will be once it has been read.
+ */
+static int
+sd_ra_read(struct scsipi_periph *periph, sd_readahead_t *ra, uint64_t blkno,
+           void *buf, uint buflen, void *ior)
+{
+    uint32_t blkshift = periph->periph_blkshift;
+    uint32_t nblks = buflen >> blkshift;
+    struct sd_ra_wait *w;
+
+    if ((nblks << blkshift) != buflen)
+        return (0);
+
+    if (ra->ra_changenum != periph->periph_changenum) {
+        sd_ra_drop(ra);
+        ra->ra_changenum = periph->periph_changenum;
+        ra->ra_seq = 0;
+    }
+    if (blkno == ra->ra_next) {
+        if (ra->ra_seq < SD_RA_TRIGGER)
+            ra->ra_seq++;
+    } else {
+        ra->ra_seq = 0;
+    }
+    ra->ra_next = blkno + nblks;
+
+    if ((ra->ra_state == SD_RA_EMPTY) || ra->ra_stale ||
+        (blkno < ra->ra_blkno) ||
+        (blkno + nblks > ra->ra_blkno + ra->ra_nblks)) {
+        if (ra->ra_seq >= SD_RA_TRIGGER)
+            ra->ra_misses++;
+        return (0);
+    }
+
+    if (ra->ra_state == SD_RA_READING) {
+        if (ra->ra_nwait == SD_RA_WAITERS) {
+            ra->ra_misses++;
+            return (0);
+        }
+        w = &ra->ra_wait[ra->ra_nwait++];
+        w->ior    = ior;
+        w->buf    = buf;
+        w->blkno  = blkno;
+        w->buflen = buflen;
+        return (1);
+    }
+
+    CopyMem(ra->ra_buf + ((blkno - ra->ra_blkno) << blkshift), buf, buflen);
+    ra->ra_hits++;
+    cmd_complete(ior, 0);
+    sd_ra_fill(periph, ra);
+    return (1);
+}
+
+/* Called when a read-ahead is complete */
+static void
+sd_ra_complete(struct scsipi_xfer *xs)
+{
+    struct scsipi_periph *periph = xs->xs_periph;
+    sd_readahead_t *ra = periph->periph_ra;
+    struct sd_ra_wait wait[SD_RA_WAITERS];
+    uint nwait = ra->ra_nwait;
+    uint i;
+    int valid = (xs->error == XS_NOERROR) && !ra->ra_stale &&
+                (ra->ra_changenum == periph->periph_changenum);
+
+    if (valid) {
+        ra->ra_state = SD_RA_VALID;
+    } else {
+        ra->ra_state = SD_RA_EMPTY;
+        ra->ra_dropped++;
+        if (xs->error != XS_NOERROR)
+            ra->ra_seq = 0;  // Don't try again until there is a new stream
+    }
+
+    /* Reissued reads may start another read-ahead with its own waiters */
+    CopyMem(ra->ra_wait, wait, nwait * sizeof (wait[0]));
+    ra->ra_nwait = 0;
+    for (i = 0; i < nwait; i++) {
+        struct sd_ra_wait *w = &wait[i];
+        if (valid) {
+            CopyMem(ra->ra_buf + ((w->blkno - ra->ra_blkno) <<
+                                  periph->periph_blkshift),
+                    w->buf, w->buflen);
+            ra->ra_hits++;
+            cmd_complete(w->ior, 0);
+        } else {
+            int rc = sd_rw_issue(periph, w->blkno, B_READ, w->buf,
+                                 w->buflen, w->ior, XS_CTL_SIMPLE_TAG);
+            ra->ra_misses++;
+            if (rc != 0)
+                cmd_complete(w->ior, rc);
+        }
+    }
+    if (valid)
+        sd_ra_fill(periph, ra);
+}
+
+void
+sd_readahead_init(struct scsipi_periph *periph)
+{
+    sd_readahead_t *ra;
+    uint buflen;
+
+    if (sd_ra_budget_kb * 1024 <= sd_ra_used)
+        return;
+    buflen = MIN(SD_RA_KB * 1024, sd_ra_budget_kb * 1024 - sd_ra_used);
+    buflen &= ~((1 << periph->periph_blkshift) - 1);
+    if ((periph->periph_capacity == 0) ||
+        ((buflen >> periph->periph_blkshift) < 2))
+        return;
+
+    ra = AllocMem(sizeof (*ra), MEMF_PUBLIC | MEMF_CLEAR);
+    if (ra == NULL)
+        return;
+    ra->ra_buf = AllocMem(buflen, MEMF_PUBLIC);
+    if (ra->ra_buf == NULL) {
+        FreeMem(ra, sizeof (*ra));
+        return;
+    }
+    ra->ra_buflen = buflen;
+    ra->ra_changenum = periph->periph_changenum;
+    periph->periph_ra = ra;
+    sd_ra_used += buflen;
+}
+
+/* Non-zero while the read-ahead buffer is being read into */
+int
+sd_readahead_busy(struct scsipi_periph *periph)
+{
+    sd_readahead_t *ra = periph->periph_ra;
+
+    return ((ra != NULL) && (ra->ra_state == SD_RA_READING));
+}
+
+/* The buffer must not be being read into (sd_readahead_busy()) */
+void
+sd_readahead_free(struct scsipi_periph *periph)
+{
+    sd_readahead_t *ra = periph->periph_ra;
+
+    if (ra == NULL)
+        return;
+    periph->periph_ra = NULL;
+    sd_ra_used -= ra->ra_buflen;
+    FreeMem(ra->ra_buf, ra->ra_buflen);
+    FreeMem(ra, sizeof (*ra));
+}
+
+/*
+ * A unit needs SYNCHRONIZE CACHE to write what it has cached unless it
+ * lacks the command or its write cache is known to be off.
+ */
+static int
+sd_sync_needed(struct scsipi_periph *periph)
+{
+    if (periph->periph_quirks & PQUIRK_NOSYNCCACHE)
+        return (0);
+    return ((periph->periph_caching & (SD_CACHE_READ | CACHING_WCE)) !=
+            SD_CACHE_READ);
+}
+
+static struct scsipi_xfer *
+sd_sync_xs(struct scsipi_periph *periph, void (*done)(struct scsipi_xfer *))
+{
+    struct scsi_synchronize_cache_10 cmd;
+    struct scsipi_xfer *xs;
+
+    memset(&cmd, 0, sizeof (cmd));
+    cmd.opcode = SCSI_SYNCHRONIZE_CACHE_10;
+    xs = scsipi_make_xs_locked(periph, (struct scsipi_generic *) &cmd,
+                               sizeof (cmd), NULL, 0, SDRETRIES,
+                               SD_SYNC_TIMEOUT, NULL,
+                               XS_CTL_ASYNC | XS_CTL_SIMPLE_TAG);
+    if (xs != NULL)
+        xs->xs_done_callback = done;
+    return (xs);
+}
+
+static int
+sd_sync_error(struct scsipi_xfer *xs)
+{
+    if ((xs->error == XS_SENSE) &&
+        (SSD_SENSE_KEY(xs->sense.scsi_sense.flags) == SKEY_ILLEGAL_REQUEST)) {
+        /* No cache to write */
+        xs->xs_periph->periph_quirks |= PQUIRK_NOSYNCCACHE;
+        return (0);
+    }
+    return (translate_xs_error(xs));
+}
+
+/* CMD_UPDATE of a unit without write-back */
+static void
+sd_sync_complete(struct scsipi_xfer *xs)
+{
+    cmd_complete(xs->amiga_ior, sd_sync_error(xs));
+}
+
+/*
+ * Write-back
+ * ----------
+ * A unit opened with TDF_WRITE_BACK gets a buffer of sd_wb_kb. Writes of
+ * up to a quarter of it which start within or right after the blocks it
+ * holds are copied into it and complete at once, so small sequential
+ * writes and rewrites of the same blocks go to the unit as a single
+ * WRITE. It is written when full, sd_wb_age_ms after it first got dirty,
+ * before a read or write which overlaps it but can't use it, on
+ * CMD_UPDATE (followed by SYNCHRONIZE CACHE) and on detach. A read or
+ * write overlapping it while it is being written is ordered after it.
+ */
+uint sd_wb_kb = 64;        // Write-back buffer of a unit
+uint sd_wb_age_ms = 500;   // Longest time a block is held
+
+static void sd_wb_complete(struct scsipi_xfer *xs);
+static void sd_wb_sync_complete(struct scsipi_xfer *xs);
+
+static int
+sd_wb_overlaps(sd_writeback_t *wb, uint64_t blkno, uint64_t nblks)
+{
+    return ((wb != NULL) && (wb->wb_nblks != 0) &&
+            (blkno < wb->wb_blkno + wb->wb_nblks) &&
+            (blkno + nblks > wb->wb_blkno));
+}
+
+static void
+sd_wb_timeout(void *arg)
+{
+    sd_writeback_flush(arg);
+}
+
+void
+sd_writeback_flush(struct scsipi_periph *periph)
+{
+    sd_writeback_t *wb = periph->periph_wb;
+    struct scsipi_xfer *xs;
+
+    if ((wb == NULL) || (wb->wb_nblks == 0) || wb->wb_flushing)
+        return;
+
+    xs = sd_rw_xs(periph, wb->wb_blkno, B_WRITE, wb->wb_buf,
+                  wb->wb_nblks << periph->periph_blkshift, XS_CTL_SIMPLE_TAG);
+    if (xs == NULL) {
+        callout_reset(&wb->wb_callout, 1, sd_wb_timeout, periph);
+        return;
+    }
+    callout_stop(&wb->wb_callout);
+    xs->xs_done_callback = sd_wb_complete;
+    wb->wb_flushing = 1;
+    wb->wb_flushes++;
+    wb->wb_blocks += wb->wb_nblks;
+    (void) scsipi_execute_xs(xs);
+}
+
+/* Complete the first n CMD_UPDATE requests waiting */
+static void
+sd_wb_updated(sd_writeback_t *wb, uint n, int rc)
+{
+    if ((rc == 0) && (wb->wb_error != 0))
+        rc = wb->wb_error;
+    wb->wb_error = 0;
+    while (n-- > 0)
+        cmd_complete(RemHead(&wb->wb_updates), rc);
+}
+
+/* Have the unit write its cache for the CMD_UPDATE requests waiting */
+static void
+sd_wb_sync(struct scsipi_periph *periph)
+{
+    sd_writeback_t *wb = periph->periph_wb;
+    struct scsipi_xfer *xs;
+    struct Node *node;
+    uint n = 0;
+
+    if (wb->wb_nsync != 0)
+        return;  // sd_wb_sync_complete() issues the next one
+    for (node = wb->wb_updates.lh_Head; node->ln_Succ != NULL;
+         node = node->ln_Succ)
+        n++;
+    if (n == 0)
+        return;
+    if (!sd_sync_needed(periph)) {
+        sd_wb_updated(wb, n, 0);
+        return;
+    }
+
+    xs = sd_sync_xs(periph, sd_wb_sync_complete);
+    if (__predict_false(xs == NULL)) {
+        sd_wb_updated(wb, n, TDERR_NoMem);
+        return;
+    }
+    wb->wb_nsync = n;
+    wb->wb_syncs++;
+    (void) scsipi_execute_xs(xs);
+}
+
+/* Called when the write-back buffer has been written */
+static void
+sd_wb_complete(struct scsipi_xfer *xs)
+{
+    struct scsipi_periph *periph = xs->xs_periph;
+    sd_writeback_t *wb = periph->periph_wb;
+    int rc = translate_xs_error(xs);
+
+    if (rc != 0) {
+        printf("sd%d.%d write-back of %u blocks failed %d\n",
+               periph->periph_target, periph->periph_lun,
+               wb->wb_nblks, rc);
+        wb->wb_error = rc;  // The blocks are lost
+    }
+    wb->wb_flushing = 0;
+    wb->wb_nblks = 0;
+    sd_wb_sync(periph);
+}
+
+static void
+sd_wb_sync_complete(struct scsipi_xfer *xs)
+{
+    struct scsipi_periph *periph = xs->xs_periph;
+    sd_writeback_t *wb = periph->periph_wb;
+    int rc = sd_sync_error(xs);
+    uint n = wb->wb_nsync;
+
+    wb->wb_nsync = 0;
+    sd_wb_updated(wb, n, rc);
+
+    /* CMD_UPDATE requests which came in meanwhile */
+    if (IsListEmpty(&wb->wb_updates))
+        return;
+    if (wb->wb_nblks != 0)
+        sd_writeback_flush(periph);  // sd_wb_complete() syncs
+    else
+        sd_wb_sync(periph);
+}
+
+/*
+ * sd_wb_rw
+ * --------
+ * Returns non-zero if the read or write was completed from or into the
+ * write-back buffer, or failed as the buffer couldn't be written ahead of
+ * it. Otherwise it may need an ordered tag in *tag.
+ */
+static int
+sd_wb_rw(struct scsipi_periph *periph, sd_writeback_t *wb, uint64_t blkno,
+         uint b_flags, void *buf, uint buflen, void *ior, int *tag)
+{
+    uint32_t blkshift = periph->periph_blkshift;
+    uint32_t nblks = buflen >> blkshift;
+    uint64_t end = wb->wb_blkno + wb->wb_nblks;
+    int      whole = ((nblks << blkshift) == buflen);
+
+    if (b_flags & B_READ) {
+        if (whole && (wb->wb_nblks != 0) &&
+            (blkno >= wb->wb_blkno) && (blkno + nblks <= end)) {
+            CopyMem(wb->wb_buf + ((blkno - wb->wb_blkno) << blkshift),
+                    buf, buflen);
+            wb->wb_hits++;
+            cmd_complete(ior, 0);
+            return (1);
+        }
+    } else if (whole && !wb->wb_flushing && (buflen <= wb->wb_buflen / 4) &&
+               ((wb->wb_nblks == 0) ||
+                ((blkno >= wb->wb_blkno) && (blkno <= end) &&
+                 ((blkno + nblks - wb->wb_blkno) << blkshift <=
+                  wb->wb_buflen)))) {
+        if (wb->wb_nblks == 0) {
+            wb->wb_blkno = blkno;
+            callout_reset(&wb->wb_callout,
+                          sd_wb_age_ms * TICKS_PER_SECOND / 1000,
+                          sd_wb_timeout, periph);
+        }
+        CopyMem(buf, wb->wb_buf + ((blkno - wb->wb_blkno) << blkshift),
+                buflen);
+        if (blkno + nblks > wb->wb_blkno + wb->wb_nblks)
+            wb->wb_nblks = blkno + nblks - wb->wb_blkno;
+        wb->wb_writes++;
+        sd_ra_write(periph->periph_ra, blkno, nblks);
+        cmd_complete(ior, 0);
+        if ((wb->wb_nblks << blkshift) == wb->wb_buflen)
+            sd_writeback_flush(periph);
+        return (1);
+    }
+
+    if (!whole)
+        nblks++;
+    if (sd_wb_overlaps(wb, blkno, nblks)) {
+        /* The unit must have the blocks in the buffer first */
+        sd_writeback_flush(periph);
+        if (!wb->wb_flushing && (wb->wb_nblks != 0)) {
+            /* Not issued; the retry would write over this request */
+            cmd_complete(ior, TDERR_NoMem);
+            return (1);
+        }
+        *tag = XS_CTL_ORDERED_TAG;
+    }
+    return (0);
+}
+
+void
+sd_writeback_init(struct scsipi_periph *periph)
+{
+    sd_writeback_t *wb;
+    uint buflen = (sd_wb_kb * 1024) & ~((1 << periph->periph_blkshift) - 1);
+
+    if ((buflen >> periph->periph_blkshift) < 4)
+        return;
+
+    wb = AllocMem(sizeof (*wb), MEMF_PUBLIC | MEMF_CLEAR);
+    if (wb == NULL)
+        return;
+    wb->wb_buf = AllocMem(buflen, MEMF_PUBLIC);
+    if (wb->wb_buf == NULL) {
+        FreeMem(wb, sizeof (*wb));
+        return;
+    }
+    wb->wb_buflen = buflen;
+    NewList(&wb->wb_updates);
+    callout_init(&wb->wb_callout, 0);
+    periph->periph_wb = wb;
+}
+
+/* Non-zero while the buffer holds blocks the unit doesn't have yet */
+int
+sd_writeback_dirty(struct scsipi_periph *periph)
+{
+    sd_writeback_t *wb = periph->periph_wb;
+
+    return ((wb != NULL) && (wb->wb_nblks != 0));
+}
+
+/*
+ * The buffer must have been flushed (sd_writeback_flush()) until
+ * sd_writeback_dirty() returns zero. CMD_UPDATE requests still waiting
+ * are aborted.
+ */
+void
+sd_writeback_free(struct scsipi_periph *periph)
+{
+    sd_writeback_t *wb = periph->periph_wb;
+    struct Node *node;
+
+    if (wb == NULL)
+        return;
+    callout_stop(&wb->wb_callout);
+    while ((node = RemHead(&wb->wb_updates)) != NULL)
+        cmd_complete(node, IOERR_ABORTED);
+    periph->periph_wb = NULL;
+    FreeMem(wb->wb_buf, wb->wb_buflen);
+    FreeMem(wb, sizeof (*wb));
+}
+
+/*
+ * sd_update
+ * ---------
+ * CMD_UPDATE: write what the write-back buffer holds, then have the unit
+ * write its own cache, unless its write cache is known to be off.
+ */
+int
+sd_update(void *periph_p, void *ior)
+{
+    struct scsipi_periph *periph = periph_p;
+    sd_writeback_t *wb = periph->periph_wb;
+    struct scsipi_xfer *xs;
+
+    if (wb == NULL) {
+        if (!sd_sync_needed(periph)) {
+            cmd_complete(ior, 0);
+            return (0);
+        }
+        xs = sd_sync_xs(periph, sd_sync_complete);
+        if (__predict_false(xs == NULL))
+            return (TDERR_NoMem);
+        xs->amiga_ior = ior;
+        return (scsipi_execute_xs(xs));
+    }
+    AddTail(&wb->wb_updates, (struct Node *) ior);
+    if (wb->wb_nblks != 0)
+        sd_writeback_flush(periph);  // sd_wb_complete() syncs
+    else
+        sd_wb_sync(periph);
+    return (0);
+}
+
+/*
+ * sd_readwrite
+ * ------------
+ * Initiate a read or write operation on the specified SCSI device.
+ * b_flags includes B_READ when the operation is a read from the SCSI
+ * device to computer RAM.
+ */
+int
+sd_readwrite(void *periph_p, uint64_t blkno, uint b_flags, void *buf,
+             uint buflen, void *ior)
+{
+    struct scsipi_periph *periph = periph_p;
+    sd_readahead_t *ra = periph->periph_ra;
+    uint32_t blkshift = periph->periph_blkshift;
+    int tag = XS_CTL_SIMPLE_TAG;
+    int rc;
+
+    if ((periph->periph_wb != NULL) &&
+        sd_wb_rw(periph, periph->periph_wb, blkno, b_flags, buf, buflen,
+                 ior, &tag))
+        return (0);
+
+    if (ra == NULL)
+        return (sd_rw_issue(periph, blkno, b_flags, buf, buflen, ior, tag));
+
+    if (b_flags & B_READ) {
+        if (sd_ra_read(periph, ra, blkno, buf, buflen, ior))
+            return (0);
+        rc = sd_rw_issue(periph, blkno, b_flags, buf, buflen, ior, tag);
+        if (rc == 0)
+            sd_ra_fill(periph, ra);
+        return (rc);
+    }
+
+    sd_ra_write(ra, blkno, (buflen + (1 << blkshift) - 1) >> blkshift);
+    ra->ra_writes++;  // sd_complete() counts it down
+    rc = sd_rw_issue(periph, blkno, b_flags, buf, buflen, ior, tag);
+    if (rc != 0)
+        ra->ra_writes--;
+    return (rc);
+}
+
 #ifdef ENABLE_SEEK
 /* Seek is implemented but untested code */
 int
@@ -569,6 +1207,554 @@ sd_get_protstatus(void *periph_p, ULONG *status)
     }
 }
 
+/* Read mode page 8, noting its WCE and RCD bits in periph_caching */
+static int
+sd_cache_page(struct scsipi_periph *periph, scsi_mode_sense_t *modepage)
+{
+    int rc;
+
+    rc = scsipi_mode_sense(periph, SMS_DBD, 8, &modepage->hdr,
+                           sizeof (modepage->hdr) +
+                           sizeof (modepage->pg.caching_params),
+                           XS_CTL_SIMPLE_TAG | XS_CTL_DATA_IN, 0, 2000);
+    if (rc != 0)
+        return (rc);
+    if ((modepage->hdr.blk_desc_len != 0) ||
+        ((modepage->pg.caching_params.pg_code & SMS_PAGE_MASK) != 8))
+        return (HFERR_BadStatus);  // Not the page asked for
+    periph->periph_caching = SD_CACHE_READ |
+                             (modepage->pg.caching_params.flags &
+                              (CACHING_WCE | CACHING_RCD));
+    return (0);
+}
+
+/*
+ * sd_getcache
+ * -----------
+ * Get the drive's cache enables (CACHING_WCE, CACHING_RCD)
+ */
+int
+sd_getcache(void *periph_p, ULONG *caching)
+{
+    struct scsipi_periph *periph = periph_p;
+    scsi_mode_sense_t     modepage;
+    int                   rc;
+
+    rc = sd_cache_page(periph, &modepage);
+    *caching = periph->periph_caching & (CACHING_WCE | CACHING_RCD);
+    return (rc);
+}
+
+/*
+ * sd_setcache
+ * -----------
+ * Set the drive's cache enables in mask to those in caching (HDCC_WCE and
+ * HDCC_RCD are the mode page 8 bits). The drive writes its cache before
+ * its write cache is turned off.
+ */
+int
+sd_setcache(void *periph_p, uint caching, uint mask)
+{
+    struct scsipi_periph *periph = periph_p;
+    struct scsi_synchronize_cache_10 cmd;
+    scsi_mode_sense_t     modepage;
+    uint8_t              *flags = &modepage.pg.caching_params.flags;
+    int                   rc;
+
+    mask &= CACHING_WCE | CACHING_RCD;
+    if ((rc = sd_cache_page(periph, &modepage)) != 0)
+        return (rc);
+    if (((*flags ^ caching) & mask) == 0)
+        return (0);
+
+    if ((*flags & CACHING_WCE) && (mask & CACHING_WCE) &&
+        !(caching & CACHING_WCE) && sd_sync_needed(periph)) {
+        memset(&cmd, 0, sizeof (cmd));
+        cmd.opcode = SCSI_SYNCHRONIZE_CACHE_10;
+        rc = scsipi_command(periph, (struct scsipi_generic *) &cmd,
+                            sizeof (cmd), NULL, 0, SDRETRIES,
+                            SD_SYNC_TIMEOUT, NULL, XS_CTL_SIMPLE_TAG);
+        if (rc != 0)
+            return (rc);
+    }
+
+    /* MODE SELECT takes no mode data length, WP or PS bits */
+    modepage.hdr.data_length = 0;
+    modepage.hdr.dev_spec = 0;
+    modepage.pg.caching_params.pg_code &= SMS_PAGE_MASK;
+    *flags = (*flags & ~mask) | (caching & mask);
+    rc = scsipi_mode_select(periph, SMS_PF, &modepage.hdr,
+                            sizeof (modepage.hdr) + 2 +
+                            MIN(modepage.pg.caching_params.pg_length,
+                                sizeof (modepage.pg.caching_params) - 2),
+                            XS_CTL_SIMPLE_TAG, 0, 5000);
+    if (rc == 0)
+        periph->periph_caching = SD_CACHE_READ |
+                                 (*flags & (CACHING_WCE | CACHING_RCD));
+    return (rc);
+}
+
+/* Read an INQUIRY vital product data page */
+static int
+sd_vpd(struct scsipi_periph *periph, uint8_t page, void *buf, uint len)
+{
+    struct scsipi_inquiry cmd;
+
+    memset(buf, 0, len);
+    memset(&cmd, 0, sizeof (cmd));
+    cmd.opcode = INQUIRY;
+    cmd.byte2 = SINQ_EVPD;
+    cmd.unused[0] = page;
+    cmd.length = len;
+    return (scsipi_command(periph, (struct scsipi_generic *) &cmd,
+                           sizeof (cmd), buf, len, 0, 2000, NULL,
+                           XS_CTL_SIMPLE_TAG | XS_CTL_DATA_IN));
+}
+
+/*
+ * sd_unmap_probe
+ * --------------
+ * Learn from the Block Limits and Logical Block Provisioning VPD pages
+ * whether and how the unit discards blocks, and in what units, and how
+ * many blocks a WRITE SAME may write. Called by sd_probe(), so only at
+ * the first open of a unit with fixed media; later opens take the
+ * result from sd_probed[][], including an UNMAP the unit has rejected.
+ */
+static void
+sd_unmap_probe(struct scsipi_periph *periph)
+{
+    struct scsi_vpd_block_limits bl;
+    struct scsi_vpd_provisioning lbp;
+    uint8_t  pages[32];
+    int      have_bl = 0;
+    int      have_lbp = 0;
+    uint32_t align;
+    uint     i;
+
+    periph->periph_unmap = SD_UNMAP_NONE;
+    if (sd_vpd(periph, SINQ_VPD_SUPPORTED, pages, sizeof (pages)) != 0)
+        return;
+    for (i = 4; i < MIN(4 + pages[3], sizeof (pages)); i++) {
+        if (pages[i] == SINQ_VPD_BLOCK_LIMITS)
+            have_bl = 1;
+        else if (pages[i] == SINQ_VPD_PROVISIONING)
+            have_lbp = 1;
+    }
+    if (!have_bl || (sd_vpd(periph, SINQ_VPD_BLOCK_LIMITS, &bl,
+                            sizeof (bl)) != 0))
+        return;
+    periph->periph_ws_max = MIN(_8btol(bl.max_write_same_len), 0xffffffff);
+    if (have_lbp &&
+        (sd_vpd(periph, SINQ_VPD_PROVISIONING, &lbp, sizeof (lbp)) != 0))
+        have_lbp = 0;
+
+    /* Without the provisioning page, a maximum UNMAP count says enough */
+    if (have_lbp ? (lbp.flags & VPD_LBPU) :
+                   (_4btol(bl.max_unmap_lba_cnt) != 0)) {
+        periph->periph_unmap = SD_UNMAP_UNMAP;
+        periph->periph_unmap_max = _4btol(bl.max_unmap_lba_cnt);
+        periph->periph_unmap_descs = MIN(_4btol(bl.max_unmap_desc_cnt),
+                                         SD_UNMAP_DESCS);
+    } else if (have_lbp && (lbp.flags & VPD_LBPWS)) {
+        periph->periph_unmap = SD_UNMAP_WS16;
+        periph->periph_unmap_max = MIN(_8btol(bl.max_write_same_len),
+                                       0xffffffff);
+        periph->periph_unmap_descs = 1;
+    } else {
+        return;
+    }
+    if (periph->periph_unmap_max == 0)
+        periph->periph_unmap_max = 0xffffffff;  // No limit
+    if (periph->periph_unmap_descs == 0)
+        periph->periph_unmap_descs = 1;
+    periph->periph_unmap_gran = MAX(_4btol(bl.opt_unmap_gran), 1);
+    align = _4btol(bl.unmap_gran_align);
+    periph->periph_unmap_align = (align & VPD_UGAVALID) ?
+                                 (align & ~VPD_UGAVALID) %
+                                 periph->periph_unmap_gran : 0;
+}
+
+/*
+ * What sd_probe() learned of each target and LUN. Units are opened once
+ * per filesystem and tool, so only the first open asks the unit. Units
+ * with removable media are not kept, as the next medium may differ.
+ */
+typedef struct sd_probed {
+    uint8_t  sp_valid;        // Non-zero once the unit has been probed
+    uint8_t  sp_caching;      // periph_caching
+    uint8_t  sp_unmap;        // periph_unmap and the limits which go with it
+    uint16_t sp_unmap_descs;
+    uint32_t sp_unmap_max;
+    uint32_t sp_unmap_gran;
+    uint32_t sp_unmap_align;
+    uint32_t sp_ws_max;
+} sd_probed_t;
+
+static sd_probed_t sd_probed[8][8];  // [target][lun]
+
+/*
+ * sd_probe
+ * --------
+ * Read the cache mode page and VPD pages of a direct access unit at its
+ * first open, or at every open if its media are removable, turning its
+ * write cache on if TDF_WRITE_CACHE is in flags. Later opens take what
+ * was kept by sd_probe_save().
+ */
+void
+sd_probe(struct scsipi_periph *periph, uint flags)
+{
+    sd_probed_t *sp = &sd_probed[periph->periph_target][periph->periph_lun];
+    ULONG caching;
+
+    if (periph->periph_type != T_DIRECT)
+        return;
+    if (!sp->sp_valid || (periph->periph_flags & PERIPH_REMOVABLE)) {
+        if (flags & TDF_WRITE_CACHE)
+            (void) sd_setcache(periph, HDCC_WCE, HDCC_WCE);
+        else
+            (void) sd_getcache(periph, &caching);
+        sd_unmap_probe(periph);
+        sd_probe_save(periph);
+        return;
+    }
+    periph->periph_caching     = sp->sp_caching;
+    periph->periph_unmap       = sp->sp_unmap;
+    periph->periph_unmap_descs = sp->sp_unmap_descs;
+    periph->periph_unmap_max   = sp->sp_unmap_max;
+    periph->periph_unmap_gran  = sp->sp_unmap_gran;
+    periph->periph_unmap_align = sp->sp_unmap_align;
+    periph->periph_ws_max      = sp->sp_ws_max;
+    if ((flags & TDF_WRITE_CACHE) &&
+        ((periph->periph_caching & (SD_CACHE_READ | CACHING_WCE)) !=
+         (SD_CACHE_READ | CACHING_WCE)))
+        (void) sd_setcache(periph, HDCC_WCE, HDCC_WCE);
+}
+
+/* Keep what is known of the unit for its next open, as at its close */
+void
+sd_probe_save(struct scsipi_periph *periph)
+{
+    sd_probed_t *sp = &sd_probed[periph->periph_target][periph->periph_lun];
+
+    if (periph->periph_type != T_DIRECT)
+        return;
+    if (periph->periph_flags & PERIPH_REMOVABLE) {
+        sp->sp_valid = 0;
+        return;
+    }
+    sp->sp_caching     = periph->periph_caching;
+    sp->sp_unmap       = periph->periph_unmap;
+    sp->sp_unmap_descs = periph->periph_unmap_descs;
+    sp->sp_unmap_max   = periph->periph_unmap_max;
+    sp->sp_unmap_gran  = periph->periph_unmap_gran;
+    sp->sp_unmap_align = periph->periph_unmap_align;
+    sp->sp_ws_max      = periph->periph_ws_max;
+    sp->sp_valid       = 1;
+}
+
+/* The unit didn't answer; probe whatever answers there next time */
+void
+sd_probe_forget(uint target, uint lun)
+{
+    sd_probed[target % 8][lun % 8].sp_valid = 0;
+}
+
+/*
+ * HD_UNMAP
+ * --------
+ * Each command discards as much of the ranges as the unit takes in one,
+ * ordered after what was issued before it, and the next is issued when
+ * it completes. Write-back blocks in the ranges are written first.
+ */
+typedef struct {
+    struct IOStdReq             *su_ior;
+    const struct hd_unmap_range *su_next;   // Next range to discard
+    uint      su_left;                      // Ranges from it on
+    uint64_t  su_blkno;                     // Next block of this range
+    uint64_t  su_end;                       // Block after this range
+    uint32_t  su_nblks;                     // Blocks in the command issued
+    uint      su_buflen;
+    uint8_t  *su_buf;                       // Parameter list or zero block
+} sd_unmap_t;
+
+static void sd_unmap_complete(struct scsipi_xfer *xs);
+
+/* Move to the next range which holds a whole unit of granularity */
+static int
+sd_unmap_range(struct scsipi_periph *periph, sd_unmap_t *su)
+{
+    const struct hd_unmap_range *range;
+    uint32_t gran = periph->periph_unmap_gran;
+    uint32_t align = periph->periph_unmap_align;
+    uint32_t cut;
+
+    while (su->su_blkno >= su->su_end) {
+        if (su->su_left == 0)
+            return (0);
+        range = su->su_next++;
+        su->su_left--;
+        su->su_blkno = ((uint64_t) range->hur_blkhi << 32) | range->hur_blklo;
+        su->su_end = su->su_blkno + range->hur_nblks;
+        su->su_blkno += (align + gran - su->su_blkno % gran) % gran;
+        cut = (su->su_end % gran + gran - align) % gran;
+        su->su_end = (su->su_end > cut) ? su->su_end - cut : 0;
+    }
+    return (1);
+}
+
+static void
+sd_unmap_free(sd_unmap_t *su)
+{
+    FreeMem(su->su_buf, su->su_buflen);
+    FreeMem(su, sizeof (*su));
+}
+
+/* Issue the next command, or complete the request */
+static void
+sd_unmap_next(struct scsipi_periph *periph, sd_unmap_t *su)
+{
+    struct scsi_unmap_data *ud = (struct scsi_unmap_data *) su->su_buf;
+    struct scsi_write_same_16 ws;
+    struct scsi_unmap cmd;
+    struct scsipi_generic *cmdp;
+    struct scsipi_xfer *xs;
+    uint32_t nblks;
+    uint     cmdlen;
+    uint     len;
+    uint     n = 0;
+    int      overlap = 0;
+
+    su->su_nblks = 0;
+    while ((n < periph->periph_unmap_descs) &&
+           (su->su_nblks < periph->periph_unmap_max) &&
+           sd_unmap_range(periph, su)) {
+        nblks = MIN(su->su_end - su->su_blkno,
+                    periph->periph_unmap_max - su->su_nblks);
+        overlap |= sd_wb_overlaps(periph->periph_wb, su->su_blkno, nblks);
+        if (periph->periph_unmap == SD_UNMAP_WS16) {
+            memset(&ws, 0, sizeof (ws));
+            ws.opcode = SCSI_WRITE_SAME_16;
+            ws.flags = SWS_UNMAP;
+            _lto8b(su->su_blkno, ws.addr);
+            _lto4b(nblks, ws.length);
+        } else {
+            _lto8b(su->su_blkno, ud->desc[n].addr);
+            _lto4b(nblks, ud->desc[n].nblks);
+            memset(ud->desc[n].reserved, 0, sizeof (ud->desc[n].reserved));
+        }
+        su->su_blkno += nblks;
+        su->su_nblks += nblks;
+        n++;
+    }
+    if (n == 0) {
+        cmd_complete(su->su_ior, 0);
+        sd_unmap_free(su);
+        return;
+    }
+
+    if (periph->periph_unmap == SD_UNMAP_WS16) {
+        cmdp = (struct scsipi_generic *) &ws;
+        cmdlen = sizeof (ws);
+        len = su->su_buflen;  // One block of zeros
+    } else {
+        len = sizeof (*ud) + (n - 1) * sizeof (ud->desc[0]);
+        _lto2b(len - 2, ud->length);
+        _lto2b(n * sizeof (ud->desc[0]), ud->desc_length);
+        memset(ud->reserved, 0, sizeof (ud->reserved));
+        memset(&cmd, 0, sizeof (cmd));
+        cmd.opcode = SCSI_UNMAP;
+        _lto2b(len, cmd.length);
+        cmdp = (struct scsipi_generic *) &cmd;
+        cmdlen = sizeof (cmd);
+    }
+    if (overlap) {
+        /* The ordered tag keeps the discard after the write */
+        sd_writeback_flush(periph);
+        if ((periph->periph_wb->wb_nblks != 0) &&
+            !periph->periph_wb->wb_flushing) {
+            cmd_complete(su->su_ior, TDERR_NoMem);
+            sd_unmap_free(su);
+            return;
+        }
+    }
+    if (periph->periph_ra != NULL) {
+        sd_ra_drop(periph->periph_ra);
+        periph->periph_ra->ra_writes++;  // No read-ahead until it completes
+    }
+
+    xs = scsipi_make_xs_locked(periph, cmdp, cmdlen, su->su_buf, len,
+                               SDRETRIES, SD_UNMAP_TIMEOUT, NULL,
+                               XS_CTL_ASYNC | XS_CTL_ORDERED_TAG |
+                               XS_CTL_DATA_OUT);
+    if (__predict_false(xs == NULL)) {
+        if (periph->periph_ra != NULL)
+            periph->periph_ra->ra_writes--;
+        cmd_complete(su->su_ior, TDERR_NoMem);
+        sd_unmap_free(su);
+        return;
+    }
+    xs->amiga_ior = su->su_ior;
+    xs->xs_callback_arg = su;
+    xs->xs_done_callback = sd_unmap_complete;
+    (void) scsipi_execute_xs(xs);
+}
+
+static void
+sd_unmap_complete(struct scsipi_xfer *xs)
+{
+    struct scsipi_periph *periph = xs->xs_periph;
+    sd_unmap_t *su = xs->xs_callback_arg;
+    int rc = translate_xs_error(xs);
+
+    if (periph->periph_ra != NULL)
+        periph->periph_ra->ra_writes--;
+    if (rc != 0) {
+        if ((xs->error == XS_SENSE) &&
+            (SSD_SENSE_KEY(xs->sense.scsi_sense.flags) ==
+             SKEY_ILLEGAL_REQUEST) && (su->su_ior->io_Actual == 0)) {
+            /* The VPD pages promised more than the unit does */
+            periph->periph_unmap = SD_UNMAP_NONE;
+            rc = IOERR_NOCMD;
+        }
+        cmd_complete(su->su_ior, rc);
+        sd_unmap_free(su);
+        return;
+    }
+    su->su_ior->io_Actual += su->su_nblks;
+    sd_unmap_next(periph, su);
+}
+
+/*
+ * sd_unmap
+ * --------
+ * Discard the nranges block ranges at ranges (struct hd_unmap_range)
+ */
+int
+sd_unmap(void *periph_p, void *ranges, uint nranges, void *ior)
+{
+    struct scsipi_periph *periph = periph_p;
+    sd_unmap_t *su;
+
+    if (periph->periph_unmap == SD_UNMAP_NONE)
+        return (IOERR_NOCMD);
+
+    su = AllocMem(sizeof (*su), MEMF_PUBLIC | MEMF_CLEAR);
+    if (__predict_false(su == NULL))
+        return (TDERR_NoMem);
+    if (periph->periph_unmap == SD_UNMAP_WS16)
+        su->su_buflen = 1 << periph->periph_blkshift;
+    else
+        su->su_buflen = sizeof (struct scsi_unmap_data) +
+                        (periph->periph_unmap_descs - 1) *
+                        sizeof (struct scsi_unmap_desc);
+    su->su_buf = AllocMem(su->su_buflen, MEMF_PUBLIC | MEMF_CLEAR);
+    if (__predict_false(su->su_buf == NULL)) {
+        FreeMem(su, sizeof (*su));
+        return (TDERR_NoMem);
+    }
+    su->su_ior = ior;
+    su->su_ior->io_Actual = 0;
+    su->su_next = ranges;
+    su->su_left = nranges;
+    sd_unmap_next(periph, su);
+    return (0);
+}
+
+/*
+ * TD_FORMAT
+ * ---------
+ * Formatting writes the same pattern to every block, so a buffer which
+ * is one block repeated is written by a single WRITE SAME, and only that
+ * block crosses the Zorro and SCSI buses. Other buffers, short ones,
+ * ones overlapping the write-back buffer and units which reject WRITE
+ * SAME take the CMD_WRITE path.
+ */
+#define SD_FORMAT_MIN   8       // Fewest blocks worth a WRITE SAME
+#define SD_WS_MAX       0xffff  // Most blocks if the unit doesn't say
+
+static void
+sd_format_complete(struct scsipi_xfer *xs)
+{
+    struct scsipi_periph *periph = xs->xs_periph;
+    struct IOStdReq *ior = xs->amiga_ior;
+    uint64_t blkno;
+    int rc = translate_xs_error(xs);
+
+    if (periph->periph_ra != NULL)
+        periph->periph_ra->ra_writes--;
+    if ((xs->error == XS_SENSE) &&
+        (SSD_SENSE_KEY(xs->sense.scsi_sense.flags) == SKEY_ILLEGAL_REQUEST)) {
+        /* Nothing was written: write it all after all */
+        periph->periph_quirks |= PQUIRK_NOWRITESAME;
+        if (xs->cmd->opcode == SCSI_WRITE_SAME_10)
+            blkno = _4btol(((struct scsi_write_same_10 *) xs->cmd)->addr);
+        else
+            blkno = _8btol(((struct scsi_write_same_16 *) xs->cmd)->addr);
+        rc = sd_readwrite(periph, blkno, B_WRITE, ior->io_Data,
+                          ior->io_Length, ior);
+        if (rc == 0)
+            return;
+        ior->io_Actual = 0;
+    }
+    cmd_complete(ior, rc);
+}
+
+/*
+ * sd_format
+ * ---------
+ * Write buflen bytes of format data at blkno
+ */
+int
+sd_format(void *periph_p, uint64_t blkno, void *buf, uint buflen, void *ior)
+{
+    struct scsipi_periph *periph = periph_p;
+    uint32_t blkshift = periph->periph_blkshift;
+    uint32_t blksize = 1 << blkshift;
+    uint32_t nblks = buflen >> blkshift;
+    uint32_t max = periph->periph_ws_max ? periph->periph_ws_max : SD_WS_MAX;
+    struct scsi_write_same_10 ws10;
+    struct scsi_write_same_16 ws16;
+    struct scsipi_generic *cmdp;
+    struct scsipi_xfer *xs;
+    int cmdlen;
+
+    if ((periph->periph_quirks & PQUIRK_NOWRITESAME) ||
+        (nblks < SD_FORMAT_MIN) || (nblks > max) ||
+        ((nblks << blkshift) != buflen) ||
+        sd_wb_overlaps(periph->periph_wb, blkno, nblks) ||
+        (memcmp(buf, (uint8_t *) buf + blksize, buflen - blksize) != 0))
+        return (sd_readwrite(periph, blkno, B_WRITE, buf, buflen, ior));
+
+    if ((blkno + nblks <= 0x100000000ULL) && (nblks <= 0xffff)) {
+        memset(&ws10, 0, sizeof (ws10));
+        ws10.opcode = SCSI_WRITE_SAME_10;
+        _lto4b(blkno, ws10.addr);
+        _lto2b(nblks, ws10.length);
+        cmdp = (struct scsipi_generic *) &ws10;
+        cmdlen = sizeof (ws10);
+    } else {
+        memset(&ws16, 0, sizeof (ws16));
+        ws16.opcode = SCSI_WRITE_SAME_16;
+        _lto8b(blkno, ws16.addr);
+        _lto4b(nblks, ws16.length);
+        cmdp = (struct scsipi_generic *) &ws16;
+        cmdlen = sizeof (ws16);
+    }
+    xs = scsipi_make_xs_locked(periph, cmdp, cmdlen, buf, blksize,
+                               SDRETRIES, SD_FORMAT_TIMEOUT, NULL,
+                               XS_CTL_ASYNC | XS_CTL_SIMPLE_TAG |
+                               XS_CTL_DATA_OUT);
+    if (__predict_false(xs == NULL))
+        return (TDERR_NoMem);
+    if (periph->periph_ra != NULL) {
+        sd_ra_write(periph->periph_ra, blkno, nblks);
+        periph->periph_ra->ra_writes++;  // sd_format_complete() counts it
+    }
+    xs->amiga_ior = ior;
+    xs->xs_done_callback = sd_format_complete;
+    return (scsipi_execute_xs(xs));
+}
+
 /*
  * sd_startstop
  * ------------
@@ -817,11 +2003,11 @@ geom_done_get_capacity(struct scsipi_xfer *xs)
          * the Amiga struct specifies, so they must be swapped (below).
          * Also, SCSI READ_CAPACITY_10 reports the highest sector number,
          * and the dg_TotalSectors is the count of sectors, so need to
-         * add 1 there.
+         * add 1 there. The values are big-endian as sent by the drive.
          */
         struct DriveGeometry *geom = xs->xs_callback_arg;
-        uint32_t blksize = geom->dg_TotalSectors;
-        geom->dg_TotalSectors = geom->dg_SectorSize + 1;
+        uint32_t blksize = _4btol((uint8_t *) &geom->dg_TotalSectors);
+        geom->dg_TotalSectors = _4btol((uint8_t *) &geom->dg_SectorSize) + 1;
         geom->dg_SectorSize = blksize;
         conv_sectors_to_chs(geom->dg_TotalSectors, &geom->dg_Cylinders,
                             &geom->dg_Heads, &geom->dg_TrackSectors);
@@ -961,6 +2147,11 @@ sd_scsidirect(void *periph_p, void *scmd_p, void *ior)
     xs->amiga_ior = ior;
     xs->xs_callback_arg = scmd;
     xs->xs_done_callback = scsidirect_complete;
+    if (periph->periph_ra != NULL) {
+        /* It may write anything */
+        sd_ra_drop(periph->periph_ra);
+        periph->periph_ra->ra_writes++;
+    }
 #if 0
     printf("sdirect%d.%d %p issue\n",
            xs->xs_periph->periph_target, xs->xs_periph->periph_lun, xs);
@@ -1000,6 +2191,9 @@ sd_complete(struct scsipi_xfer *xs)
 #endif
     }
 #endif
+    if ((xs->xs_control & XS_CTL_DATA_OUT) &&
+        (xs->xs_periph->periph_ra != NULL))
+        xs->xs_periph->periph_ra->ra_writes--;
     cmd_complete(xs->amiga_ior, rc);
 }
 
@@ -1100,5 +2294,7 @@ scsidirect_complete(struct scsipi_xfer *xs)
             scmd->scsi_SenseActual = len;
         }
     }
+    if (xs->xs_periph->periph_ra != NULL)
+        xs->xs_periph->periph_ra->ra_writes--;
     cmd_complete(xs->amiga_ior, rc);
 }
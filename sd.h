@@ -1,12 +1,86 @@
 #ifndef _SD_H
 #define _SD_H
 
+/*
+ * Sequential read-ahead of a unit opened with TDF_READ_AHEAD
+ */
+#define SD_RA_WAITERS 4  // Reads which may wait for a read-ahead
+
+typedef struct sd_readahead {
+    char     *ra_buf;        // Blocks read ahead
+    uint      ra_buflen;     // Size of ra_buf in bytes
+    uint64_t  ra_blkno;      // First block in ra_buf
+    uint32_t  ra_nblks;      // Blocks in ra_buf, or being read into it
+    uint8_t   ra_state;      // SD_RA_EMPTY, SD_RA_READING or SD_RA_VALID
+    uint8_t   ra_stale;      // Dropped while being read
+    uint8_t   ra_seq;        // Reads in a row starting where the last ended
+    uint8_t   ra_nwait;      // Entries used in ra_wait[]
+    uint      ra_changenum;  // periph_changenum of the blocks in ra_buf
+    uint      ra_writes;     // Writes and SCSI direct commands in progress
+    uint64_t  ra_next;       // Block after the last read
+    struct sd_ra_wait {
+        void     *ior;
+        void     *buf;
+        uint64_t  blkno;
+        uint      buflen;
+    } ra_wait[SD_RA_WAITERS];  // Reads waiting for ra_buf to be read
+    uint      ra_hits;       // Reads of a stream copied from ra_buf
+    uint      ra_misses;     // Reads of a stream which went to the target
+    uint      ra_reads;      // Read-aheads issued
+    uint      ra_dropped;    // Read-aheads dropped before being read
+} sd_readahead_t;
+
+#define SD_RA_EMPTY   0
+#define SD_RA_READING 1
+#define SD_RA_VALID   2
+
+extern uint sd_ra_budget_kb;
+
+/*
+ * Write-back of small writes to a unit opened with TDF_WRITE_BACK
+ */
+typedef struct sd_writeback {
+    char     *wb_buf;        // Blocks written but not yet sent to the unit
+    uint      wb_buflen;     // Size of wb_buf in bytes
+    uint64_t  wb_blkno;      // First block in wb_buf
+    uint32_t  wb_nblks;      // Blocks in wb_buf, 0 if clean
+    uint8_t   wb_flushing;   // wb_buf is being written to the unit
+    int8_t    wb_error;      // Error of a flush, for the next CMD_UPDATE
+    uint      wb_nsync;      // Entries of wb_updates the SYNC CACHE is for
+    struct List wb_updates;  // CMD_UPDATE requests waiting
+    callout_t wb_callout;    // Flushes wb_buf sd_wb_age_ms after it's dirty
+    uint      wb_writes;     // Writes copied into wb_buf
+    uint      wb_hits;       // Reads copied from wb_buf
+    uint      wb_flushes;    // WRITEs of wb_buf
+    uint      wb_blocks;     // Blocks in those
+    uint      wb_syncs;      // SYNCHRONIZE CACHE commands issued
+} sd_writeback_t;
+
+extern uint sd_wb_kb;
+extern uint sd_wb_age_ms;
+
+#define SD_CACHE_READ 0x80  // periph_caching holds mode page 8 WCE and RCD
+
+#define SD_UNMAP_NONE  0     // periph_unmap: the unit can't discard blocks
+#define SD_UNMAP_UNMAP 1     // UNMAP
+#define SD_UNMAP_WS16  2     // WRITE SAME (16) with UNMAP
+#define SD_UNMAP_DESCS 16    // Most ranges in an UNMAP parameter list
+
+
 int sd_readwrite(void *periph, uint64_t blkno, uint b_flags,
                  void *buf, uint buflen, void *ior);
 int sd_seek(void *periph_p, uint64_t blkno, void *ior);
 int sd_scsidirect(void *periph, void *cmd_p, void *ior);
 int sd_getgeometry(void *periph, void *buf, void *ior);
 int sd_get_protstatus(void *periph_p, ULONG *status);
+int sd_getcache(void *periph_p, ULONG *caching);
+int sd_setcache(void *periph_p, uint caching, uint mask);
+void sd_probe(struct scsipi_periph *periph, uint flags);
+void sd_probe_save(struct scsipi_periph *periph);
+void sd_probe_forget(uint target, uint lun);
+int sd_unmap(void *periph_p, void *ranges, uint nranges, void *ior);
+int sd_format(void *periph_p, uint64_t blkno, void *buf, uint buflen,
+              void *ior);
 int sd_startstop(void *periph_p, void *ior, int start, int load_eject,
                  int immed);
 int sd_testunitready(void *periph_p, void *ior);
@@ -16,5 +90,13 @@ uint32_t sd_blocksize(void *periph_p);
 
 void sd_media_unloaded(struct scsipi_periph *periph);
 void sd_media_loaded(struct scsipi_periph *periph);
+void sd_readahead_init(struct scsipi_periph *periph);
+int sd_readahead_busy(struct scsipi_periph *periph);
+void sd_readahead_free(struct scsipi_periph *periph);
+void sd_writeback_init(struct scsipi_periph *periph);
+void sd_writeback_flush(struct scsipi_periph *periph);
+int sd_writeback_dirty(struct scsipi_periph *periph);
+void sd_writeback_free(struct scsipi_periph *periph);
+int sd_update(void *periph_p, void *ior);
 
 #endif /* _SD_H */
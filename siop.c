@@ -118,7 +118,7 @@ __KERNEL_RCSID(0, "$NetBSD: siop.c,v 1.71 2022/04/07 19:33:37 andvar Exp $");
 #define SCSI_DATA_WAIT  500000  /* wait per data in/out step */
 #define SCSI_INIT_WAIT  500000  /* wait per step (both) during init */
 
-void siop_select(struct siop_softc *);
+void siop_select(struct siop_softc *, struct siop_acb *);
 void siopabort(struct siop_softc *, siop_regmap_p, const char *);
 void sioperror(struct siop_softc *, siop_regmap_p, u_char);
 void siopstart(struct siop_softc *);
@@ -131,10 +131,29 @@ void siop_sched(struct siop_softc *);
 void siop_poll(struct siop_softc *, struct siop_acb *);
 void siopintr(struct siop_softc *);
 void scsi_period_to_siop(struct siop_softc *, int);
-void siop_start(struct siop_softc *, int, int, u_char *, int, u_char *, int);
+void siop_start(struct siop_softc *, struct siop_acb *, int, int, u_char *,
+                int, u_char *, int);
 #ifdef DEBUG_SIOP
 void siop_dump_acb(struct siop_acb *);
 #endif
+static int siop_done_reap(struct siop_softc *, int);
+static void siop_sync_async(struct siop_softc *, int);
+static void siop_issued_insert(struct siop_softc *, struct siop_acb *, int);
+static void siop_issued_remove(struct siop_softc *, struct siop_acb *);
+static struct siop_acb *siop_dsa_acb(struct siop_softc *, u_int32_t);
+static struct siop_acb *siop_acb_alloc(struct siop_softc *, int);
+static void siop_acb_free(struct siop_softc *, int);
+static void siop_acb_push(struct siop_softc *, void *, u_long);
+static void siop_acb_grow(struct siop_softc *);
+static void siop_acb_shrink(void *);
+#ifdef PORT_AMIGA
+static int siop_dma_ok(const void *, u_long);
+static void *siop_dma_alloc(u_long);
+static void siop_bounce_init(struct siop_softc *);
+static void siop_bounce_get(struct siop_softc *, struct siop_acb *);
+static void siop_bounce_put(struct siop_softc *, struct siop_acb *);
+static void siop_bounce_done(struct siop_acb *);
+#endif
 
 /* 53C710 script */
 #include "siop_script.out"
@@ -148,6 +167,53 @@ u_char siop_allow_disc[8];
 #endif
 int siop_no_disc = 0;  // Disable Synchronous SCSI when this flag is set
 int siop_no_dma = 0;   // Disable 53C710 DMA when this flag is set
+int siop_no_resel_table = 0;  // Host handles every reselection when set
+int siop_no_disc_park = 0;    // Host handles every disconnect when set
+int siop_done_coalesce = 4;   // Completions per interrupt, 1 to 16
+int siop_done_usec = 0;       // Poll for completions this often, 0 never
+u_long siop_dma_mask = 0x7ffffffe;  // Addresses the 53C710 can DMA to
+int siop_poll_spin_usec = 500;  // siop_poll() watches the done ring this long
+
+/*
+ * The reselect table follows the SCRIPTS in the same allocation. It is
+ * aligned to 256 bytes, so SCRATCH1-3 hold its base and SCRATCH0 the
+ * offset of a target/LUN entry (see siop_script.ss). The mailbox ring
+ * follows the table, so it starts on a 256 byte boundary too, and the
+ * done ring follows the mailbox, on the next 256 byte boundary. Each
+ * mailbox slot has a cache line of its own: the host pushes the line of
+ * a slot it fills, which must not carry stale copies of slots SCRIPTS
+ * have freed meanwhile. After the rings come the address of the next
+ * slot SCRIPTS look at, a zero longword, the IDENTIFY message of a
+ * reselection, the address of the next done ring slot, the count of
+ * completions SCRIPTS hold back, the queue tag of a reselection and an
+ * ABORT message, then the host's copy of the JUMP at done_busy in a cache
+ * line of its own. The tag table, a reselect table per tag, comes last,
+ * aligned to its size.
+ */
+#define SIOP_RESELTAB_SIZE  (8 * 8 * sizeof (u_int32_t))
+#define SIOP_NTAGS          8       /* tags SCRIPTS look up, a power of 2 */
+#define SIOP_TAGTAB_SIZE    (SIOP_NTAGS * SIOP_RESELTAB_SIZE)
+#define SIOP_SLOT_WORDS     (SIOP_CACHE_LINE / sizeof (u_int32_t))
+#define SIOP_MBOX_SLOT(sc, i) (&(sc)->sc_mbox[(i) * SIOP_SLOT_WORDS])
+#define SIOP_MBOX_SIZE      (SIOP_MBOX_SLOTS * SIOP_CACHE_LINE + \
+                             SIOP_DONE_SLOTS * sizeof (u_int32_t) + \
+                             3 * SIOP_CACHE_LINE)
+#define SIOP_SCRIPT_SIZE    (sizeof (scripts) + 2 * SIOP_RESELTAB_SIZE + \
+                             SIOP_MBOX_SIZE + 2 * SIOP_TAGTAB_SIZE)
+#define SIOP_MBOX_WITHDRAWN 1       /* slot of a command taken back */
+#define SIOP_RESEL_TAGGED   2       /* reselect table: look up by tag */
+#define SIOP_RESEL_RESUMED  0x01    /* SCRATCH0: SCRIPTS resumed a command */
+#define SIOP_RESEL_TARGET(scratch)  (((scratch) >> 5) & 7)
+#define SIOP_RESEL_LUN(scratch)     (((scratch) >> 2) & 7)
+#define SIOP_LUNQ(sc, target, lun)  (&(sc)->sc_lunq[(target) * 8 + (lun)])
+
+/* SCRIPTS instructions of a data transfer list (see siop_sg_fill()) */
+#define SIOP_SG_DATA_OUT    0x08000000  /* MOVE count, addr, WHEN DATA_OUT */
+#define SIOP_SG_DATA_IN     0x09000000  /* MOVE count, addr, WHEN DATA_IN */
+#define SIOP_SG_CALL        0x88030000  /* CALL addr, WHEN NOT phase */
+#define SIOP_SG_INT         0x98080000  /* INT code */
+#define SIOP_SG_END         0xff0f      /* err15: end of the list */
+#define SIOP_SG_MAXLEN      MAXPHYS     /* largest segment listed */
 
 /*
  * siop_reset_delay must provide sufficient time for all targets
@@ -249,6 +315,39 @@ siop_minphys(struct buf *bp)
 }
 #endif
 
+/*
+ * Report the transfer modes the SIOP will use with a target. Only
+ * tagged queueing is reported; synchronous transfers are negotiated by
+ * siop_start(). Tags are only used with targets which are allowed to
+ * disconnect, as otherwise the target holds the bus until each command
+ * completes and nothing is gained by queueing more.
+ */
+static void
+siop_set_xfer_mode(struct siop_softc *sc, struct scsipi_xfer_mode *xm)
+{
+    struct scsipi_channel *chan = &sc->sc_channel;
+#ifdef PORT_AMIGA
+    struct scsipi_periph *periph;
+    int lun;
+#endif
+
+    xm->xm_mode &= PERIPH_CAP_TQING;
+    if ((siop_allow_disc[xm->xm_target] & 2) == 0)
+        xm->xm_mode = 0;
+#ifdef PORT_AMIGA
+    /* No bus type is attached to deliver ASYNC_EVENT_XFER_MODE */
+    for (lun = 0; lun < chan->chan_nluns; lun++) {
+        periph = scsipi_lookup_periph(chan, xm->xm_target, lun);
+        if (periph == NULL)
+            continue;
+        periph->periph_mode = xm->xm_mode & periph->periph_cap;
+        periph->periph_flags |= PERIPH_MODE_VALID;
+    }
+#else
+    scsipi_async_event(chan, ASYNC_EVENT_XFER_MODE, xm);
+#endif
+}
+
 /*
  * used by specific siop controller
  *
@@ -317,13 +416,20 @@ siop_scsipi_request(struct scsipi_channel *chan, scsipi_adapter_req_t req,
         acb->clen = xs->cmdlen;
         acb->daddr = xs->data;
         acb->dleft = xs->datalen;
+#ifdef PORT_AMIGA
+        if (sc->sc_bounce != NULL) {
+            struct scsipi_xfer *mxs;
+
+            for (mxs = xs; mxs != NULL; mxs = mxs->amiga_merge)
+                if (!siop_dma_ok(mxs->data, mxs->datalen))
+                    acb->flags |= ACB_BOUNCE;
+        }
+#endif
 
         s = bsd_splbio();
         TAILQ_INSERT_TAIL(&sc->ready_list, acb, chain);
-
-        if (sc->sc_nexus == NULL)
-            siop_sched(sc);
-
+        acb->queue = ACB_Q_READY;
+        siop_sched(sc);
         bsd_splx(s);
 
         if (flags & XS_CTL_POLL || siop_no_dma)
@@ -331,9 +437,11 @@ siop_scsipi_request(struct scsipi_channel *chan, scsipi_adapter_req_t req,
         return;
 
     case ADAPTER_REQ_GROW_RESOURCES:
+        siop_acb_grow(sc);
         return;
 
     case ADAPTER_REQ_SET_XFER_MODE:
+        siop_set_xfer_mode(sc, arg);
         return;
     }
 }
@@ -350,16 +458,35 @@ siop_poll(struct siop_softc *sc, struct siop_acb *acb)
     u_char sstat0;
     int s;
     int to;
+    uint64_t end;
 
     s = bsd_splbio();
     to = xs->timeout / 1000;  // to is in seconds
-    if (sc->nexus_list.tqh_first)
+    if (sc->nexus_list.tqh_first != NULL &&
+        (sc->nexus_list.tqh_first != acb || acb->chain.tqe_next != NULL))
         printf("%s: siop_poll called with disconnected device\n",
             device_xname(sc->sc_dev));
+    sc->sc_stats.st_poll_cmds++;
     for (;;) {
         /* use cmd_wait values? */
 #define WAIT_ITERS 1000  // Decrement to once per second
         i = WAIT_ITERS;
+        /*
+         * Most commands complete within microseconds: spin on the done
+         * ring before sleeping. ISTAT is not safe to spin on (see
+         * irq_poll() in cmdhandler.c).
+         */
+        if ((siop_poll_spin_usec > 0) && (eclock_hz != 0)) {
+            end = eclock_now() +
+                  (uint64_t) siop_poll_spin_usec * eclock_hz / 1000000;
+            while (((xs->xs_status & XS_STS_DONE) == 0) &&
+                   (eclock_now() < end))
+                siop_done_reap(sc, 0);
+            if (xs->xs_status & XS_STS_DONE) {
+                sc->sc_stats.st_poll_spun++;
+                break;
+            }
+        }
         /* XXX spl0(); */
         while (((istat = rp->siop_istat) &
             (SIOP_ISTAT_SIP | SIOP_ISTAT_DIP)) == 0) {
@@ -378,8 +505,14 @@ siop_poll(struct siop_softc *sc, struct siop_acb *acb)
                     return;
                 }
             }
+            /* SCRIPTS may hold back the completion */
+            if (siop_done_reap(sc, 0) && (xs->xs_status & XS_STS_DONE))
+                break;
             delay(1000);  // 1 ms
+            sc->sc_stats.st_poll_sleeps++;
         }
+        if (xs->xs_status & XS_STS_DONE)
+            break;
 #ifdef PORT_AMIGA
         /*
          * Work around the caution specified in 53C710 documentation for
@@ -388,104 +521,509 @@ siop_poll(struct siop_softc *sc, struct siop_acb *acb)
          * a delay equivalent to 12 BCLK periods must be inserted to
          * ensure the interrupts clear properly.
          */
-        uint32_t reg = *ADDR32((uintptr_t) &rp->siop_sstat2);
+        uint32_t reg = SIOP_READ_SSTAT_DSTAT(rp);
         sstat0 = reg >> 8;
         dstat  = reg;
 #else
         sstat0 = rp->siop_sstat0;
         dstat = rp->siop_dstat;
 #endif
+        siop_done_reap(sc, 1);
         if (siop_checkintr(sc, istat, dstat, sstat0, &status)) {
             if (acb != sc->sc_nexus)
                 printf("%s: siop_poll disconnected device completed\n",
                     device_xname(sc->sc_dev));
-            else if ((sc->sc_flags & SIOP_INTDEFER) == 0) {
-                sc->sc_flags &= ~SIOP_INTSOFF;
-                rp->siop_sien = sc->sc_sien;
-                rp->siop_dien = sc->sc_dien;
-            }
             siop_scsidone(sc->sc_nexus, status);
         }
 
         if (xs->xs_status & XS_STS_DONE)
             break;
     }
+    if ((sc->sc_flags & SIOP_INTDEFER) == 0) {
+        sc->sc_flags &= ~SIOP_INTSOFF;
+        rp->siop_sien = sc->sc_sien;
+        rp->siop_dien = sc->sc_dien;
+    }
     bsd_splx(s);
 }
 
 /*
- * start next command that's ready
+ * Undo the per-LUN accounting of siop_sched() for a command which has
+ * completed or was put back on the ready list.
  */
-void
-siop_sched(struct siop_softc *sc)
+static void
+siop_lun_release(struct siop_softc *sc, struct siop_acb *acb)
 {
-    struct scsipi_periph *periph;
-    struct siop_acb *acb;
-    int i;
+    struct scsipi_periph *periph = acb->xs->xs_periph;
+    struct siop_tinfo *ti = &sc->sc_tinfo[periph->periph_target];
 
-#ifdef DEBUG
-    if (sc->sc_nexus) {
-        printf("%s: siop_sched- nexus %p/%d ready %p/%d\n",
-            device_xname(sc->sc_dev), sc->sc_nexus,
-            sc->sc_nexus->xs->xs_periph->periph_target,
-            sc->ready_list.tqh_first,
-            sc->ready_list.tqh_first->xs->xs_periph->periph_target);
+    if (XS_CTL_TAGTYPE(acb->xs) == 0)
+        ti->lubusy &= ~(1 << periph->periph_lun);
+    if (ti->luactive[periph->periph_lun] > 0)
+        ti->luactive[periph->periph_lun]--;
+}
+
+/*
+ * Patch the data byte of a SCRIPTS register instruction.
+ */
+static void
+siop_script_data(struct siop_softc *sc, u_long offset, u_char data)
+{
+    u_int32_t *insn = &sc->sc_script[offset / 4];
+
+    *insn = (*insn & ~0x0000ff00) | (data << 8);
+#ifdef PORT_AMIGA
+    CacheClearE(insn, sizeof (*insn), CACRF_ClearD);
+#else
+    dma_cachectl((void *)insn, sizeof (*insn));
+#endif
+}
+
+/*
+ * Set a reselect or tag table entry SCRIPTS read.
+ */
+static void
+siop_resel_set(u_int32_t *entry, u_int32_t dsa)
+{
+    if (*entry == dsa)
+        return;
+    *entry = dsa;
+#ifdef PORT_AMIGA
+    CacheClearE(entry, sizeof (*entry), CACRF_ClearD);
+#else
+    dma_cachectl((void *)entry, sizeof (*entry));
+#endif
+}
+
+/*
+ * Note where SCRIPTS find a command issued to a target/LUN: the DSA of
+ * an untagged command in the reselect table, or SIOP_RESEL_TAGGED there
+ * and the DSA in the entry of its tag.
+ */
+static void
+siop_resel_note(struct siop_acb *acb, u_int32_t *dsa, u_int32_t *tags)
+{
+    u_int tag = acb->xs->xs_tag_id;
+
+    if (XS_CTL_TAGTYPE(acb->xs) == 0) {
+        *dsa = kvtop((void *)&acb->ds);
         return;
     }
+    *dsa = SIOP_RESEL_TAGGED;
+    if (tag < SIOP_NTAGS)
+        tags[tag] = kvtop((void *)&acb->ds);
+}
+
+/*
+ * Point the reselect table entry of a target/LUN at the untagged command
+ * issued to it, or the tag table entries at its tagged commands, so
+ * SCRIPTS can resume a command without interrupting the host. The
+ * entries are set as a command starts, since SCRIPTS may park it on a
+ * disconnect the host doesn't hear about. The host picks a command by
+ * its queue tag only if the tag is beyond the tag table.
+ */
+static void
+siop_resel_update(struct siop_softc *sc, int target, int lun)
+{
+    struct siop_acb *acb;
+    u_int32_t tags[SIOP_NTAGS];
+    u_int32_t dsa = 0;
+    u_int tag;
+
+    memset(tags, 0, sizeof (tags));
+    if (siop_no_resel_table == 0) {
+        for (acb = SIOP_LUNQ(sc, target, lun)->tqh_first; acb;
+            acb = acb->lunchain.tqe_next)
+            siop_resel_note(acb, &dsa, tags);
+        acb = sc->sc_nexus;
+        if (acb != NULL && acb->xs->xs_periph->periph_target == target &&
+            acb->xs->xs_periph->periph_lun == lun)
+            siop_resel_note(acb, &dsa, tags);
+    }
+    /* A command is in its tag table entry before SCRIPTS look there */
+    for (tag = 0; tag < SIOP_NTAGS; tag++) {
+        siop_resel_set(&sc->sc_tagtab[tag * 64 + target * 8 + lun],
+            tags[tag]);
+    }
+    siop_resel_set(&sc->sc_reseltab[target * 8 + lun], dsa);
+}
+
+/*
+ * Hand a command to SCRIPTS, which start it once the commands ahead of it
+ * in the mailbox have been started and the bus is free. Sig_P gets them
+ * out of WAIT RESELECT; if they are busy, they find the command when the
+ * bus goes free.
+ */
+static void
+siop_mbox_put(struct siop_softc *sc, struct siop_acb *acb)
+{
+    u_int32_t *slot = SIOP_MBOX_SLOT(sc, sc->sc_mboxin);
+
+    *slot = kvtop((void *)&acb->ds);
+#ifdef PORT_AMIGA
+    CacheClearE(slot, sizeof (*slot), CACRF_ClearD);
+#else
+    dma_cachectl((void *)slot, sizeof (*slot));
 #endif
+    sc->sc_mboxin = (sc->sc_mboxin + 1) % SIOP_MBOX_SLOTS;
+    sc->sc_siopp->siop_istat = SIOP_ISTAT_SIGP;
+}
 
-    for (acb = sc->ready_list.tqh_first; acb; acb = acb->chain.tqe_next) {
-        periph = acb->xs->xs_periph;
-        i = periph->periph_target;
-        if(!(sc->sc_tinfo[i].lubusy & (1 << periph->periph_lun))) {
-            struct siop_tinfo *ti = &sc->sc_tinfo[i];
-
-            TAILQ_REMOVE(&sc->ready_list, acb, chain);
-            sc->sc_nexus = acb;
-            periph = acb->xs->xs_periph;
-            ti = &sc->sc_tinfo[periph->periph_target];
-            ti->lubusy |= (1 << periph->periph_lun);
+/*
+ * Check whether SCRIPTS have yet to free the mailbox slot the host would
+ * fill next.
+ */
+static int
+siop_mbox_full(struct siop_softc *sc)
+{
+    u_int32_t *slot = SIOP_MBOX_SLOT(sc, sc->sc_mboxin);
+
+#ifdef PORT_AMIGA
+    CacheClearE(slot, sizeof (*slot), CACRF_ClearD);
+#else
+    DCIAS(kvtop(slot));
+#endif
+    return (*slot != 0);
+}
+
+/*
+ * Take a command which is done before SCRIPTS started it back out of the
+ * mailbox. SCRIPTS skip the slot, or abort the command if they were
+ * selecting its target, as they read the slot again after moving
+ * mbox_next past it. Once mbox_next is past the slot, SCRIPTS may have
+ * freed it already, so it is set back to zero, which they take as
+ * withdrawn too, rather than being left full behind them.
+ */
+static void
+siop_mbox_withdraw(struct siop_softc *sc, struct siop_acb *acb)
+{
+    u_int32_t dsa = kvtop((void *)&acb->ds);
+    u_int32_t *slot;
+    u_int next;
+    u_int i;
+
+#ifdef PORT_AMIGA
+    CacheClearE(sc->sc_mbox, SIOP_MBOX_SIZE, CACRF_ClearD);
+#else
+    dma_cachectl((void *)sc->sc_mbox, SIOP_MBOX_SIZE);
+#endif
+    for (i = 0; i < SIOP_MBOX_SLOTS; i++) {
+        if (*SIOP_MBOX_SLOT(sc, i) == dsa)
             break;
-        }
     }
+    if (i == SIOP_MBOX_SLOTS)
+        return;
+    slot = SIOP_MBOX_SLOT(sc, i);
+    *slot = SIOP_MBOX_WITHDRAWN;
+#ifdef PORT_AMIGA
+    CacheClearE(slot, sizeof (*slot), CACRF_ClearD);
+    CacheClearE(sc->sc_mbox, SIOP_MBOX_SIZE, CACRF_ClearD);
+#else
+    dma_cachectl((void *)slot, sizeof (*slot));
+    dma_cachectl((void *)sc->sc_mbox, SIOP_MBOX_SIZE);
+#endif
+    next = (*sc->sc_mboxnext - kvtop((void *)sc->sc_mbox)) /
+        SIOP_CACHE_LINE;
+    if ((i - next) % SIOP_MBOX_SLOTS <
+        (sc->sc_mboxin - next) % SIOP_MBOX_SLOTS ||
+        (next == sc->sc_mboxin && *SIOP_MBOX_SLOT(sc, next) != 0))
+        return;     /* SCRIPTS will see it */
+    *slot = 0;
+#ifdef PORT_AMIGA
+    CacheClearE(slot, sizeof (*slot), CACRF_ClearD);
+#else
+    dma_cachectl((void *)slot, sizeof (*slot));
+#endif
+}
 
-// XXX: Might need to kick the queue processing here if it's not running
+/*
+ * Free the mailbox slot SCRIPTS are at, as they do once they have
+ * selected the target of its command. For a selection which timed out.
+ */
+static void
+siop_mbox_take(struct siop_softc *sc)
+{
+    u_int i;
 
-    if (acb == NULL) {
-#ifdef DEBUG
-        printf("%s: siop_sched didn't find ready command\n",
-            device_xname(sc->sc_dev));
+#ifdef PORT_AMIGA
+    CacheClearE(sc->sc_mboxnext, sizeof (u_int32_t), CACRF_ClearD);
+#else
+    DCIAS(kvtop(sc->sc_mboxnext));
+#endif
+    i = (*sc->sc_mboxnext - kvtop((void *)sc->sc_mbox)) / SIOP_CACHE_LINE;
+    *SIOP_MBOX_SLOT(sc, i) = 0;
+    *sc->sc_mboxnext = kvtop((void *)SIOP_MBOX_SLOT(sc,
+        (i + 1) % SIOP_MBOX_SLOTS));
+#ifdef PORT_AMIGA
+    CacheClearE(sc->sc_mbox, SIOP_MBOX_SIZE, CACRF_ClearD);
+#else
+    dma_cachectl((void *)sc->sc_mbox, SIOP_MBOX_SIZE);
 #endif
+}
+
+/*
+ * Patch in the count, modulo 256, of the commands SCRIPTS put in the
+ * done ring once all active commands are done. While SCRIPTS have put
+ * fewer, some command is parked at its target, and completions are held
+ * back until it reconnects. A command the host finished itself lowers
+ * the count, so Sig_P has SCRIPTS which wait for a reselection check
+ * again (poke != 0). SCRIPTS copy the JUMP from sc_donebusy before they
+ * run it.
+ */
+static void
+siop_done_busy(struct siop_softc *sc, int poke)
+{
+    u_int32_t *insn = sc->sc_donebusy;
+    u_char busy = sc->sc_donetaken + sc->sc_active;
+
+    if ((*insn & 0xff) == busy)
         return;
+    *insn = (*insn & ~0xff) | busy;
+#ifdef PORT_AMIGA
+    CacheClearE(insn, sizeof (*insn), CACRF_ClearD);
+#else
+    dma_cachectl((void *)insn, sizeof (*insn));
+#endif
+    if (poke)
+        sc->sc_siopp->siop_istat = SIOP_ISTAT_SIGP;
+}
+
+/*
+ * Empty the mailbox and the done ring, for a chip which has been reset.
+ */
+static void
+siop_mbox_reset(struct siop_softc *sc)
+{
+    memset(sc->sc_mbox, 0, SIOP_MBOX_SIZE);
+    *sc->sc_mboxnext = kvtop((void *)sc->sc_mbox);
+    *sc->sc_donenext = kvtop((void *)sc->sc_done);
+    sc->sc_mboxin = 0;
+    sc->sc_doneout = 0;
+    sc->sc_donetaken = 0;
+    *(u_char *) &sc->sc_donenext[3] = MSG_ABORT;
+    *sc->sc_donebusy = sc->sc_script[Ent_done_busy / 4] & ~0xff;
+#ifdef PORT_AMIGA
+    CacheClearE(sc->sc_mbox, SIOP_MBOX_SIZE, CACRF_ClearD);
+#else
+    dma_cachectl((void *)sc->sc_mbox, SIOP_MBOX_SIZE);
+#endif
+    siop_done_busy(sc, 0);
+}
+
+/*
+ * Finish a command SCRIPTS put in the done ring.
+ */
+static void
+siop_done_finish(struct siop_softc *sc, struct siop_acb *acb)
+{
+    int target = acb->xs->xs_periph->periph_target;
+
+    if (sc->sc_sync[target].state == NEG_WAITS) {
+        if (acb->msg[1] == 0xff) {
+            printf ("%s: target %d ignored sync request\n",
+                device_xname(sc->sc_dev), target);
+            siop_sync_async(sc, target);
+        } else if (acb->msg[1] == MSG_REJECT) {
+            printf ("%s: target %d rejected sync request\n",
+                device_xname(sc->sc_dev), target);
+            siop_sync_async(sc, target);
+        } else
+/* XXX - need to set sync transfer parameters? */
+            printf("%s: target %d (sync) %02x %02x %02x\n",
+                device_xname(sc->sc_dev), target, acb->msg[1],
+                acb->msg[2], acb->msg[3]);
+        sc->sc_sync[target].state = NEG_DONE;
     }
+#ifdef PORT_AMIGA
+    CacheClearE(&acb->stat[0], 1, CACRF_ClearD);
+#else
+    dma_cachectl(&acb->stat[0], 1);
+#endif
+#ifdef DEBUG
+    if (acb->msg[0] != 0x00)
+        printf("%s: message was not COMMAND COMPLETE: %x\n",
+            device_xname(sc->sc_dev), acb->msg[0]);
+#endif
+    acb->flags |= ACB_DONE;     /* not in the mailbox */
+    if (acb->flags & ACB_ABORT)
+        acb->xs->error = XS_REQUEUE;    /* target ignored the ABORT */
+    siop_scsidone(acb, acb->stat[0]);
+}
 
-    if (acb->xs->xs_control & XS_CTL_RESET)
-        siopreset(sc);
+/*
+ * Take the commands SCRIPTS have completed out of the done ring, then
+ * finish them all. SCRIPTS fill a slot before they count it in TEMP1 of
+ * done_count, and the host only reads the ring, so it never pushes a
+ * stale copy of a slot SCRIPTS are filling. At an interrupt SCRIPTS are
+ * stopped, and start counting the completions they hold back from zero
+ * again. Returns the number of commands finished.
+ */
+static int
+siop_done_reap(struct siop_softc *sc, int intr)
+{
+    struct siop_acb *done[SIOP_DONE_SLOTS];
+    struct siop_acb *acb;
+    u_int32_t dsa;
+    u_char put;
+    int count = 0;
+    int i;
 
 #ifdef PORT_AMIGA
-    /*
-     * Setup timeout callout for every issued transaction on the channel.
-     *
-     * This differs from the original NetBSD driver where a callout is
-     * only set for the first transaction active on the bus. In that case,
-     * if the first one finishes, but following transactions do not finish,
-     * a driver hang will occur, since there is nothing to terminate another
-     * active command.
-     */
-    callout_reset(&acb->xs->xs_callout,
-        mstohz(acb->xs->timeout) + 1, siop_timeout, acb);
+    CacheClearE(sc->sc_done, SIOP_DONE_SLOTS * sizeof (u_int32_t),
+        CACRF_ClearD);
+    CacheClearE(&sc->sc_donenext[1], sizeof (u_int32_t), CACRF_ClearD);
+#else
+    dma_cachectl((void *)sc->sc_done, SIOP_DONE_SLOTS * sizeof (u_int32_t));
+    DCIAS(kvtop(&sc->sc_donenext[1]));
+#endif
+    put = sc->sc_donenext[1] >> 8;      /* TEMP1 of done_count */
+    for (; sc->sc_donetaken != put; sc->sc_donetaken++) {
+        dsa = sc->sc_done[sc->sc_doneout];
+        sc->sc_doneout = (sc->sc_doneout + 1) % SIOP_DONE_SLOTS;
+        acb = siop_dsa_acb(sc, dsa);
+        if (acb == NULL) {
+            printf("%s: done ring holds unknown DSA %lx\n",
+                device_xname(sc->sc_dev), (u_long)dsa);
+            continue;
+        }
+        done[count++] = acb;
+    }
+    if (intr) {
+        sc->sc_donenext[1] &= ~0xff;    /* TEMP0 of done_count */
+#ifdef PORT_AMIGA
+        CacheClearE(&sc->sc_donenext[1], sizeof (u_int32_t), CACRF_ClearD);
+#else
+        dma_cachectl((void *)&sc->sc_donenext[1], sizeof (u_int32_t));
+#endif
+    }
+    if (count == 0)
+        return (0);
+
+    if (intr) {
+        sc->sc_stats.st_done += count;
+        sc->sc_stats.st_done_ints++;
+        if (sc->sc_stats.st_done_max < count)
+            sc->sc_stats.st_done_max = count;
+    } else {
+        sc->sc_stats.st_done_polled += count;
+    }
+    for (i = 0; i < count; i++)
+        siop_done_finish(sc, done[i]);
+    siop_done_busy(sc, 1);  /* commands started meanwhile counted early */
+    return (count);
+}
+
+/*
+ * Finish the commands SCRIPTS have completed but not yet interrupted
+ * for. Called by the command handler whenever it wakes up, and every
+ * siop_done_usec while commands are active. Returns the number of
+ * commands finished.
+ */
+int
+siop_done_poll(struct siop_softc *sc)
+{
+    int count;
+    int s;
+
+    if ((sc->sc_flags & SIOP_ALIVE) == 0)
+        return (0);
+    s = bsd_splbio();
+    count = siop_done_reap(sc, 0);
+    bsd_splx(s);
+    return (count);
+}
+
+/*
+ * A LUN may have several tagged commands issued, up to the number of
+ * openings of the periph, but an untagged command must have the LUN to
+ * itself. The lubusy bit marks a LUN running an untagged command, and
+ * luactive counts the commands issued to each LUN.
+ */
+static int
+siop_can_start(struct siop_softc *sc, struct siop_acb *acb)
+{
+    struct scsipi_periph *periph = acb->xs->xs_periph;
+    struct siop_tinfo *ti = &sc->sc_tinfo[periph->periph_target];
+    int lun = periph->periph_lun;
+
+    if (ti->lubusy & (1 << lun))
+        return (0);
+#ifdef PORT_AMIGA
+    if ((acb->flags & ACB_BOUNCE) && acb->bounce == NULL &&
+        sc->sc_bounce_free == 0)
+        return (0);
+#endif
+    if (XS_CTL_TAGTYPE(acb->xs) == 0)
+        return (ti->luactive[lun] == 0);
+    return (ti->luactive[lun] < periph->periph_openings);
+}
+
+/*
+ * Start the ready commands which can be started, by handing them to
+ * SCRIPTS through the mailbox. The ready list is searched from the start
+ * for each command, as siopreset() may complete commands and have more
+ * queued while a command is being started.
+ */
+void
+siop_sched(struct siop_softc *sc)
+{
+    struct scsipi_periph *periph;
+    struct siop_acb *acb;
+    struct siop_tinfo *ti;
+    int lun;
+
+    for (;;) {
+        for (acb = sc->ready_list.tqh_first; acb;
+            acb = acb->chain.tqe_next)
+            if (siop_can_start(sc, acb))
+                break;
+        if (acb == NULL || siop_mbox_full(sc))
+            return;
+        periph = acb->xs->xs_periph;
+        lun = periph->periph_lun;
+        ti = &sc->sc_tinfo[periph->periph_target];
+        if (XS_CTL_TAGTYPE(acb->xs) == 0)
+            ti->lubusy |= (1 << lun);
+        ti->luactive[lun]++;
+        TAILQ_REMOVE(&sc->ready_list, acb, chain);
+#ifdef PORT_AMIGA
+        if (acb->flags & ACB_BOUNCE)
+            siop_bounce_get(sc, acb);
+#endif
+
+        if (acb->xs->xs_control & XS_CTL_RESET)
+            siopreset(sc);
+
+#ifdef PORT_AMIGA
+        /*
+         * Setup timeout callout for every issued transaction on the
+         * channel.
+         *
+         * This differs from the original NetBSD driver where a callout
+         * is only set for the first transaction active on the bus. In
+         * that case, if the first one finishes, but following
+         * transactions do not finish, a driver hang will occur, since
+         * there is nothing to terminate another active command.
+         */
+        callout_reset(&acb->xs->xs_callout,
+            mstohz(acb->xs->timeout) + 1, siop_timeout, acb);
 #endif
 #if 0
-    acb->cmd.bytes[0] |= slp->scsipi_scsi.lun << 5; /* XXXX */
+        acb->cmd.bytes[0] |= slp->scsipi_scsi.lun << 5; /* XXXX */
 #endif
-    ++sc->sc_active;
-    siop_select(sc);
+        ++sc->sc_active;
+        siop_done_busy(sc, 0);
+        siop_select(sc, acb);
+    }
 }
 
 void
 siop_scsidone(struct siop_acb *acb, int stat)
 {
     struct scsipi_xfer *xs;
+#ifdef PORT_AMIGA
+    struct scsipi_xfer *mxs;
+#endif
     struct scsipi_periph *periph;
     struct siop_softc *sc;
     int dosched = 0;
@@ -510,52 +1048,45 @@ siop_scsidone(struct siop_acb *acb, int stat)
     xs->resid = 0;      /* XXXX */
 
     if (xs->error == XS_NOERROR) {
-        if (stat == SCSI_CHECK || stat == SCSI_BUSY)
+        if (stat == SCSI_CHECK || stat == SCSI_BUSY ||
+            stat == SCSI_QUEUE_FULL)
             xs->error = XS_BUSY;
     }
 
-    /*
-     * Remove the ACB from whatever queue it's on.  We have to do a bit of
-     * a hack to figure out which queue it's on.  Note that it is *not*
-     * necessary to cdr down the ready queue, but we must cdr down the
-     * nexus queue and see if it's there, so we can mark the unit as no
-     * longer busy.  This code is sickening, but it works.
-     */
-    if (acb == sc->sc_nexus) {
+    /* Remove the ACB from the queue it's on */
+    switch (acb->queue) {
+    case ACB_Q_NEXUS:
         sc->sc_nexus = NULL;
-        sc->sc_tinfo[periph->periph_target].lubusy &=
-            ~(1<<periph->periph_lun);
+        siop_resel_update(sc, periph->periph_target, periph->periph_lun);
+        siop_lun_release(sc, acb);
         if (sc->ready_list.tqh_first)
             dosched = 1;    /* start next command */
         --sc->sc_active;
+        if ((acb->flags & ACB_DONE) == 0)
+            siop_done_busy(sc, 1);
         SIOP_TRACE('d','a',stat,0)
-    } else if (sc->ready_list.tqh_last == &acb->chain.tqe_next) {
+        break;
+    case ACB_Q_ISSUED:
+        siop_issued_remove(sc, acb);
+        if ((acb->flags & ACB_DONE) == 0)
+            siop_mbox_withdraw(sc, acb);
+        siop_resel_update(sc, periph->periph_target, periph->periph_lun);
+        siop_lun_release(sc, acb);
+        if (sc->ready_list.tqh_first)
+            dosched = 1;
+        --sc->sc_active;
+        if ((acb->flags & ACB_DONE) == 0)
+            siop_done_busy(sc, 1);
+        SIOP_TRACE('d','n',stat,0);
+        break;
+    case ACB_Q_READY:
         TAILQ_REMOVE(&sc->ready_list, acb, chain);
         SIOP_TRACE('d','r',stat,0)
-    } else {
-        register struct siop_acb *acb2;
-        for (acb2 = sc->nexus_list.tqh_first; acb2;
-            acb2 = acb2->chain.tqe_next)
-            if (acb2 == acb) {
-                TAILQ_REMOVE(&sc->nexus_list, acb, chain);
-                sc->sc_tinfo[periph->periph_target].lubusy
-                    &= ~(1<<periph->periph_lun);
-                --sc->sc_active;
-                break;
-            }
-        if (acb2)
-            ;
-        else if (acb->chain.tqe_next) {
-            TAILQ_REMOVE(&sc->ready_list, acb, chain);
-            --sc->sc_active;
-        } else {
-            printf("%s: can't find matching acb\n",
-                device_xname(sc->sc_dev));
-#ifdef DDB
-/*          Debugger(); */
-#endif
-        }
-        SIOP_TRACE('d','n',stat,0);
+        break;
+    default:
+        printf("%s: can't find matching acb\n",
+            device_xname(sc->sc_dev));
+        break;
     }
 
 #ifdef PORT_AMIGA
@@ -569,13 +1100,43 @@ siop_scsidone(struct siop_acb *acb, int stat)
     if (acb->iob_buf != NULL && acb->iob_len != 0) {
         CachePostDMA(&acb->iob_buf, (LONG *)&acb->iob_len, 0);
     }
+    /* Each xfer merged into this one was listed from its own CachePreDMA */
+    for (mxs = xs->amiga_merge; mxs != NULL; mxs = mxs->amiga_merge) {
+        LONG len = mxs->datalen;
+        if (len != 0)
+            CachePostDMA(mxs->data, &len, 0);
+        mxs->resid = 0;
+    }
+    if (acb->bounce != NULL) {
+        siop_bounce_done(acb);
+        siop_bounce_put(sc, acb);
+        if (sc->ready_list.tqh_first)
+            dosched = 1;
+    }
 #endif
 
-    /* Put it on the free list. */
+    /*
+     * Put it on the free list, which is kept in chunk order so that the
+     * ACBs of later chunks are the last to be reused, and can go idle.
+     */
     acb->flags = ACB_FREE;
-    TAILQ_INSERT_HEAD(&sc->free_list, acb, chain);
-
-    sc->sc_tinfo[periph->periph_target].cmds++;
+    acb->queue = ACB_Q_FREE;
+    if (acb->chunk == 0) {
+        TAILQ_INSERT_HEAD(&sc->free_list, acb, chain);
+    } else {
+        struct siop_acb *facb;
+
+        TAILQ_FOREACH(facb, &sc->free_list, chain)
+            if (facb->chunk >= acb->chunk)
+                break;
+        if (facb != NULL)
+            TAILQ_INSERT_BEFORE(facb, acb, chain);
+        else
+            TAILQ_INSERT_TAIL(&sc->free_list, acb, chain);
+    }
+
+    sc->sc_tinfo[periph->periph_target].cmds++;
+    sc->sc_stats.st_cmds++;
 
     scsipi_done(xs);
 
@@ -594,7 +1155,7 @@ siop_scsidone(struct siop_acb *acb, int stat)
     }
 #endif
 
-    if (dosched && sc->sc_nexus == NULL)
+    if (dosched)
         siop_sched(sc);
 }
 
@@ -650,6 +1211,153 @@ siopabort(register struct siop_softc *sc, siop_regmap_p rp, const char *where)
     }
 }
 
+/*
+ * Load the current sync parameters of a target into its select and
+ * reselect blocks.
+ */
+static void
+siop_resel_sync(struct siop_softc *sc, int target)
+{
+    u_long offset = Ent_resel_t0 + target * (Ent_resel_t1 - Ent_resel_t0);
+
+    siop_script_data(sc, offset, sc->sc_sync[target].sxfer);
+    siop_script_data(sc, offset + 8, sc->sc_sync[target].sbcl);
+    offset = Ent_sel_t0 + target * (Ent_sel_t1 - Ent_sel_t0);
+    siop_script_data(sc, offset, sc->sc_sync[target].sxfer);
+    siop_script_data(sc, offset + 8, sc->sc_sync[target].sbcl);
+}
+
+/*
+ * The target is to transfer asynchronously.
+ */
+static void
+siop_sync_async(struct siop_softc *sc, int target)
+{
+    sc->sc_sync[target].sxfer = 0;
+    sc->sc_sync[target].sbcl = 0;
+    sc->sc_sync[target].period = 0;
+    siop_resel_sync(sc, target);
+}
+
+/*
+ * After a parity or gross error on a target which transfers
+ * synchronously, have the next command offer a period one clock slower,
+ * or asynchronous transfers once the 53C710 can go no slower. Returns 0
+ * if the target transfers asynchronously already.
+ */
+static int
+siop_sync_slower(struct siop_softc *sc, int target)
+{
+    struct syncpar *sp = &sc->sc_sync[target];
+    int period;
+
+    if (sp->period == 0)
+        return (0);
+    if (sp->state != NEG_DONE)
+        return (1);     /* already renegotiating */
+    period = sp->period + sc->sc_tcp[sp->sbcl];
+    if (period <= sc->sc_tcp[3] * 11) {
+        sp->offer = period / 4;
+        printf("%s: target %d transfer errors, slowing to %dns\n",
+            device_xname(sc->sc_dev), target, period);
+    } else {
+        sp->offer = 0;
+        printf("%s: target %d transfer errors, going asynchronous\n",
+            device_xname(sc->sc_dev), target);
+    }
+    sp->state = NEG_WIDE;
+    sc->sc_stats.st_sync_slower++;
+    return (1);
+}
+
+/*
+ * Fill in the addresses the mailbox, done ring, reselect and disconnect
+ * code works with, the mask which drops our own ID from the reselection
+ * ID bits, whether the host is told of every disconnect, and how many
+ * completions SCRIPTS hold back before interrupting. If the command
+ * handler polls for completions, SCRIPTS also hold them back while
+ * waiting for a reselection.
+ */
+static void
+siop_patch_scripts(struct siop_softc *sc)
+{
+    siop_regmap_p rp = sc->sc_siopp;
+    u_int i;
+    int limit;
+
+    for (i = 0; i < ARRAY_SIZE(E_reg_scratch_Used); i++)
+        sc->sc_script[E_reg_scratch_Used[i]] = kvtop(&rp->siop_scratch);
+    for (i = 0; i < ARRAY_SIZE(E_reg_dsa_Used); i++)
+        sc->sc_script[E_reg_dsa_Used[i]] = kvtop(&rp->siop_dsa);
+    for (i = 0; i < ARRAY_SIZE(E_reg_temp_Used); i++)
+        sc->sc_script[E_reg_temp_Used[i]] = kvtop(&rp->siop_temp);
+    for (i = 0; i < ARRAY_SIZE(E_mbox_next_Used); i++)
+        sc->sc_script[E_mbox_next_Used[i]] = kvtop(sc->sc_mboxnext);
+    for (i = 0; i < ARRAY_SIZE(E_mbox_zero_Used); i++)
+        sc->sc_script[E_mbox_zero_Used[i]] = kvtop(sc->sc_mboxnext + 1);
+    for (i = 0; i < ARRAY_SIZE(E_resel_msg_Used); i++)
+        sc->sc_script[E_resel_msg_Used[i]] = kvtop(sc->sc_mboxnext + 2);
+    for (i = 0; i < ARRAY_SIZE(E_done_next_Used); i++)
+        sc->sc_script[E_done_next_Used[i]] = kvtop(sc->sc_donenext);
+    for (i = 0; i < ARRAY_SIZE(E_done_count_Used); i++)
+        sc->sc_script[E_done_count_Used[i]] = kvtop(sc->sc_donenext + 1);
+    for (i = 0; i < ARRAY_SIZE(E_done_put_dst_Used); i++)
+        sc->sc_script[E_done_put_dst_Used[i]] =
+            sc->sc_scriptspa + Ent_done_put + 8;
+    for (i = 0; i < ARRAY_SIZE(E_done_busy_src_Used); i++)
+        sc->sc_script[E_done_busy_src_Used[i]] = kvtop(sc->sc_donebusy);
+    for (i = 0; i < ARRAY_SIZE(E_done_busy_dst_Used); i++)
+        sc->sc_script[E_done_busy_dst_Used[i]] =
+            sc->sc_scriptspa + Ent_done_busy;
+    for (i = 0; i < ARRAY_SIZE(E_mbox_load_src_Used); i++)
+        sc->sc_script[E_mbox_load_src_Used[i]] =
+            sc->sc_scriptspa + Ent_mbox_load + 4;
+    for (i = 0; i < ARRAY_SIZE(E_mbox_clear_dst_Used); i++)
+        sc->sc_script[E_mbox_clear_dst_Used[i]] =
+            sc->sc_scriptspa + Ent_mbox_clear + 8;
+    for (i = 0; i < ARRAY_SIZE(E_mbox_temp_src_Used); i++)
+        sc->sc_script[E_mbox_temp_src_Used[i]] =
+            sc->sc_scriptspa + Ent_mbox_temp + 4;
+    for (i = 0; i < ARRAY_SIZE(E_mbox_check_src_Used); i++)
+        sc->sc_script[E_mbox_check_src_Used[i]] =
+            sc->sc_scriptspa + Ent_mbox_check + 4;
+    for (i = 0; i < ARRAY_SIZE(E_mbox_abort_Used); i++)
+        sc->sc_script[E_mbox_abort_Used[i]] = kvtop(sc->sc_donenext + 3);
+    for (i = 0; i < ARRAY_SIZE(E_resel_load_src_Used); i++)
+        sc->sc_script[E_resel_load_src_Used[i]] =
+            sc->sc_scriptspa + Ent_resel_load + 4;
+    for (i = 0; i < ARRAY_SIZE(E_resel_temp_src_Used); i++)
+        sc->sc_script[E_resel_temp_src_Used[i]] =
+            sc->sc_scriptspa + Ent_resel_temp + 4;
+    for (i = 0; i < ARRAY_SIZE(E_resel_qtag_Used); i++)
+        sc->sc_script[E_resel_qtag_Used[i]] = kvtop(sc->sc_donenext + 2);
+    for (i = 0; i < ARRAY_SIZE(E_resel_tload_src_Used); i++)
+        sc->sc_script[E_resel_tload_src_Used[i]] =
+            sc->sc_scriptspa + Ent_resel_tload + 4;
+    for (i = 0; i < ARRAY_SIZE(E_disc_save_dst_Used); i++)
+        sc->sc_script[E_disc_save_dst_Used[i]] =
+            sc->sc_scriptspa + Ent_disc_save + 8;
+    siop_script_data(sc, Ent_resel_id, ~(1 << sc->sc_channel.chan_id));
+    siop_script_data(sc, Ent_resel_tagtab, kvtop(sc->sc_tagtab) >> 8);
+    siop_script_data(sc, Ent_resel_tagtab + 8, kvtop(sc->sc_tagtab) >> 16);
+    siop_script_data(sc, Ent_resel_tagtab + 16, kvtop(sc->sc_tagtab) >> 24);
+    siop_script_data(sc, Ent_disc_nosdp, siop_no_disc_park != 0);
+    siop_script_data(sc, Ent_disc_sdp, siop_no_disc_park != 0);
+    limit = siop_done_coalesce;
+    if (limit < 1)
+        limit = 1;
+    else if (limit > SIOP_DONE_SLOTS)
+        limit = SIOP_DONE_SLOTS;
+    sc->sc_script[Ent_done_limit / 4] =
+        (sc->sc_script[Ent_done_limit / 4] & ~0xff) | limit;
+    siop_script_data(sc, Ent_done_idle, siop_done_usec ? 0x00 : 0xff);
+#ifdef PORT_AMIGA
+    CacheClearE(sc->sc_script, sizeof (scripts), CACRF_ClearD);
+#else
+    dma_cachectl((void *)sc->sc_script, sizeof (scripts));
+#endif
+}
+
 void
 siopinitialize(struct siop_softc *sc)
 {
@@ -661,21 +1369,38 @@ siopinitialize(struct siop_softc *sc)
 #endif
 
     /*
-     * Need to check that scripts is on a long word boundary
+     * SCRIPTS run from a copy in RAM, as the reselect code is patched
+     * for this SIOP and modifies itself.
      * Also should verify that dev doesn't span non-contiguous
      * physical pages.
      */
-    sc->sc_scriptspa = kvtop((void *)__UNCONST(scripts));
+#ifdef PORT_AMIGA
+    sc->sc_script = siop_dma_alloc(SIOP_SCRIPT_SIZE);
+    CopyMem(__UNCONST(scripts), sc->sc_script, sizeof (scripts));
+#else
+    sc->sc_script = malloc(SIOP_SCRIPT_SIZE);
+    memcpy(sc->sc_script, scripts, sizeof (scripts));
+#endif
+    sc->sc_reseltab = (u_int32_t *) (((u_long) sc->sc_script +
+        sizeof (scripts) + SIOP_RESELTAB_SIZE - 1) & ~(SIOP_RESELTAB_SIZE - 1));
+    sc->sc_mbox = sc->sc_reseltab + SIOP_RESELTAB_SIZE / sizeof (u_int32_t);
+    sc->sc_done = SIOP_MBOX_SLOT(sc, SIOP_MBOX_SLOTS);
+    sc->sc_mboxnext = sc->sc_done + SIOP_DONE_SLOTS;
+    sc->sc_donenext = sc->sc_mboxnext + 3;
+    sc->sc_donebusy = sc->sc_mboxnext + 2 * SIOP_SLOT_WORDS;
+    sc->sc_tagtab = (u_int32_t *) (((u_long) (sc->sc_donebusy +
+        SIOP_SLOT_WORDS) + SIOP_TAGTAB_SIZE - 1) & ~(SIOP_TAGTAB_SIZE - 1));
+    sc->sc_scriptspa = kvtop((void *)sc->sc_script);
+    siop_patch_scripts(sc);
 
     /*
-     * malloc sc_acb to ensure that DS is on a long word boundary.
+     * The first chunk of ACBs is kept; the channel grows more on demand.
      */
-
+    siop_acb_alloc(sc, 0);
+    sc->sc_nchunks = 1;
+    callout_init(&sc->sc_acb_callout, 0);
 #ifdef PORT_AMIGA
-    sc->sc_acb = AllocMem(sizeof(struct siop_acb) * SIOP_NACB,
-                          MEMF_CLEAR | MEMF_PUBLIC);
-#else
-    sc->sc_acb = malloc(sizeof(struct siop_acb) * SIOP_NACB);
+    siop_bounce_init(sc);
 #endif
 
     sc->sc_tcp[1] = 1000 / sc->sc_clock_freq;
@@ -724,6 +1449,13 @@ siopinitialize(struct siop_softc *sc)
             if (inhibit_sync & (1 << i))
                 siop_inhibit_sync[i] = 1;
     }
+    for (i = 0; i < 8; ++i) {
+        sc->sc_sync[i].offer = sc->sc_minsync;
+#ifdef PORT_AMIGA
+        if (sc->sc_nofast & (1 << i))
+            sc->sc_sync[i].offer = 200 / 4;     /* 5 MB/s */
+#endif
+    }
 
     siopreset(sc);
 }
@@ -736,7 +1468,12 @@ siopshutdown(struct scsipi_channel *chan)
 
     siopreset(sc);
     scsipi_free_all_xs(chan);
-    FreeMem(sc->sc_acb, sizeof(struct siop_acb) * SIOP_NACB);
+    callout_stop(&sc->sc_acb_callout);
+    while (sc->sc_nchunks > 0)
+        siop_acb_free(sc, --sc->sc_nchunks);
+    if (sc->sc_bounce != NULL)
+        FreeMem(sc->sc_bounce, SIOP_NBOUNCE * SIOP_BOUNCE_LEN);
+    FreeMem(sc->sc_script, SIOP_SCRIPT_SIZE);
 }
 #endif
 
@@ -807,7 +1544,7 @@ siopreset(struct siop_softc *sc)
      */
     rp->siop_sien = 0;
     rp->siop_scntl1 |= SIOP_SCNTL1_RST;
-    delay(1);
+    delay(25);      /* Reset hold time */
     rp->siop_scntl1 &= ~SIOP_SCNTL1_RST;
 
     /*
@@ -829,13 +1566,20 @@ siopreset(struct siop_softc *sc)
     rp->siop_ctest7 |= sc->sc_ctest7;
     // rp->siop_ctest0 |= SIOP_CTEST0_ERF;  // Set only for <= 5M transfer rate
 
-    /* will need to re-negotiate sync xfers */
-    memset(&sc->sc_sync, 0, sizeof (sc->sc_sync));
+    /* will need to re-negotiate sync xfers, at the period last offered */
+    for (i = 0; i < 8; i++) {
+        sc->sc_sync[i].state = NEG_WIDE;
+        siop_sync_async(sc, i);
+    }
+
+    /* SCRIPTS keep the reselect table base in SCRATCH1-3 */
+    rp->siop_scratch = kvtop((void *)sc->sc_reseltab);
+    siop_mbox_reset(sc);
 
     i = rp->siop_istat;
 #ifdef PORT_AMIGA
     if (i & (SIOP_ISTAT_SIP | SIOP_ISTAT_DIP))
-        dummy = *ADDR32((uintptr_t) &rp->siop_sstat2);
+        dummy = SIOP_READ_SSTAT_DSTAT(rp);
 #else
     if (i & SIOP_ISTAT_SIP)
         dummy = rp->siop_sstat0;
@@ -858,14 +1602,25 @@ siopreset(struct siop_softc *sc)
         TAILQ_INIT(&sc->ready_list);
         TAILQ_INIT(&sc->nexus_list);
         TAILQ_INIT(&sc->free_list);
+        for (i = 0; i < 8 * 8; i++)
+            TAILQ_INIT(&sc->sc_lunq[i]);
         sc->sc_nexus = NULL;
-        acb = sc->sc_acb;
-        memset(acb, 0, sizeof(struct siop_acb) * SIOP_NACB);
-        for (i = 0; i < SIOP_NACB; i++) {
+        for (i = 0; i < sc->sc_nchunks * SIOP_NACB_CHUNK; i++) {
+            acb = &sc->sc_acb[i / SIOP_NACB_CHUNK][i % SIOP_NACB_CHUNK];
+            memset(acb, 0, sizeof(struct siop_acb));
+            acb->chunk = i / SIOP_NACB_CHUNK;
             TAILQ_INSERT_TAIL(&sc->free_list, acb, chain);
-            acb++;
         }
         memset(sc->sc_tinfo, 0, sizeof(sc->sc_tinfo));
+        memset(sc->sc_reseltab, 0, SIOP_RESELTAB_SIZE);
+        memset(sc->sc_tagtab, 0, SIOP_TAGTAB_SIZE);
+#ifdef PORT_AMIGA
+        CacheClearE(sc->sc_reseltab, SIOP_RESELTAB_SIZE, CACRF_ClearD);
+        CacheClearE(sc->sc_tagtab, SIOP_TAGTAB_SIZE, CACRF_ClearD);
+#else
+        dma_cachectl((void *)sc->sc_reseltab, SIOP_RESELTAB_SIZE);
+        dma_cachectl((void *)sc->sc_tagtab, SIOP_TAGTAB_SIZE);
+#endif
     } else {
         if (sc->sc_nexus != NULL) {
             sc->sc_nexus->xs->error = XS_RESET;
@@ -890,33 +1645,172 @@ siopreset(struct siop_softc *sc)
         /*SIOP_DIEN_WTD |*/ SIOP_DIEN_IID;
     rp->siop_sien = sc->sc_sien;
     rp->siop_dien = sc->sc_dien;
+
+    /* SCRIPTS run from now on, waiting for commands or reselections */
+    rp->siop_dsp = sc->sc_scriptspa + Ent_idle;
 }
 
 /*
- * Setup Data Storage for 53C710 and start SCRIPTS processing
+ * List the next part of the data buffer of a command in its ACB, as the
+ * SCRIPTS the data phase returns to: a block move for each physically
+ * contiguous segment, each followed by a CALL to switch should the
+ * target leave the data phase there. The list ends in INT err15, at
+ * which the host lists the next part, or finds an overrun.
  */
-
-void
-siop_start(struct siop_softc *sc, int target, int lun, u_char *cbuf, int clen,
-           u_char *buf, int len)
+static void
+siop_sg_fill(struct siop_softc *sc, struct siop_acb *acb)
 {
-    siop_regmap_p rp = sc->sc_siopp;
-    int nchain;
+    struct siop_sg *sg = acb->sg;
+    u_int32_t move;
+    char *addr = acb->sg_next;
+    u_long count = acb->sg_left;
+    char *pa, *dmaend = NULL;
+    int nsg = 0;
 #ifdef PORT_AMIGA
-    int count;
     ULONG tcount;
+    /*
+     * ReadFromRAM should only be set when writing to the device
+     * When this flag is set, CachePreDMA doesn't turn off copyback mode
+     * Maybe there's some way to know here what the direction of the transfer is?
+     * We also need to match this flag at the other side
+     */
+    //ULONG flags = DMA_ReadFromRAM;
+    ULONG flags = (addr != (char *) acb->sg_xs->data) ? DMA_Continue : 0;
 #else
-    int count, tcount;
+    u_long tcount;
 #endif
-    char *addr, *dmaend;
-    struct siop_acb *acb = sc->sc_nexus;
+
+    if (acb->xs->xs_control & XS_CTL_DATA_OUT)
+        move = SIOP_SG_DATA_OUT;
+    else
+        move = SIOP_SG_DATA_IN;
+#ifdef PORT_AMIGA
+    siop_bounce_done(acb);      /* SCRIPTS are done with the last part */
+#endif
+
+    while (nsg < SIOP_NSG) {
+        if (count == 0) {
+            /* Continue with the buffer of the next xfer merged in */
+            if (acb->sg_xs->amiga_merge == NULL)
+                break;
+            acb->sg_xs = acb->sg_xs->amiga_merge;
+            addr = (char *) acb->sg_xs->data;
+            count = acb->sg_xs->datalen;
+#ifdef PORT_AMIGA
+            flags = 0;
+#endif
+            continue;
+        }
+#ifdef PORT_AMIGA
+        if (acb->bounce != NULL && !siop_dma_ok(addr, count)) {
+            /* A bounced piece is a list part of its own */
+            if (nsg > 0)
+                break;
+            tcount = count;
+            if (tcount > SIOP_BOUNCE_LEN)
+                tcount = SIOP_BOUNCE_LEN;
+            if (move == SIOP_SG_DATA_OUT)
+                CopyMem(addr, acb->bounce, tcount);
+            pa = (char *) CachePreDMA((APTR) acb->bounce, &tcount, 0);
+            acb->bounce_addr = addr;
+            acb->bounce_len = tcount;
+            sc->sc_stats.st_bounce_bytes += tcount;
+            addr += tcount;
+            count -= tcount;
+            sg[0].move = move | tcount;
+            sg[0].addr = kvtop(pa);
+            sg[0].call = SIOP_SG_CALL | (move & 0x07000000);
+            sg[0].swtch = sc->sc_scriptspa + Ent_switch;
+            nsg = 1;
+            break;
+        }
+        tcount = count;
+        if (tcount > AMIGA_MAX_TRANSFER)
+            tcount = AMIGA_MAX_TRANSFER;
+        if ((((ULONG) addr) & 3) && (tcount > 30)) {
+            /*
+             * First sg should align transfer, unless it's a small transfer.
+             *
+             * XXX: The 30 above is subject to tuning. The tradeoff is that
+             *      one more sg entry takes CPU time and some bus bandwidth
+             *      to process.
+             */
+            tcount = 4 - (((ULONG) addr) & 3);
+        }
+        pa = (char *) CachePreDMA((APTR) addr, &tcount, flags);
+        flags |= DMA_Continue;
+#else
+        /* original PAGESIZE scatter gather */
+        pa = (char *) kvtop (addr);
+        if (count < (tcount = PAGE_SIZE - ((int) addr & PGOFSET)))
+            tcount = count;
+#endif
+        addr += tcount;
+        count -= tcount;
+        if (pa == dmaend &&
+            (sg[nsg - 1].move & 0xffffff) + tcount <= SIOP_SG_MAXLEN) {
+            sg[nsg - 1].move += tcount;
+            dmaend += tcount;
 #ifdef DEBUG
-    int i;
+            ++siopdma_hits;
 #endif
-    if (acb == NULL) {
-        printf("siop_start: NULL acb!\n");
-        return;
+            continue;
+        }
+#ifdef DEBUG
+        if (nsg) /* Don't count miss on first one */
+            ++siopdma_misses;
+#endif
+        sg[nsg].move = move | tcount;
+        sg[nsg].addr = kvtop(pa);
+        sg[nsg].call = SIOP_SG_CALL | (move & 0x07000000);
+        sg[nsg].swtch = sc->sc_scriptspa + Ent_switch;
+        dmaend = pa + tcount;
+        nsg++;
+    }
+    sg[nsg].move = SIOP_SG_INT;
+    sg[nsg].addr = SIOP_SG_END;
+    siop_acb_push(sc, sg, (nsg + 1) * sizeof (*sg));
+    acb->sg_next = addr;
+    acb->sg_left = count;
+    sc->sc_stats.st_sg_segs += nsg;
+#ifdef DEBUG
+    if (nsg > 1 && siop_debug & 3) {
+        int i;
+
+        printf ("DMA chaining set: %d%s\n", nsg, count ? " (more)" : "");
+        for (i = 0; i < nsg; ++i) {
+            printf ("  [%d] %8lx %lx\n", i, (u_long) sg[i].addr,
+                (u_long) sg[i].move & 0xffffff);
+        }
     }
+#endif
+}
+
+/*
+ * The data transfer list entry of an ACB at a SCRIPTS address, or NULL if
+ * the address is not that of an entry.
+ */
+static struct siop_sg *
+siop_sg_entry(struct siop_acb *acb, u_long addr)
+{
+    u_long off = addr - kvtop(&acb->sg[0]);
+
+    if (off >= sizeof (acb->sg) || (off % sizeof (acb->sg[0])) != 0)
+        return (NULL);
+    return (&acb->sg[off / sizeof (acb->sg[0])]);
+}
+
+/*
+ * Setup Data Storage for 53C710 and hand the command to SCRIPTS
+ */
+
+void
+siop_start(struct siop_softc *sc, struct siop_acb *acb, int target, int lun,
+           u_char *cbuf, int clen, u_char *buf, int len)
+{
+#ifdef DEBUG
+    siop_regmap_p rp = sc->sc_siopp;
+#endif
 #if 0
    printf("siop_start %d.%d  acb=%p xs=%p retries=%d\n", target, lun, acb, acb->xs, acb->xs ? acb->xs->xs_retries : -1);
 #endif
@@ -940,8 +1834,15 @@ siop_start(struct siop_softc *sc, int target, int lun, u_char *cbuf, int clen,
     acb->status = 0;
     acb->stat[0] = -1;
     acb->msg[0] = -1;
+    acb->ds.savedp = kvtop(&acb->sg[0]);
     acb->ds.scsi_addr = (0x10000 << target) | (sc->sc_sync[target].sxfer << 8);
     acb->ds.idlen = 1;
+    if (XS_CTL_TAGTYPE(acb->xs) != 0) {
+        /* Queue tag message follows IDENTIFY */
+        acb->msgout[1] = acb->xs->xs_tag_type;
+        acb->msgout[2] = acb->xs->xs_tag_id;
+        acb->ds.idlen = 3;
+    }
     acb->ds.idbuf = (char *) kvtop(&acb->msgout[0]);
     acb->ds.cmdlen = clen;
     acb->ds.cmdbuf = (char *) kvtop(cbuf);
@@ -956,7 +1857,6 @@ siop_start(struct siop_softc *sc, int target, int lun, u_char *cbuf, int clen,
     acb->ds.msginbuf = (char *) kvtop(&acb->msg[1]);
     acb->ds.extmsgbuf = (char *) kvtop(&acb->msg[2]);
     acb->ds.synmsgbuf = (char *) kvtop(&acb->msg[3]);
-    memset(&acb->ds.chain, 0, sizeof (acb->ds.chain));
 
     /*
      * Negotiate wide is the initial negotiation state;  since the 53c710
@@ -974,17 +1874,24 @@ siop_start(struct siop_softc *sc, int target, int lun, u_char *cbuf, int clen,
 #endif
         }
         else {
+            u_char *sdtr = &acb->msgout[acb->ds.idlen];
+
             acb->msg[2] = -1;
-            acb->msgout[1] = MSG_EXT_MESSAGE;
-            acb->msgout[2] = 3;
-            acb->msgout[3] = MSG_SYNC_REQ;
+            sdtr[0] = MSG_EXT_MESSAGE;
+            sdtr[1] = 3;
+            sdtr[2] = MSG_SYNC_REQ;
 #ifdef MAXTOR_SYNC_KLUDGE
-            acb->msgout[4] = 50 / 4;    /* ask for ridiculous period */
+            sdtr[3] = 50 / 4;           /* ask for ridiculous period */
 #else
-            acb->msgout[4] = sc->sc_minsync;
+            sdtr[3] = sc->sc_sync[target].offer;
 #endif
-            acb->msgout[5] = SIOP_MAX_OFFSET;
-            acb->ds.idlen = 6;
+            sdtr[4] = SIOP_MAX_OFFSET;
+            if (sc->sc_sync[target].offer == 0) {
+                /* Slowed down to asynchronous, see siop_sync_slower() */
+                sdtr[3] = sc->sc_minsync;
+                sdtr[4] = 0;
+            }
+            acb->ds.idlen += 5;
             sc->sc_sync[target].state = NEG_WAITS;
 #ifdef DEBUG_SYNC
             if (siopsync_debug)
@@ -993,91 +1900,25 @@ siop_start(struct siop_softc *sc, int target, int lun, u_char *cbuf, int clen,
         }
     }
 
-/*
- * Build physical DMA addresses for scatter/gather I/O
- */
     acb->iob_buf = buf;
     acb->iob_len = len;
     acb->iob_curbuf = acb->iob_curlen = 0;
-    nchain = 0;
-    count = len;
-    addr = buf;
-    dmaend = NULL;
-#ifdef PORT_AMIGA
-    /*
-     * ReadFromRAM should only be set when writing to the device
-     * When this flag is set, CachePreDMA doesn't turn off copyback mode
-     * Maybe there's some way to know here what the direction of the transfer is?
-     * We also need to match this flag at the other side
-     */
-    //ULONG flags = DMA_ReadFromRAM;
-    ULONG flags = 0;
-#endif
-
-    while (count > 0) {
-        acb->ds.chain[nchain].databuf = (char *) kvtop (addr);
+    acb->sg_next = buf;
+    acb->sg_left = len;
+    acb->sg_xs = acb->xs;
 #ifdef PORT_AMIGA
-        tcount = count;
-        if (tcount > AMIGA_MAX_TRANSFER)
-            tcount = AMIGA_MAX_TRANSFER;
-        if ((((ULONG) addr) & 3) && (tcount > 30)) {
-            /*
-             * First sg should align transfer, unless it's a small transfer.
-             *
-             * XXX: The 30 above is subject to tuning. The tradeoff is that
-             *      one more sg entry takes CPU time and some bus bandwidth
-             *      to process.
-             */
-            tcount = 4 - (((ULONG) addr) & 3);
-        }
-        acb->ds.chain[nchain].databuf = (char *)
-                CachePreDMA((APTR) addr, &tcount, flags);
-        flags |= DMA_Continue;
-#else
-        /* original PAGESIZE scatter gather */
-        acb->ds.chain[nchain].databuf = (char *) kvtop (addr);
-        if (count < (tcount = PAGE_SIZE - ((int) addr & PGOFSET)))
-            tcount = count;
-#endif
-        acb->ds.chain[nchain].datalen = tcount;
-        addr += tcount;
-        count -= tcount;
-        if (acb->ds.chain[nchain].databuf == dmaend) {
-            dmaend += acb->ds.chain[nchain].datalen;
-            acb->ds.chain[nchain].datalen = 0;
-            acb->ds.chain[--nchain].datalen += tcount;
-#ifdef DEBUG
-            ++siopdma_hits;
-#endif
-        }
-        else {
-            dmaend = acb->ds.chain[nchain].databuf +
-                acb->ds.chain[nchain].datalen;
-            acb->ds.chain[nchain].datalen = tcount;
-#ifdef DEBUG
-            if (nchain) /* Don't count miss on first one */
-                ++siopdma_misses;
-#endif
-        }
-        ++nchain;
-    }
-#ifdef DEBUG
-    if (nchain != 1 && len != 0 && siop_debug & 3) {
-        printf ("DMA chaining set: %d\n", nchain);
-        for (i = 0; i < nchain; ++i) {
-            printf ("  [%d] %8p %lx\n", i, acb->ds.chain[i].databuf,
-                acb->ds.chain[i].datalen);
-        }
-    }
+    acb->bounce_len = 0;        /* (re)started from the first part */
 #endif
+    siop_sg_fill(sc, acb);
 
-    /* push data cache for all data the 53c710 needs to access */
-#ifdef PORT_AMIGA
-    CacheClearE(acb,sizeof(struct siop_acb),CACRF_ClearD);
-    CacheClearE(cbuf,clen,CACRF_ClearD);
-#else
-    dma_cachectl ((void *)acb, sizeof (struct siop_acb));
-    dma_cachectl (cbuf, clen);
+    /*
+     * push data cache for all data the 53c710 needs to access: the DSA
+     * table, command and messages (siop_sg_fill() did the list)
+     */
+    siop_acb_push(sc, &acb->ds, (char *) acb->sg - (char *) &acb->ds);
+    if (cbuf != (u_char *) &acb->cmd)
+        siop_acb_push(sc, cbuf, clen);
+#ifndef PORT_AMIGA
     if (buf != NULL && len != 0)
         dma_cachectl (buf, len);
 #endif
@@ -1094,29 +1935,16 @@ siop_start(struct siop_softc *sc, int target, int lun, u_char *cbuf, int clen,
     }
 #endif
 #endif
-    if (sc->nexus_list.tqh_first == NULL) {
 #ifndef PORT_AMIGA
-        /* Callout is now configured for every transaction in siop_sched() */
+    /* Callout is now configured for every transaction in siop_sched() */
+    if (sc->nexus_list.tqh_first == NULL)
         callout_reset(&acb->xs->xs_callout,
             mstohz(acb->xs->timeout) + 1, siop_timeout, acb);
 #endif
-        if (rp->siop_istat & SIOP_ISTAT_CON)
-            printf("%s: siop_select while connected?\n",
-                device_xname(sc->sc_dev));
-        rp->siop_temp = 0;
-        rp->siop_sbcl = sc->sc_sync[target].sbcl;
-        rp->siop_dsa = kvtop((void *)&acb->ds);
-        rp->siop_dsp = sc->sc_scriptspa;
-        SIOP_TRACE('s',1,0,0)
-    } else {
-        if ((rp->siop_istat & SIOP_ISTAT_CON) == 0) {
-            rp->siop_istat = SIOP_ISTAT_SIGP;
-            SIOP_TRACE('s',2,0,0);
-        }
-        else {
-            SIOP_TRACE('s',3,rp->siop_istat,0);
-        }
-    }
+    siop_issued_insert(sc, acb, 0);
+    siop_resel_update(sc, target, lun);
+    siop_mbox_put(sc, acb);
+    SIOP_TRACE('s',1,0,0)
 #ifdef DEBUG
     ++siopstarts;
 #endif
@@ -1179,77 +2007,452 @@ report_scsi_speed(siop_regmap_p rp, uint sbcl)
     scsi_aclk_str = cf_str[dcntl_cf];
     scsi_aclk_freq = sclk * 10 / aclk_div[dcntl_cf];
 
-    if (sscf == 0) {
-        scsi_sclk_str = scsi_aclk_str;
-        scsi_cclk_freq = scsi_aclk_freq;
-    } else {
-        scsi_sclk_str = sscf_str[sscf];
-        if (sscf == 1)
-            scsi_cclk_freq = sclk;
-        else if (sscf == 2)
-            scsi_cclk_freq = sclk * 2 / 3;
-        else
-            scsi_cclk_freq = sclk / 2;
+    if (sscf == 0) {
+        scsi_sclk_str = scsi_aclk_str;
+        scsi_cclk_freq = scsi_aclk_freq;
+    } else {
+        scsi_sclk_str = sscf_str[sscf];
+        if (sscf == 1)
+            scsi_cclk_freq = sclk;
+        else if (sscf == 2)
+            scsi_cclk_freq = sclk * 2 / 3;
+        else
+            scsi_cclk_freq = sclk / 2;
+    }
+
+    uint xferp = (rp->siop_sxfer >> 4) & 0x7;
+// CDH for 50MHz A4091, if xferp == 0, then 80ns period = 12.5MHz. 1 = 10MHz
+    uint period;
+    uint scntl1 = rp->siop_scntl1;
+    uint khz100;
+
+    uint tcp = 1000000 / scsi_cclk_freq;  // this is a fraction, now in ns
+    if (scntl1 & BIT(7))
+        period = tcp * (4 + xferp + 1) / 1000;
+    else
+        period = tcp * (4 + xferp) / 1000;
+    khz100 = 10000 / period;
+
+    printf("bclk=%u sclk=%u dcntl_cf=%u aclk=%uMHz \"%s\" sclk=%uMHz \"%s\" tcp=%u xferp=%u scntl1(7)=%x  SCSI Sync period=%uns %u.%uMHz\n", bclk, sclk, dcntl_cf, scsi_aclk_freq, scsi_aclk_str, scsi_cclk_freq, scsi_sclk_str, tcp, xferp, !!(scntl1 & BIT(7)), period, khz100 / 10, khz100 % 10);
+}
+#endif
+
+
+#if 0
+/* Debug code for calculating SCSI synchronous speeds */
+static struct scsipi_syncparam {
+        int     ss_factor;
+        int     ss_period;      /* ns * 100 */
+} scsipi_syncparams[] = {
+        { 0x08,          625 }, /* FAST-160 (Ultra320) */
+        { 0x09,         1250 }, /* FAST-80 (Ultra160) */
+        { 0x0a,         2500 }, /* FAST-40 40MHz (Ultra2) */
+        { 0x0b,         3030 }, /* FAST-40 33MHz (Ultra2) */
+        { 0x0c,         5000 }, /* FAST-20 (Ultra) */
+};
+static const int scsipi_nsyncparams =
+    sizeof(scsipi_syncparams) / sizeof(scsipi_syncparams[0]);
+int
+scsipi_sync_factor_to_period(int factor)
+{
+        int i;
+
+        for (i = 0; i < scsipi_nsyncparams; i++) {
+                if (factor == scsipi_syncparams[i].ss_factor)
+                        return scsipi_syncparams[i].ss_period;
+        }
+
+        return (factor * 4) * 100;
+}
+
+int
+scsipi_sync_factor_to_freq(int factor)
+{
+        int i;
+
+        for (i = 0; i < scsipi_nsyncparams; i++) {
+                if (factor == scsipi_syncparams[i].ss_factor)
+                        return 100000000 / scsipi_syncparams[i].ss_period;
+        }
+
+        return 10000000 / ((factor * 4) * 10);
+}
+#endif
+
+/*
+ * The current nexus is no longer connected. Put the command back on the
+ * list of issued commands.
+ */
+static void
+siop_park_nexus(struct siop_softc *sc)
+{
+    struct siop_acb *acb = sc->sc_nexus;
+
+    acb->status = sc->sc_flags & SIOP_INTSOFF;
+    siop_issued_insert(sc, acb, 1);
+    sc->sc_nexus = NULL;
+}
+
+/*
+ * Make an issued command the current nexus.
+ */
+static void
+siop_resume_nexus(struct siop_softc *sc, struct siop_acb *acb)
+{
+    siop_issued_remove(sc, acb);
+    acb->queue = ACB_Q_NEXUS;
+    sc->sc_nexus = acb;
+    sc->sc_flags |= acb->status;
+    acb->status = 0;
+#ifdef PORT_AMIGA
+    CacheClearE(&acb->stat[0], sizeof(acb->stat[0]), CACRF_ClearD);
+#else
+    DCIAS(kvtop(&acb->stat[0]));
+#endif
+}
+
+/*
+ * Add an issued command to nexus_list, at the head or the tail, and to
+ * the list of its target/LUN for reselections.
+ */
+static void
+siop_issued_insert(struct siop_softc *sc, struct siop_acb *acb, int head)
+{
+    struct scsipi_periph *periph = acb->xs->xs_periph;
+    struct acb_list *lunq =
+        SIOP_LUNQ(sc, periph->periph_target, periph->periph_lun);
+
+    if (head) {
+        TAILQ_INSERT_HEAD(&sc->nexus_list, acb, chain);
+        TAILQ_INSERT_HEAD(lunq, acb, lunchain);
+    } else {
+        TAILQ_INSERT_TAIL(&sc->nexus_list, acb, chain);
+        TAILQ_INSERT_TAIL(lunq, acb, lunchain);
+    }
+    acb->queue = ACB_Q_ISSUED;
+}
+
+static void
+siop_issued_remove(struct siop_softc *sc, struct siop_acb *acb)
+{
+    struct scsipi_periph *periph = acb->xs->xs_periph;
+
+    TAILQ_REMOVE(&sc->nexus_list, acb, chain);
+    TAILQ_REMOVE(SIOP_LUNQ(sc, periph->periph_target, periph->periph_lun),
+        acb, lunchain);
+}
+
+/*
+ * Find the issued or connected command SCRIPTS know by its DSA. Each
+ * chunk of ACBs is physically contiguous, so the DSA gives the index in
+ * the chunk it falls in.
+ */
+static struct siop_acb *
+siop_dsa_acb(struct siop_softc *sc, u_int32_t dsa)
+{
+    struct siop_acb *acb;
+    u_int32_t off;
+    int i;
+
+    for (i = 0; i < sc->sc_nchunks; i++) {
+        off = dsa - kvtop((void *)&sc->sc_acb[i][0].ds);
+        if (off % sizeof (struct siop_acb) != 0 ||
+            off / sizeof (struct siop_acb) >= SIOP_NACB_CHUNK)
+            continue;
+        acb = &sc->sc_acb[i][off / sizeof (struct siop_acb)];
+        if (acb->queue != ACB_Q_ISSUED && acb->queue != ACB_Q_NEXUS)
+            return (NULL);
+        return (acb);
+    }
+    return (NULL);
+}
+
+/*
+ * Allocate sc_acb[chunk], cache line aligned (see siopvar.h).
+ */
+static struct siop_acb *
+siop_acb_alloc(struct siop_softc *sc, int chunk)
+{
+    u_long size = sizeof(struct siop_acb) * SIOP_NACB_CHUNK + SIOP_CACHE_LINE;
+    void *mem;
+
+#ifdef PORT_AMIGA
+    mem = siop_dma_alloc(size);
+#else
+    mem = malloc(size);
+    if (mem != NULL)
+        memset(mem, 0, size);
+#endif
+    if (mem == NULL)
+        return (NULL);
+    sc->sc_acbmem[chunk] = mem;
+    sc->sc_acb[chunk] = (struct siop_acb *)
+        (((u_long) mem + SIOP_CACHE_LINE - 1) & ~(SIOP_CACHE_LINE - 1));
+    return (sc->sc_acb[chunk]);
+}
+
+static void
+siop_acb_free(struct siop_softc *sc, int chunk)
+{
+#ifdef PORT_AMIGA
+    FreeMem(sc->sc_acbmem[chunk],
+            sizeof(struct siop_acb) * SIOP_NACB_CHUNK + SIOP_CACHE_LINE);
+#else
+    free(sc->sc_acbmem[chunk]);
+#endif
+    sc->sc_acbmem[chunk] = NULL;
+    sc->sc_acb[chunk] = NULL;
+}
+
+/*
+ * Push the cache lines over part of an ACB out to memory for SCRIPTS,
+ * and count them.
+ */
+static void
+siop_acb_push(struct siop_softc *sc, void *addr, u_long len)
+{
+    u_long start = (u_long) addr & ~(SIOP_CACHE_LINE - 1);
+    u_long end = ((u_long) addr + len + SIOP_CACHE_LINE - 1) &
+                 ~(SIOP_CACHE_LINE - 1);
+
+    sc->sc_stats.st_push_bytes += end - start;
+#ifdef PORT_AMIGA
+    CacheClearE((APTR) start, end - start, CACRF_ClearD);
+#else
+    dma_cachectl((void *) start, end - start);
+#endif
+}
+
+/*
+ * The channel is out of openings: add a chunk of ACBs, up to SIOP_NACB
+ * in all, and the openings which go with them.
+ */
+static void
+siop_acb_grow(struct siop_softc *sc)
+{
+    struct siop_acb *acb;
+    int i, s;
+
+    if (sc->sc_nchunks >= SIOP_NACB / SIOP_NACB_CHUNK)
+        return;
+    acb = siop_acb_alloc(sc, sc->sc_nchunks);
+    if (acb == NULL)
+        return;
+
+    s = bsd_splbio();
+    for (i = 0; i < SIOP_NACB_CHUNK; i++) {
+        acb[i].chunk = sc->sc_nchunks;
+        TAILQ_INSERT_TAIL(&sc->free_list, &acb[i], chain);
     }
+    sc->sc_nchunks++;
+    sc->sc_adapter.adapt_openings += SIOP_NACB_CHUNK;
+    sc->sc_stats.st_acb_grows++;
+    sc->sc_acb_idle = 0;
+    if (!callout_pending(&sc->sc_acb_callout))
+        callout_reset(&sc->sc_acb_callout, hz, siop_acb_shrink, sc);
+    bsd_splx(s);
+}
 
-    uint xferp = (rp->siop_sxfer >> 4) & 0x7;
-// CDH for 50MHz A4091, if xferp == 0, then 80ns period = 12.5MHz. 1 = 10MHz
-    uint period;
-    uint scntl1 = rp->siop_scntl1;
-    uint khz100;
+/*
+ * Timer callout while the channel has grown: free the last chunk of
+ * ACBs once none of it has been in use for SIOP_ACB_IDLE seconds.
+ */
+static void
+siop_acb_shrink(void *arg)
+{
+    struct siop_softc *sc = arg;
+    struct siop_acb *acb;
+    int last = sc->sc_nchunks - 1;
+    int i, s;
 
-    uint tcp = 1000000 / scsi_cclk_freq;  // this is a fraction, now in ns
-    if (scntl1 & BIT(7))
-        period = tcp * (4 + xferp + 1) / 1000;
-    else
-        period = tcp * (4 + xferp) / 1000;
-    khz100 = 10000 / period;
+    if (last < 1)
+        return;
+    s = bsd_splbio();
+    acb = sc->sc_acb[last];
+    for (i = 0; i < SIOP_NACB_CHUNK; i++)
+        if (acb[i].queue != ACB_Q_FREE)
+            break;
+    if (i < SIOP_NACB_CHUNK ||
+        sc->sc_adapter.adapt_openings < SIOP_NACB_CHUNK) {
+        sc->sc_acb_idle = 0;
+    } else if (++sc->sc_acb_idle >= SIOP_ACB_IDLE) {
+        for (i = 0; i < SIOP_NACB_CHUNK; i++)
+            TAILQ_REMOVE(&sc->free_list, &acb[i], chain);
+        sc->sc_adapter.adapt_openings -= SIOP_NACB_CHUNK;
+        siop_acb_free(sc, last);
+        sc->sc_nchunks = last;
+        sc->sc_acb_idle = 0;
+        sc->sc_stats.st_acb_shrinks++;
+    }
+    if (sc->sc_nchunks > 1)
+        callout_reset(&sc->sc_acb_callout, hz, siop_acb_shrink, sc);
+    bsd_splx(s);
+}
 
-    printf("bclk=%u sclk=%u dcntl_cf=%u aclk=%uMHz \"%s\" sclk=%uMHz \"%s\" tcp=%u xferp=%u scntl1(7)=%x  SCSI Sync period=%uns %u.%uMHz\n", bclk, sclk, dcntl_cf, scsi_aclk_freq, scsi_aclk_str, scsi_cclk_freq, scsi_sclk_str, tcp, xferp, !!(scntl1 & BIT(7)), period, khz100 / 10, khz100 % 10);
+#ifdef PORT_AMIGA
+/*
+ * Whether the 53C710 can DMA to all of a buffer: siop_dma_mask has the
+ * address bits it may drive, like de_Mask in a mountlist. With bit 0
+ * clear, odd buffers are bounced too.
+ */
+static int
+siop_dma_ok(const void *addr, u_long len)
+{
+    u_long start = (u_long) addr;
+
+    if (len == 0)
+        return (1);
+    return ((start & ~siop_dma_mask) == 0 &&
+            ((start + len - 1) & ~(siop_dma_mask | 1)) == 0);
 }
-#endif
 
+/*
+ * Allocate cleared memory the 53C710 can DMA to, from 24-bit DMA memory
+ * if other memory is not reachable. Free it with FreeMem().
+ */
+static void *
+siop_dma_alloc(u_long size)
+{
+    void *mem;
 
-#if 0
-/* Debug code for calculating SCSI synchronous speeds */
-static struct scsipi_syncparam {
-        int     ss_factor;
-        int     ss_period;      /* ns * 100 */
-} scsipi_syncparams[] = {
-        { 0x08,          625 }, /* FAST-160 (Ultra320) */
-        { 0x09,         1250 }, /* FAST-80 (Ultra160) */
-        { 0x0a,         2500 }, /* FAST-40 40MHz (Ultra2) */
-        { 0x0b,         3030 }, /* FAST-40 33MHz (Ultra2) */
-        { 0x0c,         5000 }, /* FAST-20 (Ultra) */
-};
-static const int scsipi_nsyncparams =
-    sizeof(scsipi_syncparams) / sizeof(scsipi_syncparams[0]);
-int
-scsipi_sync_factor_to_period(int factor)
+    mem = AllocMem(size, MEMF_CLEAR | MEMF_PUBLIC);
+    if (mem != NULL && !siop_dma_ok(mem, size)) {
+        FreeMem(mem, size);
+        mem = AllocMem(size, MEMF_CLEAR | MEMF_PUBLIC | MEMF_24BITDMA);
+    }
+    return (mem);
+}
+
+/*
+ * Allocate the bounce buffers. Without them, buffers are listed as they
+ * are.
+ */
+static void
+siop_bounce_init(struct siop_softc *sc)
 {
-        int i;
+    char *mem;
 
-        for (i = 0; i < scsipi_nsyncparams; i++) {
-                if (factor == scsipi_syncparams[i].ss_factor)
-                        return scsipi_syncparams[i].ss_period;
-        }
+    mem = siop_dma_alloc(SIOP_NBOUNCE * SIOP_BOUNCE_LEN);
+    sc->sc_bounce = mem;
+    sc->sc_bounce_free = (mem != NULL) ? (1 << SIOP_NBOUNCE) - 1 : 0;
+}
 
-        return (factor * 4) * 100;
+/*
+ * Give a command starting a bounce buffer, which siop_can_start() found
+ * free. A command aborted and started again keeps its own.
+ */
+static void
+siop_bounce_get(struct siop_softc *sc, struct siop_acb *acb)
+{
+    int i;
+
+    if (acb->bounce != NULL)
+        return;
+    for (i = 0; (sc->sc_bounce_free & (1 << i)) == 0; i++)
+        ;
+    sc->sc_bounce_free &= ~(1 << i);
+    acb->bounce = sc->sc_bounce + i * SIOP_BOUNCE_LEN;
+    acb->bounce_len = 0;
+    sc->sc_stats.st_bounce_cmds++;
 }
 
-int
-scsipi_sync_factor_to_freq(int factor)
+static void
+siop_bounce_put(struct siop_softc *sc, struct siop_acb *acb)
 {
-        int i;
+    sc->sc_bounce_free |= 1 << ((acb->bounce - sc->sc_bounce) /
+                                SIOP_BOUNCE_LEN);
+    acb->bounce = NULL;
+}
 
-        for (i = 0; i < scsipi_nsyncparams; i++) {
-                if (factor == scsipi_syncparams[i].ss_factor)
-                        return 100000000 / scsipi_syncparams[i].ss_period;
-        }
+/*
+ * SCRIPTS are done with the list part a piece of the buffer was bounced
+ * in: copy what was read to the buffer, and push it out, so that
+ * CachePostDMA() of the whole buffer does not drop it.
+ */
+static void
+siop_bounce_done(struct siop_acb *acb)
+{
+    LONG len = acb->bounce_len;
 
-        return 10000000 / ((factor * 4) * 10);
+    if (len == 0)
+        return;
+    CachePostDMA((APTR) acb->bounce, &len, 0);
+    if ((acb->xs->xs_control & XS_CTL_DATA_OUT) == 0) {
+        CopyMem(acb->bounce, acb->bounce_addr, acb->bounce_len);
+        CacheClearE(acb->bounce_addr, acb->bounce_len, CACRF_ClearD);
+    }
+    acb->bounce_len = 0;
+}
+#endif
+
+/*
+ * SCRIPTS start commands from the mailbox, park them when their target
+ * disconnects and resume them from the reselect table, all without
+ * interrupting the host. Catch up with them before handling an
+ * interrupt: it is for the command at DSA, unless SCRIPTS were dealing
+ * with a reselection the host has to sort out or signalling completions.
+ */
+static void
+siop_sync_nexus(struct siop_softc *sc, u_char dstat)
+{
+    siop_regmap_p rp = sc->sc_siopp;
+    struct siop_acb *acb;
+    u_long dsa = rp->siop_dsa;
+
+    if (rp->siop_scratch & SIOP_RESEL_RESUMED) {
+        rp->siop_scratch &= ~SIOP_RESEL_RESUMED;
+        sc->sc_stats.st_resel_scripts++;
+    }
+    if (dstat & SIOP_DSTAT_SIR) {
+        switch (rp->siop_dsps) {
+        case 0xff00:
+        case 0xff03:
+        case 0xff09:
+        case 0xff0c:
+        case 0xff0d:
+        case 0xff0e:
+            dsa = 0;
+            break;
+        }
+    }
+    if (sc->sc_nexus != NULL) {
+        if (dsa == kvtop((void *)&sc->sc_nexus->ds))
+            return;
+        /* The target disconnected and SCRIPTS parked the command */
+        siop_park_nexus(sc);
+        sc->sc_stats.st_disc_scripts++;
+    }
+    if (dsa == 0)
+        return;
+    acb = siop_dsa_acb(sc, dsa);
+    if (acb != NULL && acb->queue == ACB_Q_ISSUED)
+        siop_resume_nexus(sc, acb);
 }
+
+/*
+ * Make the command which reselected the current nexus, and continue
+ * SCRIPTS with its DSA.
+ */
+static void
+siop_reselect_nexus(struct siop_softc *sc, struct siop_acb *acb)
+{
+    siop_regmap_p rp = sc->sc_siopp;
+
+    siop_resume_nexus(sc, acb);
+    sc->sc_stats.st_resel_host++;
+    rp->siop_dsa = kvtop((void *)&acb->ds);
+    rp->siop_sxfer =
+        sc->sc_sync[acb->xs->xs_periph->periph_target].sxfer;
+    rp->siop_sbcl =
+        sc->sc_sync[acb->xs->xs_periph->periph_target].sbcl;
+#ifdef PORT_AMIGA
+    CacheClearE(acb, sizeof(*acb), CACRF_ClearD);
+#else
+    dma_cachectl ((void *)acb, sizeof(*acb));
 #endif
+    rp->siop_temp = acb->ds.savedp;
+    rp->siop_dcntl |= SIOP_DCNTL_STD;
+}
 
 /*
  * Process a DMA or SCSI interrupt from the 53C710 SIOP
@@ -1286,6 +2489,9 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
 #ifdef DEBUG
     ++siopints;
 #endif
+    sc->sc_stats.st_ints++;
+    siop_sync_nexus(sc, dstat);
+    acb = sc->sc_nexus;
 #ifdef DEBUG
 #if 0
     if ((siop_debug & 0x100) && (acb != NULL))  {
@@ -1303,7 +2509,9 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
     }
 #endif
     if (rp->siop_dsp && (rp->siop_dsp < sc->sc_scriptspa ||
-        rp->siop_dsp >= sc->sc_scriptspa + sizeof(scripts))) {
+        rp->siop_dsp >= sc->sc_scriptspa + sizeof(scripts)) &&
+        (acb == NULL ||
+        rp->siop_dsp - kvtop(&acb->sg[0]) >= sizeof (acb->sg))) {
         printf ("%s: dsp not within script dsp %lx scripts %lx:%lx",
             device_xname(sc->sc_dev), rp->siop_dsp, sc->sc_scriptspa,
             sc->sc_scriptspa + sizeof(scripts));
@@ -1316,62 +2524,13 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
 #endif
     SIOP_TRACE('i',dstat,istat,(istat&SIOP_ISTAT_DIP)?rp->siop_dsps&0xff:sstat0);
     if (dstat & SIOP_DSTAT_SIR && rp->siop_dsps == 0xff00) {
-        /* Normal completion status, or check condition */
-#ifdef DEBUG
-        if (acb == NULL) {
-            printf("%s: completion or check cond with active command?\n",
-                device_xname(sc->sc_dev));
-            goto fail_return;
-        }
-#endif
-#ifdef DEBUG
-        if (rp->siop_dsa != kvtop((void *)&acb->ds)) {
-#ifdef PORT_AMIGA
-            panic("*** siop DSA invalid: %lx != %lx ***",
-                rp->siop_dsa, (unsigned)kvtop((void *)&acb->ds));
-#else
-            printf ("siop: invalid dsa: %lx %x\n", rp->siop_dsa,
-                (unsigned)kvtop((void *)&acb->ds));
-            panic("*** siop DSA invalid ***");
-#endif
-        }
-#endif
-        target = acb->xs->xs_periph->periph_target;
-        if (sc->sc_sync[target].state == NEG_WAITS) {
-            if (acb->msg[1] == 0xff)
-                printf ("%s: target %d ignored sync request\n",
-                    device_xname(sc->sc_dev), target);
-            else if (acb->msg[1] == MSG_REJECT)
-                printf ("%s: target %d rejected sync request\n",
-                    device_xname(sc->sc_dev), target);
-            else
-/* XXX - need to set sync transfer parameters? */
-                printf("%s: target %d (sync) %02x %02x %02x\n",
-                    device_xname(sc->sc_dev), target, acb->msg[1],
-                    acb->msg[2], acb->msg[3]);
-            sc->sc_sync[target].state = NEG_DONE;
-        }
-#ifdef PORT_AMIGA
-        CacheClearE(&acb->stat[0], 1, CACRF_ClearD);
-#else
-        dma_cachectl(&acb->stat[0], 1);
-#endif
-        *status = acb->stat[0];
-#ifdef DEBUG
-        if (rp->siop_sbcl & SIOP_BSY) {
-            /*printf ("ACK! siop was busy at end: rp %x script %x dsa %x\n",
-                rp, &scripts, &acb->ds);*/
-#ifdef DDB
-            /*Debugger();*/
-#endif
-        }
-        if (acb->msg[0] != 0x00)
-            printf("%s: message was not COMMAND COMPLETE: %x\n",
-                device_xname(sc->sc_dev), acb->msg[0]);
-#endif
-        if (sc->nexus_list.tqh_first)
-            rp->siop_dcntl |= SIOP_DCNTL_STD;
-        return 1;
+        /*
+         * The completed commands are in the done ring, and have been
+         * finished by siop_done_reap(). SCRIPTS go on to the next
+         * command in the mailbox.
+         */
+        rp->siop_dcntl |= SIOP_DCNTL_STD;
+        return 0;
     }
     if (dstat & SIOP_DSTAT_SIR && rp->siop_dsps == 0xff0b) {
 #ifdef DEBUG
@@ -1392,6 +2551,7 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
 #endif
             sc->sc_sync[target].sxfer = 0;
             sc->sc_sync[target].sbcl = 0;
+            sc->sc_sync[target].period = 0;
             if (acb->msg[2] == 3 &&
                 acb->msg[3] == MSG_SYNC_REQ &&
                 acb->msg[5] != 0) {
@@ -1424,6 +2584,7 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
             }
             rp->siop_sxfer = sc->sc_sync[target].sxfer;
             rp->siop_sbcl = sc->sc_sync[target].sbcl;
+            siop_resel_sync(sc, target);
 #ifdef DEBUG_SYNC
             report_scsi_speed(rp, sc->sc_sync[target].sbcl);
 #endif
@@ -1438,6 +2599,31 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
         }
         /* XXX - not SDTR message */
     }
+    if ((sstat0 & (SIOP_SSTAT0_PAR | SIOP_SSTAT0_SGE)) && acb != NULL &&
+        (acb->flags & ACB_ABORT) == 0 &&
+        siop_sync_slower(sc, acb->xs->xs_periph->periph_target)) {
+        target = acb->xs->xs_periph->periph_target;
+        /*
+         * Rather than resetting the bus, abort the command and requeue
+         * it once the target has gone bus free. The next command to the
+         * target renegotiates a slower period.
+         */
+        printf ("%s: target %d %s, aborting command\n",
+            device_xname(sc->sc_dev), target,
+            (sstat0 & SIOP_SSTAT0_PAR) ? "parity error" : "gross error");
+        acb->msgout[0] = XS_CTL_TAGTYPE(acb->xs) ? MSG_ABORT_TAG : MSG_ABORT;
+        acb->ds.idlen = 1;
+        acb->flags |= ACB_ABORT;
+#ifdef PORT_AMIGA
+        CacheClearE(&acb->ds, sizeof(acb->ds), CACRF_ClearD);
+        CacheClearE(&acb->msgout[0], 1, CACRF_ClearD);
+#else
+        dma_cachectl ((void *)&acb->ds, sizeof(acb->ds));
+        dma_cachectl (&acb->msgout[0], 1);
+#endif
+        rp->siop_dsp = sc->sc_scriptspa + Ent_set_atn;
+        return (0);
+    }
     if (sstat0 & SIOP_SSTAT0_M_A) {     /* Phase mismatch */
 #ifdef DEBUG
         ++siopphmm;
@@ -1448,6 +2634,7 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
         }
 #endif
         if (acb->iob_len) {
+            struct siop_sg *sg;
             int adjust;
             adjust = ((dfifo - (dbc & 0x7f)) & 0x7f);
             if (sstat1 & SIOP_SSTAT1_ORF)
@@ -1461,24 +2648,36 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
                 *((long *)__UNVOLATILE(&rp->siop_dnad)) - adjust;
 #ifdef DEBUG
             if (siop_debug & 0x100) {
-                int i;
                 printf ("Phase mismatch: curbuf %lx curlen %lx dfifo %x dbc %x sstat1 %x adjust %x sbcl %x starts %d acb %p\n",
                     acb->iob_curbuf, acb->iob_curlen, dfifo,
                     dbc, sstat1, adjust, rp->siop_sbcl,
                     siopstarts, acb);
-                if (acb->ds.chain[1].datalen) {
-                    for (i = 0; acb->ds.chain[i].datalen; ++i)
-                        printf("chain[%d] addr %p len %lx\n",
-                            i, acb->ds.chain[i].databuf,
-                            acb->ds.chain[i].datalen);
-                }
             }
 #endif
+            /*
+             * If a block move of the data transfer list was cut short,
+             * it is rewritten to move the rest and TEMP points at it, so
+             * the data pointer is current should the target disconnect
+             * or go back to the data phase.
+             */
+            sg = siop_sg_entry(acb, rp->siop_dsp - 8);
+            if (sg != NULL) {
+                if ((rp->siop_sbcl & 6) == 0 &&
+                    ((rp->siop_sbcl ^ (sg->move >> 24)) & 1) != 0) {
+                    printf ("%s: target %d data phase in the wrong direction\n",
+                        device_xname(sc->sc_dev),
+                        acb->xs->xs_periph->periph_target);
+                    goto bad_phase;
+                }
+                sg->move = (sg->move & 0xff000000) | acb->iob_curlen;
+                sg->addr = acb->iob_curbuf;
+                rp->siop_temp = kvtop(sg);
 #ifdef PORT_AMIGA
-            CacheClearE(acb,sizeof(*acb),CACRF_ClearD);
+                CacheClearE(sg, sizeof(*sg), CACRF_ClearD);
 #else
-            dma_cachectl ((void *)acb, sizeof(*acb));
+                dma_cachectl ((void *)sg, sizeof(*sg));
 #endif
+            }
         }
 #ifdef DEBUG
         SIOP_TRACE('m',rp->siop_sbcl,(rp->siop_dsp>>8),rp->siop_dsp);
@@ -1525,8 +2724,8 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
                 printf ("Yikes, it's not busy now!\n");
 #if 0
                 *status = -1;
-                if (sc->nexus_list.tqh_first)
-                    rp->siop_dsp = sc->sc_scriptspa + Ent_wait_reselect;
+                siop_mbox_take(sc);
+                rp->siop_dsp = sc->sc_scriptspa + Ent_idle;
                 return 1;
 #endif
             }
@@ -1536,8 +2735,8 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
 #endif
         *status = -1;
         acb->xs->error = XS_SELTIMEOUT;
-        if (sc->nexus_list.tqh_first)
-            rp->siop_dsp = sc->sc_scriptspa + Ent_wait_reselect;
+        siop_mbox_take(sc);
+        rp->siop_dsp = sc->sc_scriptspa + Ent_idle;
         return 1;
     }
     if (acb)
@@ -1558,147 +2757,60 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
         /* This is commented out in the original NetBSD code for Amiga */
         siopabort (sc, rp, "siopchkintr");
 #endif
+        if (acb != NULL && (acb->flags & ACB_ABORT))
+            acb->xs->error = XS_REQUEUE;    /* see the bus error below */
         *status = STS_BUSY;
-        if (sc->nexus_list.tqh_first)
-            rp->siop_dsp = sc->sc_scriptspa + Ent_wait_reselect;
+        rp->siop_dsp = sc->sc_scriptspa + Ent_idle;
         return (acb != NULL);
     }
     if (dstat & SIOP_DSTAT_SIR && (rp->siop_dsps == 0xff01 ||
         rp->siop_dsps == 0xff02)) {
 #ifdef DEBUG
         if (siop_debug & 0x100)
-            printf ("%s: TGT %x disconnected TEMP %lx (+%lx) curbuf %lx curlen %lx buf %p len %lx dfifo %x dbc %x sstat1 %x starts %d acb %p\n",
+            printf ("%s: TGT %x disconnected TEMP %lx curbuf %lx curlen %lx buf %p len %lx dfifo %x dbc %x sstat1 %x starts %d acb %p\n",
                 device_xname(sc->sc_dev), target, rp->siop_temp,
-                rp->siop_temp ? rp->siop_temp - sc->sc_scriptspa : 0,
                 acb->iob_curbuf, acb->iob_curlen,
-                acb->ds.chain[0].databuf, acb->ds.chain[0].datalen, dfifo, dbc, sstat1, siopstarts, acb);
+                acb->iob_buf, acb->iob_len, dfifo, dbc, sstat1, siopstarts, acb);
 #endif
         if (acb == NULL) {
             printf("%s: Disconnect with no active command?\n",
                 device_xname(sc->sc_dev));
+            rp->siop_dsp = sc->sc_scriptspa + Ent_idle;
             goto fail_return;
         }
-        /*
-         * XXXX need to update iob_curbuf/iob_curlen to reflect
-         * current data transferred.  If device disconnected in
-         * the middle of a DMA block, they should already be set
-         * by the phase change interrupt.  If the disconnect
-         * occurs on a DMA block boundary, we have to figure out
-         * which DMA block it was.
-         */
-        if (acb->iob_len && rp->siop_temp) {
-            int n = rp->siop_temp - sc->sc_scriptspa;
-
-            if (acb->iob_curlen && acb->iob_curlen != acb->ds.chain[0].datalen)
-                printf("%s: iob_curbuf/len already set? n %x iob %lx/%lx chain[0] %p/%lx\n",
-                    device_xname(sc->sc_dev), n, acb->iob_curbuf, acb->iob_curlen,
-                    acb->ds.chain[0].databuf, acb->ds.chain[0].datalen);
-            if (n < Ent_datain)
-                n = (n - Ent_dataout) / 16;
-            else
-                n = (n - Ent_datain) / 16;
-            if (n <= 0 && n > DMAMAXIO)
-                printf("TEMP invalid %d\n", n);
-            else {
-                acb->iob_curbuf = (u_long)acb->ds.chain[n].databuf;
-                acb->iob_curlen = acb->ds.chain[n].datalen;
-            }
 #ifdef DEBUG
-            if (siop_debug & 0x100) {
-                printf("%s: TEMP offset %d", device_xname(sc->sc_dev), n);
-                printf(" curbuf %lx curlen %lx\n", acb->iob_curbuf,
-                    acb->iob_curlen);
-            }
+        if (rp->siop_dsps == 0xff02 && (siop_debug & 0x100))
+            printf ("%s: TGT %x disconnected without Save Data Pointers\n",
+                device_xname(sc->sc_dev), target);
 #endif
-        }
         /*
-         * If data transfer was interrupted by disconnect, iob_curbuf
-         * and iob_curlen should reflect the point of interruption.
-         * Adjust the DMA chain so that the data transfer begins
-         * at the appropriate place upon reselection.
+         * SCRIPTS report a disconnect only if siop_no_disc_park is set,
+         * and park the command themselves otherwise. A block move cut
+         * short has been rewritten to move the rest (see the phase
+         * mismatch above), so TEMP is all that needs saving.
          * XXX This should only be done on save data pointer message?
          */
-        if (acb->iob_curlen) {
-            int i, j;
-
-#ifdef DEBUG
-            if (siop_debug & 0x100)
-                printf ("%s: adjusting DMA chain\n",
-                    device_xname(sc->sc_dev));
-            if (rp->siop_dsps == 0xff02)
-                printf ("%s: TGT %x disconnected without Save Data Pointers\n",
-                    device_xname(sc->sc_dev), target);
-#endif
-/* XXX is:      if (rp->siop_dsps != 0xff02) { */
-                /* not disconnected without save data ptr */
-            for (i = 0; i < DMAMAXIO; ++i) {
-                if (acb->ds.chain[i].datalen == 0)
-                    break;
-                if (acb->iob_curbuf >= (long)acb->ds.chain[i].databuf &&
-                    acb->iob_curbuf < (long)(acb->ds.chain[i].databuf +
-                    acb->ds.chain[i].datalen))
-                    break;
-            }
-            if (i >= DMAMAXIO || acb->ds.chain[i].datalen == 0) {
-                printf("couldn't find saved data pointer: ");
-                printf("curbuf %lx curlen %lx i %d\n",
-                    acb->iob_curbuf, acb->iob_curlen, i);
-#ifdef DDB
-                Debugger();
-#endif
-            }
-/* XXX is:      }           */
-#ifdef DEBUG
-            if (siop_debug & 0x100)
-                printf("  chain[0]: %p/%lx -> %lx/%lx\n",
-                    acb->ds.chain[0].databuf,
-                    acb->ds.chain[0].datalen,
-                    acb->iob_curbuf,
-                    acb->iob_curlen);
-#endif
-            acb->ds.chain[0].databuf = (char *)acb->iob_curbuf;
-            acb->ds.chain[0].datalen = acb->iob_curlen;
-            for (j = 1, ++i; i < DMAMAXIO && acb->ds.chain[i].datalen; ++i, ++j) {
-#ifdef DEBUG
-            if (siop_debug & 0x100)
-                printf("  chain[%d]: %p/%lx -> %p/%lx\n", j,
-                    acb->ds.chain[j].databuf,
-                    acb->ds.chain[j].datalen,
-                    acb->ds.chain[i].databuf,
-                    acb->ds.chain[i].datalen);
-#endif
-                acb->ds.chain[j].databuf = acb->ds.chain[i].databuf;
-                acb->ds.chain[j].datalen = acb->ds.chain[i].datalen;
-            }
-            if (j < DMAMAXIO)
-                acb->ds.chain[j].datalen = 0;
+        acb->ds.savedp = rp->siop_temp;
 #ifdef PORT_AMIGA
-            CacheClearE(&acb->ds.chain, sizeof(acb->ds.chain), CACRF_ClearD);
+        CacheClearE(&acb->ds.savedp, sizeof(acb->ds.savedp), CACRF_ClearD);
 #else
-            /* Push and invalidate data cache line */
-            DCIAS(kvtop((void *)&acb->ds.chain));
+        dma_cachectl ((void *)&acb->ds.savedp, sizeof(acb->ds.savedp));
 #endif
-        }
+        sc->sc_stats.st_disc_host++;
         ++sc->sc_tinfo[target].dconns;
         /*
          * add nexus to waiting list
          * clear nexus
-         * try to start another command for another target/lun
          */
-        acb->status = sc->sc_flags & SIOP_INTSOFF;
-        TAILQ_INSERT_HEAD(&sc->nexus_list, acb, chain);
-        sc->sc_nexus = NULL;        /* no current device */
-        /* start script to wait for reselect */
-        if (sc->sc_nexus == NULL)
-            rp->siop_dsp = sc->sc_scriptspa + Ent_wait_reselect;
-/* XXXX start another command ? */
-        if (sc->ready_list.tqh_first)
-            siop_sched(sc);
+        siop_park_nexus(sc);
+        /* start script to wait for reselect or start the next command */
+        rp->siop_dsp = sc->sc_scriptspa + Ent_idle;
         return (0);
     }
     if (dstat & SIOP_DSTAT_SIR && rp->siop_dsps == 0xff03) {
-        int reselid = rp->siop_scratch & 0x7f;
-        int reselun = rp->siop_sfbr & 0x07;
+        /* SCRATCH0 has the reselect table offset of the target/LUN */
+        int reselid = 1 << SIOP_RESEL_TARGET(rp->siop_scratch);
+        int reselun = SIOP_RESEL_LUN(rp->siop_scratch);
 
         sc->sc_sstat1 = rp->siop_sbcl;  /* XXXX save current SBCL */
 #ifdef DEBUG
@@ -1706,47 +2818,29 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
             printf ("%s: target ID %02x reselected dsps %lx\n",
                  device_xname(sc->sc_dev), reselid,
                  rp->siop_dsps);
-        if ((rp->siop_sfbr & 0x80) == 0)
-            printf("%s: Reselect message in was not identify: %x\n",
-                device_xname(sc->sc_dev), rp->siop_sfbr);
+        if ((siop_debug & 0x100) && sc->sc_nexus)
+            printf ("%s: reselect ID %02x w/active\n",
+                device_xname(sc->sc_dev), reselid);
 #endif
-        if (sc->sc_nexus) {
-#ifdef DEBUG
-            if (siop_debug & 0x100)
-                printf ("%s: reselect ID %02x w/active\n",
-                    device_xname(sc->sc_dev), reselid);
-#endif
-            TAILQ_INSERT_HEAD(&sc->ready_list, sc->sc_nexus, chain);
-            sc->sc_tinfo[sc->sc_nexus->xs->xs_periph->periph_target].lubusy
-                &= ~(1 << sc->sc_nexus->xs->xs_periph->periph_lun);
-            --sc->sc_active;
-        }
         /*
          * locate acb of reselecting device
          * set sc->sc_nexus to acb
          */
-        for (acb = sc->nexus_list.tqh_first; acb;
-            acb = acb->chain.tqe_next) {
-            if (reselid != (acb->ds.scsi_addr >> 16) ||
-                reselun != (acb->msgout[0] & 0x07))
-                continue;
-            TAILQ_REMOVE(&sc->nexus_list, acb, chain);
-            sc->sc_nexus = acb;
-            sc->sc_flags |= acb->status;
-            acb->status = 0;
-#ifdef PORT_AMIGA
-            CacheClearE(&acb->stat[0], sizeof(acb->stat[0]), CACRF_ClearD);
-#else
-            DCIAS(kvtop(&acb->stat[0]));
-#endif
-            rp->siop_dsa = kvtop((void *)&acb->ds);
-            rp->siop_sxfer =
-                sc->sc_sync[acb->xs->xs_periph->periph_target].sxfer;
-            rp->siop_sbcl =
-                sc->sc_sync[acb->xs->xs_periph->periph_target].sbcl;
-            break;
-        }
-        if (acb == NULL) {
+        acb = SIOP_LUNQ(sc, SIOP_RESEL_TARGET(rp->siop_scratch),
+            reselun)->tqh_first;
+        if (acb != NULL) {
+            if (XS_CTL_TAGTYPE(acb->xs) != 0) {
+                /*
+                 * The LUN has tagged commands outstanding, so the
+                 * target will send a queue tag message next. Have
+                 * SCRIPTS read it and look the command up, or stop
+                 * at 0xff0c for the host to pick it.
+                 */
+                rp->siop_dsp = sc->sc_scriptspa + Ent_resel_tag;
+                return (0);
+            }
+            siop_reselect_nexus(sc, acb);
+        } else {
 #ifdef PORT_AMIGA
             panic("No active I/O for reselecting device %02lx.%lx\nnexus %lx",
                   reselid, reselun, sc->nexus_list.tqh_first);
@@ -1757,53 +2851,85 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
             panic("unable to find reselecting device");
 #endif
         }
+        return (0);
+    }
+    if (dstat & SIOP_DSTAT_SIR && rp->siop_dsps == 0xff0c) {
+        /* Tagged reselection the tag table didn't have */
+        int reselid = 1 << SIOP_RESEL_TARGET(rp->siop_scratch);
+        int reselun = SIOP_RESEL_LUN(rp->siop_scratch);
+        int reseltag;
+
 #ifdef PORT_AMIGA
-        CacheClearE(acb, sizeof(*acb), CACRF_ClearD);
+        CacheClearE(&sc->sc_donenext[2], sizeof (u_int32_t), CACRF_ClearD);
 #else
-        dma_cachectl ((void *)acb, sizeof(*acb));
+        DCIAS(kvtop(&sc->sc_donenext[2]));
 #endif
-        rp->siop_temp = 0;
-        rp->siop_dcntl |= SIOP_DCNTL_STD;
+        reseltag = *(u_char *) &sc->sc_donenext[2];
+        for (acb = SIOP_LUNQ(sc, SIOP_RESEL_TARGET(rp->siop_scratch),
+            reselun)->tqh_first; acb; acb = acb->lunchain.tqe_next) {
+            if (XS_CTL_TAGTYPE(acb->xs) == 0 ||
+                reseltag != acb->xs->xs_tag_id)
+                continue;
+            siop_reselect_nexus(sc, acb);
+            break;
+        }
+        if (acb == NULL) {
+#ifdef PORT_AMIGA
+            panic("No active I/O for reselecting device %02lx.%lx tag %lx\nnexus %lx",
+                  reselid, reselun, reseltag,
+                  sc->nexus_list.tqh_first);
+#else
+            printf("%s: target ID %02x tag %02x reselect nexus_list %p\n",
+                device_xname(sc->sc_dev), reselid, reseltag,
+                sc->nexus_list.tqh_first);
+            panic("unable to find reselecting device");
+#endif
+        }
         return (0);
     }
-    if (dstat & SIOP_DSTAT_SIR && rp->siop_dsps == 0xff04) {
-#ifdef DEBUG
-        u_short ctest2 = rp->siop_ctest2;
-
-        /* reselect was interrupted (by Sig_P or select) */
-        if (siop_debug & 0x100 ||
-            (ctest2 & SIOP_CTEST2_SIGP) == 0)
-            printf ("%s: reselect interrupted (Sig_P?) scntl1 %x ctest2 %x sfbr %x istat %x/%x\n",
-                device_xname(sc->sc_dev), rp->siop_scntl1,
-                ctest2, rp->siop_sfbr, istat, rp->siop_istat);
-#endif
-        /* XXX assumes it was not select */
-        if (sc->sc_nexus == NULL) {
-#ifdef DEBUG
-            printf("%s: reselect interrupted, sc_nexus == NULL\n",
+    if (dstat & SIOP_DSTAT_SIR && rp->siop_dsps == 0xff0d) {
+        /* Reselected by a LUN with tagged commands, but no queue tag */
+        printf("%s: target %d reselected without queue tag sfbr %x sbcl %x\n",
+            device_xname(sc->sc_dev), SIOP_RESEL_TARGET(rp->siop_scratch),
+            rp->siop_sfbr, rp->siop_sbcl);
+        siopreset(sc);
+        *status = -1;
+        return (0);
+    }
+    if (dstat & SIOP_DSTAT_SIR && rp->siop_dsps == 0xff0e) {
+        /* Reselection ID bits had no target ID besides our own */
+        printf("%s: reselected with bad ID %02x sbcl %x\n",
+            device_xname(sc->sc_dev), rp->siop_scratch & 0xff,
+            rp->siop_sbcl);
+        siopreset(sc);
+        *status = -1;
+        return (0);
+    }
+    if (dstat & SIOP_DSTAT_SIR && rp->siop_dsps == SIOP_SG_END) {
+        /* End of the data transfer list, but still in the data phase */
+        if (acb == NULL) {
+            printf("%s: Data phase with no active command?\n",
                 device_xname(sc->sc_dev));
-#if 0
-            siop_dump(sc);
-#ifdef DDB
-            Debugger();
-#endif
-#endif
-#endif
-            rp->siop_dcntl |= SIOP_DCNTL_STD;
-            return(0);
+            siopreset(sc);
+            goto fail_return;
+        }
+        if (acb->sg_left == 0 && acb->sg_xs->amiga_merge == NULL) {
+            printf("%s: target %d data overrun sbcl %x\n",
+                device_xname(sc->sc_dev),
+                acb->xs->xs_periph->periph_target, rp->siop_sbcl);
+            goto bad_phase;
         }
-        target = sc->sc_nexus->xs->xs_periph->periph_target;
-        rp->siop_temp = 0;
-        rp->siop_dsa = kvtop((void *)&sc->sc_nexus->ds);
-        rp->siop_sxfer = sc->sc_sync[target].sxfer;
-        rp->siop_sbcl = sc->sc_sync[target].sbcl;
-        rp->siop_dsp = sc->sc_scriptspa;
+        siop_sg_fill(sc, acb);
+        sc->sc_stats.st_sg_parts++;
+        rp->siop_temp = kvtop(&acb->sg[0]);
+        rp->siop_dsp = sc->sc_scriptspa + Ent_switch;
         return (0);
     }
     if (dstat & SIOP_DSTAT_SIR && rp->siop_dsps == 0xff06) {
         if (acb == NULL) {
             printf("%s: Bad message-in with no active command?\n",
                 device_xname(sc->sc_dev));
+            siopreset(sc);
             goto fail_return;
         }
         /* Unrecognized message in byte */
@@ -1837,6 +2963,7 @@ siop_checkintr(struct siop_softc *sc, u_char istat, u_char dstat,
         if (acb == NULL) {
             printf("%s: DSTA_SIR with no active command?\n",
                 device_xname(sc->sc_dev));
+            siopreset(sc);
             goto fail_return;
         } else {
 #ifdef PORT_AMIGA
@@ -1910,10 +3037,9 @@ fail_return:
 }
 
 void
-siop_select(struct siop_softc *sc)
+siop_select(struct siop_softc *sc, struct siop_acb *acb)
 {
     siop_regmap_p rp;
-    struct siop_acb *acb = sc->sc_nexus;
 
 #ifdef DEBUG
     if (siop_debug & 1)
@@ -1941,10 +3067,10 @@ siop_select(struct siop_softc *sc)
     if (siop_debug & 1)
         printf ("siop_select: target %x cmd %02x ds %p\n",
             acb->xs->xs_periph->periph_target, acb->cmd.opcode,
-            &sc->sc_nexus->ds);
+            &acb->ds);
 #endif
 
-    siop_start(sc, acb->xs->xs_periph->periph_target,
+    siop_start(sc, acb, acb->xs->xs_periph->periph_target,
         acb->xs->xs_periph->periph_lun,
         (u_char *)&acb->cmd, acb->clen, acb->daddr, acb->dleft);
 
@@ -2008,6 +3134,7 @@ siopintr(register struct siop_softc *sc)
         rp->siop_sien = sc->sc_sien;
         rp->siop_dien = sc->sc_dien;
     }
+    siop_done_reap(sc, 1);
     if (siop_checkintr (sc, istat, dstat, sstat0, &status)) {
 #if 1
         if (status == 0xff)
@@ -2090,6 +3217,8 @@ scsi_period_to_siop(struct siop_softc *sc, int target)
     }
     sc->sc_sync[target].sxfer = sxfer;
     sc->sc_sync[target].sbcl = sbcl;
+    sc->sc_sync[target].period = sbcl ?
+        sc->sc_tcp[sbcl] * ((sxfer >> 4) + 4) : 0;
 #ifdef DEBUG_SYNC
     printf ("siop sync: siop_sxfr %02x, siop_sbcl %02x\n", sxfer, sbcl);
 #endif
@@ -230,6 +230,18 @@ typedef struct {
 } siop_regmap_t;
 typedef volatile siop_regmap_t *siop_regmap_p;
 
+#ifdef PORT_AMIGA
+/*
+ * SCSI Status 0 and DMA Status read in a single longword access, so that
+ * the chip clears both interrupt sources properly (see the DSTAT caution
+ * in the 53C710 documentation). SSTAT0 is returned in bits 15:8 and DSTAT
+ * in bits 7:0. A simulated chip may supply its own version.
+ */
+#ifndef SIOP_READ_SSTAT_DSTAT
+#define	SIOP_READ_SSTAT_DSTAT(rp) (*ADDR32((uintptr_t) &(rp)->siop_sstat2))
+#endif
+#endif
+
 /*
  * Register defines
  */
@@ -37,23 +37,18 @@
 #define _SIOPVAR_H_
 
 /*
- * The largest single request will be MAXPHYS bytes which will require
- * at most MAXPHYS/PAGE_SIZE+1 chain elements to describe, i.e. if none of
- * the buffer pages are physically contiguous (MAXPHYS/PAGE_SIZE) and the
- * buffer is not page aligned (+1).
- */
-#define	DMAMAXIO	(MAXPHYS/PAGE_SIZE+1)
-/*
- * XXX: This should be much smaller for AmigaOS. It's currently 128, which
- *      would be 127MB + 1 for unaligned data. Probably doesn't need to be
- *      that large. Max segment size (AMIGA_MAX_TRANSFER) can be bumped from
- *      1MB to ?32MB? in which case we would need very few segments here.
+ * The data transfer of a command is a list of SCRIPTS instructions in its
+ * ACB (see siop_sg_fill()). A buffer with more physically contiguous
+ * segments than the list holds is listed in parts, so there is no limit
+ * to the number of segments of a command.
  */
+#define	SIOP_NSG	32
 
 /*
  * Data Structure for SCRIPTS program
  */
 struct siop_ds {
+	long	savedp;			/* Saved data pointer (TEMP) */
 	long	scsi_addr;		/* SCSI ID & sync */
 	long	idlen;			/* Identify message */
 	char	*idbuf;
@@ -69,10 +64,17 @@ struct siop_ds {
 	char	*extmsgbuf;
 	long	synmsglen;		/* Sync transfer request */
 	char	*synmsgbuf;
-	struct {
-		long datalen;
-		char *databuf;
-	} chain[DMAMAXIO];
+};
+
+/*
+ * Data transfer list entry: a block move of one segment, followed by a
+ * CALL to switch should the target leave the data phase after it.
+ */
+struct siop_sg {
+	u_int32_t	move;		/* MOVE count, WHEN DATA_IN/OUT */
+	u_int32_t	addr;		/* physical address of the segment */
+	u_int32_t	call;		/* CALL, WHEN NOT DATA_IN/OUT */
+	u_int32_t	swtch;		/* physical address of switch */
 };
 
 /*
@@ -82,27 +84,52 @@ struct siop_ds {
  * the scsi_xfer struct (except do the expected updating of return values).
  * We'll generally update: xs->{flags,resid,error,sense,status} and
  * occasionally xs->retries.
+ *
+ * The host-only fields come first. What SCRIPTS read or write starts on
+ * a cache line of its own, so siop_start() pushes just the lines from ds
+ * to the data transfer list, and siop_sg_fill() the list entries it
+ * built. The ACBs of a chunk are cache line aligned.
  */
+#define	SIOP_CACHE_LINE	16
+
 struct siop_acb {
 	TAILQ_ENTRY(siop_acb) chain;
+	TAILQ_ENTRY(siop_acb) lunchain;	/* on sc_lunq while issued */
 	struct scsipi_xfer *xs;	/* SCSI xfer ctrl block from above */
 	int		flags;	/* Status */
 #define ACB_FREE	0x00
 #define ACB_ACTIVE	0x01
 #define ACB_DONE	0x04
-	struct scsipi_generic cmd;  /* SCSI command block */
-	struct siop_ds ds;
+#define ACB_ABORT	0x08		/* aborted after a bus error, requeue */
+#define ACB_BOUNCE	0x10		/* buffer not all DMA-reachable */
+	char	*sg_next;	/* buffer not yet in the list */
+	u_long	sg_left;	/* bytes not yet in the list */
+	struct scsipi_xfer *sg_xs; /* xfer whose buffer sg_next is in */
 	void	*iob_buf;
 	u_long	iob_curbuf;
 	u_long	iob_len, iob_curlen;
-	u_char	msgout[6];
-	u_char	msg[6];
-	u_char	stat[1];
 	u_char	status;
-	u_char	dummy[2];
+	u_char	queue;		/* list the ACB is on */
+#define ACB_Q_FREE	0	/* free_list */
+#define ACB_Q_READY	1	/* ready_list */
+#define ACB_Q_ISSUED	2	/* nexus_list and sc_lunq, not connected */
+#define ACB_Q_NEXUS	3	/* sc_nexus */
+	u_char	chunk;		/* sc_acb[] entry the ACB is in */
+	char	*bounce;	/* bounce buffer held while issued */
+	char	*bounce_addr;	/* buffer piece the list part bounces */
+	u_long	bounce_len;	/* bytes of it, 0 if none */
 	int	 clen;
 	char	*daddr;		/* Saved data pointer */
 	int	 dleft;		/* Residue */
+
+	/* Seen by SCRIPTS */
+	struct siop_ds ds __attribute__((aligned(SIOP_CACHE_LINE)));
+	struct scsipi_generic cmd;  /* SCSI command block */
+	u_char	msgout[8];	/* IDENTIFY, queue tag, SDTR */
+	u_char	msg[6];
+	u_char	stat[1];
+	struct siop_sg sg[SIOP_NSG + 1]	/* data transfer list */
+	    __attribute__((aligned(SIOP_CACHE_LINE)));
 };
 
 /*
@@ -116,11 +143,45 @@ struct siop_tinfo {
 	int	touts;		/* #timeouts */
 	int	perrs;		/* #parity errors */
 	ushort	lubusy;		/* What local units/subr. are busy? */
+	u_char	luactive[8];	/* Commands issued to each LUN */
 	u_char  flags;
 	u_char  period;		/* Period suggestion */
 	u_char  offset;		/* Offset suggestion */
 };
 
+/*
+ * Interrupt, disconnect and reselection counts, shown by a4091d. Every
+ * reselection resumed and disconnect parked by SCRIPTS is a host
+ * interrupt saved.
+ */
+struct siop_stats {
+	u_long	st_cmds;		/* commands completed */
+	u_long	st_ints;		/* SIOP interrupts serviced */
+	u_long	st_resel_host;		/* reselections found by the host */
+	u_long	st_resel_scripts;	/* reselections resumed by SCRIPTS */
+	u_long	st_disc_host;		/* disconnects handled by the host */
+	u_long	st_disc_scripts;	/* disconnects parked by SCRIPTS */
+	u_long	st_done;		/* completions taken from the done ring */
+	u_long	st_done_ints;		/* interrupts which brought completions */
+	u_long	st_done_polled;		/* completions found without interrupt */
+	u_long	st_done_max;		/* most completions at one interrupt */
+	u_long	st_sg_segs;		/* data transfer list entries built */
+	u_long	st_sg_parts;		/* lists continued with the next part */
+	u_long	st_sync_slower;		/* sync periods slowed after errors */
+	u_long	st_poll_starts;		/* times done ring polling took over */
+	u_long	st_polls;		/* done ring polls */
+	u_long	st_intr_ms;		/* time waiting for interrupts alone */
+	u_long	st_poll_ms;		/* time polling the done ring */
+	u_long	st_push_bytes;		/* ACB cache lines pushed for commands */
+	u_long	st_acb_grows;		/* chunks of ACBs added */
+	u_long	st_acb_shrinks;		/* idle chunks of ACBs freed */
+	u_long	st_bounce_cmds;		/* commands with a bounce buffer */
+	u_long	st_bounce_bytes;	/* bytes copied through bounce buffers */
+	u_long	st_poll_cmds;		/* commands siop_poll() completed */
+	u_long	st_poll_spun;		/* completions it found while spinning */
+	u_long	st_poll_sleeps;		/* 1 ms sleeps it took */
+};
+
 struct	siop_softc {
 	device_t sc_dev;
 #ifndef PORT_AMIGA
@@ -141,6 +202,14 @@ struct	siop_softc {
 	struct	scsipi_adapter sc_adapter;
 	struct	scsipi_channel sc_channel;
 	u_long	sc_scriptspa;		/* physical address of scripts */
+	u_int32_t *sc_script;		/* scripts, patched for this SIOP */
+	u_int32_t *sc_reseltab;		/* reselect DSA by target and LUN */
+	u_int32_t *sc_tagtab;		/* reselect tables by queue tag */
+	u_int32_t *sc_mbox;		/* DSAs of commands for SCRIPTS to start */
+	u_int32_t *sc_mboxnext;		/* address of the slot SCRIPTS look at */
+	u_int32_t *sc_done;		/* DSAs of commands SCRIPTS completed */
+	u_int32_t *sc_donenext;		/* address of the slot SCRIPTS fill */
+	u_int32_t *sc_donebusy;		/* JUMP SCRIPTS copy to done_busy */
 	siop_regmap_p	sc_siopp;	/* the SIOP */
 	u_long	sc_active;		/* number of active I/O's */
 
@@ -148,10 +217,23 @@ struct	siop_softc {
 	TAILQ_HEAD(acb_list, siop_acb) free_list,
 				       ready_list,
 				       nexus_list;
+	struct acb_list sc_lunq[8 * 8];	/* nexus_list by target and LUN */
 
 	struct siop_acb *sc_nexus;	/* current command */
-#define SIOP_NACB 16
-	struct siop_acb *sc_acb;	/* the real command blocks */
+#define SIOP_NACB 16			/* most ACBs allocated */
+#define SIOP_NACB_CHUNK 4		/* ACBs allocated at a time */
+#define SIOP_ACB_IDLE 10		/* seconds an idle chunk is kept */
+#define SIOP_MBOX_SLOTS 16		/* a cache line each, 256 bytes */
+#define SIOP_DONE_SLOTS 16		/* at least SIOP_NACB */
+	struct siop_acb *sc_acb[SIOP_NACB / SIOP_NACB_CHUNK]; /* ACB chunks */
+	void	*sc_acbmem[SIOP_NACB / SIOP_NACB_CHUNK]; /* as allocated */
+	u_char	sc_nchunks;		/* chunks in sc_acb[], first is kept */
+	u_char	sc_acb_idle;		/* checks the last chunk was unused */
+	callout_t sc_acb_callout;	/* frees idle chunks */
+#define SIOP_NBOUNCE 4			/* bounce buffers */
+#define SIOP_BOUNCE_LEN 4096		/* bytes a list part bounces */
+	char	*sc_bounce;		/* the bounce buffers, or NULL */
+	u_char	sc_bounce_free;		/* bit per free bounce buffer */
 #ifndef ARCH_720
 	struct siop_tinfo sc_tinfo[8];
 #else
@@ -165,6 +247,10 @@ struct	siop_softc {
 	u_char	sc_flags;
 	u_char	sc_dien;
 	u_char	sc_minsync;
+	u_char	sc_mboxin;		/* next mailbox slot the host fills */
+	u_char	sc_doneout;		/* next done ring slot the host takes */
+	u_char	sc_donetaken;		/* done ring slots taken, modulo 256 */
+	struct	siop_stats sc_stats;
 #ifndef ARCH_720
 	u_char	sc_sien;
 #else
@@ -172,6 +258,7 @@ struct	siop_softc {
 #endif
 #ifdef PORT_AMIGA
 	u_char  sc_nosync;              /* no synchronous SCSI (bit / target) */
+	u_char  sc_nofast;              /* no fast SCSI (bit / target) */
 	u_char  sc_nodisconnect;        /* no disconnect SCSI (bit / target) */
 #endif
 	/* one for each target */
@@ -180,6 +267,8 @@ struct	siop_softc {
 		u_char sxfer;
 #ifndef ARCH_720
 		u_char sbcl;
+		u_char offer;		/* period offered, 4ns units, 0 async */
+		u_short period;		/* period agreed in ns, 0 if async */
 	} sc_sync[8];
 #else
 		u_char scntl3;
@@ -212,6 +301,7 @@ struct	siop_softc {
 #define	MSG_NOOP		0x08
 #define	MSG_PARITY_ERROR	0x09
 #define	MSG_BUS_DEVICE_RESET	0x0C
+#define	MSG_ABORT_TAG		0x0d
 #define	MSG_IDENTIFY		0x80
 #define	MSG_IDENTIFY_DR		0xc0	/* (disconnect/reconnect allowed) */
 #define	MSG_SYNC_REQ		0x01
@@ -241,6 +331,10 @@ void siop_scsipi_request(struct scsipi_channel *,
 			scsipi_adapter_req_t, void *);
 void siopinitialize(struct siop_softc *);
 void siopintr(struct siop_softc *);
+int siop_done_poll(struct siop_softc *);
+extern int siop_done_usec;
+extern u_long siop_dma_mask;
+extern int siop_poll_spin_usec;
 void siop_dump_registers(struct siop_softc *);
 #ifdef DEBUG
 void siop_dump(struct siop_softc *);